@@ -11,14 +11,46 @@
  * A node begins with the pointer data, followed by a null terminated value string IF
  * the pointer data indicates that this node is a leaf node.
  *
- * The pointer data is variable length, and has two forms:
+ * The pointer data is variable length, and has these forms (this is version 2 of the format, which
+ * also records the length of every leaf's value and the number of children of every list):
  *
- * 1) One form is a single byte with value 0-254. In this case this value represents 
- * the relative offset to skip within the parsed data buffer to find the next subling node
- * (or 0 if no next sibling), and also indicates that this is a leaf node.
+ * 1) One form is a single byte with value 0-245, holding the length of the leaf's value shifted left
+ * by one, with the low bit set if the next sibling follows right after this node's string (or clear if
+ * there's no next sibling). This indicates that this is a leaf node of under 123 characters.
  *
- * 2) If the first byte is 255 then the next following bytes are a next_sibling
- * absolute offset followed by a first_child absolute offset.
+ * 2) If the first byte is 255 then it's followed by padding up to the next 4 byte boundary, then a
+ * first_child absolute offset, a next_sibling absolute offset, and a size: the number of children
+ * for a list, or the length of the value for a leaf (of 123+ characters).
+ *
+ * 3) If the first byte is 254 then this is a leaf node whose value string wasn't copied,
+ * but lies within a memory mapped file (see TML_PARSE_MMAP). It's laid out as for 255, but with
+ * the offset of the string within the mapping in place of first_child.
+ *
+ * Offsets in these forms are 32 bit, unless the document is too large for that. Then
+ * 253 and 252 are used instead of 255 and 254, followed by 64 bit offsets (aligned to 8 bytes).
+ * The links are aligned relative to the start of the buffer, which is at least that aligned itself,
+ * so they're read and written directly.
+ *
+ * 4) If the first byte is 251 or 250 then this is a leaf node whose value string is that
+ * of an earlier leaf with the same value (see TML_PARSE_INTERN). The next bytes are the
+ * offset of that string within the data buffer. The next sibling follows right after for
+ * 251, and there's none for 250. 249 and 248 are the same with a 64 bit offset. The pooled
+ * string is always that of a packed leaf, so its length is in the byte before it.
+ *
+ * 5) A list stored as a binary array (see TML_PARSE_NUMERIC_ARRAYS) is a 255 or 253 node whose
+ * first_child offset is its own. Its value's null terminator is followed by a TML_ARRAY_TYPE byte,
+ * then padding up to the size of an element, then the elements.
+ *
+ * 6) If the first byte is 247 or 246 then this is a leaf with its binary value stored too (see
+ * TML_PARSE_TYPED_LEAVES). It's followed by the length of the value, padding up to the next 8 byte
+ * boundary, an int64_t or double, a float, a byte holding 248 plus the TML_LEAF_TYPE, and then the
+ * null terminated value. The next sibling follows right after for 247, and there's none for 246.
+ * That type byte is always right before the value, where no other leaf can have a byte over 245
+ * (the flag of a packed leaf, the last byte of a short leaf's size, or a delimiter in the file), so
+ * the binary value can be found from the tml_node alone.
+ *
+ * The data buffer begins with a pointer back to its tml_doc, so that things kept there (such
+ * as the file mapping, or the child offset tables) can be found from any node.
  */
 
 #include "tml_parser.h"
@@ -27,66 +59,362 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+#include <locale.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TML_HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef TML_NO_THREADS
+#define TML_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#endif
 
 
 static void set_parse_error(struct tml_doc *data, const char *error_message);
 static void parse_root(struct tml_doc *data, struct tml_stream *tokens);
-static size_t parse_list_node(struct tml_doc *data, struct tml_stream *tokens, bool process_divider, struct tml_token *token_out);
+struct key_table;
+static void free_child_index(struct tml_doc *data);
+static bool create_string_pool(struct tml_doc *data);
+static void free_string_pool(struct tml_doc *data);
+static void free_key_table(struct tml_doc *data, struct key_table *keys, size_t child_count);
 
-const struct tml_node TML_NODE_NULL = { value: "", buff: 0, next_sibling: 0, first_child: 0 };
+const struct tml_node TML_NODE_NULL = { value: "", buff: 0, next_sibling: 0, first_child: 0, size: 0 };
 
 #define FULL_NODE_DATA_FLAG 0xFF
-static const int NODE_LINK_DATA_SIZE = sizeof(char) + sizeof(tml_offset_t)*2;
+#define REFERENCE_NODE_DATA_FLAG 0xFE
+#define WIDE_FULL_NODE_DATA_FLAG 0xFD
+#define WIDE_REFERENCE_NODE_DATA_FLAG 0xFC
+#define INTERNED_NODE_DATA_FLAG 0xFB
+#define LAST_INTERNED_NODE_DATA_FLAG 0xFA
+#define WIDE_INTERNED_NODE_DATA_FLAG 0xF9
+#define WIDE_LAST_INTERNED_NODE_DATA_FLAG 0xF8
+#define TYPED_LEAF_DATA_FLAG 0xF7
+#define LAST_TYPED_LEAF_DATA_FLAG 0xF6
+#define MIN_NODE_DATA_FLAG LAST_TYPED_LEAF_DATA_FLAG
+
+/* Full and reference nodes have three links (first_child, next_sibling and size) after their flag byte */
+#define NODE_LINK_COUNT 3
+#define NODE_LINK_DATA_SIZE (sizeof(uint32_t) * NODE_LINK_COUNT)
+#define WIDE_NODE_LINK_DATA_SIZE (sizeof(uint64_t) * NODE_LINK_COUNT)
+/* The most a full node's flag, padding and links can take */
+#define MAX_NODE_HEADER_SIZE (sizeof(uint64_t) + WIDE_NODE_LINK_DATA_SIZE)
+
+/* Packed leaf headers hold the length and a has-next-sibling bit, and must stay under MIN_NODE_DATA_FLAG */
+#define MAX_PACKED_LENGTH ((MIN_NODE_DATA_FLAG - 1) >> 1)
+#define PACKED_HEADER(length, has_sibling) ((unsigned char)(((length) << 1) | ((has_sibling) ? 1 : 0)))
+
+/* A typed leaf's value is preceded by its type byte (TYPED_LEAF_MARK plus the TML_LEAF_TYPE), which is
+ * preceded by its float and then its int64_t or double */
+#define TYPED_LEAF_MARK 0xF8
+#define TYPED_LEAF_FLOAT_OFFSET (sizeof(char) + sizeof(float))
+#define TYPED_LEAF_VALUE_OFFSET (TYPED_LEAF_FLOAT_OFFSET + sizeof(double))
+
+#define INTERNED_NODE_SIZE (sizeof(char) + sizeof(uint32_t))
+#define WIDE_INTERNED_NODE_SIZE (sizeof(char) + sizeof(uint64_t))
+
+/* Size of the pointer to the tml_doc at the start of every data buffer */
+#define DOC_HEADER_SIZE sizeof(struct tml_doc *)
+
+/* The most parsed data one byte of input can produce (a "[" adds a list node of up to 17 bytes) */
+#define MAX_PARSED_SIZE_PER_INPUT_BYTE 17
+
+/* About the most parsed data one byte of input produces in practice, where words take up most of the text */
+#define LIKELY_PARSED_SIZE_PER_INPUT_BYTE 2
+
+
+/* --------------- MEMORY ALLOCATION -------------------- */
+
+static void *default_alloc(void *user_data, size_t size)
+{
+	return malloc(size);
+}
 
+static void *default_resize(void *user_data, void *ptr, size_t old_size, size_t new_size)
+{
+	return realloc(ptr, new_size);
+}
 
-static void grow_buffer_if_needed(struct tml_doc *data, size_t new_size)
+static void default_release(void *user_data, void *ptr, size_t size)
+{
+	free(ptr);
+}
+
+static const struct tml_allocator default_allocator = { NULL, default_alloc, default_resize, default_release };
+
+static TML_INLINE const struct tml_allocator *allocator_or_default(const struct tml_allocator *allocator)
+{
+	return allocator ? allocator : &default_allocator;
+}
+
+/* The arena hands out memory from the end of its current block, and only ever gets more from malloc
+ * when that block runs out. The most recent allocation can be grown, shrunk or released in place,
+ * which is what a tml_doc's buffer almost always is while it's being parsed. */
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(size) (((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+struct arena_block
+{
+	struct arena_block *prev;
+	size_t size, used;
+};
+
+#define ARENA_BLOCK_DATA(block) ((char*)(block) + ARENA_ALIGN(sizeof(struct arena_block)))
+
+struct tml_arena
+{
+	struct arena_block *block;
+	size_t total_size;
+};
+
+static struct arena_block *add_arena_block(struct tml_arena *arena, size_t min_size)
+{
+	size_t size = arena->block ? arena->block->size * 2 : ARENA_ALIGNMENT;
+	struct arena_block *block;
+
+	if (size < min_size)
+		size = min_size;
+
+	block = malloc(ARENA_ALIGN(sizeof(struct arena_block)) + size);
+	if (!block) return NULL;
+
+	block->prev = arena->block;
+	block->size = size;
+	block->used = 0;
+
+	arena->block = block;
+	arena->total_size += size;
+	return block;
+}
+
+static void free_arena_blocks(struct tml_arena *arena)
+{
+	while (arena->block) {
+		struct arena_block *prev = arena->block->prev;
+		free(arena->block);
+		arena->block = prev;
+	}
+	arena->total_size = 0;
+}
+
+/* Returns true if ptr is the most recent allocation from the arena */
+static bool is_last_arena_alloc(const struct tml_arena *arena, const void *ptr, size_t size)
+{
+	const struct arena_block *block = arena->block;
+	return block && (const char*)ptr + ARENA_ALIGN(size) == ARENA_BLOCK_DATA(block) + block->used;
+}
+
+static void *arena_alloc(void *user_data, size_t size)
+{
+	struct tml_arena *arena = user_data;
+	struct arena_block *block = arena->block;
+	void *ptr;
+
+	size = ARENA_ALIGN(size);
+	if (!block || block->size - block->used < size) {
+		block = add_arena_block(arena, size);
+		if (!block) return NULL;
+	}
+
+	ptr = ARENA_BLOCK_DATA(block) + block->used;
+	block->used += size;
+	return ptr;
+}
+
+static void *arena_resize(void *user_data, void *ptr, size_t old_size, size_t new_size)
+{
+	struct tml_arena *arena = user_data;
+	void *new_ptr;
+
+	if (ptr == NULL)
+		return arena_alloc(arena, new_size);
+
+	if (is_last_arena_alloc(arena, ptr, old_size)) {
+		struct arena_block *block = arena->block;
+		size_t start = (char*)ptr - ARENA_BLOCK_DATA(block);
+		if (ARENA_ALIGN(new_size) <= block->size - start) {
+			block->used = start + ARENA_ALIGN(new_size);
+			return ptr;
+		}
+	}
+	else if (new_size <= old_size) {
+		return ptr;
+	}
+
+	new_ptr = arena_alloc(arena, new_size);
+	if (new_ptr)
+		memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+	return new_ptr;
+}
+
+static void arena_release(void *user_data, void *ptr, size_t size)
+{
+	struct tml_arena *arena = user_data;
+
+	/* anything but the most recent allocation is just left until the arena is reset */
+	if (ptr && is_last_arena_alloc(arena, ptr, size))
+		arena->block->used = (char*)ptr - ARENA_BLOCK_DATA(arena->block);
+}
+
+struct tml_arena *tml_arena_create(size_t initial_size)
+{
+	struct tml_arena *arena = malloc(sizeof(*arena));
+	if (!arena) return NULL;
+
+	arena->block = NULL;
+	arena->total_size = 0;
+
+	if (initial_size > 0 && !add_arena_block(arena, ARENA_ALIGN(initial_size))) {
+		free(arena);
+		return NULL;
+	}
+
+	return arena;
+}
+
+struct tml_allocator tml_arena_allocator(struct tml_arena *arena)
+{
+	struct tml_allocator allocator;
+	allocator.user_data = arena;
+	allocator.alloc = arena_alloc;
+	allocator.resize = arena_resize;
+	allocator.release = arena_release;
+	return allocator;
+}
+
+void tml_arena_reset(struct tml_arena *arena)
+{
+	/* if the arena outgrew its first block, replace them all with one block big enough for everything,
+	 * so the next round of parsing won't need any more */
+	if (arena->block && arena->block->prev) {
+		size_t total_size = arena->total_size;
+		free_arena_blocks(arena);
+		add_arena_block(arena, total_size);
+	}
+
+	if (arena->block)
+		arena->block->used = 0;
+}
+
+void tml_arena_destroy(struct tml_arena *arena)
 {
-	if (new_size >= TML_PARSER_MAX_DATA_SIZE) {
-		set_parse_error(data, 
-			"TML data file is too large, parsed data structures exceeded TML_PARSER_MAX_DATA_SIZE.");
+	if (arena) {
+		free_arena_blocks(arena);
+		free(arena);
 	}
+}
+
+
+/* --------------- DATA PARSE FUNCTIONS -------------------- */
+
+/* The error a document with 32 bit links gets once it grows too big for them (see retry_wide_offsets()) */
+static const char too_large_error[] =
+	"TML data file is too large, parsed data structures exceeded TML_PARSER_MAX_DATA_SIZE.";
+
+static void grow_buffer_if_needed(struct tml_doc *data, size_t new_size)
+{
+	if (new_size >= TML_PARSER_MAX_DATA_SIZE && !data->wide_offsets)
+		set_parse_error(data, too_large_error);
 
 	if (new_size > data->buff_allocated && data->buff) {
-		data->buff_allocated *= 2;
-		data->buff = realloc(data->buff, data->buff_allocated);
+		size_t old_size = data->buff_allocated;
+		while (new_size > data->buff_allocated)
+			data->buff_allocated *= 2;
+		data->buff = data->allocator.resize(data->allocator.user_data, data->buff, old_size, data->buff_allocated);
 	}
 }
 
 static void shrink_buffer(struct tml_doc *data)
 {
-	if (data->buff) {
+	if (data->buff && data->buff_index > 0) {
+		size_t old_size = data->buff_allocated;
 		data->buff_allocated = data->buff_index;
-		data->buff = realloc(data->buff, data->buff_allocated);
+		data->buff = data->allocator.resize(data->allocator.user_data, data->buff, old_size, data->buff_allocated);
 	}
 }
 
 
 struct tml_doc *tml_parse_in_memory(char *ibuff, size_t ibuff_size)
 {
-	struct tml_doc *data = malloc(sizeof(*data));
+	return tml_parse_in_memory_ex(ibuff, ibuff_size, TML_PARSE_DEFAULT);
+}
+
+/* A document is parsed with 32 bit links unless it's likely to grow past TML_PARSER_MAX_DATA_SIZE, or
+ * TML_PARSE_WIDE_OFFSETS is given. Inputs which could grow that big at worst are parsed again with 64 bit links
+ * if they do (see retry_wide_offsets()), which needs the text as it was to begin with. So that has to be kept
+ * where it's parsed in place and may be modified, unless it can't possibly be needed. */
+
+/* Returns true if a document parsed from input_size bytes should have 64 bit links from the start */
+static bool needs_wide_offsets(size_t input_size, unsigned int flags)
+{
+	return (flags & TML_PARSE_WIDE_OFFSETS) ||
+		input_size > TML_PARSER_MAX_DATA_SIZE / LIKELY_PARSED_SIZE_PER_INPUT_BYTE;
+}
+
+/* Returns true if a document parsed from input_size bytes with 32 bit links could grow too big for them */
+static bool might_need_wide_offsets(size_t input_size, unsigned int flags)
+{
+	return !(flags & TML_PARSE_WIDE_OFFSETS) && input_size > TML_PARSER_MAX_DATA_SIZE / MAX_PARSED_SIZE_PER_INPUT_BYTE;
+}
+
+/* Returns true if the document was parsed with 32 bit links and grew too big for them, in which case it's freed
+ * and wide_options are set up to parse it again with 64 bit links */
+static bool retry_wide_offsets(struct tml_doc *data, const struct tml_parse_options *options,
+	struct tml_parse_options *wide_options)
+{
+	if (!data || data->error_message != too_large_error)
+		return false;
+
+	tml_free_doc(data);
+	*wide_options = *options;
+	wide_options->flags |= TML_PARSE_WIDE_OFFSETS;
+	return true;
+}
+
+/* Creates an empty tml_doc, with room for buff_size bytes of parsed data to begin with */
+static struct tml_doc *create_doc(size_t buff_size, bool wide_offsets, const struct tml_allocator *allocator)
+{
+	struct tml_doc *data;
+
+	allocator = allocator_or_default(allocator);
+	data = allocator->alloc(allocator->user_data, sizeof(*data));
 	if (!data) return NULL;
 
 	memset(data, 0, sizeof(*data));
 
+	data->allocator = *allocator;
 	data->error_message = NULL;
-	data->buff_index = 0;
-	data->buff_allocated = ibuff_size * 2;
-	data->buff = malloc(data->buff_allocated);
+	data->wide_offsets = wide_offsets;
+	data->buff_allocated = DOC_HEADER_SIZE + buff_size + MAX_NODE_HEADER_SIZE + 1;
+	data->buff = allocator->alloc(allocator->user_data, data->buff_allocated);
 
 	if (!data->buff) {
-		free(data);
+		allocator->release(allocator->user_data, data, sizeof(*data));
 		return NULL;
 	}
 
-	struct tml_stream tokens = tml_stream_open(ibuff, ibuff_size);
-	parse_root(data, &tokens);
-	tml_stream_close(&tokens);
+	memcpy(data->buff, &data, sizeof(data));
+	data->buff_index = DOC_HEADER_SIZE;
 
+	return data;
+}
+
+/* Trims a fully parsed tml_doc down to size */
+static struct tml_doc *finish_doc(struct tml_doc *data)
+{
+	free_string_pool(data);
 	shrink_buffer(data);
 
 	if (data->buff == NULL) {
 		/* buff is NULL if realloc has failed */
-		free(data);
+		data->allocator.release(data->allocator.user_data, data, sizeof(*data));
 		return NULL;
 	}
 
@@ -95,26 +423,203 @@ struct tml_doc *tml_parse_in_memory(char *ibuff, size_t ibuff_size)
 	return data;
 }
 
+/* Applies the options which affect how the document is written while parsing. Returns false if out of memory. */
+static bool start_parse(struct tml_doc *data, const struct tml_parse_options *options)
+{
+	data->numeric_arrays = (options->flags & TML_PARSE_NUMERIC_ARRAYS) != 0;
+	data->typed_leaves = (options->flags & TML_PARSE_TYPED_LEAVES) != 0;
+	data->max_depth = options->max_depth;
+	data->max_nodes = options->max_nodes;
+	return !(options->flags & TML_PARSE_INTERN) || create_string_pool(data);
+}
+
+/* Applies the options which take effect once parsing has finished */
+static struct tml_doc *finish_parse(struct tml_doc *data, unsigned int flags)
+{
+	if (data && (flags & TML_PARSE_DEDUP))
+		tml_doc_dedup(data);
+	if (data && (flags & TML_PARSE_CHILD_INDEX) && !tml_index_children(data))
+		set_parse_error(data, "Out of memory");
+	return data;
+}
+
+/* Fills in options with the given flags and allocator, and the default limits */
+static const struct tml_parse_options *make_options(struct tml_parse_options *options, unsigned int flags,
+	const struct tml_allocator *allocator)
+{
+	tml_init_parse_options(options);
+	options->flags = flags;
+	options->allocator = allocator;
+	return options;
+}
+
+struct tml_doc *tml_parse_in_memory_ex(char *ibuff, size_t ibuff_size, unsigned int flags)
+{
+	return tml_parse_in_memory_alloc(ibuff, ibuff_size, flags, NULL);
+}
+
+struct tml_doc *tml_parse_in_memory_alloc(char *ibuff, size_t ibuff_size, unsigned int flags,
+	const struct tml_allocator *allocator)
+{
+	struct tml_parse_options options;
+	return tml_parse_in_memory_opts(ibuff, ibuff_size, make_options(&options, flags, allocator));
+}
+
+/* Parses the buffer in place, with 64 bit links if needs_wide_offsets() */
+static struct tml_doc *parse_in_memory(char *ibuff, size_t ibuff_size, const struct tml_parse_options *options)
+{
+	unsigned int flags = options->flags;
+	struct tml_doc *data = create_doc(ibuff_size * 2, needs_wide_offsets(ibuff_size, flags), options->allocator);
+	if (!data) return NULL;
+
+	if (!start_parse(data, options)) {
+		tml_free_doc(data);
+		return NULL;
+	}
+
+	struct tml_stream tokens;
+	if (flags & TML_PARSE_STRUCTURAL_INDEX)
+		tokens = tml_stream_open_indexed(ibuff, ibuff_size);
+	else
+		tokens = tml_stream_open(ibuff, ibuff_size);
+
+	parse_root(data, &tokens);
+	tml_stream_close(&tokens);
+
+	return finish_parse(finish_doc(data), flags);
+}
+
+struct tml_doc *tml_parse_in_memory_opts(char *ibuff, size_t ibuff_size, const struct tml_parse_options *options)
+{
+	struct tml_parse_options wide_options;
+	struct tml_doc *data;
+
+	/* only escape codes are written over as the text is parsed, so without them it can be parsed again */
+	if (might_need_wide_offsets(ibuff_size, options->flags) && !needs_wide_offsets(ibuff_size, options->flags) &&
+		memchr(ibuff, TML_ESCAPE_CHAR, ibuff_size)) {
+		wide_options = *options;
+		wide_options.flags |= TML_PARSE_WIDE_OFFSETS;
+		return parse_in_memory(ibuff, ibuff_size, &wide_options);
+	}
+
+	data = parse_in_memory(ibuff, ibuff_size, options);
+	if (retry_wide_offsets(data, options, &wide_options))
+		data = parse_in_memory(ibuff, ibuff_size, &wide_options);
+	return data;
+}
+
 struct tml_doc *tml_parse_memory(const char *ibuff, size_t ibuff_size)
 {
-	char *ibuff_copy = malloc(ibuff_size);
+	return tml_parse_memory_ex(ibuff, ibuff_size, TML_PARSE_DEFAULT);
+}
+
+struct tml_doc *tml_parse_memory_ex(const char *ibuff, size_t ibuff_size, unsigned int flags)
+{
+	return tml_parse_memory_alloc(ibuff, ibuff_size, flags, NULL);
+}
+
+struct tml_doc *tml_parse_memory_alloc(const char *ibuff, size_t ibuff_size, unsigned int flags,
+	const struct tml_allocator *allocator)
+{
+	struct tml_parse_options options;
+	return tml_parse_memory_opts(ibuff, ibuff_size, make_options(&options, flags, allocator));
+}
+
+struct tml_doc *tml_parse_memory_opts(const char *ibuff, size_t ibuff_size, const struct tml_parse_options *options)
+{
+	const struct tml_allocator *allocator = allocator_or_default(options->allocator);
+	struct tml_parse_options wide_options;
+	char *ibuff_copy = allocator->alloc(allocator->user_data, ibuff_size);
 	if (!ibuff_copy) return NULL;
 	memcpy(ibuff_copy, ibuff, ibuff_size);
-	struct tml_doc *data = tml_parse_in_memory(ibuff_copy, ibuff_size);
-	free(ibuff_copy);
+	struct tml_doc *data = parse_in_memory(ibuff_copy, ibuff_size, options);
+	if (retry_wide_offsets(data, options, &wide_options)) {
+		memcpy(ibuff_copy, ibuff, ibuff_size);
+		data = parse_in_memory(ibuff_copy, ibuff_size, &wide_options);
+	}
+	allocator->release(allocator->user_data, ibuff_copy, ibuff_size);
 	return data;
 }
 
 struct tml_doc *tml_parse_string(const char *str)
+{
+	return tml_parse_string_ex(str, TML_PARSE_DEFAULT);
+}
+
+struct tml_doc *tml_parse_string_ex(const char *str, unsigned int flags)
+{
+	return tml_parse_string_alloc(str, flags, NULL);
+}
+
+struct tml_doc *tml_parse_string_alloc(const char *str, unsigned int flags, const struct tml_allocator *allocator)
+{
+	struct tml_parse_options options;
+	return tml_parse_string_opts(str, make_options(&options, flags, allocator));
+}
+
+struct tml_doc *tml_parse_string_opts(const char *str, const struct tml_parse_options *options)
 {
 	size_t len = strlen(str);
-	return tml_parse_memory(str, len);
+	return tml_parse_memory_opts(str, len, options);
 }
 
 struct tml_doc *tml_parse_file(const char *filename)
 {
+	return tml_parse_file_ex(filename, TML_PARSE_DEFAULT);
+}
+
+static struct tml_push_parser *create_push_parser(size_t buff_size, bool wide_offsets,
+	const struct tml_parse_options *options);
+static struct tml_doc *parse_file_in_chunks(FILE *fp, size_t fsize, const struct tml_parse_options *options);
+static struct tml_doc *parse_file_mapped(const char *filename, const struct tml_parse_options *options);
+
+struct tml_doc *tml_parse_file_ex(const char *filename, unsigned int flags)
+{
+	return tml_parse_file_alloc(filename, flags, NULL);
+}
+
+struct tml_doc *tml_parse_file_alloc(const char *filename, unsigned int flags, const struct tml_allocator *allocator)
+{
+	struct tml_parse_options options;
+	return tml_parse_file_opts(filename, make_options(&options, flags, allocator));
+}
+
+/* Parses the rest of the file, of fsize bytes in all */
+static struct tml_doc *parse_open_file(FILE *fp, long int fsize, const struct tml_parse_options *options)
+{
+	const struct tml_allocator *allocator;
+	struct tml_doc *data;
+	char *buff;
+
+	if (!(options->flags & TML_PARSE_STRUCTURAL_INDEX))
+		return parse_file_in_chunks(fp, fsize, options);
+
+	allocator = allocator_or_default(options->allocator);
+	buff = allocator->alloc(allocator->user_data, sizeof(char) * fsize);
+	if (!buff)
+		return NULL;
+
+	if (fsize != fread(buff, 1, fsize, fp)) {
+		allocator->release(allocator->user_data, buff, fsize);
+		return NULL;
+	}
+
+	data = parse_in_memory(buff, fsize, options);
+	allocator->release(allocator->user_data, buff, fsize);
+	return data;
+}
+
+struct tml_doc *tml_parse_file_opts(const char *filename, const struct tml_parse_options *options)
+{
+	struct tml_parse_options wide_options;
+	struct tml_doc *data;
 	long int fsize;
 
+#ifdef TML_HAVE_MMAP
+	if (options->flags & TML_PARSE_MMAP)
+		return parse_file_mapped(filename, options);
+#endif
+
 	FILE *fp = fopen(filename, "rb");
 	if (!fp)
 		return NULL;
@@ -123,32 +628,30 @@ struct tml_doc *tml_parse_file(const char *filename)
 	fsize = ftell(fp); /* get file size */
 	rewind(fp);
 
-	char *buff = malloc(sizeof(char) * fsize);
-	if (!buff) {
-		fclose(fp);
-		return NULL;
-	}
-
-	if (fsize != fread(buff, 1, fsize, fp)) {
-		fclose(fp);
-		free(buff);
-		return NULL;
+	data = parse_open_file(fp, fsize, options);
+	if (retry_wide_offsets(data, options, &wide_options)) {
+		rewind(fp);
+		data = parse_open_file(fp, fsize, &wide_options);
 	}
 
-	struct tml_doc *data = tml_parse_in_memory(buff, fsize);
-
 	fclose(fp);
-	free(buff);
-
 	return data;
 }
 
 void tml_free_doc(struct tml_doc *data)
 {
 	if (data) {
+		struct tml_allocator allocator = data->allocator;
+
+		free_child_index(data);
+		free_string_pool(data);
 		if (data->buff)
-			free(data->buff);
-		free(data);
+			allocator.release(allocator.user_data, data->buff, data->buff_allocated);
+#ifdef TML_HAVE_MMAP
+		if (data->mapping)
+			munmap(data->mapping, data->mapping_size);
+#endif
+		allocator.release(allocator.user_data, data, sizeof(*data));
 	}
 }
 
@@ -159,7 +662,8 @@ static void set_parse_error(struct tml_doc *data, const char *error_message)
 }
 
 
-static void write_packed_node(struct tml_doc *data, const char *str, int str_len, int sibling_offset)
+/* Writes a leaf of under MAX_PACKED_LENGTH characters, whose next sibling (if it has one) follows right after it */
+static void write_packed_node(struct tml_doc *data, const char *str, int str_len, bool has_sibling)
 {
 	size_t index = data->buff_index;
 
@@ -168,8 +672,8 @@ static void write_packed_node(struct tml_doc *data, const char *str, int str_len
 
 	if (data->buff == NULL) return; /* in case realloc fails */
 
-	/* write sibling offset byte */
-	((unsigned char*)data->buff)[index] = (unsigned char)sibling_offset;
+	/* write length and sibling bit */
+	((unsigned char*)data->buff)[index] = PACKED_HEADER(str_len, has_sibling);
 	index += sizeof(unsigned char);
 
 	/* copy string contents */
@@ -185,531 +689,5138 @@ static void write_packed_node(struct tml_doc *data, const char *str, int str_len
 	data->buff_index = index;
 }
 
-static size_t write_node(struct tml_doc *data, const char *str, int str_len)
+/* Marks a packed leaf as having no next sibling */
+static __inline__ void end_packed_node(char *node_ptr)
 {
-	size_t index = data->buff_index;
+	((unsigned char*)node_ptr)[0] &= ~1;
+}
 
-	grow_buffer_if_needed(data, 
-		index + NODE_LINK_DATA_SIZE + (str_len + 1) * sizeof(char));
+/* Returns the type of a word, along with its value if it's a number (as *integer for TML_LEAF_INT, or else
+ * as *number) */
+static enum TML_LEAF_TYPE classify_word(const char *str, size_t str_len, int64_t *integer, double *number)
+{
+	size_t length;
+
+	if (tml_parse_int64(str, str_len, integer, &length) == TML_NUMBER_OK && length == str_len)
+		return TML_LEAF_INT;
+	if (tml_parse_double(str, str_len, number, &length) == TML_NUMBER_OK && length == str_len)
+		return TML_LEAF_DOUBLE;
+	if ((str_len == 4 && memcmp(str, "true", 4) == 0) || (str_len == 5 && memcmp(str, "false", 5) == 0))
+		return TML_LEAF_BOOL;
+	return TML_LEAF_STRING;
+}
 
-	if (data->buff == NULL) return 0; /* in case realloc fails */
+/* Writes a typed leaf (see TML_PARSE_TYPED_LEAVES) if the word is a number, "true" or "false" of up to
+ * MAX_PACKED_LENGTH characters, whose next sibling (if it has one) follows right after it. Returns false
+ * without writing anything for any other word. */
+static bool write_typed_leaf(struct tml_doc *data, const char *str, size_t str_len, bool has_sibling)
+{
+	size_t index = data->buff_index, value_index, text_index;
+	enum TML_LEAF_TYPE type;
+	int64_t integer = 0;
+	double number = 0;
+	float single = 0;
+
+	if (str_len > MAX_PACKED_LENGTH)
+		return false;
+	type = classify_word(str, str_len, &integer, &number);
+	if (type == TML_LEAF_STRING)
+		return false;
+	if (type != TML_LEAF_BOOL)
+		tml_parse_float(str, str_len, &single, NULL);
+
+	value_index = (index + 2 + sizeof(double) - 1) & ~(sizeof(double) - 1);
+	text_index = value_index + TYPED_LEAF_VALUE_OFFSET;
+	grow_buffer_if_needed(data, text_index + str_len + 1);
+	if (data->buff == NULL) return true; /* in case realloc fails */
+
+	data->buff[index] = (char)(has_sibling ? TYPED_LEAF_DATA_FLAG : LAST_TYPED_LEAF_DATA_FLAG);
+	data->buff[index + 1] = (char)str_len;
+	memset(&data->buff[index + 2], 0, value_index - index - 2);
+	if (type == TML_LEAF_INT)
+		memcpy(&data->buff[value_index], &integer, sizeof(integer));
+	else
+		memcpy(&data->buff[value_index], &number, sizeof(number));
+	memcpy(&data->buff[text_index - TYPED_LEAF_FLOAT_OFFSET], &single, sizeof(single));
+	data->buff[text_index - 1] = (char)(TYPED_LEAF_MARK + type);
+
+	memcpy(&data->buff[text_index], str, str_len);
+	data->buff[text_index + str_len] = '\0';
+	data->buff_index = text_index + str_len + 1;
+	return true;
+}
 
-	/* write node link data */
-	char *ptr = &data->buff[index];
-	ptr[0] = FULL_NODE_DATA_FLAG;
-	memset(ptr+1, 0, NODE_LINK_DATA_SIZE-1);
-	index += NODE_LINK_DATA_SIZE;
+/* Returns the offset of a typed leaf's value, given the offset of the leaf */
+static __inline__ size_t typed_leaf_value_index(size_t index)
+{
+	return ((index + 2 + sizeof(double) - 1) & ~(sizeof(double) - 1)) + TYPED_LEAF_VALUE_OFFSET;
+}
 
-	/* copy string contents */
-	if (str_len > 0) {
-		memcpy(data->buff + index, str, str_len * sizeof(char));
-		index += str_len * sizeof(char);
-	}
+static __inline__ bool is_typed_leaf(unsigned char flag)
+{
+	return flag == TYPED_LEAF_DATA_FLAG || flag == LAST_TYPED_LEAF_DATA_FLAG;
+}
 
-	/* null terminate string */
-	data->buff[index] = '\0';
-	index += sizeof(char);
+/* Returns the TML_LEAF_TYPE stored with a node's value, or TML_LEAF_NONE if it isn't a typed leaf. Only a
+ * typed leaf has a byte over TYPED_LEAF_MARK right before a value of up to MAX_PACKED_LENGTH characters. */
+static __inline__ enum TML_LEAF_TYPE stored_leaf_type(const struct tml_node *node)
+{
+	unsigned char mark;
 
-	data->buff_index = index;
-	return ptr - data->buff;
+	if (node->value[0] == '\0' || node->size > MAX_PACKED_LENGTH)
+		return TML_LEAF_NONE;
+	mark = ((const unsigned char *)node->value)[-1];
+	return (mark > TYPED_LEAF_MARK) ? (enum TML_LEAF_TYPE)(mark - TYPED_LEAF_MARK) : TML_LEAF_NONE;
 }
 
-static __inline__ void update_node_child(char *node_ptr, size_t first_child)
+static __inline__ size_t link_width(bool wide)
 {
-	tml_offset_t *fc = (tml_offset_t*)(node_ptr + 1);
-	*fc = (tml_offset_t)first_child;
+	return wide ? sizeof(uint64_t) : sizeof(uint32_t);
 }
 
-static __inline__ void update_node_sibling(char *node_ptr, size_t next_sibling)
+/* Returns the size of the flag, padding and links of a full or reference node written at the given offset */
+static __inline__ size_t node_header_size(size_t index, bool wide)
 {
-	tml_offset_t *ns = (tml_offset_t*)(node_ptr + 1 + sizeof(tml_offset_t));
-	*ns = (tml_offset_t)next_sibling;
+	size_t width = link_width(wide);
+	return ((index + 1 + width - 1) & ~(width - 1)) - index + width * NODE_LINK_COUNT;
 }
 
-static __inline__ size_t get_node_child(char *node_ptr)
+/* Link data is read and written according to the node's own flag byte, so the functions below work
+ * on nodes of either offset width. The links of full and reference nodes are aligned. */
+
+static __inline__ bool is_wide_node(const char *node_ptr)
 {
-	tml_offset_t *fc = (tml_offset_t*)(node_ptr + 1);
-	return *fc;
+	unsigned char flag = ((const unsigned char*)node_ptr)[0];
+	return flag == WIDE_FULL_NODE_DATA_FLAG || flag == WIDE_REFERENCE_NODE_DATA_FLAG;
 }
 
-static __inline__ size_t get_node_sibling(char *node_ptr)
+/* Returns the address of the given link of a full or reference node (0 for first_child, 1 for next_sibling,
+ * 2 for size), which is the first aligned position after its flag byte */
+static __inline__ char *node_link(const char *node_ptr, int link, bool wide)
 {
-	tml_offset_t *ns = (tml_offset_t*)(node_ptr + 1 + sizeof(tml_offset_t));
-	return *ns;
+	uintptr_t width = link_width(wide);
+	return (char *)((((uintptr_t)node_ptr + 1 + width - 1) & ~(width - 1)) + width * link);
 }
 
+static __inline__ void write_link(char *link_ptr, size_t offset, bool wide)
+{
+	if (wide)
+		*(uint64_t *)link_ptr = offset;
+	else
+		*(uint32_t *)link_ptr = (uint32_t)offset;
+}
 
-/* Parses "[...]" */
-static void parse_root(struct tml_doc *data, struct tml_stream *tokens)
+static __inline__ size_t read_link(const char *link_ptr, bool wide)
 {
-	struct tml_token token = tml_stream_pop(tokens);
+	if (wide)
+		return (size_t)*(const uint64_t *)link_ptr;
+	else
+		return *(const uint32_t *)link_ptr;
+}
 
-	if (token.type != TML_TOKEN_OPEN) {
-		if (token.type == TML_TOKEN_EOF)
-			set_parse_error(data, "File contents is empty");
-		else
-			set_parse_error(data, "Expecting opening bracket at start of file");
-		data->root_node = TML_NODE_NULL;
-		return;
+/* Interned leaves have their one link right after the flag byte, so it isn't necessarily aligned */
+static __inline__ void write_unaligned_link(char *link_ptr, size_t offset, bool wide)
+{
+	if (wide) {
+		uint64_t link = offset;
+		memcpy(link_ptr, &link, sizeof(link));
+	}
+	else {
+		uint32_t link = (uint32_t)offset;
+		memcpy(link_ptr, &link, sizeof(link));
 	}
+}
 
-	size_t root_node_offset = parse_list_node(data, tokens, true, NULL);
+static __inline__ size_t read_unaligned_link(const char *link_ptr, bool wide)
+{
+	if (wide) {
+		uint64_t link;
+		memcpy(&link, link_ptr, sizeof(link));
+		return (size_t)link;
+	}
+	else {
+		uint32_t link;
+		memcpy(&link, link_ptr, sizeof(link));
+		return link;
+	}
+}
 
-	token = tml_stream_pop(tokens);
+static __inline__ void update_node_child(char *node_ptr, size_t first_child)
+{
+	bool wide = is_wide_node(node_ptr);
+	write_link(node_link(node_ptr, 0, wide), first_child, wide);
+}
 
-	if (token.type != TML_TOKEN_EOF) {
-		set_parse_error(data, "Expected end of file after end of root node");
-		return;
-	}
+static __inline__ void update_node_sibling(char *node_ptr, size_t next_sibling)
+{
+	bool wide = is_wide_node(node_ptr);
+	write_link(node_link(node_ptr, 1, wide), next_sibling, wide);
+}
 
-	if (data->buff) {
-		data->root_node.buff = data->buff;
-		data->root_node.value = "";
-		data->root_node.next_sibling = 0;
-		data->root_node.first_child = get_node_child(&data->buff[root_node_offset]);
-	}
+static __inline__ void update_node_size(char *node_ptr, size_t size)
+{
+	bool wide = is_wide_node(node_ptr);
+	write_link(node_link(node_ptr, 2, wide), size, wide);
+}
 
-	return;
+static __inline__ size_t get_node_child(const char *node_ptr)
+{
+	bool wide = is_wide_node(node_ptr);
+	return read_link(node_link(node_ptr, 0, wide), wide);
 }
 
+static __inline__ size_t get_node_sibling(const char *node_ptr)
+{
+	bool wide = is_wide_node(node_ptr);
+	return read_link(node_link(node_ptr, 1, wide), wide);
+}
 
-/* Parses "...]", a list where we assume that the opening brace has been read. 
- * After returning from this function, the stream will have read the closing brace. */
-static size_t parse_list_node(struct tml_doc *data, struct tml_stream *tokens, bool process_divider, struct tml_token *token_out)
+static __inline__ size_t get_node_size(const char *node_ptr)
 {
-	/* this is the container node for the list contents */
-	size_t root_node = write_node(data, NULL, 0);
+	bool wide = is_wide_node(node_ptr);
+	return read_link(node_link(node_ptr, 2, wide), wide);
+}
 
-	struct tml_token token, last_token;
-	bool peeked = false;
-	bool set_first_child = false;
+static size_t write_node(struct tml_doc *data, const char *str, int str_len)
+{
+	size_t index = data->buff_index, header_size = node_header_size(index, data->wide_offsets);
 
-	for (;;) {
-		/* read the next token, if we haven't already peeked at it */
-		if (!peeked) {
-			last_token = token;
-			token = tml_stream_pop(tokens);
-		} else {
-			peeked = false;
-		}
+	grow_buffer_if_needed(data, 
+		index + header_size + (str_len + 1) * sizeof(char));
 
-		if (token.type == TML_TOKEN_ITEM) {
-			/* record the first child under this list */
-			if (!set_first_child) {
-				update_node_child(&data->buff[root_node], data->buff_index);
-				set_first_child = true;
-			}
+	if (data->buff == NULL) return 0; /* in case realloc fails */
 
-			/* peek ahead to see if there is a next sibling */
-			last_token = token;
-			token = tml_stream_pop(tokens);
-			peeked = true;
+	/* write node link data, with the value's length as its size (a list's is filled in when it ends) */
+	char *ptr = &data->buff[index];
+	ptr[0] = (char)(data->wide_offsets ? WIDE_FULL_NODE_DATA_FLAG : FULL_NODE_DATA_FLAG);
+	memset(ptr+1, 0, header_size-1);
+	index += header_size;
+	update_node_size(ptr, str_len);
 
-			if (token.type != TML_TOKEN_ITEM && token.type != TML_TOKEN_OPEN) {
-				/* this is the last element of a list, so use next_sibling offset = 0 */
-				write_packed_node(data, last_token.value, last_token.value_size, 0);
-			}
-			else {
-				/* this is a regular leaf node with a next sibling */
-				if (last_token.value_size < FULL_NODE_DATA_FLAG) {
-					/* length of this leaf node string is under 255 characters */
-					int sibling_offset = last_token.value_size;
-					write_packed_node(data, last_token.value, last_token.value_size, sibling_offset);
-				}
-				else {
-					/* length of contents exceeds 255 characters so use full 32-bit node link data */
-					size_t n = write_node(data, last_token.value, last_token.value_size);
-					update_node_sibling(&data->buff[n], data->buff_index);
-				}
+	/* copy string contents */
+	if (str_len > 0) {
+		memcpy(data->buff + index, str, str_len * sizeof(char));
+		index += str_len * sizeof(char);
+	}
+
+	/* null terminate string */
+	data->buff[index] = '\0';
+	index += sizeof(char);
+
+	data->buff_index = index;
+	return ptr - data->buff;
+}
+
+/* Writes a leaf node referring to a string of str_len characters in the file mapping, and returns its offset */
+static size_t write_reference_node(struct tml_doc *data, size_t str_offset, size_t str_len)
+{
+	size_t index = data->buff_index, header_size = node_header_size(index, data->wide_offsets);
+
+	grow_buffer_if_needed(data, index + header_size);
+
+	if (data->buff == NULL) return 0; /* in case realloc fails */
+
+	/* the string offset goes where a full node's first_child would be */
+	char *ptr = &data->buff[index];
+	ptr[0] = (char)(data->wide_offsets ? WIDE_REFERENCE_NODE_DATA_FLAG : REFERENCE_NODE_DATA_FLAG);
+	memset(ptr + 1, 0, header_size - 1);
+	update_node_child(ptr, str_offset);
+	update_node_size(ptr, str_len);
+
+	data->buff_index = index + header_size;
+	return index;
+}
+
+/* With TML_PARSE_NUMERIC_ARRAYS, a list of NUMERIC_ARRAY_MIN_LENGTH or more numbers is rewritten as a binary
+ * array when its end is reached, if that takes less space than its words did. Its words are then all packed
+ * leaves right after the list node, so the array just takes their place. Its first_child link is the offset of
+ * the list node itself, which read_node() gives as no first_child at all (so that it's never taken for the id of
+ * a node), and array_node_offset() then tells it apart from an empty list. Its children are only made when
+ * they're needed, as text (see add_array_table()).
+ *
+ * Each element has to be formatted back into exactly the word it came from, so a list is only converted if
+ * every word is written just as it would be formatted. Integers are stored as the smallest type they all fit
+ * in, and decimals as floats if every word is written as its float would be, or else as doubles. Words with no
+ * more significant digits than FLT_DIG (or DBL_DIG) in the normal range always are, so only longer ones need
+ * to be formatted to check. */
+
+/* Shorter lists don't take enough space as words to be worth it */
+#define NUMERIC_ARRAY_MIN_LENGTH 4
+
+/* The size of an element of each TML_ARRAY_TYPE */
+static const unsigned char array_element_sizes[] = { 0, sizeof(int8_t), sizeof(int16_t), sizeof(int32_t),
+	sizeof(int64_t), sizeof(float), sizeof(double) };
+
+enum number_form { NOT_A_NUMBER, INTEGER_FORM, DECIMAL_FORM };
+
+static __inline__ bool is_digit(char c)
+{
+	return (unsigned char)(c - '0') < 10;
+}
+
+/* Returns true if a word could be a number written as it would be formatted */
+static __inline__ bool starts_like_number(const char *str, size_t str_len)
+{
+	return str_len > 0 && (is_digit(str[0]) || (str[0] == '-' && str_len > 1 && is_digit(str[1])));
+}
+
+/* Returns the offset where the elements of an array begin, given the offset of its type byte */
+static __inline__ size_t array_data_index(const char *buff, size_t type_index, size_t element_size)
+{
+	uintptr_t start = (uintptr_t)(buff + type_index + 1);
+	return type_index + 1 + (size_t)(((start + element_size - 1) & ~(uintptr_t)(element_size - 1)) - start);
+}
+
+/* Reads where the elements of the binary array at this offset are */
+static void read_array_node(const char *buff, size_t node, struct tml_array *array)
+{
+	const char *ptr = &buff[node];
+	size_t type_index = (node_link(ptr, NODE_LINK_COUNT, is_wide_node(ptr)) + 1) - buff;
+
+	array->type = (enum TML_ARRAY_TYPE)((const unsigned char *)buff)[type_index];
+	array->data = &buff[array_data_index(buff, type_index, array_element_sizes[array->type])];
+	array->count = get_node_size(ptr);
+}
+
+/* Returns the form of a word if it's written the way its number would be formatted, and sets *digits to its
+ * number of significant digits (not counting zeros at either end) */
+static enum number_form number_form(const char *str, size_t str_len, int *digits)
+{
+	const char *end = str + str_len, *p = str, *first = NULL, *last = NULL, *point = NULL;
+
+	if (p < end && *p == '-')
+		++p;
+	if (p == end || !is_digit(*p) || (*p == '0' && p + 1 < end && is_digit(p[1])))
+		return NOT_A_NUMBER;
+
+	for (; p < end; ++p) {
+		if (is_digit(*p)) {
+			if (*p != '0') {
+				if (!first) first = p;
+				last = p;
 			}
 		}
-		else if (token.type == TML_TOKEN_OPEN) {
-			/* record the first child under this list */
-			if (!set_first_child) {
-				update_node_child(&data->buff[root_node], data->buff_index);
-				set_first_child = true;
-			}
+		else if (*p == '.' && !point && p + 1 < end) {
+			point = p;
+		}
+		else {
+			return NOT_A_NUMBER;
+		}
+	}
+
+	/* zero is only ever "0", and decimals never end in a zero */
+	if (!first) {
+		*digits = 0;
+		return str_len == 1 ? INTEGER_FORM : NOT_A_NUMBER;
+	}
+	if (point && end[-1] == '0')
+		return NOT_A_NUMBER;
+
+	*digits = (int)(last - first) + 1 - ((point && first < point && point < last) ? 1 : 0);
+	return point ? DECIMAL_FORM : INTEGER_FORM;
+}
+
+/* Writes an integer, returning its length (at most 20) */
+static size_t format_integer(char *dest, int64_t value)
+{
+	char digits[20];
+	uint64_t magnitude = value < 0 ? (uint64_t)0 - (uint64_t)value : (uint64_t)value;
+	size_t count = 0, length = 0;
+
+	do {
+		digits[count++] = (char)('0' + magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude);
+
+	if (value < 0)
+		dest[length++] = '-';
+	while (count > 0)
+		dest[length++] = digits[--count];
+	return length;
+}
+
+/* Writes the shortest decimal that reads back as the same value (as a float, if single is true) without an
+ * exponent, e.g. "-0.00125" or "1500". The digits come from sprintf(), which uses the locale's decimal point
+ * and doesn't look for the shortest, so each precision is tried in turn and the digits written out again here.
+ * Returns the length, or 0 if it doesn't fit in dest_size - 1 characters. */
+static size_t format_decimal(char *dest, size_t dest_size, double value, bool single)
+{
+	char text[40], digits[20];
+	int precision, max_precision = single ? 9 : 17;
+	size_t length = 0;
 
-			/* recurse into a new list item */
-			size_t list_node = parse_list_node(data, tokens, true, NULL);
+	if (value == 0) {
+		dest[length++] = '0';
+		return length;
+	}
+
+	for (precision = 1; precision <= max_precision; ++precision) {
+		const char *p = text;
+		int digit_count = 0, exponent = 0, point, i;
+		bool negative_exponent = false;
+		size_t needed;
 
-			/* peek ahead to see if there is a next sibling */
-			last_token = token;
-			token = tml_stream_pop(tokens);
-			peeked = true;
+		sprintf(text, "%.*e", precision - 1, value);
+
+		/* the digits are all those before the "e", and the decimal point goes after the first exponent + 1 */
+		for (; *p && *p != 'e'; ++p) {
+			if (is_digit(*p) && digit_count < (int)sizeof(digits))
+				digits[digit_count++] = *p;
+		}
+		if (*p == 'e')
+			++p;
+		if (*p == '-' || *p == '+')
+			negative_exponent = (*p++ == '-');
+		for (; is_digit(*p); ++p)
+			exponent = exponent * 10 + (*p - '0');
+		point = (negative_exponent ? -exponent : exponent) + 1;
+
+		while (digit_count > 1 && digits[digit_count - 1] == '0')
+			digit_count--;
+
+		needed = (value < 0 ? 1 : 0) + (point <= 0 ? (size_t)(2 - point + digit_count) :
+			(size_t)(digit_count > point ? digit_count + 1 : point));
+		if (needed >= dest_size)
+			return 0;
 
-			/* set the list's next node link the current writing position if there are more list items */
-			if (token.type == TML_TOKEN_ITEM || token.type == TML_TOKEN_OPEN) {
-				update_node_sibling(&data->buff[list_node], data->buff_index);
+		length = 0;
+		if (value < 0)
+			dest[length++] = '-';
+		if (point <= 0) {
+			dest[length++] = '0';
+			dest[length++] = '.';
+			for (i = point; i < 0; ++i)
+				dest[length++] = '0';
+			memcpy(&dest[length], digits, digit_count);
+			length += digit_count;
+		}
+		else {
+			for (i = 0; i < point || i < digit_count; ++i) {
+				if (i == point)
+					dest[length++] = '.';
+				dest[length++] = (i < digit_count) ? digits[i] : '0';
 			}
 		}
-		else if (token.type == TML_TOKEN_DIVIDER) {
-			if (!process_divider) {
+
+		if (single) {
+			float read;
+			tml_parse_float(dest, length, &read, NULL);
+			if (read == (float)value)
+				break;
+		}
+		else {
+			double read;
+			tml_parse_double(dest, length, &read, NULL);
+			if (read == value)
 				break;
-			}
+		}
+	}
 
-			/* make the already written items into a list */
-			size_t first_list = write_node(data, NULL, 0);
-			update_node_child(&data->buff[first_list], get_node_child(&data->buff[root_node]));
-			update_node_sibling(&data->buff[first_list], data->buff_index);
-			update_node_child(&data->buff[root_node], first_list);
+	return length;
+}
 
-			/* recurse reading the list of nested items */
-			for (;;) {
-				struct tml_token closing_token;
-				size_t list_node = parse_list_node(data, tokens, false, &closing_token);
+/* Writes an element of an array as text, returning its length (or 0 if it doesn't fit in dest_size - 1) */
+static size_t format_array_element(char *dest, size_t dest_size, const struct tml_array *array, size_t i)
+{
+	switch (array->type) {
+		case TML_ARRAY_INT8: return format_integer(dest, ((const int8_t *)array->data)[i]);
+		case TML_ARRAY_INT16: return format_integer(dest, ((const int16_t *)array->data)[i]);
+		case TML_ARRAY_INT32: return format_integer(dest, ((const int32_t *)array->data)[i]);
+		case TML_ARRAY_INT64: return format_integer(dest, ((const int64_t *)array->data)[i]);
+		case TML_ARRAY_FLOAT: return format_decimal(dest, dest_size, ((const float *)array->data)[i], true);
+		case TML_ARRAY_DOUBLE: return format_decimal(dest, dest_size, ((const double *)array->data)[i], false);
+		default: return 0;
+	}
+}
 
-				if (closing_token.type == TML_TOKEN_DIVIDER)
-					update_node_sibling(&data->buff[list_node], data->buff_index);
-				else
-					break;
-			}
+/* Gives the word of the packed or typed leaf at this offset, and returns the offset right after it (or 0 if
+ * there's no such leaf there) */
+static __inline__ size_t read_leaf_word(const char *buff, size_t index, const char **word, size_t *length)
+{
+	unsigned char flag = ((const unsigned char *)buff)[index];
 
-			/* we've read the last nested list plus its closing ']', so all done */
-			break;
+	if (flag < MIN_NODE_DATA_FLAG) {
+		*word = &buff[index + 1];
+		*length = flag >> 1;
+		return index + 2 + *length;
+	}
+	if (is_typed_leaf(flag)) {
+		size_t value_index = typed_leaf_value_index(index);
+		*word = &buff[value_index];
+		*length = ((const unsigned char *)buff)[index + 1];
+		return value_index + *length + 1;
+	}
+	return 0;
+}
+
+/* Returns true if every one of the count leaves from offset first (each a number) is written just as
+ * format_decimal() would write its value */
+static bool decimals_round_trip(const char *buff, size_t first, size_t count, bool single)
+{
+	char text[MAX_PACKED_LENGTH + 1];
+	size_t index = first, i;
+
+	for (i = 0; i < count; ++i) {
+		const char *word;
+		size_t length;
+		double value;
+		int digits;
+
+		index = read_leaf_word(buff, index, &word, &length);
+		if (index == 0)
+			return false;
+		number_form(word, length, &digits);
+
+		if (single) {
+			float number;
+			if (tml_parse_float(word, length, &number, NULL) != TML_NUMBER_OK)
+				return false;
+			if (digits <= FLT_DIG && (number == 0 || number >= FLT_MIN || number <= -FLT_MIN))
+				continue;
+			value = number;
+		}
+		else {
+			if (tml_parse_double(word, length, &value, NULL) != TML_NUMBER_OK)
+				return false;
+			if (digits <= DBL_DIG && (value == 0 || value >= DBL_MIN || value <= -DBL_MIN))
+				continue;
+		}
+
+		if (format_decimal(text, sizeof(text), value, single) != length || memcmp(text, word, length) != 0)
+			return false;
+	}
+	return true;
+}
+
+/* Returns the type of binary array that the count leaves from offset first (which end at end) can be stored as,
+ * or TML_ARRAY_NONE if they aren't all packed or typed leaves of numbers written as they'd be formatted */
+static enum TML_ARRAY_TYPE numeric_array_type(const char *buff, size_t first, size_t end, size_t count)
+{
+	int64_t min = INT64_MAX, max = INT64_MIN;
+	bool integers = true;
+	size_t index = first, i;
+
+	for (i = 0; i < count; ++i) {
+		const char *word;
+		size_t length;
+		enum number_form form;
+		int64_t value;
+		int digits;
+
+		if (index >= end)
+			return TML_ARRAY_NONE;
+		index = read_leaf_word(buff, index, &word, &length);
+		if (index == 0 || index > end)
+			return TML_ARRAY_NONE;
+
+		form = number_form(word, length, &digits);
+		if (form == NOT_A_NUMBER)
+			return TML_ARRAY_NONE;
+
+		if (form == DECIMAL_FORM || tml_parse_int64(word, length, &value, NULL) != TML_NUMBER_OK) {
+			integers = false;
+		}
+		else {
+			if (value < min) min = value;
+			if (value > max) max = value;
+		}
+	}
+
+	if (index != end)
+		return TML_ARRAY_NONE;
+
+	if (integers) {
+		if (min >= INT8_MIN && max <= INT8_MAX) return TML_ARRAY_INT8;
+		if (min >= INT16_MIN && max <= INT16_MAX) return TML_ARRAY_INT16;
+		if (min >= INT32_MIN && max <= INT32_MAX) return TML_ARRAY_INT32;
+		return TML_ARRAY_INT64;
+	}
+	if (decimals_round_trip(buff, first, count, true))
+		return TML_ARRAY_FLOAT;
+	if (decimals_round_trip(buff, first, count, false))
+		return TML_ARRAY_DOUBLE;
+	return TML_ARRAY_NONE;
+}
+
+/* Rewrites the list at this offset, whose children have just been written, as a binary array if they're all
+ * numbers written as they'd be formatted and the array takes less space */
+static void write_numeric_array(struct tml_doc *data, size_t node)
+{
+	char *ptr = &data->buff[node];
+	size_t count = get_node_size(ptr), first = get_node_child(ptr), end = data->buff_index;
+	size_t type_index = (node_link(ptr, NODE_LINK_COUNT, is_wide_node(ptr)) + 1) - data->buff;
+	size_t element_size, scratch, data_index, index, i;
+	enum TML_ARRAY_TYPE type;
+
+	if (count < NUMERIC_ARRAY_MIN_LENGTH || first != type_index)
+		return;
+
+	type = numeric_array_type(data->buff, first, end, count);
+	if (type == TML_ARRAY_NONE)
+		return;
+
+	element_size = array_element_sizes[type];
+	data_index = array_data_index(data->buff, type_index, element_size);
+	if (data_index + count * element_size > end ||
+		(!data->wide_offsets && end + count * element_size >= TML_PARSER_MAX_DATA_SIZE))
+		return;
+
+	/* the numbers are read into the space after the words first, since the array is written over them */
+	scratch = end;
+	grow_buffer_if_needed(data, scratch + count * element_size);
+	if (data->buff == NULL) return; /* in case realloc fails */
+
+	index = first;
+	for (i = 0; i < count; ++i) {
+		char *element = &data->buff[scratch + i * element_size];
+		const char *word;
+		size_t length;
+
+		/* numeric_array_type() has checked these already, and the list is left as it is if not */
+		index = read_leaf_word(data->buff, index, &word, &length);
+		if (index == 0)
+			return;
+
+		if (type == TML_ARRAY_FLOAT) {
+			float number;
+			tml_parse_float(word, length, &number, NULL);
+			memcpy(element, &number, sizeof(number));
+		}
+		else if (type == TML_ARRAY_DOUBLE) {
+			double number;
+			tml_parse_double(word, length, &number, NULL);
+			memcpy(element, &number, sizeof(number));
+		}
+		else {
+			int64_t number;
+			int8_t number8;
+			int16_t number16;
+			int32_t number32;
+
+			tml_parse_int64(word, length, &number, NULL);
+			switch (type) {
+				case TML_ARRAY_INT8: number8 = (int8_t)number; memcpy(element, &number8, sizeof(number8)); break;
+				case TML_ARRAY_INT16: number16 = (int16_t)number; memcpy(element, &number16, sizeof(number16)); break;
+				case TML_ARRAY_INT32: number32 = (int32_t)number; memcpy(element, &number32, sizeof(number32)); break;
+				default: memcpy(element, &number, sizeof(number)); break;
+			}
 		}
-		else if (token.type == TML_TOKEN_CLOSE || token.type == TML_TOKEN_EOF) {
+	}
+
+	memmove(&data->buff[data_index], &data->buff[scratch], count * element_size);
+	data->buff[type_index] = (char)type;
+	memset(&data->buff[type_index + 1], 0, data_index - type_index - 1);
+	update_node_child(&data->buff[node], node);
+	data->buff_index = data_index + count * element_size;
+}
+
+/* Writes a copy of a binary array as a list node, and returns its offset (or 0 if out of memory) */
+static size_t write_array_node(struct tml_doc *data, const struct tml_array *array)
+{
+	size_t element_size = array_element_sizes[array->type], node, type_index, data_index;
+
+	node = write_node(data, NULL, 0);
+	if (data->buff == NULL) return 0; /* in case realloc fails */
+
+	type_index = data->buff_index;
+	grow_buffer_if_needed(data, type_index + element_size + array->count * element_size);
+	if (data->buff == NULL) return 0;
+
+	data_index = array_data_index(data->buff, type_index, element_size);
+	data->buff[type_index] = (char)array->type;
+	memset(&data->buff[type_index + 1], 0, data_index - type_index - 1);
+	memcpy(&data->buff[data_index], array->data, array->count * element_size);
+	update_node_child(&data->buff[node], node);
+	update_node_size(&data->buff[node], array->count);
+
+	data->buff_index = data_index + array->count * element_size;
+	return node;
+}
+
+/* Repeated words in a document parsed with TML_PARSE_INTERN are only stored once. The first of each is written
+ * as a packed leaf as usual, and the offset of its string kept in a hash table (the string pool) while parsing.
+ * Any later leaf with the same value is written as an interned leaf referring to that string, so equal words
+ * share one value pointer. Strings of packed leaves never move, so the offsets stay valid. Only words long
+ * enough for an interned leaf to be smaller than a packed one are pooled. */
+
+struct string_pool
+{
+	size_t *offsets; /* offset of each pooled string in the buffer, or 0 for an unused slot */
+	uint32_t *hashes;
+	size_t count, capacity;
+};
+
+#define STRING_POOL_INITIAL_CAPACITY 256
+
+static __inline__ bool is_interned_node(unsigned char flag)
+{
+	return flag >= WIDE_LAST_INTERNED_NODE_DATA_FLAG && flag <= INTERNED_NODE_DATA_FLAG;
+}
+
+static __inline__ size_t interned_node_size(unsigned char flag)
+{
+	return (flag <= WIDE_INTERNED_NODE_DATA_FLAG) ? WIDE_INTERNED_NODE_SIZE : INTERNED_NODE_SIZE;
+}
+
+/* Marks an interned leaf as having no next sibling */
+static __inline__ void end_interned_node(char *node_ptr)
+{
+	unsigned char flag = ((unsigned char*)node_ptr)[0];
+	node_ptr[0] = (char)(flag <= WIDE_INTERNED_NODE_DATA_FLAG ? WIDE_LAST_INTERNED_NODE_DATA_FLAG : LAST_INTERNED_NODE_DATA_FLAG);
+}
+
+static uint32_t hash_word(const char *str, size_t str_len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < str_len; ++i) {
+		hash ^= (unsigned char)str[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static bool alloc_string_pool_slots(struct tml_doc *data, struct string_pool *pool, size_t capacity)
+{
+	pool->offsets = data->allocator.alloc(data->allocator.user_data, capacity * sizeof(size_t));
+	pool->hashes = data->allocator.alloc(data->allocator.user_data, capacity * sizeof(uint32_t));
+
+	if (!pool->offsets || !pool->hashes) {
+		if (pool->offsets) data->allocator.release(data->allocator.user_data, pool->offsets, capacity * sizeof(size_t));
+		if (pool->hashes) data->allocator.release(data->allocator.user_data, pool->hashes, capacity * sizeof(uint32_t));
+		return false;
+	}
+
+	memset(pool->offsets, 0, capacity * sizeof(size_t));
+	pool->capacity = capacity;
+	return true;
+}
+
+static void release_string_pool_slots(struct tml_doc *data, size_t *offsets, uint32_t *hashes, size_t capacity)
+{
+	data->allocator.release(data->allocator.user_data, offsets, capacity * sizeof(size_t));
+	data->allocator.release(data->allocator.user_data, hashes, capacity * sizeof(uint32_t));
+}
+
+static bool create_string_pool(struct tml_doc *data)
+{
+	struct string_pool *pool = data->allocator.alloc(data->allocator.user_data, sizeof(*pool));
+
+	if (!pool)
+		return false;
+	if (!alloc_string_pool_slots(data, pool, STRING_POOL_INITIAL_CAPACITY)) {
+		data->allocator.release(data->allocator.user_data, pool, sizeof(*pool));
+		return false;
+	}
+
+	pool->count = 0;
+	data->string_pool = pool;
+	return true;
+}
+
+static void free_string_pool(struct tml_doc *data)
+{
+	struct string_pool *pool = data->string_pool;
+
+	if (pool) {
+		release_string_pool_slots(data, pool->offsets, pool->hashes, pool->capacity);
+		data->allocator.release(data->allocator.user_data, pool, sizeof(*pool));
+		data->string_pool = NULL;
+	}
+}
+
+/* Returns the length of a pooled string, from the header of the packed leaf it belongs to */
+static __inline__ size_t pooled_string_length(const char *str)
+{
+	return ((const unsigned char*)str)[-1] >> 1;
+}
+
+/* Returns the slot for the given word: the slot holding it if it's pooled, or else the empty slot for it */
+static size_t find_pooled_string(const struct tml_doc *data, const char *str, size_t str_len, uint32_t hash)
+{
+	const struct string_pool *pool = data->string_pool;
+	size_t mask = pool->capacity - 1, slot = hash & mask;
+
+	while (pool->offsets[slot]) {
+		const char *pooled = &data->buff[pool->offsets[slot]];
+
+		if (pool->hashes[slot] == hash && pooled_string_length(pooled) == str_len && memcmp(pooled, str, str_len) == 0)
 			break;
+		slot = (slot + 1) & mask;
+	}
+
+	return slot;
+}
+
+/* Adds the string at the given buffer offset to the pool at the given (empty) slot. If the pool can't grow,
+ * the string just isn't pooled. */
+static void add_pooled_string(struct tml_doc *data, size_t slot, size_t str_offset, uint32_t hash)
+{
+	struct string_pool *pool = data->string_pool;
+
+	/* keep the table at most half full */
+	if ((pool->count + 1) * 2 > pool->capacity) {
+		size_t *old_offsets = pool->offsets, old_capacity = pool->capacity, i;
+		uint32_t *old_hashes = pool->hashes;
+
+		if (!alloc_string_pool_slots(data, pool, old_capacity * 2)) {
+			pool->offsets = old_offsets;
+			pool->hashes = old_hashes;
+			return;
 		}
 
-		/* in case out of memory */
-		if (!data->buff) {
-			return 0;
+		for (i = 0; i < old_capacity; ++i) {
+			if (old_offsets[i]) {
+				size_t new_slot = old_hashes[i] & (pool->capacity - 1);
+				while (pool->offsets[new_slot])
+					new_slot = (new_slot + 1) & (pool->capacity - 1);
+				pool->offsets[new_slot] = old_offsets[i];
+				pool->hashes[new_slot] = old_hashes[i];
+			}
 		}
+		release_string_pool_slots(data, old_offsets, old_hashes, old_capacity);
+
+		slot = find_pooled_string(data, &data->buff[str_offset], pooled_string_length(&data->buff[str_offset]), hash);
+	}
+
+	pool->offsets[slot] = str_offset;
+	pool->hashes[slot] = hash;
+	pool->count++;
+}
+
+/* Writes a leaf node referring to the pooled string at the given offset, assuming it has a next sibling */
+static void write_interned_node(struct tml_doc *data, size_t str_offset)
+{
+	size_t index = data->buff_index;
+	size_t node_size = data->wide_offsets ? WIDE_INTERNED_NODE_SIZE : INTERNED_NODE_SIZE;
+
+	grow_buffer_if_needed(data, index + node_size);
+
+	if (data->buff == NULL) return; /* in case realloc fails */
+
+	data->buff[index] = (char)(data->wide_offsets ? WIDE_INTERNED_NODE_DATA_FLAG : INTERNED_NODE_DATA_FLAG);
+	write_unaligned_link(&data->buff[index + 1], str_offset, data->wide_offsets);
+
+	data->buff_index = index + node_size;
+}
+
+/* Writes a word as an interned leaf if it's already pooled, or else as a packed leaf (pooling it if it's
+ * long enough to be worth it). Returns true if an interned leaf was written. */
+static bool write_pooled_leaf(struct tml_doc *data, const char *str, size_t str_len)
+{
+	const struct string_pool *pool = data->string_pool;
+	size_t node_size = data->wide_offsets ? WIDE_INTERNED_NODE_SIZE : INTERNED_NODE_SIZE;
+	uint32_t hash;
+	size_t slot;
+
+	/* numbers aren't pooled if their list may become a binary array, which would leave nothing to refer to */
+	if (str_len + 2 <= node_size || (data->numeric_arrays && starts_like_number(str, str_len))) {
+		write_packed_node(data, str, (int)str_len, true);
+		return false;
 	}
 
-	if (token.type == TML_TOKEN_EOF) {
-		set_parse_error(data, "Expected closing bracket on list");
+	hash = hash_word(str, str_len);
+	slot = find_pooled_string(data, str, str_len, hash);
+
+	if (pool->offsets[slot]) {
+		write_interned_node(data, pool->offsets[slot]);
+		return true;
 	}
 
-	if (token_out)
-		*token_out = token;
+	write_packed_node(data, str, (int)str_len, true);
+	if (data->buff)
+		add_pooled_string(data, slot, data->buff_index - str_len - 1, hash);
+	return false;
+}
+
+
+/* The tree is built one token at a time, so that it can be fed either from a token stream (parse_root)
+ * or from chunks of text as they arrive (tml_push_parser). Each list being written has a frame on an
+ * explicit stack. A list containing a divider becomes a FRAME_DIVIDED_LIST with one FRAME_SEGMENT
+ * above it for the nested list currently being read, e.g. "[a b | c d]" is written as "[[a b] [c d]]".
+ *
+ * Whether a node has a next sibling isn't known until the token after it arrives, so the last
+ * child of each list is patched when that happens: a new sibling fills in its next_sibling link,
+ * or the end of the list marks a packed leaf as having none. A leaf of 123+ characters is written
+ * with full link data. Each frame counts its children, which are written into the list's size link
+ * when it ends. */
+
+enum FRAME_TYPE { FRAME_LIST, FRAME_DIVIDED_LIST, FRAME_SEGMENT };
+enum CHILD_TYPE { CHILD_NONE, CHILD_PACKED_LEAF, CHILD_INTERNED_LEAF, CHILD_TYPED_LEAF, CHILD_LONG_LEAF, CHILD_REFERENCE_LEAF,
+	CHILD_LIST };
+enum BUILD_STATE { BUILD_START, BUILD_ROOT, BUILD_AFTER_ROOT, BUILD_DONE };
+
+struct build_frame
+{
+	size_t node, last_child, child_count;
+	unsigned char type, last_child_type;
+};
 
-	return root_node;
+#define BUILD_STACK_INITIAL_SIZE 32
+
+struct tree_builder
+{
+	const struct tml_allocator *allocator;
+	struct build_frame *stack;
+	size_t depth, allocated;
+	enum BUILD_STATE state;
+	size_t root_node, node_count;
+	struct build_frame initial_stack[BUILD_STACK_INITIAL_SIZE];
+	char *word; /* where words from a read only stream have their escape codes translated */
+	size_t word_allocated;
+};
+
+/* The default limits, for parses without options of their own (see tml_set_parse_limits(); 0 means unlimited) */
+static size_t parse_max_depth = 0, parse_max_nodes = 0;
+
+void tml_set_parse_limits(size_t max_depth, size_t max_nodes)
+{
+	parse_max_depth = max_depth;
+	parse_max_nodes = max_nodes;
 }
 
+void tml_get_parse_limits(size_t *max_depth, size_t *max_nodes)
+{
+	*max_depth = parse_max_depth;
+	*max_nodes = parse_max_nodes;
+}
 
-/* --------------- NODE ITERATION FUNCTIONS -------------------- */
+void tml_init_parse_options(struct tml_parse_options *options)
+{
+	options->flags = TML_PARSE_DEFAULT;
+	options->allocator = NULL;
+	options->max_depth = parse_max_depth;
+	options->max_nodes = parse_max_nodes;
+}
 
-static struct tml_node read_node(char *buff, char *ptr)
+/* Counts a node about to be written, and returns false if that's more than allowed */
+static bool count_node(struct tml_doc *data, struct tree_builder *builder)
 {
-	struct tml_node node;
-	node.buff = buff;
+	if (++builder->node_count > data->max_nodes && data->max_nodes) {
+		set_parse_error(data, "Document contains too many nodes");
+		return false;
+	}
+	return true;
+}
 
-	if (((unsigned char*)ptr)[0] == FULL_NODE_DATA_FLAG) {
-		/* read full node links */
-		node.first_child = get_node_child(ptr);
-		node.next_sibling = get_node_sibling(ptr);
-		node.value = &ptr[NODE_LINK_DATA_SIZE];
+static void builder_init(struct tree_builder *builder, const struct tml_allocator *allocator)
+{
+	builder->allocator = allocator;
+	builder->stack = builder->initial_stack;
+	builder->allocated = BUILD_STACK_INITIAL_SIZE;
+	builder->depth = 0;
+	builder->state = BUILD_START;
+	builder->root_node = 0;
+	builder->node_count = 0;
+	builder->word = NULL;
+	builder->word_allocated = 0;
+}
+
+static void builder_free(struct tree_builder *builder)
+{
+	if (builder->stack != builder->initial_stack)
+		builder->allocator->release(builder->allocator->user_data, builder->stack,
+			builder->allocated * sizeof(struct build_frame));
+	builder->stack = NULL;
+	if (builder->word)
+		builder->allocator->release(builder->allocator->user_data, builder->word, builder->word_allocated);
+	builder->word = NULL;
+}
+
+/* Writes a new list node and opens a frame for its contents */
+static bool push_frame(struct tml_doc *data, struct tree_builder *builder, enum FRAME_TYPE type)
+{
+	struct build_frame *frame;
+
+	if (builder->depth >= data->max_depth && data->max_depth) {
+		set_parse_error(data, "Lists are nested too deeply");
+		return false;
+	}
+	if (!count_node(data, builder))
+		return false;
+
+	if (builder->depth > 0)
+		builder->stack[builder->depth - 1].child_count++;
+
+	if (builder->depth == builder->allocated) {
+		const struct tml_allocator *allocator = builder->allocator;
+		size_t size = builder->allocated * 2 * sizeof(struct build_frame);
+		struct build_frame *stack = allocator->alloc(allocator->user_data, size);
+		if (!stack) {
+			set_parse_error(data, "Out of memory");
+			return false;
+		}
+		memcpy(stack, builder->stack, builder->depth * sizeof(struct build_frame));
+		if (builder->stack != builder->initial_stack)
+			allocator->release(allocator->user_data, builder->stack, builder->allocated * sizeof(struct build_frame));
+		builder->stack = stack;
+		builder->allocated *= 2;
+	}
+
+	frame = &builder->stack[builder->depth++];
+	frame->node = write_node(data, NULL, 0);
+	frame->type = type;
+	frame->last_child = 0;
+	frame->last_child_type = CHILD_NONE;
+	frame->child_count = 0;
+	return true;
+}
+
+/* Links the frame's last child (or the frame's list node, if it has no children yet) to the node
+ * about to be written at the current buffer position */
+static void link_next_child(struct tml_doc *data, struct build_frame *frame)
+{
+	switch (frame->last_child_type) {
+		case CHILD_NONE:
+			update_node_child(&data->buff[frame->node], data->buff_index);
+			break;
+		case CHILD_LONG_LEAF:
+		case CHILD_REFERENCE_LEAF:
+		case CHILD_LIST:
+			update_node_sibling(&data->buff[frame->last_child], data->buff_index);
+			break;
+		default:
+			/* packed, interned and typed leaves were written assuming they would have a sibling right after */
+			break;
+	}
+}
+
+/* Marks the frame's last child as having no next sibling, and records how many children the list has. If
+ * can_convert is true, a list of numbers may then be rewritten as a binary array (not the root, or the items
+ * before the first divider, whose list node is yet to be written). */
+static void end_children(struct tml_doc *data, struct build_frame *frame, bool can_convert)
+{
+	char *ptr = &data->buff[frame->last_child];
+
+	if (frame->last_child_type == CHILD_PACKED_LEAF)
+		end_packed_node(ptr);
+	else if (frame->last_child_type == CHILD_INTERNED_LEAF)
+		end_interned_node(ptr);
+	else if (frame->last_child_type == CHILD_TYPED_LEAF)
+		ptr[0] = (char)LAST_TYPED_LEAF_DATA_FLAG;
+
+	update_node_size(&data->buff[frame->node], frame->child_count);
+	if (can_convert && data->numeric_arrays &&
+		(frame->last_child_type == CHILD_PACKED_LEAF || frame->last_child_type == CHILD_TYPED_LEAF))
+		write_numeric_array(data, frame->node);
+	frame->last_child_type = CHILD_LIST;
+}
+
+/* Closes the innermost list, and returns false once the root list has been closed */
+static bool pop_list(struct tml_doc *data, struct tree_builder *builder)
+{
+	end_children(data, &builder->stack[builder->depth - 1], builder->depth > 1);
+
+	/* the nested list after a divider is closed by the same ']' as the list containing it */
+	if (builder->stack[--builder->depth].type == FRAME_SEGMENT) {
+		struct build_frame *frame = &builder->stack[--builder->depth];
+		update_node_size(&data->buff[frame->node], frame->child_count);
+	}
+
+	return builder->depth > 0;
+}
+
+/* Translates the escape codes of a word from a read only stream into the builder's own buffer, and gives the
+ * result as collapsed. Returns false if out of memory. */
+static bool collapse_word(struct tml_doc *data, struct tree_builder *builder, const struct tml_token *token,
+	struct tml_token *collapsed)
+{
+	if (token->value_size > builder->word_allocated) {
+		const struct tml_allocator *allocator = builder->allocator;
+		size_t size = builder->word_allocated ? builder->word_allocated : 64;
+		char *word;
+
+		while (size < token->value_size)
+			size *= 2;
+		word = allocator->alloc(allocator->user_data, size);
+		if (!word) {
+			set_parse_error(data, "Out of memory");
+			return false;
+		}
+		if (builder->word)
+			allocator->release(allocator->user_data, builder->word, builder->word_allocated);
+		builder->word = word;
+		builder->word_allocated = size;
+	}
+
+	*collapsed = *token;
+	collapsed->value = builder->word;
+	collapsed->value_size = tml_collapse_escapes(builder->word, token->value, token->value_size);
+	collapsed->escaped = 0;
+	return true;
+}
+
+static void write_leaf(struct tml_doc *data, struct tree_builder *builder, const struct tml_token *token)
+{
+	struct build_frame *frame = &builder->stack[builder->depth - 1];
+	struct tml_token collapsed;
+	bool in_mapping = data->mapping && !token->escaped;
+
+	if (!count_node(data, builder))
+		return;
+
+	if (token->escaped) {
+		if (!collapse_word(data, builder, token, &collapsed))
+			return;
+		token = &collapsed;
+	}
+
+	link_next_child(data, frame);
+	frame->last_child = data->buff_index;
+	frame->child_count++;
+
+	if (data->typed_leaves && write_typed_leaf(data, token->value, token->value_size, true)) {
+		frame->last_child_type = CHILD_TYPED_LEAF;
+	}
+	/* words shorter than a reference node (at its largest) take less space copied into a packed leaf */
+	else if (in_mapping &&
+		token->value_size + 2 >= link_width(data->wide_offsets) * (NODE_LINK_COUNT + 1)) {
+		/* the word is just as it's written in the file mapping, so refer to it there */
+		write_reference_node(data, token->value - (char*)data->mapping, token->value_size);
+		frame->last_child_type = CHILD_REFERENCE_LEAF;
+	}
+	else if (token->value_size <= MAX_PACKED_LENGTH) {
+		/* length of this leaf node string is under 123 characters */
+		if (!data->string_pool) {
+			write_packed_node(data, token->value, token->value_size, true);
+			frame->last_child_type = CHILD_PACKED_LEAF;
+		}
+		else if (write_pooled_leaf(data, token->value, token->value_size)) {
+			frame->last_child_type = CHILD_INTERNED_LEAF;
+		}
+		else {
+			frame->last_child_type = CHILD_PACKED_LEAF;
+		}
+	}
+	else {
+		/* length of contents is 123 characters or more so use full node link data */
+		write_node(data, token->value, token->value_size);
+		frame->last_child_type = CHILD_LONG_LEAF;
+	}
+}
+
+static void write_divider(struct tml_doc *data, struct tree_builder *builder)
+{
+	struct build_frame *frame = &builder->stack[builder->depth - 1];
+
+	end_children(data, frame, frame->type == FRAME_SEGMENT);
+
+	if (frame->type == FRAME_LIST) {
+		/* make the already written items into a list */
+		size_t first_list;
+		if (!count_node(data, builder)) return;
+		first_list = write_node(data, NULL, 0);
+		if (!data->buff) return;
+		update_node_child(&data->buff[first_list], get_node_child(&data->buff[frame->node]));
+		update_node_sibling(&data->buff[first_list], data->buff_index);
+		update_node_child(&data->buff[frame->node], first_list);
+		update_node_size(&data->buff[first_list], frame->child_count);
+		frame->type = FRAME_DIVIDED_LIST;
+		frame->child_count = 1;
+	}
+	else {
+		/* end this nested list and begin the next */
+		update_node_sibling(&data->buff[frame->node], data->buff_index);
+		--builder->depth;
+	}
+
+	push_frame(data, builder, FRAME_SEGMENT);
+}
+
+/* Adds the next token to the tree. Returns false once parsing has finished (at EOF, or early if
+ * an error occurred), after which no more tokens should be given. */
+static bool build_token(struct tml_doc *data, struct tree_builder *builder, const struct tml_token *token)
+{
+	struct build_frame *frame;
+
+	switch (builder->state) {
+		case BUILD_START:
+			/* expecting "[" */
+			if (token->type != TML_TOKEN_OPEN) {
+				if (token->type == TML_TOKEN_EOF)
+					set_parse_error(data, "File contents is empty");
+				else
+					set_parse_error(data, "Expecting opening bracket at start of file");
+				data->root_node = TML_NODE_NULL;
+				builder->state = BUILD_DONE;
+				return false;
+			}
+			if (!push_frame(data, builder, FRAME_LIST)) break;
+			builder->root_node = builder->stack[0].node;
+			builder->state = BUILD_ROOT;
+			return data->buff != NULL;
+
+		case BUILD_AFTER_ROOT:
+			if (token->type != TML_TOKEN_EOF) {
+				set_parse_error(data, "Expected end of file after end of root node");
+			}
+			else if (data->buff) {
+				data->root_node.buff = data->buff;
+				data->root_node.value = "";
+				data->root_node.next_sibling = 0;
+				data->root_node.first_child = get_node_child(&data->buff[builder->root_node]);
+				data->root_node.size = get_node_size(&data->buff[builder->root_node]);
+			}
+			builder->state = BUILD_DONE;
+			return false;
+
+		case BUILD_DONE:
+			return false;
+
+		default:
+			break;
+	}
+
+	if (builder->state != BUILD_ROOT || !data->buff) {
+		builder->state = BUILD_DONE;
+		return false;
+	}
+
+	frame = &builder->stack[builder->depth - 1];
+
+	switch (token->type) {
+		case TML_TOKEN_ITEM:
+			write_leaf(data, builder, token);
+			break;
+
+		case TML_TOKEN_OPEN:
+			link_next_child(data, frame);
+			frame->last_child = data->buff_index;
+			frame->last_child_type = CHILD_LIST;
+			push_frame(data, builder, FRAME_LIST);
+			break;
+
+		case TML_TOKEN_DIVIDER:
+			write_divider(data, builder);
+			break;
+
+		case TML_TOKEN_CLOSE:
+			if (!pop_list(data, builder))
+				builder->state = BUILD_AFTER_ROOT;
+			break;
+
+		case TML_TOKEN_EOF:
+			set_parse_error(data, "Expected closing bracket on list");
+			while (pop_list(data, builder))
+				;
+			builder->state = BUILD_AFTER_ROOT;
+			return build_token(data, builder, token);
+	}
+
+	if (!data->buff || data->error_message) {
+		/* in case out of memory, or a limit was exceeded */
+		builder->state = BUILD_DONE;
+		return false;
+	}
+
+	return true;
+}
+
+/* Builds tokens from the stream up to EOF */
+static void parse_tokens(struct tml_doc *data, struct tree_builder *builder, struct tml_stream *tokens)
+{
+	struct tml_token token;
+
+	do {
+		token = tml_stream_pop(tokens);
+	} while (build_token(data, builder, &token));
+}
+
+/* Parses "[...]" */
+static void parse_root(struct tml_doc *data, struct tml_stream *tokens)
+{
+	struct tree_builder builder;
+
+	builder_init(&builder, &data->allocator);
+	parse_tokens(data, &builder, tokens);
+	builder_free(&builder);
+}
+
+
+#ifdef TML_HAVE_MMAP
+/* How much of a mapped file is parsed between giving back the pages read so far */
+#define MAPPED_RELEASE_SIZE (16 * 1024 * 1024)
+
+/* Drops the pages of the mapping from start up to the page containing end, and returns where that left off. They
+ * were never written to, so they're read back from the file if they're needed again. */
+static size_t release_mapped_pages(char *map, size_t start, size_t end)
+{
+#ifdef MADV_DONTNEED
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+	end &= ~(page_size - 1);
+	if (end > start)
+		madvise(map + start, end - start, MADV_DONTNEED);
+	return end > start ? end : start;
+#else
+	(void)map;
+	(void)end;
+	return start;
+#endif
+}
+
+/* Parses "[...]" from the mapping, giving back each MAPPED_RELEASE_SIZE bytes once they've been read, so that only
+ * the words referred to are read in again as they're used */
+static void parse_mapped_root(struct tml_doc *data, struct tml_stream *tokens)
+{
+	struct tree_builder builder;
+	struct tml_token token;
+	size_t released = 0;
+
+	builder_init(&builder, &data->allocator);
+	do {
+		token = tml_stream_pop(tokens);
+		if (tokens->index - released >= MAPPED_RELEASE_SIZE)
+			released = release_mapped_pages(tokens->data, released, tokens->index);
+	} while (build_token(data, &builder, &token));
+	builder_free(&builder);
+}
+
+/* Maps the file into memory read only and parses it there, leaving long enough words without escape codes in
+ * the mapping rather than copying them. Nothing is written to the mapping, so its pages stay clean and can be
+ * dropped and read back from the file as needed; the words left there aren't null terminated, though. */
+static struct tml_doc *parse_file_mapped(const char *filename, const struct tml_parse_options *options)
+{
+	unsigned int flags = options->flags;
+	struct tml_parse_options other_options;
+	struct stat st;
+	struct tml_doc *data;
+	struct tml_stream tokens;
+	char *map;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size == 0 || (unsigned long long)st.st_size > (size_t)-1) {
+		/* nothing to map, or too large to map */
+		close(fd);
+		other_options = *options;
+		other_options.flags &= ~TML_PARSE_MMAP;
+		return tml_parse_file_opts(filename, &other_options);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	data = create_doc(st.st_size, needs_wide_offsets(st.st_size, flags), options->allocator);
+	if (!data) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	data->mapping = map;
+	data->mapping_size = st.st_size;
+
+	if (!start_parse(data, options)) {
+		tml_free_doc(data);
+		return NULL;
+	}
+
+	if (flags & TML_PARSE_STRUCTURAL_INDEX) {
+		/* indexing reads through the whole file first */
+		tokens = tml_stream_open_indexed(map, st.st_size);
+		release_mapped_pages(map, 0, st.st_size);
+	}
+	else {
+		tokens = tml_stream_open(map, st.st_size);
+	}
+	tokens.read_only = 1;
+
+	parse_mapped_root(data, &tokens);
+	tml_stream_close(&tokens);
+
+	data = finish_parse(finish_doc(data), flags);
+	if (retry_wide_offsets(data, options, &other_options))
+		data = parse_file_mapped(filename, &other_options);
+	return data;
+}
+#endif
+
+/* --------------- EVENT PARSING -------------------- */
+
+/* Event parsing resolves tokens into list structure exactly like the tree builder, but reports each
+ * piece to a tml_event_handler as it's found instead of storing it. The only state needed is the
+ * number of dividers seen so far in each list that's currently open, plus the counts that the parse
+ * limits are checked against (a divided list nests one level deeper, just as in the tree). */
+
+struct event_dispatcher
+{
+	const struct tml_event_handler *handler;
+	const char *error_message;
+	enum BUILD_STATE state;
+
+	int *segments;
+	size_t depth, allocated;
+	size_t nesting, node_count;
+	size_t max_depth, max_nodes;
+	int initial_segments[BUILD_STACK_INITIAL_SIZE];
+};
+
+static void dispatcher_init(struct event_dispatcher *events, const struct tml_event_handler *handler,
+	const struct tml_parse_options *options)
+{
+	events->handler = handler;
+	events->error_message = NULL;
+	events->state = BUILD_START;
+	events->segments = events->initial_segments;
+	events->depth = 0;
+	events->allocated = BUILD_STACK_INITIAL_SIZE;
+	events->nesting = 0;
+	events->node_count = 0;
+	events->max_depth = options->max_depth;
+	events->max_nodes = options->max_nodes;
+}
+
+static void dispatcher_free(struct event_dispatcher *events)
+{
+	if (events->segments != events->initial_segments)
+		free(events->segments);
+	events->segments = NULL;
+}
+
+static bool dispatch_error(struct event_dispatcher *events, const char *error_message)
+{
+	if (!events->error_message)
+		events->error_message = error_message;
+	events->state = BUILD_DONE;
+	return false;
+}
+
+/* Counts nodes and nesting levels the same way the tree builder would, and returns false if a limit is hit */
+static bool dispatch_count(struct event_dispatcher *events, size_t nodes, size_t nesting)
+{
+	if (nesting && events->nesting >= events->max_depth && events->max_depth)
+		return dispatch_error(events, "Lists are nested too deeply");
+	events->node_count += nodes;
+	if (events->node_count > events->max_nodes && events->max_nodes)
+		return dispatch_error(events, "Document contains too many nodes");
+	events->nesting += nesting;
+	return true;
+}
+
+static bool dispatch_list_begin(struct event_dispatcher *events)
+{
+	const struct tml_event_handler *handler = events->handler;
+
+	if (!dispatch_count(events, 1, 1))
+		return false;
+
+	if (events->depth == events->allocated) {
+		int *segments = malloc(events->allocated * 2 * sizeof(int));
+		if (!segments)
+			return dispatch_error(events, "Out of memory");
+
+		memcpy(segments, events->segments, events->depth * sizeof(int));
+		if (events->segments != events->initial_segments)
+			free(events->segments);
+
+		events->segments = segments;
+		events->allocated *= 2;
+	}
+
+	events->segments[events->depth++] = 0;
+
+	if (handler->on_list_begin && !handler->on_list_begin(handler->user_data))
+		return dispatch_error(events, "Parsing stopped by event handler");
+	return true;
+}
+
+/* Reports the next token to the handler. Returns false once parsing has finished (at EOF, or early if
+ * an error occurred or the handler asked to stop), after which no more tokens should be given. */
+static bool dispatch_token(struct event_dispatcher *events, const struct tml_token *token)
+{
+	const struct tml_event_handler *handler = events->handler;
+	bool proceed = true;
+
+	switch (events->state) {
+		case BUILD_START:
+			/* expecting "[" */
+			if (token->type != TML_TOKEN_OPEN) {
+				if (token->type == TML_TOKEN_EOF)
+					return dispatch_error(events, "File contents is empty");
+				else
+					return dispatch_error(events, "Expecting opening bracket at start of file");
+			}
+			events->state = BUILD_ROOT;
+			return dispatch_list_begin(events);
+
+		case BUILD_AFTER_ROOT:
+			if (token->type != TML_TOKEN_EOF)
+				return dispatch_error(events, "Expected end of file after end of root node");
+			events->state = BUILD_DONE;
+			return false;
+
+		case BUILD_DONE:
+			return false;
+
+		default:
+			break;
+	}
+
+	switch (token->type) {
+		case TML_TOKEN_ITEM:
+			if (!dispatch_count(events, 1, 0))
+				return false;
+			if (handler->on_word)
+				proceed = handler->on_word(handler->user_data, token->value, token->value_size);
+			break;
+
+		case TML_TOKEN_OPEN:
+			return dispatch_list_begin(events);
+
+		case TML_TOKEN_DIVIDER:
+			/* the first divider wraps the preceding items in a list and opens the next segment */
+			if (events->segments[events->depth - 1] == 0) {
+				if (!dispatch_count(events, 2, 1))
+					return false;
+			}
+			else if (!dispatch_count(events, 1, 0))
+				return false;
+			++events->segments[events->depth - 1];
+			if (handler->on_divider_nesting)
+				proceed = handler->on_divider_nesting(handler->user_data, events->segments[events->depth - 1]);
+			break;
+
+		case TML_TOKEN_CLOSE:
+			events->nesting -= (events->segments[events->depth - 1] ? 2 : 1);
+			if (--events->depth == 0)
+				events->state = BUILD_AFTER_ROOT;
+			if (handler->on_list_end)
+				proceed = handler->on_list_end(handler->user_data);
+			break;
+
+		case TML_TOKEN_EOF:
+			return dispatch_error(events, "Expected closing bracket on list");
+	}
+
+	if (!proceed)
+		return dispatch_error(events, "Parsing stopped by event handler");
+	return true;
+}
+
+const char *tml_parse_in_memory_events(char *ibuff, size_t ibuff_size, const struct tml_event_handler *handler)
+{
+	struct tml_parse_options options;
+	return tml_parse_in_memory_events_opts(ibuff, ibuff_size, handler, make_options(&options, TML_PARSE_DEFAULT, NULL));
+}
+
+const char *tml_parse_in_memory_events_opts(char *ibuff, size_t ibuff_size, const struct tml_event_handler *handler,
+	const struct tml_parse_options *options)
+{
+	struct event_dispatcher events;
+	struct tml_token token;
+	const char *error_message;
+
+	struct tml_stream tokens = tml_stream_open(ibuff, ibuff_size);
+	dispatcher_init(&events, handler, options);
+
+	do {
+		token = tml_stream_pop(&tokens);
+	} while (dispatch_token(&events, &token));
+
+	tml_stream_close(&tokens);
+
+	error_message = events.error_message;
+	dispatcher_free(&events);
+	return error_message;
+}
+
+const char *tml_parse_string_events(const char *str, const struct tml_event_handler *handler)
+{
+	struct tml_parse_options options;
+	return tml_parse_string_events_opts(str, handler, make_options(&options, TML_PARSE_DEFAULT, NULL));
+}
+
+const char *tml_parse_string_events_opts(const char *str, const struct tml_event_handler *handler,
+	const struct tml_parse_options *options)
+{
+	size_t len = strlen(str);
+	const char *error_message;
+
+	char *str_copy = malloc(len + 1);
+	if (!str_copy) return "Out of memory";
+	memcpy(str_copy, str, len + 1);
+
+	error_message = tml_parse_in_memory_events_opts(str_copy, len, handler, options);
+	free(str_copy);
+	return error_message;
+}
+
+/* --------------- INCREMENTAL (PUSH) PARSING -------------------- */
+
+#define FILE_CHUNK_SIZE 65536
+
+struct tml_push_parser
+{
+	/* tokens are built into "data", or reported as events instead if "events" is set */
+	struct tml_doc *data;
+	struct tree_builder builder;
+	struct event_dispatcher *events;
+	unsigned int flags;
+	bool finished;
+
+	/* an unfinished token from the end of the last chunk, and whether that chunk ended in a comment */
+	char *carry;
+	size_t carry_size, carry_allocated;
+	int in_comment;
+};
+
+static struct tml_push_parser *create_push_parser(size_t buff_size, bool wide_offsets,
+	const struct tml_parse_options *options)
+{
+	struct tml_push_parser *parser = malloc(sizeof(*parser));
+	if (!parser) return NULL;
+
+	memset(parser, 0, sizeof(*parser));
+
+	parser->data = create_doc(buff_size, wide_offsets, options->allocator);
+	if (!parser->data) {
+		free(parser);
+		return NULL;
+	}
+	if (!start_parse(parser->data, options)) {
+		tml_free_doc(parser->data);
+		free(parser);
+		return NULL;
+	}
+
+	parser->flags = options->flags;
+	builder_init(&parser->builder, &parser->data->allocator);
+	return parser;
+}
+
+struct tml_push_parser *tml_push_parser_create(void)
+{
+	struct tml_parse_options options;
+	return tml_push_parser_create_opts(make_options(&options, TML_PARSE_DEFAULT, NULL));
+}
+
+struct tml_push_parser *tml_push_parser_create_opts(const struct tml_parse_options *options)
+{
+	return create_push_parser(FILE_CHUNK_SIZE, (options->flags & TML_PARSE_WIDE_OFFSETS) != 0, options);
+}
+
+static bool append_carry(struct tml_push_parser *parser, const char *str, size_t str_len)
+{
+	if (str_len == 0)
+		return true;
+
+	if (parser->carry_size + str_len > parser->carry_allocated) {
+		size_t allocated = parser->carry_allocated ? parser->carry_allocated : 64;
+		char *carry;
+
+		while (parser->carry_size + str_len > allocated)
+			allocated *= 2;
+
+		carry = realloc(parser->carry, allocated);
+		if (!carry) return false;
+
+		parser->carry = carry;
+		parser->carry_allocated = allocated;
+	}
+
+	memcpy(parser->carry + parser->carry_size, str, str_len);
+	parser->carry_size += str_len;
+	return true;
+}
+
+/* Returns how many bytes from the front of the next chunk must be added to the carried over token to
+ * be sure of finishing it: up to and including the first character that ends a word. */
+static size_t carry_length(const struct tml_push_parser *parser, const char *chunk, size_t chunk_size)
+{
+	size_t i = 0, backslashes = 0;
+
+	/* a "|" needs just one more character to tell if it begins a comment */
+	if (parser->carry_size == 1 && parser->carry[0] == TML_DIVIDER_CHAR)
+		return 1;
+
+	/* skip the character escaped by a backslash at the end of the carried word */
+	while (backslashes < parser->carry_size && parser->carry[parser->carry_size - 1 - backslashes] == TML_ESCAPE_CHAR)
+		backslashes++;
+	if (backslashes & 1)
+		i = 1;
+
+	for (; i < chunk_size; ++i) {
+		char ch = chunk[i];
+		if (ch == TML_ESCAPE_CHAR)
+			++i;
+		else if (ch == ' ' || ch == '\t' || ch == TML_DIVIDER_CHAR || ch == TML_OPEN_CHAR || ch == TML_CLOSE_CHAR)
+			return i + 1;
+	}
+
+	return chunk_size;
+}
+
+static bool push_token(struct tml_push_parser *parser, const struct tml_token *token)
+{
+	if (parser->events)
+		return dispatch_token(parser->events, token);
+	else
+		return build_token(parser->data, &parser->builder, token);
+}
+
+/* Builds every complete token in the stream, and returns the number of bytes consumed */
+static size_t build_chunk_tokens(struct tml_push_parser *parser, char *chunk, size_t chunk_size)
+{
+	struct tml_stream tokens = tml_stream_open_chunk(chunk, chunk_size, parser->in_comment);
+	size_t consumed;
+
+	for (;;) {
+		struct tml_token token = tml_stream_pop(&tokens);
+		if (token.type == TML_TOKEN_EOF)
+			break;
+
+		if (!push_token(parser, &token)) {
+			parser->finished = true;
+			break;
+		}
+	}
+
+	parser->in_comment = tokens.in_comment;
+	consumed = tokens.index;
+	tml_stream_close(&tokens);
+	return consumed;
+}
+
+bool tml_push_parse(struct tml_push_parser *parser, char *chunk, size_t chunk_size)
+{
+	size_t pos = 0, consumed;
+
+	/* first finish off the token left over from the last chunk, if any */
+	while (parser->carry_size > 0 && pos < chunk_size && !parser->finished) {
+		size_t n = carry_length(parser, chunk + pos, chunk_size - pos);
+		if (!append_carry(parser, chunk + pos, n)) {
+			parser->finished = true;
+			break;
+		}
+		pos += n;
+
+		consumed = build_chunk_tokens(parser, parser->carry, parser->carry_size);
+		memmove(parser->carry, parser->carry + consumed, parser->carry_size - consumed);
+		parser->carry_size -= consumed;
+	}
+
+	/* then parse the rest in place, keeping whatever might continue into the next chunk */
+	if (pos < chunk_size && !parser->finished) {
+		consumed = build_chunk_tokens(parser, chunk + pos, chunk_size - pos);
+		pos += consumed;
+		if (!parser->finished && !append_carry(parser, chunk + pos, chunk_size - pos))
+			parser->finished = true;
+	}
+
+	if (parser->finished) {
+		if (parser->events)
+			dispatch_error(parser->events, "Out of memory");
+		else if (!parser->data->error_message)
+			set_parse_error(parser->data, "Out of memory");
+	}
+
+	return !parser->finished;
+}
+
+/* Parses the token left over after the last chunk, through to EOF */
+static void push_parser_flush(struct tml_push_parser *parser)
+{
+	struct tml_stream tokens;
+	struct tml_token token;
+
+	if (parser->finished)
+		return;
+
+	tokens = tml_stream_open(parser->carry, parser->carry_size);
+	do {
+		token = tml_stream_pop(&tokens);
+	} while (push_token(parser, &token));
+	tml_stream_close(&tokens);
+
+	parser->finished = true;
+}
+
+struct tml_doc *tml_push_parser_finish(struct tml_push_parser *parser)
+{
+	struct tml_doc *data = parser->data;
+	unsigned int flags = parser->flags;
+
+	push_parser_flush(parser);
+
+	builder_free(&parser->builder);
+	free(parser->carry);
+	free(parser);
+
+	return finish_parse(finish_doc(data), flags);
+}
+
+/* Feeds the whole file to a push parser. Returns false if the file couldn't be read. */
+static bool push_file_in_chunks(struct tml_push_parser *parser, FILE *fp)
+{
+	char *chunk = malloc(FILE_CHUNK_SIZE);
+	size_t size;
+
+	if (!chunk)
+		return false;
+
+	while ((size = fread(chunk, 1, FILE_CHUNK_SIZE, fp)) > 0) {
+		if (!tml_push_parse(parser, chunk, size))
+			break;
+	}
+
+	free(chunk);
+	return !ferror(fp);
+}
+
+static struct tml_doc *parse_file_in_chunks(FILE *fp, size_t fsize, const struct tml_parse_options *options)
+{
+	struct tml_push_parser *parser = create_push_parser(fsize, needs_wide_offsets(fsize, options->flags), options);
+	if (!parser)
+		return NULL;
+
+	if (!push_file_in_chunks(parser, fp)) {
+		tml_free_doc(tml_push_parser_finish(parser));
+		return NULL;
+	}
+
+	return tml_push_parser_finish(parser);
+}
+
+const char *tml_parse_file_events(const char *filename, const struct tml_event_handler *handler)
+{
+	struct tml_parse_options options;
+	return tml_parse_file_events_opts(filename, handler, make_options(&options, TML_PARSE_DEFAULT, NULL));
+}
+
+const char *tml_parse_file_events_opts(const char *filename, const struct tml_event_handler *handler,
+	const struct tml_parse_options *options)
+{
+	struct tml_push_parser parser;
+	struct event_dispatcher events;
+	const char *error_message;
+
+	FILE *fp = fopen(filename, "rb");
+	if (!fp)
+		return "Unable to open file";
+
+	memset(&parser, 0, sizeof(parser));
+	dispatcher_init(&events, handler, options);
+	parser.events = &events;
+
+	if (!push_file_in_chunks(&parser, fp))
+		dispatch_error(&events, "Unable to read file");
+	push_parser_flush(&parser);
+
+	fclose(fp);
+	free(parser.carry);
+
+	error_message = events.error_message;
+	dispatcher_free(&events);
+	return error_message;
+}
+
+/* --------------- PARALLEL PARSING -------------------- */
+
+/* A document is parsed in parallel by splitting the root list's contents into pieces at whitespace (or
+ * before a "[") between its children. Each piece is built on its own thread into a separate buffer as the
+ * contents of a temporary root list, exactly as the sequential parser would write them. The pieces are
+ * then copied one after another behind a new root node, adjusting their absolute links by where they
+ * landed, and finally the last child of each piece is linked to the first child of the next. Each piece
+ * lands at an offset aligned the same as where it was parsed, so the links of full nodes stay aligned;
+ * that can leave a gap before the next piece, so a piece's last child is always written with full links.
+ *
+ * Only the last piece contains the root's closing bracket and whatever follows it, so any parse errors
+ * come from there with the same messages as usual. Documents with a divider in the root list (which
+ * changes what its children are) are parsed sequentially. */
+
+#define PARALLEL_MIN_PIECE_SIZE 65536
+
+struct parse_piece
+{
+	char *text;
+	size_t text_size;
+	const struct tml_parse_options *options;
+	bool last;
+
+	/* parsed contents, and how its last child was written (for non-last pieces) */
+	struct tml_doc *data;
+	size_t node_count, child_count;
+	size_t last_child;
+	unsigned char last_child_type;
+
+	/* where the contents are copied to in the final document */
+	struct tml_doc *dest;
+	size_t dest_index;
+	bool out_of_memory;
+};
+
+static struct tml_node read_node(char *buff, char *ptr);
+
+/* Rewrites the frame's last child as a full node if it's a packed, interned or typed leaf, which would otherwise
+ * imply that its sibling follows right after it. It's the last thing in the buffer, so it's just rewritten
+ * in place. */
+static void write_last_leaf_linked(struct tml_doc *data, struct build_frame *frame)
+{
+	struct tml_node leaf;
+	char *value;
+
+	if (frame->last_child_type != CHILD_PACKED_LEAF && frame->last_child_type != CHILD_INTERNED_LEAF &&
+		frame->last_child_type != CHILD_TYPED_LEAF)
+		return;
+
+	leaf = read_node(data->buff, &data->buff[frame->last_child]);
+	value = malloc(leaf.size + 1);
+	if (!value) {
+		set_parse_error(data, "Out of memory");
+		return;
+	}
+	memcpy(value, leaf.value, leaf.size);
+
+	data->buff_index = frame->last_child;
+	write_node(data, value, (int)leaf.size);
+	frame->last_child_type = CHILD_LONG_LEAF;
+	free(value);
+}
+
+/* Parses the piece's text as the contents of a root list. The last piece includes the root's closing
+ * bracket, so it's parsed to EOF as usual; others are left open so their last child can be linked on. */
+static void parse_piece(struct parse_piece *piece)
+{
+	struct tree_builder builder;
+	struct tml_stream tokens;
+	struct tml_token token;
+
+	memset(&token, 0, sizeof(token));
+	piece->data = create_doc(piece->text_size * 2, (piece->options->flags & TML_PARSE_WIDE_OFFSETS) != 0, NULL);
+	if (!piece->data) return;
+
+	/* each piece has a string pool of its own, so words repeated between pieces are stored once in each */
+	if (!start_parse(piece->data, piece->options))
+		set_parse_error(piece->data, "Out of memory");
+
+	if (piece->options->flags & TML_PARSE_STRUCTURAL_INDEX)
+		tokens = tml_stream_open_indexed(piece->text, piece->text_size);
+	else
+		tokens = tml_stream_open(piece->text, piece->text_size);
+
+	builder_init(&builder, &piece->data->allocator);
+	token.type = TML_TOKEN_OPEN;
+	build_token(piece->data, &builder, &token);
+
+	if (piece->last) {
+		parse_tokens(piece->data, &builder, &tokens);
+		piece->child_count = piece->data->root_node.size;
+	}
+	else {
+		for (;;) {
+			token = tml_stream_pop(&tokens);
+			if (token.type == TML_TOKEN_EOF || !build_token(piece->data, &builder, &token))
+				break;
+		}
+
+		if (builder.depth == 1) {
+			write_last_leaf_linked(piece->data, &builder.stack[0]);
+			piece->last_child = builder.stack[0].last_child;
+			piece->last_child_type = builder.stack[0].last_child_type;
+			piece->child_count = builder.stack[0].child_count;
+		}
+		else if (!piece->data->error_message) {
+			/* can't happen, since pieces are split where the root list is the innermost one */
+			set_parse_error(piece->data, "Internal error splitting document for parallel parsing");
+		}
+	}
+
+	/* not counting the piece's root */
+	piece->node_count = builder.node_count - 1;
+
+	builder_free(&builder);
+	tml_stream_close(&tokens);
+}
+
+/* Returns the size of the buffer header and root list node, which the contents of each piece begin after */
+static __inline__ size_t piece_root_size(const struct tml_doc *data)
+{
+	return DOC_HEADER_SIZE + node_header_size(DOC_HEADER_SIZE, data->wide_offsets) + 1;
+}
+
+/* Copies the piece's contents into place, and adjusts its absolute links to match. The links are found
+ * by walking the tree rather than the buffer, since leaf strings may contain null characters. */
+static void copy_piece(struct parse_piece *piece)
+{
+	size_t start = piece_root_size(piece->data), end = piece->data->buff_index;
+	size_t delta = piece->dest_index - start, dest_end = piece->dest_index + (end - start);
+	char *buff = piece->dest->buff;
+	size_t *lists = NULL, list_count = 0, lists_allocated = 0;
+
+	if (end == start)
+		return;
+
+	memcpy(&buff[piece->dest_index], &piece->data->buff[start], end - start);
+
+	/* each entry is the first of a run of siblings yet to be visited */
+	lists = malloc(BUILD_STACK_INITIAL_SIZE * sizeof(size_t));
+	if (!lists) {
+		piece->out_of_memory = true;
+		return;
+	}
+	lists_allocated = BUILD_STACK_INITIAL_SIZE;
+	lists[list_count++] = piece->dest_index;
+
+	while (list_count > 0) {
+		size_t index = lists[--list_count];
+
+		/* a piece's last child (unless it's the last piece) may point past the piece, at the next one */
+		while (index != 0 && index < dest_end) {
+			char *ptr = &buff[index];
+			unsigned char flag = ((unsigned char*)ptr)[0];
+
+			if (flag == FULL_NODE_DATA_FLAG || flag == WIDE_FULL_NODE_DATA_FLAG) {
+				size_t first_child = get_node_child(ptr), next_sibling = get_node_sibling(ptr);
+
+				if (first_child == index - delta) {
+					/* a binary array, whose first_child is itself */
+					update_node_child(ptr, index);
+				}
+				else if (first_child) {
+					update_node_child(ptr, first_child + delta);
+
+					if (list_count == lists_allocated) {
+						size_t *more = realloc(lists, lists_allocated * 2 * sizeof(size_t));
+						if (!more) {
+							piece->out_of_memory = true;
+							free(lists);
+							return;
+						}
+						lists = more;
+						lists_allocated *= 2;
+					}
+					lists[list_count++] = first_child + delta;
+				}
+
+				if (next_sibling)
+					update_node_sibling(ptr, next_sibling + delta);
+				index = next_sibling ? next_sibling + delta : 0;
+			}
+			else if (is_interned_node(flag)) {
+				/* interned leaf, referring to a string within the same piece */
+				bool wide = (flag <= WIDE_INTERNED_NODE_DATA_FLAG);
+				write_unaligned_link(ptr + 1, read_unaligned_link(ptr + 1, wide) + delta, wide);
+				index = (flag == LAST_INTERNED_NODE_DATA_FLAG || flag == WIDE_LAST_INTERNED_NODE_DATA_FLAG) ?
+					0 : index + interned_node_size(flag);
+			}
+			else if (is_typed_leaf(flag)) {
+				/* typed leaf, whose value is aligned the same as where it was parsed */
+				index = (flag == TYPED_LEAF_DATA_FLAG) ? typed_leaf_value_index(index) + ((unsigned char*)ptr)[1] + 1 : 0;
+			}
+			else {
+				/* packed leaf, which is followed by its sibling if it has one */
+				index = (flag & 1) ? index + 2 + (flag >> 1) : 0;
+			}
+		}
+	}
+
+	free(lists);
+}
+
+#ifdef TML_HAVE_PTHREADS
+static void *parse_piece_thread(void *piece)
+{
+	parse_piece(piece);
+	return NULL;
+}
+
+static void *copy_piece_thread(void *piece)
+{
+	copy_piece(piece);
+	return NULL;
+}
+
+/* Runs the function for every piece, one thread each (using the calling thread for the first) */
+static void run_pieces(void *(*func)(void *), struct parse_piece *pieces, int piece_count)
+{
+	pthread_t threads[TML_PARALLEL_MAX_THREADS];
+	bool started[TML_PARALLEL_MAX_THREADS];
+	int i;
+
+	for (i = 1; i < piece_count; ++i)
+		started[i] = (pthread_create(&threads[i], NULL, func, &pieces[i]) == 0);
+
+	func(&pieces[0]);
+
+	for (i = 1; i < piece_count; ++i) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			func(&pieces[i]);
+	}
+}
+#endif
+
+/* Finds the positions to split the root list's contents at, aiming for equal sized pieces. Returns the
+ * number of pieces, or 0 if the document can't be split (in which case it should be parsed sequentially).
+ * This has to skip escape codes and comments just as the tokenizer does, but needn't look at anything else. */
+static int find_split_points(const char *text, size_t text_size, size_t *splits, int max_pieces)
+{
+	size_t i = 0, target = 0, start = 0, depth = 0;
+	int piece_count = 0;
+
+	while (i < text_size) {
+		char ch = text[i];
+
+		if (ch == TML_ESCAPE_CHAR && depth > 0) {
+			i += 2;
+			continue;
+		}
+		else if (ch == TML_DIVIDER_CHAR && i + 1 < text_size && text[i + 1] == TML_DIVIDER_CHAR) {
+			/* comment */
+			while (i < text_size && text[i] != '\n' && text[i] != '\r')
+				++i;
+			continue;
+		}
+		else if (depth == 0) {
+			if (ch == TML_OPEN_CHAR) {
+				/* the first piece begins after the root's opening bracket */
+				depth = 1;
+				start = i + 1;
+				splits[piece_count++] = start;
+				target = start + (text_size - start) / max_pieces;
+			}
+			else if (ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n') {
+				return 0; /* no root list to split */
+			}
+		}
+		else if (ch == TML_OPEN_CHAR) {
+			if (depth == 1 && i >= target && piece_count < max_pieces) {
+				splits[piece_count++] = i;
+				target = i + (text_size - start) / max_pieces;
+			}
+			++depth;
+		}
+		else if (ch == TML_CLOSE_CHAR) {
+			if (--depth == 0)
+				return piece_count;
+		}
+		else if (depth == 1) {
+			if (ch == TML_DIVIDER_CHAR)
+				return 0; /* divided root list */
+			if ((ch == ' ' || ch == '\t') && i >= target && piece_count < max_pieces) {
+				splits[piece_count++] = i;
+				target = i + (text_size - start) / max_pieces;
+			}
+		}
+
+		++i;
+	}
+
+	return depth > 0 ? piece_count : 0;
+}
+
+/* Copies the parsed pieces into one document, or returns the last piece's document if it has an error */
+static struct tml_doc *stitch_pieces(struct parse_piece *pieces, int piece_count,
+	const struct tml_parse_options *options)
+{
+	struct tml_doc *data;
+	size_t total_size, root_size, first_child = 0, node_count = 1, child_count = 0;
+	struct parse_piece *prev = NULL;
+	int i;
+
+	for (i = 0; i < piece_count; ++i) {
+		if (!pieces[i].data)
+			return NULL;
+		if (pieces[i].data->error_message)
+			return finish_doc(pieces[i].data);
+		node_count += pieces[i].node_count;
+	}
+
+	/* each piece was only checked against the node limit by itself */
+	if (node_count > options->max_nodes && options->max_nodes) {
+		set_parse_error(pieces[0].data, "Document contains too many nodes");
+		return finish_doc(pieces[0].data);
+	}
+
+	/* each piece goes at an offset aligned like root_size, where it was parsed */
+	root_size = piece_root_size(pieces[0].data);
+	total_size = root_size;
+	for (i = 0; i < piece_count; ++i) {
+		total_size += (root_size - total_size) & (sizeof(uint64_t) - 1);
+		pieces[i].dest_index = total_size;
+		total_size += pieces[i].data->buff_index - root_size;
+		child_count += pieces[i].child_count;
+	}
+
+	if (total_size >= TML_PARSER_MAX_DATA_SIZE && !(options->flags & TML_PARSE_WIDE_OFFSETS)) {
+		set_parse_error(pieces[0].data, too_large_error);
+		return finish_doc(pieces[0].data);
+	}
+
+	data = create_doc(total_size, (options->flags & TML_PARSE_WIDE_OFFSETS) != 0, options->allocator);
+	if (!data) return NULL;
+	data->typed_leaves = (options->flags & TML_PARSE_TYPED_LEAVES) != 0;
+	write_node(data, NULL, 0);
+	memset(&data->buff[root_size], 0, total_size - root_size); /* for the gaps between pieces */
+
+	for (i = 0; i < piece_count; ++i)
+		pieces[i].dest = data;
+
+#ifdef TML_HAVE_PTHREADS
+	run_pieces(copy_piece_thread, pieces, piece_count);
+#else
+	for (i = 0; i < piece_count; ++i)
+		copy_piece(&pieces[i]);
+#endif
+
+	data->buff_index = total_size;
+
+	for (i = 0; i < piece_count; ++i) {
+		if (pieces[i].out_of_memory)
+			set_parse_error(data, "Out of memory");
+	}
+
+	/* link each piece's last child to the next piece's first (if the last piece was empty, the child before
+	 * it is the last, and its sibling link is left as 0) */
+	for (i = 0; i < piece_count; ++i) {
+		if (pieces[i].data->buff_index == root_size)
+			continue; /* empty piece */
+
+		if (!prev)
+			first_child = pieces[i].dest_index;
+		else
+			update_node_sibling(&data->buff[prev->dest_index + prev->last_child - root_size], pieces[i].dest_index);
+
+		prev = (pieces[i].last) ? NULL : &pieces[i];
+	}
+
+	update_node_child(&data->buff[DOC_HEADER_SIZE], first_child);
+	update_node_size(&data->buff[DOC_HEADER_SIZE], child_count);
+	data->root_node.value = "";
+	data->root_node.next_sibling = 0;
+	data->root_node.first_child = first_child;
+	data->root_node.size = child_count;
+
+	return finish_doc(data);
+}
+
+struct tml_doc *tml_parse_parallel(char *buff, size_t buff_size, unsigned int flags, int thread_count)
+{
+	struct tml_parse_options options;
+	return tml_parse_parallel_opts(buff, buff_size, make_options(&options, flags, NULL), thread_count);
+}
+
+struct tml_doc *tml_parse_parallel_opts(char *buff, size_t buff_size, const struct tml_parse_options *options,
+	int thread_count)
+{
+	struct parse_piece pieces[TML_PARALLEL_MAX_THREADS];
+	size_t splits[TML_PARALLEL_MAX_THREADS];
+	struct tml_parse_options piece_options = *options, wide_options;
+	struct tml_doc *data;
+	int piece_count, i;
+
+	if (thread_count <= 0) {
+#if defined(TML_HAVE_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+		thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+		thread_count = 1;
+#endif
+	}
+	if (thread_count > TML_PARALLEL_MAX_THREADS)
+		thread_count = TML_PARALLEL_MAX_THREADS;
+	if ((size_t)thread_count > buff_size / PARALLEL_MIN_PIECE_SIZE)
+		thread_count = (int)(buff_size / PARALLEL_MIN_PIECE_SIZE);
+
+	/* as with tml_parse_in_memory_opts(), the text can only be parsed again if it has no escape codes */
+	if (needs_wide_offsets(buff_size, options->flags) ||
+		(might_need_wide_offsets(buff_size, options->flags) && memchr(buff, TML_ESCAPE_CHAR, buff_size)))
+		piece_options.flags |= TML_PARSE_WIDE_OFFSETS;
+
+	piece_count = (thread_count > 1) ? find_split_points(buff, buff_size, splits, thread_count) : 0;
+	if (piece_count < 2)
+		return tml_parse_in_memory_opts(buff, buff_size, &piece_options);
+
+	for (i = 0; i < piece_count; ++i) {
+		memset(&pieces[i], 0, sizeof(pieces[i]));
+		pieces[i].text = &buff[splits[i]];
+		pieces[i].last = (i == piece_count - 1);
+		pieces[i].text_size = (pieces[i].last ? buff_size : splits[i + 1]) - splits[i];
+		pieces[i].options = &piece_options;
+	}
+
+#ifdef TML_HAVE_PTHREADS
+	run_pieces(parse_piece_thread, pieces, piece_count);
+#else
+	for (i = 0; i < piece_count; ++i)
+		parse_piece(&pieces[i]);
+#endif
+
+	data = stitch_pieces(pieces, piece_count, &piece_options);
+
+	for (i = 0; i < piece_count; ++i) {
+		if (pieces[i].data != data)
+			tml_free_doc(pieces[i].data);
+	}
+
+	data = finish_parse(data, piece_options.flags);
+	if (retry_wide_offsets(data, &piece_options, &wide_options))
+		data = tml_parse_parallel_opts(buff, buff_size, &wide_options, thread_count);
+	return data;
+}
+
+
+/* --------------- NODE ITERATION FUNCTIONS -------------------- */
+
+static struct tml_node read_node(char *buff, char *ptr)
+{
+	struct tml_node node;
+	node.buff = buff;
+
+	unsigned char flag = ((unsigned char*)ptr)[0];
+
+	if (flag == FULL_NODE_DATA_FLAG || flag == WIDE_FULL_NODE_DATA_FLAG) {
+		/* read full node links */
+		bool wide = (flag == WIDE_FULL_NODE_DATA_FLAG);
+		node.first_child = read_link(node_link(ptr, 0, wide), wide);
+		node.next_sibling = read_link(node_link(ptr, 1, wide), wide);
+		node.size = read_link(node_link(ptr, 2, wide), wide);
+		node.value = node_link(ptr, NODE_LINK_COUNT, wide);
+
+		/* a binary array's first_child link is itself, but it has no child nodes (see array_node_offset()) */
+		if (node.first_child == (size_t)(ptr - buff))
+			node.first_child = 0;
+	}
+	else if (flag == REFERENCE_NODE_DATA_FLAG || flag == WIDE_REFERENCE_NODE_DATA_FLAG) {
+		/* read reference to string in the file mapping */
+		struct tml_doc *data;
+		memcpy(&data, buff, sizeof(data));
+
+		node.first_child = 0;
+		node.next_sibling = get_node_sibling(ptr);
+		node.size = get_node_size(ptr);
+		node.value = (const char *)data->mapping + get_node_child(ptr);
+	}
+	else if (is_interned_node(flag)) {
+		/* read reference to an earlier copy of the string */
+		node.first_child = 0;
+		node.next_sibling = (flag == LAST_INTERNED_NODE_DATA_FLAG || flag == WIDE_LAST_INTERNED_NODE_DATA_FLAG) ?
+			0 : (ptr - buff) + interned_node_size(flag);
+		node.value = buff + read_unaligned_link(ptr + 1, flag <= WIDE_INTERNED_NODE_DATA_FLAG);
+		node.size = pooled_string_length(node.value);
+	}
+	else if (is_typed_leaf(flag)) {
+		/* read length, with the value after the binary one */
+		size_t value_index = typed_leaf_value_index(ptr - buff);
+		node.first_child = 0;
+		node.size = ((unsigned char*)ptr)[1];
+		node.next_sibling = (flag == TYPED_LEAF_DATA_FLAG) ? value_index + node.size + 1 : 0;
+		node.value = buff + value_index;
+	}
+	else {
+		/* read packed node length and sibling bit */
+		node.first_child = 0;
+		node.size = flag >> 1;
+
+		if (flag & 1)
+			node.next_sibling = (ptr - buff) + 2 + node.size;
+		else
+			node.next_sibling = 0;
+
+		node.value = &ptr[1];
+	}
+
+	return node;
+}
+
+struct tml_node tml_next_sibling(const struct tml_node *node)
+{
+	if (node->next_sibling)
+		return read_node(node->buff, node->buff + node->next_sibling);
+	else
+		return TML_NODE_NULL;
+}
+
+static size_t array_node_offset(const struct tml_node *node);
+static struct tml_node first_array_element(const struct tml_node *node, size_t array_offset);
+
+struct tml_node tml_first_child(const struct tml_node *node)
+{
+	size_t array_offset;
+
+	if (node->first_child)
+		return read_node(node->buff, node->buff + node->first_child);
+	array_offset = array_node_offset(node);
+	return array_offset ? first_array_element(node, array_offset) : TML_NODE_NULL;
+}
+
+/* A node id is just the node's offset in the document buffer, and the root list is always the first node in it */
+tml_node_id tml_root_id(const struct tml_doc *data)
+{
+	if (data->error_message || data->buff_index <= DOC_HEADER_SIZE)
+		return TML_NODE_ID_NULL;
+	/* ids are plain offsets, so a document too large for them has none rather than ids that wrap around. Every
+	 * node of the rest is within buff_index, which is why the casts below can't truncate */
+	if (data->buff_index - 1 > (size_t)(tml_node_id)-1)
+		return TML_NODE_ID_NULL;
+	return DOC_HEADER_SIZE;
+}
+
+tml_node_id tml_first_child_id(const struct tml_doc *data, tml_node_id id)
+{
+	const char *ptr = data->buff + id;
+	unsigned char flag = ((const unsigned char*)ptr)[0];
+	size_t first_child;
+
+	/* only full nodes can have children, and binary arrays (whose first_child is themselves) have no nodes */
+	if (id == TML_NODE_ID_NULL || (flag != FULL_NODE_DATA_FLAG && flag != WIDE_FULL_NODE_DATA_FLAG))
+		return TML_NODE_ID_NULL;
+	first_child = get_node_child(ptr);
+	return first_child == id ? TML_NODE_ID_NULL : (tml_node_id)first_child;
+}
+
+tml_node_id tml_next_sibling_id(const struct tml_doc *data, tml_node_id id)
+{
+	const char *ptr = data->buff + id;
+	unsigned char flag = ((const unsigned char*)ptr)[0];
+
+	if (id == TML_NODE_ID_NULL)
+		return TML_NODE_ID_NULL;
+
+	if (flag == FULL_NODE_DATA_FLAG || flag == WIDE_FULL_NODE_DATA_FLAG ||
+		flag == REFERENCE_NODE_DATA_FLAG || flag == WIDE_REFERENCE_NODE_DATA_FLAG)
+		return (tml_node_id)get_node_sibling(ptr);
+	else if (is_interned_node(flag))
+		return (flag == LAST_INTERNED_NODE_DATA_FLAG || flag == WIDE_LAST_INTERNED_NODE_DATA_FLAG) ?
+			TML_NODE_ID_NULL : (tml_node_id)(id + interned_node_size(flag));
+	else if (is_typed_leaf(flag))
+		return (flag == TYPED_LEAF_DATA_FLAG) ?
+			(tml_node_id)(typed_leaf_value_index(id) + ((const unsigned char*)ptr)[1] + 1) : TML_NODE_ID_NULL;
+	else
+		return (flag & 1) ? (tml_node_id)(id + 2 + (flag >> 1)) : TML_NODE_ID_NULL;
+}
+
+bool tml_is_list_id(const struct tml_doc *data, tml_node_id id)
+{
+	const char *ptr = data->buff + id;
+	unsigned char flag = ((const unsigned char*)ptr)[0];
+	bool wide = (flag == WIDE_FULL_NODE_DATA_FLAG);
+
+	/* lists are full nodes with an empty value */
+	if (id == TML_NODE_ID_NULL || (flag != FULL_NODE_DATA_FLAG && !wide))
+		return false;
+	return node_link(ptr, NODE_LINK_COUNT, wide)[0] == '\0';
+}
+
+struct tml_node tml_node_at(const struct tml_doc *data, tml_node_id id)
+{
+	if (id == TML_NODE_ID_NULL)
+		return TML_NODE_NULL;
+	return read_node(data->buff, data->buff + id);
+}
+
+/* Long lists get a table of the offsets of their children, so they can be indexed into in O(1) time. The
+ * tables are kept in a hash table attached to the tml_doc, keyed by the offset of each list's first child
+ * (which is unique to the list), and are made the first time a list is indexed past the first
+ * CHILD_TABLE_MIN_CHILDREN children - or for every list at once by tml_index_children(). */
+
+/* Shorter lists are just walked, which is about as quick as looking up their table would be */
+#define CHILD_TABLE_MIN_CHILDREN 32
+
+struct child_table
+{
+	size_t list; /* offset of the list's first child, or 0 for an unused slot */
+	size_t count;
+	void *offsets; /* uint32_t or uint64_t offsets of each child, the same size as the document's links */
+	struct key_table *keys; /* see tml_index_keys(), or NULL */
+	char *text; /* for a binary array, the buffer its children are in (see add_array_table()), or NULL */
+	size_t text_size;
+};
+
+struct child_index
+{
+	struct child_table *tables;
+	size_t table_count, capacity;
+};
+
+static struct tml_doc *node_doc(const struct tml_node *node)
+{
+	struct tml_doc *data;
+	memcpy(&data, node->buff, sizeof(data));
+	return data;
+}
+
+/* Returns the offset of the list node if this is a binary array, or 0 if not. A binary array is a list with
+ * children but no first_child, and its value (which is empty) follows the links of its list node, the first of
+ * which is the offset of the node itself. That's only so if it really is a list node's value, so this is
+ * checked against the node found there too. */
+static size_t array_node_offset(const struct tml_node *node)
+{
+	struct tml_doc *data;
+	size_t value, offset;
+	bool wide;
+
+	if (node->first_child || !node->size || node->value[0] != '\0' || !node->buff)
+		return 0;
+
+	data = node_doc(node);
+	wide = data->wide_offsets;
+	value = (size_t)((uintptr_t)node->value - (uintptr_t)node->buff);
+	/* an array's value follows its aligned links, which a leaf's needn't */
+	if (value >= data->buff_index || value < DOC_HEADER_SIZE + NODE_LINK_COUNT * link_width(wide) + 1 ||
+		(value & (link_width(wide) - 1)) != 0)
+		return 0;
+
+	offset = read_link(node->value - NODE_LINK_COUNT * link_width(wide), wide);
+	if (offset < DOC_HEADER_SIZE || offset >= value ||
+		(unsigned char)node->buff[offset] != (wide ? WIDE_FULL_NODE_DATA_FLAG : FULL_NODE_DATA_FLAG) ||
+		node_link(&node->buff[offset], NODE_LINK_COUNT, wide) != node->value)
+		return 0;
+	return offset;
+}
+
+static struct child_table *find_child_table(struct child_index *index, size_t list)
+{
+	size_t mask = index->capacity - 1;
+	size_t i = (size_t)(((uint64_t)list * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+
+	while (index->tables[i].list != 0 && index->tables[i].list != list)
+		i = (i + 1) & mask;
+	return &index->tables[i];
+}
+
+/* A binary array has no first_child to key its table by, and the offset of its list node won't do either, since
+ * that's also the first_child of its parent if it's the first child. Its table is keyed by the offset of its
+ * (empty) value instead, which lies inside the list node, so no node starts there. */
+static __inline__ size_t array_table_key(const struct tml_node *node)
+{
+	return (size_t)((uintptr_t)node->value - (uintptr_t)node->buff);
+}
+
+/* Returns the table for the given list, or NULL if it doesn't have one (yet) */
+static struct child_table *lookup_child_table(const struct tml_node *node)
+{
+	struct child_index *index = node_doc(node)->child_index;
+	struct child_table *table;
+	size_t list;
+
+	if (!index)
+		return NULL;
+
+	if (node->first_child)
+		list = node->first_child;
+	else if (array_node_offset(node))
+		list = array_table_key(node);
+	else
+		return NULL;
+
+	table = find_child_table(index, list);
+	return table->list ? table : NULL;
+}
+
+static bool grow_child_index(struct tml_doc *data)
+{
+	struct tml_allocator *allocator = &data->allocator;
+	struct child_index *index = data->child_index;
+	struct child_table *old_tables;
+	size_t old_capacity, i;
+
+	if (!index) {
+		index = allocator->alloc(allocator->user_data, sizeof(*index));
+		if (!index) return false;
+		memset(index, 0, sizeof(*index));
+		data->child_index = index;
+	}
+
+	old_tables = index->tables;
+	old_capacity = index->capacity;
+
+	index->capacity = old_capacity ? old_capacity * 2 : 16;
+	index->tables = allocator->alloc(allocator->user_data, index->capacity * sizeof(struct child_table));
+	if (!index->tables) {
+		index->tables = old_tables;
+		index->capacity = old_capacity;
+		return false;
+	}
+	memset(index->tables, 0, index->capacity * sizeof(struct child_table));
+
+	for (i = 0; i < old_capacity; ++i) {
+		if (old_tables[i].list)
+			*find_child_table(index, old_tables[i].list) = old_tables[i];
+	}
+	if (old_tables)
+		allocator->release(allocator->user_data, old_tables, old_capacity * sizeof(struct child_table));
+
+	return true;
+}
+
+/* Makes sure there's room in the index for one more table. Returns false if out of memory. */
+static bool reserve_child_table(struct tml_doc *data)
+{
+	struct child_index *index = data->child_index;
+	return (index && (index->table_count + 1) * 2 <= index->capacity) || grow_child_index(data);
+}
+
+/* Adds a table of child_count offsets for the list whose first_child (or array_table_key()) is given, after
+ * reserve_child_table() */
+static struct child_table *insert_child_table(struct tml_doc *data, size_t list, size_t child_count, void *offsets)
+{
+	struct child_index *index = data->child_index;
+	struct child_table *table = find_child_table(index, list);
+
+	table->list = list;
+	table->count = child_count;
+	table->offsets = offsets;
+	table->keys = NULL;
+	table->text = NULL;
+	table->text_size = 0;
+	index->table_count++;
+
+	return table;
+}
+
+static __inline__ void set_child_offset(const struct tml_doc *data, void *offsets, size_t i, size_t offset)
+{
+	if (data->wide_offsets)
+		((uint64_t *)offsets)[i] = offset;
+	else
+		((uint32_t *)offsets)[i] = (uint32_t)offset;
+}
+
+static struct child_table *add_array_table(const struct tml_node *node, size_t array_offset);
+
+/* Makes a table for the given list, which has child_count children. Returns NULL if out of memory (or if it has
+ * no children after all). */
+static struct child_table *add_child_table(const struct tml_node *node, size_t child_count)
+{
+	struct tml_doc *data = node_doc(node);
+	size_t offset = node->first_child, i;
+	void *offsets;
+
+	if (!offset) {
+		offset = array_node_offset(node);
+		return offset ? add_array_table(node, offset) : NULL;
+	}
+	if (!reserve_child_table(data))
+		return NULL;
+
+	offsets = data->allocator.alloc(data->allocator.user_data,
+		child_count * (data->wide_offsets ? sizeof(uint64_t) : sizeof(uint32_t)));
+	if (!offsets)
+		return NULL;
+
+	for (i = 0; i < child_count; ++i) {
+		struct tml_node child = read_node(node->buff, node->buff + offset);
+		set_child_offset(data, offsets, i, offset);
+		offset = child.next_sibling;
+	}
+
+	return insert_child_table(data, node->first_child, child_count, offsets);
+}
+
+/* The children of a binary array are made the first time they're needed, by formatting each element into a packed
+ * leaf. They're written into a buffer of their own, which begins with a pointer to the tml_doc just like the
+ * document's buffer, so they read as any other leaves do. That's kept in the array's child table, along with
+ * the offsets of the leaves. Returns NULL if out of memory. */
+static struct child_table *add_array_table(const struct tml_node *node, size_t array_offset)
+{
+	struct tml_doc *data = node_doc(node);
+	struct tml_allocator *allocator = &data->allocator;
+	struct child_table *table;
+	struct tml_array array;
+	size_t index = DOC_HEADER_SIZE, offsets_size, text_size, i;
+	void *offsets;
+	char *text;
+
+	read_array_node(node->buff, array_offset, &array);
+	if (!reserve_child_table(data))
+		return NULL;
+
+	offsets_size = array.count * (data->wide_offsets ? sizeof(uint64_t) : sizeof(uint32_t));
+	offsets = allocator->alloc(allocator->user_data, offsets_size);
+	if (!offsets)
+		return NULL;
+
+	text_size = DOC_HEADER_SIZE + array.count * 8;
+	text = allocator->alloc(allocator->user_data, text_size);
+	if (!text) {
+		allocator->release(allocator->user_data, offsets, offsets_size);
+		return NULL;
+	}
+	memcpy(text, &data, sizeof(data));
+
+	for (i = 0; i < array.count; ++i) {
+		char word[MAX_PACKED_LENGTH + 1];
+		size_t length = format_array_element(word, sizeof(word), &array, i);
+
+		if (index + length + 2 > text_size) {
+			size_t old_size = text_size;
+			char *more;
+
+			while (index + length + 2 > text_size)
+				text_size *= 2;
+			more = allocator->resize(allocator->user_data, text, old_size, text_size);
+			if (!more) {
+				allocator->release(allocator->user_data, offsets, offsets_size);
+				allocator->release(allocator->user_data, text, old_size);
+				return NULL;
+			}
+			text = more;
+		}
+
+		set_child_offset(data, offsets, i, index);
+		text[index] = (char)PACKED_HEADER(length, i + 1 < array.count);
+		memcpy(&text[index + 1], word, length);
+		text[index + 1 + length] = '\0';
+		index += length + 2;
+	}
+
+	table = insert_child_table(data, array_table_key(node), array.count, offsets);
+	table->text = text;
+	table->text_size = text_size;
+	return table;
+}
+
+
+static void free_child_index(struct tml_doc *data)
+{
+	struct tml_allocator *allocator = &data->allocator;
+	struct child_index *index = data->child_index;
+	size_t i, offset_size = data->wide_offsets ? sizeof(uint64_t) : sizeof(uint32_t);
+
+	if (!index)
+		return;
+
+	for (i = 0; i < index->capacity; ++i) {
+		if (index->tables[i].list) {
+			free_key_table(data, index->tables[i].keys, index->tables[i].count);
+			allocator->release(allocator->user_data, index->tables[i].offsets, index->tables[i].count * offset_size);
+			if (index->tables[i].text)
+				allocator->release(allocator->user_data, index->tables[i].text, index->tables[i].text_size);
+		}
+	}
+	if (index->tables)
+		allocator->release(allocator->user_data, index->tables, index->capacity * sizeof(struct child_table));
+	allocator->release(allocator->user_data, index, sizeof(*index));
+	data->child_index = NULL;
+}
+
+bool tml_index_children(struct tml_doc *data)
+{
+	struct tml_node *lists;
+	size_t list_count = 0, lists_allocated = BUILD_STACK_INITIAL_SIZE;
+	bool success = true;
+
+	if (data->error_message)
+		return true;
+
+	lists = malloc(lists_allocated * sizeof(struct tml_node));
+	if (!lists)
+		return false;
+	lists[list_count++] = data->root_node;
+
+	while (list_count > 0) {
+		struct tml_node list = lists[--list_count], child;
+		size_t child_count = 0, array_offset = array_node_offset(&list);
+
+		/* a binary array's children are all words, formatted once here rather than on first use */
+		if (array_offset) {
+			if (!lookup_child_table(&list) && !add_array_table(&list, array_offset))
+				success = false;
+			continue;
+		}
+
+		for (child = tml_first_child(&list); !tml_is_null(&child); child = tml_next_sibling(&child)) {
+			child_count++;
+
+			if (tml_has_children(&child)) {
+				if (list_count == lists_allocated) {
+					struct tml_node *more = realloc(lists, lists_allocated * 2 * sizeof(struct tml_node));
+					if (!more) {
+						free(lists);
+						return false;
+					}
+					lists = more;
+					lists_allocated *= 2;
+				}
+				lists[list_count++] = child;
+			}
+		}
+
+		/* the key tables tml_find_key() would otherwise make on first use, too */
+		if (child_count >= CHILD_TABLE_MIN_CHILDREN && !tml_index_keys(&list))
+			success = false;
+	}
+
+	free(lists);
+	return success;
+}
+
+static struct tml_node table_child(const struct tml_node *node, const struct child_table *table, size_t child_index)
+{
+	char *buff = table->text ? table->text : node->buff;
+	size_t offset;
+
+	if (node_doc(node)->wide_offsets)
+		offset = (size_t)((const uint64_t *)table->offsets)[child_index];
+	else
+		offset = ((const uint32_t *)table->offsets)[child_index];
+
+	return read_node(buff, buff + offset);
+}
+
+/* Returns the first child of a binary array, making its children if they haven't been yet (or a null node if
+ * there's no memory to, which tml_index_children() reports instead) */
+static struct tml_node first_array_element(const struct tml_node *node, size_t array_offset)
+{
+	struct child_table *table = lookup_child_table(node);
+
+	if (!table)
+		table = add_array_table(node, array_offset);
+	return table ? table_child(node, table, 0) : TML_NODE_NULL;
+}
+
+int tml_child_count(const struct tml_node *node)
+{
+	return tml_is_list(node) ? (int)node->size : 0;
+}
+
+struct tml_node tml_child_at_index(const struct tml_node *node, int child_index)
+{
+	int count = 0;
+	struct tml_node cnode;
+
+	if (child_index < 0 || (size_t)child_index >= (size_t)tml_child_count(node))
+		return TML_NODE_NULL;
+
+	if (child_index >= CHILD_TABLE_MIN_CHILDREN || !node->first_child) {
+		struct child_table *table = lookup_child_table(node);
+
+		if (!table)
+			table = add_child_table(node, node->size);
+		if (table)
+			return table_child(node, table, child_index);
+	}
+
+	cnode = tml_first_child(node);
+	while (!tml_is_null(&cnode)) {
+		if (count == child_index)
+			return cnode;
+		count++;
+		cnode = tml_next_sibling(&cnode);
+	}
+	return TML_NODE_NULL;
+}
+
+
+/* --------------- COMPACTION -------------------- */
+
+/* tml_doc_dedup() rewrites the document bottom up, so that the children of every child list have been written
+ * by the time a list's own children are. Since a node's next_sibling link belongs to the node itself, what's
+ * shared is each run of children: a list whose children are the same as an earlier list's just points to the
+ * same run. Equal child lists then point to the same run too, so runs are compared one level deep only (their
+ * words, and where their child lists' runs are). The runs written so far are kept in a hash table, and words
+ * are stored once using a string pool, as with TML_PARSE_INTERN. */
+
+struct dedup_item
+{
+	const char *value; /* the word, or "" for a list */
+	size_t size; /* the length of the word, or the number of children of a list */
+	size_t children; /* for a list, the offset of its run of children in the new buffer, or 0 if it has none */
+	struct tml_array array; /* for a binary array, its elements (which are copied as they are) */
+};
+
+struct dedup_frame
+{
+	struct tml_node child; /* the next child of the list to visit */
+	size_t first_item; /* where the list's children begin on the item stack */
+};
+
+struct dedup_run
+{
+	size_t offset; /* 0 for an unused slot */
+	uint32_t hash;
+};
+
+struct dedup_state
+{
+	struct tml_doc *dest;
+
+	struct dedup_item *items;
+	size_t item_count, items_allocated;
+
+	struct dedup_frame *frames;
+	size_t frame_count, frames_allocated;
+
+	struct dedup_run *runs;
+	size_t run_count, run_capacity;
+};
+
+/* Moves the buffer of dest (a rewritten copy of the document, with its root list at the start) into the
+ * document, freeing the old buffer and dest itself */
+static void replace_buffer(struct tml_doc *data, struct tml_doc *dest)
+{
+	char *root;
+
+	/* the offsets of everything have changed */
+	free_child_index(data);
+
+	data->allocator.release(data->allocator.user_data, data->buff, data->buff_allocated);
+	data->buff = dest->buff;
+	data->buff_index = dest->buff_index;
+	data->buff_allocated = dest->buff_allocated;
+	memcpy(data->buff, &data, sizeof(data));
+	data->allocator.release(data->allocator.user_data, dest, sizeof(*dest));
+
+	shrink_buffer(data);
+	root = &data->buff[DOC_HEADER_SIZE];
+	data->root_node.buff = data->buff;
+	data->root_node.first_child = get_node_child(root);
+	data->root_node.size = get_node_size(root);
+}
+
+/* Makes room for one more element in a malloc'd array. Returns false if out of memory. */
+static bool grow_array(void **array, size_t count, size_t *allocated, size_t element_size)
+{
+	if (count == *allocated) {
+		size_t new_size = *allocated ? *allocated * 2 : BUILD_STACK_INITIAL_SIZE;
+		void *more = realloc(*array, new_size * element_size);
+		if (!more)
+			return false;
+		*array = more;
+		*allocated = new_size;
+	}
+	return true;
+}
+
+static uint32_t hash_dedup_run(const struct dedup_item *items, size_t count)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		uint32_t item_hash;
+
+		if (items[i].array.type != TML_ARRAY_NONE)
+			item_hash = hash_word(items[i].array.data, items[i].array.count * array_element_sizes[items[i].array.type]) ^
+				items[i].array.type;
+		else if (items[i].value[0])
+			item_hash = hash_word(items[i].value, items[i].size);
+		else
+			item_hash = (uint32_t)(items[i].children * 2654435761u) ^ 0x9E3779B9u;
+		hash = (hash ^ item_hash) * 16777619u;
+	}
+	return hash;
+}
+
+/* Returns true if the run of nodes written at the given offset is the same as the items */
+static bool dedup_run_matches(struct tml_doc *dest, size_t offset, const struct dedup_item *items, size_t count)
+{
+	struct tml_node node = read_node(dest->buff, dest->buff + offset);
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		struct tml_array array;
+
+		if (tml_is_null(&node))
+			return false;
+
+		if (tml_node_array(&node, &array) || items[i].array.type != TML_ARRAY_NONE) {
+			if (array.type != items[i].array.type || array.count != items[i].array.count ||
+				memcmp(array.data, items[i].array.data, array.count * array_element_sizes[array.type]) != 0)
+				return false;
+		}
+		else if (items[i].value[0]) {
+			if (tml_is_list(&node) || node.size != items[i].size || memcmp(node.value, items[i].value, node.size) != 0)
+				return false;
+		}
+		else if (!tml_is_list(&node) || node.first_child != items[i].children) {
+			return false;
+		}
+
+		node = tml_next_sibling(&node);
+	}
+
+	return tml_is_null(&node);
+}
+
+/* Writes the items as a run of siblings, returning the offset of the first (or 0 if out of memory) */
+static size_t write_dedup_run(struct tml_doc *dest, const struct dedup_item *items, size_t count)
+{
+	size_t start = dest->buff_index, i;
+
+	for (i = 0; i < count && dest->buff; ++i) {
+		bool last = (i == count - 1);
+		size_t index = dest->buff_index;
+
+		if (items[i].array.type != TML_ARRAY_NONE) {
+			write_array_node(dest, &items[i].array);
+			if (!dest->buff) break;
+			if (!last)
+				update_node_sibling(&dest->buff[index], dest->buff_index);
+		}
+		else if (!items[i].value[0] || items[i].size > MAX_PACKED_LENGTH) {
+			write_node(dest, items[i].value, items[i].value[0] ? (int)items[i].size : 0);
+			if (!dest->buff) break;
+			if (!items[i].value[0]) {
+				update_node_child(&dest->buff[index], items[i].children);
+				update_node_size(&dest->buff[index], items[i].size);
+			}
+			if (!last)
+				update_node_sibling(&dest->buff[index], dest->buff_index);
+		}
+		else if (dest->typed_leaves && write_typed_leaf(dest, items[i].value, items[i].size, !last)) {
+			continue;
+		}
+		else {
+			/* packed and interned leaves are followed by their sibling, unless marked as the last */
+			bool interned = write_pooled_leaf(dest, items[i].value, items[i].size);
+			if (last && dest->buff) {
+				if (interned)
+					end_interned_node(&dest->buff[index]);
+				else
+					end_packed_node(&dest->buff[index]);
+			}
+		}
+	}
+
+	return dest->buff ? start : 0;
+}
+
+/* Returns the offset of a run of nodes the same as the given items, writing one if there isn't one yet
+ * (or 0 if out of memory) */
+static size_t dedup_run(struct dedup_state *state, const struct dedup_item *items, size_t count)
+{
+	uint32_t hash = hash_dedup_run(items, count);
+	size_t mask, slot, offset;
+
+	/* keep the table at most half full */
+	if ((state->run_count + 1) * 2 > state->run_capacity) {
+		struct dedup_run *old_runs = state->runs;
+		size_t old_capacity = state->run_capacity, i;
+
+		state->run_capacity = old_capacity ? old_capacity * 2 : 256;
+		state->runs = calloc(state->run_capacity, sizeof(struct dedup_run));
+		if (!state->runs) {
+			state->runs = old_runs;
+			state->run_capacity = old_capacity;
+			return 0;
+		}
+
+		mask = state->run_capacity - 1;
+		for (i = 0; i < old_capacity; ++i) {
+			if (old_runs[i].offset) {
+				slot = old_runs[i].hash & mask;
+				while (state->runs[slot].offset)
+					slot = (slot + 1) & mask;
+				state->runs[slot] = old_runs[i];
+			}
+		}
+		free(old_runs);
+	}
+
+	mask = state->run_capacity - 1;
+	for (slot = hash & mask; state->runs[slot].offset; slot = (slot + 1) & mask) {
+		if (state->runs[slot].hash == hash && dedup_run_matches(state->dest, state->runs[slot].offset, items, count))
+			return state->runs[slot].offset;
+	}
+
+	offset = write_dedup_run(state->dest, items, count);
+	if (offset) {
+		state->runs[slot].offset = offset;
+		state->runs[slot].hash = hash;
+		state->run_count++;
+	}
+	return offset;
+}
+
+/* Writes the document's tree into state->dest, returning the offset of the root's children (or 0 if it has
+ * none) and setting *root_child_count. Sets *out_of_memory if it fails. */
+static size_t dedup_tree(struct tml_doc *data, struct dedup_state *state, size_t *root_child_count, bool *out_of_memory)
+{
+	size_t root_children = 0;
+
+	if (!grow_array((void **)&state->frames, 0, &state->frames_allocated, sizeof(struct dedup_frame))) {
+		*out_of_memory = true;
+		return 0;
+	}
+	state->frames[0].child = tml_first_child(&data->root_node);
+	state->frames[0].first_item = 0;
+	state->frame_count = 1;
+
+	while (state->frame_count > 0) {
+		struct dedup_frame *frame = &state->frames[state->frame_count - 1];
+		size_t first, child_count, children = 0;
+
+		if (!tml_is_null(&frame->child)) {
+			struct tml_node child = frame->child;
+			frame->child = tml_next_sibling(&child);
+
+			if (tml_is_list(&child) && !array_node_offset(&child)) {
+				if (!grow_array((void **)&state->frames, state->frame_count, &state->frames_allocated,
+					sizeof(struct dedup_frame))) {
+					*out_of_memory = true;
+					return 0;
+				}
+				state->frames[state->frame_count].child = tml_first_child(&child);
+				state->frames[state->frame_count].first_item = state->item_count;
+				state->frame_count++;
+			}
+			else {
+				if (!grow_array((void **)&state->items, state->item_count, &state->items_allocated,
+					sizeof(struct dedup_item))) {
+					*out_of_memory = true;
+					return 0;
+				}
+				state->items[state->item_count].value = child.value;
+				state->items[state->item_count].size = child.size;
+				state->items[state->item_count].children = 0;
+				tml_node_array(&child, &state->items[state->item_count].array);
+				state->item_count++;
+			}
+			continue;
+		}
+
+		/* all of the list's children have been visited, so write them (or find them already written) */
+		first = frame->first_item;
+		child_count = state->item_count - first;
+		if (state->item_count > first) {
+			children = dedup_run(state, &state->items[first], state->item_count - first);
+			if (!children) {
+				*out_of_memory = true;
+				return 0;
+			}
+		}
+
+		state->item_count = first;
+		state->frame_count--;
+
+		if (state->frame_count == 0) {
+			root_children = children;
+			*root_child_count = child_count;
+		}
+		else {
+			/* the list becomes an item of its parent */
+			if (!grow_array((void **)&state->items, state->item_count, &state->items_allocated,
+				sizeof(struct dedup_item))) {
+				*out_of_memory = true;
+				return 0;
+			}
+			state->items[state->item_count].value = "";
+			state->items[state->item_count].size = child_count;
+			state->items[state->item_count].children = children;
+			state->items[state->item_count].array.type = TML_ARRAY_NONE;
+			state->item_count++;
+		}
+	}
+
+	return root_children;
+}
+
+bool tml_doc_dedup(struct tml_doc *data)
+{
+	struct dedup_state state;
+	struct tml_doc *dest;
+	size_t root, root_children, root_child_count = 0;
+	bool out_of_memory = false;
+
+	if (data->error_message)
+		return true;
+
+	dest = create_doc(data->buff_index, data->wide_offsets, &data->allocator);
+	if (!dest)
+		return false;
+	dest->typed_leaves = data->typed_leaves;
+	if (!create_string_pool(dest)) {
+		tml_free_doc(dest);
+		return false;
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.dest = dest;
+
+	root = write_node(dest, NULL, 0);
+	root_children = dedup_tree(data, &state, &root_child_count, &out_of_memory);
+
+	free(state.items);
+	free(state.frames);
+	free(state.runs);
+
+	if (out_of_memory || !dest->buff) {
+		tml_free_doc(dest);
+		return false;
+	}
+
+	update_node_child(&dest->buff[root], root_children);
+	update_node_size(&dest->buff[root], root_child_count);
+	free_string_pool(dest);
+
+	replace_buffer(data, dest);
+	return true;
+}
+
+
+/* tml_doc_repack() rewrites the document breadth first: the root's children are written one after another, then
+ * the children of each of those lists in turn, and so on. So every list's children are contiguous, with each
+ * list's node among its siblings rather than in front of its own children, and a list's children come before
+ * those of any list after it. Each list waiting for its children to be written is kept in a queue along with
+ * where its node was written. */
+
+struct repack_entry
+{
+	struct tml_node list;
+	size_t node; /* offset of the list's node in the new buffer */
+};
+
+/* Writes the list's children contiguously, queueing those which are lists. Returns false if out of memory. */
+static bool repack_children(const struct tml_doc *data, struct tml_doc *dest, const struct tml_node *list,
+	size_t node, struct repack_entry **queue, size_t *queue_count, size_t *queue_allocated)
+{
+	const char *mapping = data->mapping;
+	struct tml_node child = tml_first_child(list);
+
+	if (tml_is_null(&child))
+		return true;
+
+	update_node_child(&dest->buff[node], dest->buff_index);
+
+	while (!tml_is_null(&child)) {
+		struct tml_node next = tml_next_sibling(&child);
+		bool last = tml_is_null(&next), packed = false;
+		size_t index = dest->buff_index;
+		struct tml_array array;
+
+		if (tml_node_array(&child, &array)) {
+			/* binary arrays are copied whole, rather than as children */
+			write_array_node(dest, &array);
+		}
+		else if (tml_is_list(&child)) {
+			if (!grow_array((void **)queue, *queue_count, queue_allocated, sizeof(struct repack_entry)))
+				return false;
+			write_node(dest, NULL, 0);
+			if (dest->buff) {
+				update_node_size(&dest->buff[index], child.size);
+				(*queue)[*queue_count].list = child;
+				(*queue)[*queue_count].node = index;
+				(*queue_count)++;
+			}
+		}
+		else if (dest->typed_leaves && write_typed_leaf(dest, child.value, child.size, !last)) {
+			packed = true; /* laid out like a packed leaf, with its sibling right after */
+		}
+		else if (mapping && child.value >= mapping && child.value < mapping + data->mapping_size) {
+			/* words left in the file mapping stay there */
+			write_reference_node(dest, child.value - mapping, child.size);
+		}
+		else if (child.size <= MAX_PACKED_LENGTH) {
+			/* shared words are copied too, so that every leaf's value is right there with it */
+			write_packed_node(dest, child.value, (int)child.size, !last);
+			packed = true;
+		}
+		else {
+			write_node(dest, child.value, (int)child.size);
+		}
+
+		if (!dest->buff)
+			return false;
+		if (!last && !packed)
+			update_node_sibling(&dest->buff[index], dest->buff_index);
+		child = next;
+	}
+
+	return true;
+}
+
+bool tml_doc_repack(struct tml_doc *data)
+{
+	struct tml_doc *dest;
+	struct repack_entry *queue = NULL;
+	size_t queue_count = 0, queue_allocated = 0, i;
+	bool success = true;
+
+	if (data->error_message)
+		return true;
+
+	dest = create_doc(data->buff_index, data->wide_offsets, &data->allocator);
+	if (!dest)
+		return false;
+	dest->typed_leaves = data->typed_leaves;
+
+	write_node(dest, NULL, 0);
+	if (dest->buff) {
+		update_node_size(&dest->buff[DOC_HEADER_SIZE], data->root_node.size);
+		success = repack_children(data, dest, &data->root_node, DOC_HEADER_SIZE, &queue, &queue_count, &queue_allocated);
+	}
+
+	/* lists are taken from the front of the queue, which only grows at the back */
+	for (i = 0; i < queue_count && success; ++i) {
+		struct repack_entry entry = queue[i];
+		success = repack_children(data, dest, &entry.list, entry.node, &queue, &queue_count, &queue_allocated);
+	}
+
+	free(queue);
+
+	if (!success || !dest->buff) {
+		tml_free_doc(dest);
+		return false;
+	}
+
+	replace_buffer(data, dest);
+	return true;
+}
+
+
+/* --------------------------------- UTILITY FUNCTIONS (CONVERSION) -------------------------------- */
+
+static char *write_node_to_string(const struct tml_node *node, char *dest_str, char *dest_end, bool write_brackets)
+{
+	if (dest_str >= dest_end-1)
+		return dest_str;
+
+	if (!tml_has_children(node)) {
+		const char *value;
+		size_t nodelen;
+
+		if (!tml_is_list(node)) {
+			value = node->value;
+			nodelen = node->size;
+		}
+		else {
+			if (write_brackets) {
+				value = "[]";
+				nodelen = 2;
+			}
+			else {
+				return dest_str;
+			}
+		}
+
+		size_t dest_str_size = dest_end - dest_str - 1;
+		if (nodelen > dest_str_size)
+			nodelen = dest_str_size;
+
+		memcpy(dest_str, value, sizeof(char) * nodelen);
+
+		dest_str += nodelen;
+		return dest_str;
+	}
+	else {
+		struct tml_node s_node = tml_first_child(node);
+			
+		if (write_brackets) {
+			if (dest_str >= dest_end-1)
+				return dest_str;
+			*dest_str++ = '[';
+		}
+
+		for (;;) {
+			dest_str = write_node_to_string(&s_node, dest_str, dest_end, write_brackets);
+
+			s_node = tml_next_sibling(&s_node);
+			if (tml_is_null(&s_node))
+				break;
+
+			if (dest_str >= dest_end-1)
+				return dest_str;
+			*dest_str++ = ' ';
+		}
+
+		if (write_brackets) {
+			if (dest_str >= dest_end-1)
+				return dest_str;
+			*dest_str++ = ']';
+		}
+
+		return dest_str;
+	}
+}
+
+size_t tml_node_to_string(const struct tml_node *node, char *dest_str, size_t dest_str_size)
+{
+	char *str = write_node_to_string(node, dest_str, dest_str + dest_str_size, false);
+	size_t result_size = str - dest_str;
+
+	if (result_size < dest_str_size) {
+		*str = '\0';
+		return result_size;
+	}
+	else {
+		return 0; /* error - this shouldn't happen */
+	}
+}
+
+size_t tml_node_to_markup_string(const struct tml_node *node, char *dest_str, size_t dest_str_size)
+{
+	char *str = write_node_to_string(node, dest_str, dest_str + dest_str_size, true);
+	size_t result_size = str - dest_str;
+
+	if (result_size < dest_str_size) {
+		*str = '\0';
+		return result_size;
+	}
+	else {
+		return 0; /* error - this shouldn't happen */
+	}
+}
+
+/* Numbers are read in two steps: first the digits are scanned into a 64 bit mantissa and a power of ten, and
+ * then that's converted to floating point. When the mantissa and the power of ten are both exactly representable
+ * (as they are for most numbers in practice), one floating point multiply or divide gives the correctly rounded
+ * result. Otherwise, the text is handed to strtod(), with its decimal point swapped for the locale's. */
+
+/* The most digits kept in the mantissa (any more are only used to round, by strtod()) */
+#define MAX_MANTISSA_DIGITS 19
+/* Exponents are clamped to this while reading them, which is well past the range of any double */
+#define MAX_DECIMAL_EXPONENT 100000
+/* Numbers no longer than this are copied onto the stack for strtod(), rather than into allocated memory */
+#define MAX_STACK_NUMBER_LENGTH 64
+
+/* The largest mantissas which convert to floating point exactly */
+#define MAX_EXACT_DOUBLE_MANTISSA ((uint64_t)1 << 53)
+#define MAX_EXACT_FLOAT_MANTISSA ((uint64_t)1 << 24)
+
+enum decimal_kind { DECIMAL_FINITE, DECIMAL_INFINITY, DECIMAL_NAN };
+
+struct decimal_number
+{
+	enum decimal_kind kind;
+	bool negative;
+	uint64_t mantissa; /* the first MAX_MANTISSA_DIGITS significant digits */
+	int exponent; /* the power of ten to multiply the mantissa by */
+	bool truncated; /* true if any significant digits didn't fit in the mantissa */
+};
+
+/* Exact conversions need each operation to round to the precision of its type (which isn't the case for x87) */
+#if (defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0) || (defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ == 0) || \
+	defined(_M_X64) || defined(_M_ARM64)
+#define TML_EXACT_FLOAT_ARITHMETIC
+#endif
+
+#ifdef NAN
+#define TML_NAN NAN
+#else
+#define TML_NAN (HUGE_VAL - HUGE_VAL)
+#endif
+
+#ifdef TML_EXACT_FLOAT_ARITHMETIC
+/* Powers of ten which are exactly representable as doubles, and as floats */
+static const double exact_double_powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+static const float exact_float_powers[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+static const uint64_t integer_powers[] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+	10000000000000ULL, 100000000000000ULL, 1000000000000000ULL };
+
+#define EXACT_POWER_COUNT(powers) ((int)(sizeof(powers) / sizeof(powers[0])))
+#endif
+
+/* Returns true if the string starts with the given lowercase word, in any case */
+static bool starts_with_word(const char *str, size_t str_len, const char *word)
+{
+	size_t i;
+
+	for (i = 0; word[i]; ++i) {
+		if (i >= str_len || (str[i] | 0x20) != word[i])
+			return false;
+	}
+	return true;
+}
+
+/* Adds a digit of a decimal to the mantissa, and returns true if it fit */
+static __inline__ bool add_mantissa_digit(struct decimal_number *num, int *digit_count, int digit)
+{
+	if (num->mantissa == 0 && digit == 0)
+		return true; /* leading zero */
+
+	if (*digit_count < MAX_MANTISSA_DIGITS) {
+		num->mantissa = num->mantissa * 10 + digit;
+		(*digit_count)++;
+		return true;
+	}
+
+	if (digit != 0)
+		num->truncated = true;
+	return false;
+}
+
+/* Eight digits at a time are read with SWAR (treating a 64 bit integer as a vector of bytes), which needs to know
+ * which order the bytes are loaded in */
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_X64) || defined(_M_IX86) || \
+	defined(_M_ARM64)
+#define TML_LITTLE_ENDIAN
+#endif
+
+/* If the next 8 characters are all digits, reads them as one number and returns true */
+static __inline__ bool parse_eight_digits(const char *str, size_t str_len, uint32_t *result)
+{
+#ifdef TML_LITTLE_ENDIAN
+	uint64_t chunk;
+
+	if (str_len < 8)
+		return false;
+	memcpy(&chunk, str, sizeof(chunk));
+
+	/* every byte must be from '0' to '9', so neither adding 0x46 nor subtracting 0x30 can carry into its top bit */
+	if (((chunk + 0x4646464646464646ULL) | (chunk - 0x3030303030303030ULL)) & 0x8080808080808080ULL)
+		return false;
+
+	/* combine neighbouring digits into 2, then 4, then 8 digit numbers */
+	chunk -= 0x3030303030303030ULL;
+	chunk = (chunk * 10) + (chunk >> 8);
+	chunk = (((chunk & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+		(((chunk >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+	*result = (uint32_t)chunk;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Adds eight digits at once to a mantissa that already has a significant digit, and returns true if they fit */
+static __inline__ bool add_mantissa_chunk(struct decimal_number *num, int *digit_count, const char *str, size_t str_len)
+{
+	uint32_t chunk;
+
+	if (num->mantissa == 0 || *digit_count + 8 > MAX_MANTISSA_DIGITS || !parse_eight_digits(str, str_len, &chunk))
+		return false;
+
+	num->mantissa = num->mantissa * 100000000 + chunk;
+	*digit_count += 8;
+	return true;
+}
+
+/* Reads the floating point number at the start of the string, and returns the number of characters it took
+ * up, or 0 if there isn't one */
+static size_t scan_decimal(const char *str, size_t str_len, struct decimal_number *num)
+{
+	size_t i = 0, exponent_end;
+	int digit_count = 0, exponent = 0;
+	bool any_digits = false, exponent_negative;
+
+	memset(num, 0, sizeof(*num));
+
+	if (i < str_len && (str[i] == '-' || str[i] == '+'))
+		num->negative = (str[i++] == '-');
+
+	if (i < str_len && !is_digit(str[i]) && str[i] != '.') {
+		num->kind = DECIMAL_INFINITY;
+		if (starts_with_word(str + i, str_len - i, "infinity"))
+			return i + 8;
+		if (starts_with_word(str + i, str_len - i, "inf"))
+			return i + 3;
+		num->kind = DECIMAL_NAN;
+		if (starts_with_word(str + i, str_len - i, "nan"))
+			return i + 3;
+		return 0;
+	}
+
+	/* whole part (digits that don't fit scale the mantissa up) */
+	while (i < str_len && is_digit(str[i])) {
+		any_digits = true;
+		if (add_mantissa_chunk(num, &digit_count, str + i, str_len - i)) {
+			i += 8;
+			continue;
+		}
+		if (!add_mantissa_digit(num, &digit_count, str[i] - '0'))
+			num->exponent++;
+		++i;
+	}
+
+	/* fractional part (digits that do fit scale the mantissa down) */
+	if (i < str_len && str[i] == '.') {
+		++i;
+		while (i < str_len && is_digit(str[i])) {
+			any_digits = true;
+			if (add_mantissa_chunk(num, &digit_count, str + i, str_len - i)) {
+				num->exponent -= 8;
+				i += 8;
+				continue;
+			}
+			if (add_mantissa_digit(num, &digit_count, str[i] - '0'))
+				num->exponent--;
+			++i;
+		}
+	}
+
+	if (!any_digits)
+		return 0;
+
+	/* exponent, which is only part of the number if it has digits */
+	if (i < str_len && (str[i] == 'e' || str[i] == 'E')) {
+		exponent_end = i + 1;
+		exponent_negative = false;
+		if (exponent_end < str_len && (str[exponent_end] == '-' || str[exponent_end] == '+'))
+			exponent_negative = (str[exponent_end++] == '-');
+
+		if (exponent_end < str_len && is_digit(str[exponent_end])) {
+			for (; exponent_end < str_len && is_digit(str[exponent_end]); ++exponent_end) {
+				if (exponent < MAX_DECIMAL_EXPONENT)
+					exponent = exponent * 10 + (str[exponent_end] - '0');
+			}
+			num->exponent += exponent_negative ? -exponent : exponent;
+			i = exponent_end;
+		}
+	}
+
+	return i;
+}
+
+/* Converts a number that can't be converted exactly, using strtod() or strtof() on a copy of its text */
+static double parse_inexact_decimal(const char *str, size_t str_len, bool single_precision)
+{
+	char stack_copy[MAX_STACK_NUMBER_LENGTH], *copy = stack_copy;
+	const char *point = localeconv()->decimal_point;
+	size_t point_len = strlen(point), i, j = 0;
+	double value;
+
+	if (str_len + point_len >= MAX_STACK_NUMBER_LENGTH) {
+		copy = malloc(str_len + point_len + 1);
+		if (!copy) return 0;
+	}
+
+	for (i = 0; i < str_len; ++i) {
+		if (str[i] == '.') {
+			memcpy(copy + j, point, point_len);
+			j += point_len;
+		}
+		else {
+			copy[j++] = str[i];
+		}
+	}
+	copy[j] = '\0';
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+	value = single_precision ? strtof(copy, NULL) : strtod(copy, NULL);
+#else
+	value = strtod(copy, NULL); /* (floats may very rarely be rounded twice) */
+#endif
+
+	if (copy != stack_copy)
+		free(copy);
+	return value;
+}
+
+
+enum TML_NUMBER_STATUS tml_parse_double(const char *str, size_t str_len, double *result, size_t *consumed)
+{
+	struct decimal_number num;
+	size_t length = scan_decimal(str, str_len, &num);
+	double value;
+
+	if (consumed) *consumed = length;
+	if (length == 0) {
+		*result = 0;
+		return TML_NUMBER_INVALID;
+	}
+
+	if (num.kind != DECIMAL_FINITE) {
+		value = (num.kind == DECIMAL_INFINITY) ? HUGE_VAL : TML_NAN;
+		*result = num.negative ? -value : value;
+		return TML_NUMBER_OK;
+	}
+
+	if (num.mantissa == 0) {
+		*result = num.negative ? -0.0 : 0.0;
+		return TML_NUMBER_OK;
+	}
+
+#ifdef TML_EXACT_FLOAT_ARITHMETIC
+	int max_exponent = EXACT_POWER_COUNT(exact_double_powers) - 1;
+
+	/* move powers of ten into the mantissa where it's small enough, so that more exponents are exact */
+	if (!num.truncated && num.exponent > max_exponent && num.exponent - max_exponent < EXACT_POWER_COUNT(integer_powers)) {
+		uint64_t scale = integer_powers[num.exponent - max_exponent];
+		if (num.mantissa <= MAX_EXACT_DOUBLE_MANTISSA / scale) {
+			num.mantissa *= scale;
+			num.exponent = max_exponent;
+		}
+	}
+
+	if (!num.truncated && num.mantissa <= MAX_EXACT_DOUBLE_MANTISSA &&
+		num.exponent > -EXACT_POWER_COUNT(exact_double_powers) && num.exponent < EXACT_POWER_COUNT(exact_double_powers)) {
+		value = (double)num.mantissa;
+		if (num.exponent < 0)
+			value /= exact_double_powers[-num.exponent];
+		else
+			value *= exact_double_powers[num.exponent];
+
+		*result = num.negative ? -value : value;
+		return TML_NUMBER_OK;
+	}
+#endif
+
+	value = parse_inexact_decimal(str, length, false);
+	*result = value;
+
+	if (value > DBL_MAX || value < -DBL_MAX || value == 0)
+		return TML_NUMBER_OUT_OF_RANGE;
+	return TML_NUMBER_OK;
+}
+
+enum TML_NUMBER_STATUS tml_parse_float(const char *str, size_t str_len, float *result, size_t *consumed)
+{
+	struct decimal_number num;
+	size_t length = scan_decimal(str, str_len, &num);
+	float value;
+
+	if (consumed) *consumed = length;
+	if (length == 0) {
+		*result = 0;
+		return TML_NUMBER_INVALID;
+	}
+
+	if (num.kind != DECIMAL_FINITE) {
+		value = (num.kind == DECIMAL_INFINITY) ? (float)HUGE_VAL : (float)TML_NAN;
+		*result = num.negative ? -value : value;
+		return TML_NUMBER_OK;
+	}
+
+	if (num.mantissa == 0) {
+		*result = num.negative ? -0.0f : 0.0f;
+		return TML_NUMBER_OK;
+	}
+
+#ifdef TML_EXACT_FLOAT_ARITHMETIC
+	if (!num.truncated && num.mantissa <= MAX_EXACT_FLOAT_MANTISSA &&
+		num.exponent > -EXACT_POWER_COUNT(exact_float_powers) && num.exponent < EXACT_POWER_COUNT(exact_float_powers)) {
+		value = (float)num.mantissa;
+		if (num.exponent < 0)
+			value /= exact_float_powers[-num.exponent];
+		else
+			value *= exact_float_powers[num.exponent];
+
+		*result = num.negative ? -value : value;
+		return TML_NUMBER_OK;
+	}
+#endif
+
+	value = (float)parse_inexact_decimal(str, length, true);
+	*result = value;
+
+	if (value > FLT_MAX || value < -FLT_MAX || value == 0)
+		return TML_NUMBER_OUT_OF_RANGE;
+	return TML_NUMBER_OK;
+}
+
+/* Reads the digits of an integer at the start of the string, and returns the number of characters it took up,
+ * or 0 if there isn't one. *overflow is set if the magnitude doesn't fit in 64 bits. */
+static size_t scan_integer(const char *str, size_t str_len, bool allow_negative, bool *negative,
+	uint64_t *magnitude, bool *overflow)
+{
+	size_t i = 0, digits_start;
+	uint64_t value = 0;
+
+	*negative = false;
+	*overflow = false;
+
+	if (i < str_len && (str[i] == '+' || (allow_negative && str[i] == '-')))
+		*negative = (str[i++] == '-');
+
+	digits_start = i;
+	while (i < str_len && is_digit(str[i])) {
+		uint32_t chunk;
+		int digit = str[i] - '0';
+
+		/* (below 10^11, another eight digits can't overflow) */
+		if (value < 100000000000ULL && parse_eight_digits(str + i, str_len - i, &chunk)) {
+			value = value * 100000000 + chunk;
+			i += 8;
+			continue;
+		}
+
+		if (value > (UINT64_MAX - digit) / 10)
+			*overflow = true;
+		value = value * 10 + digit;
+		++i;
+	}
+
+	*magnitude = value;
+	return (i > digits_start) ? i : 0;
+}
+
+/* Reads a signed integer between -max_value-1 and max_value */
+static enum TML_NUMBER_STATUS parse_signed(const char *str, size_t str_len, uint64_t max_value,
+	int64_t *result, size_t *consumed)
+{
+	uint64_t magnitude;
+	bool negative, overflow;
+	size_t length = scan_integer(str, str_len, true, &negative, &magnitude, &overflow);
+
+	if (consumed) *consumed = length;
+	if (length == 0) {
+		*result = 0;
+		return TML_NUMBER_INVALID;
+	}
+
+	if (overflow || magnitude > max_value + (negative ? 1 : 0)) {
+		*result = negative ? -(int64_t)max_value - 1 : (int64_t)max_value;
+		return TML_NUMBER_OUT_OF_RANGE;
+	}
+
+	/* (the most negative value doesn't fit as a positive one) */
+	*result = negative ? -(int64_t)(magnitude - 1) - 1 : (int64_t)magnitude;
+	return TML_NUMBER_OK;
+}
+
+enum TML_NUMBER_STATUS tml_parse_int32(const char *str, size_t str_len, int32_t *result, size_t *consumed)
+{
+	int64_t value;
+	enum TML_NUMBER_STATUS status = parse_signed(str, str_len, INT32_MAX, &value, consumed);
+	*result = (int32_t)value;
+	return status;
+}
+
+enum TML_NUMBER_STATUS tml_parse_int64(const char *str, size_t str_len, int64_t *result, size_t *consumed)
+{
+	return parse_signed(str, str_len, INT64_MAX, result, consumed);
+}
+
+enum TML_NUMBER_STATUS tml_parse_uint64(const char *str, size_t str_len, uint64_t *result, size_t *consumed)
+{
+	uint64_t magnitude;
+	bool negative, overflow;
+	size_t length = scan_integer(str, str_len, false, &negative, &magnitude, &overflow);
+
+	if (consumed) *consumed = length;
+	if (length == 0) {
+		*result = 0;
+		return TML_NUMBER_INVALID;
+	}
+
+	*result = overflow ? UINT64_MAX : magnitude;
+	return overflow ? TML_NUMBER_OUT_OF_RANGE : TML_NUMBER_OK;
+}
+
+/* The values stored with typed leaves (see write_typed_leaf()). An int64_t converts to the same double as its
+ * text does, since both are rounded to the nearest. */
+static __inline__ int64_t stored_integer(const struct tml_node *node)
+{
+	int64_t value;
+	memcpy(&value, node->value - TYPED_LEAF_VALUE_OFFSET, sizeof(value));
+	return value;
+}
+
+static __inline__ double stored_double(const struct tml_node *node)
+{
+	double value;
+	memcpy(&value, node->value - TYPED_LEAF_VALUE_OFFSET, sizeof(value));
+	return value;
+}
+
+static __inline__ float stored_float(const struct tml_node *node)
+{
+	float value;
+	memcpy(&value, node->value - TYPED_LEAF_FLOAT_OFFSET, sizeof(value));
+	return value;
+}
+
+double tml_node_to_double(const struct tml_node *node)
+{
+	enum TML_LEAF_TYPE type = stored_leaf_type(node);
+	double value;
+
+	if (type == TML_LEAF_INT) {
+		/* as text, "-0" is a negative zero */
+		int64_t integer = stored_integer(node);
+		return (integer == 0 && node->value[0] == '-') ? -0.0 : (double)integer;
+	}
+	if (type == TML_LEAF_DOUBLE)
+		return stored_double(node);
+	tml_parse_double(node->value, tml_is_list(node) ? 0 : node->size, &value, NULL);
+	return value;
+}
+
+float tml_node_to_float(const struct tml_node *node)
+{
+	enum TML_LEAF_TYPE type = stored_leaf_type(node);
+	float value;
+
+	if (type == TML_LEAF_INT || type == TML_LEAF_DOUBLE)
+		return stored_float(node);
+	tml_parse_float(node->value, tml_is_list(node) ? 0 : node->size, &value, NULL);
+	return value;
+}
+
+int64_t tml_node_to_int64(const struct tml_node *node)
+{
+	int64_t value;
+
+	if (stored_leaf_type(node) == TML_LEAF_INT)
+		return stored_integer(node);
+	tml_parse_int64(node->value, tml_is_list(node) ? 0 : node->size, &value, NULL);
+	return value;
+}
+
+int tml_node_to_int(const struct tml_node *node)
+{
+	int64_t value = tml_node_to_int64(node);
+
+	if (value > INT_MAX) return INT_MAX;
+	if (value < INT_MIN) return INT_MIN;
+	return (int)value;
+}
+
+bool tml_node_to_bool(const struct tml_node *node)
+{
+	return !tml_is_list(node) && node->size == 4 && memcmp(node->value, "true", 4) == 0;
+}
+
+enum TML_LEAF_TYPE tml_leaf_type(const struct tml_node *node)
+{
+	enum TML_LEAF_TYPE type = stored_leaf_type(node);
+	int64_t integer;
+	double number;
+
+	if (type != TML_LEAF_NONE)
+		return type;
+	if (tml_is_list(node))
+		return TML_LEAF_NONE;
+	return classify_word(node->value, node->size, &integer, &number);
+}
+
+/* Reads the value of the node at this offset ("" for a list), and returns the offset of its next sibling. Numbers
+ * are almost always packed leaves, which are read directly rather than as a whole tml_node. */
+static __inline__ size_t read_child_value(char *buff, size_t offset, const char **value, size_t *size)
+{
+	unsigned char flag = ((unsigned char*)buff)[offset];
+	struct tml_node node;
+
+	if (flag < MIN_NODE_DATA_FLAG) {
+		*value = &buff[offset + 1];
+		*size = flag >> 1;
+		return (flag & 1) ? offset + 2 + *size : 0;
+	}
+
+	node = read_node(buff, &buff[offset]);
+	*value = node.value;
+	*size = tml_is_list(&node) ? 0 : node.size;
+	return node.next_sibling;
+}
+
+bool tml_is_array(const struct tml_node *node)
+{
+	return array_node_offset(node) != 0;
+}
+
+bool tml_node_array(const struct tml_node *node, struct tml_array *array)
+{
+	size_t array_offset = array_node_offset(node);
+
+	if (!array_offset) {
+		array->type = TML_ARRAY_NONE;
+		array->data = NULL;
+		array->count = 0;
+		return false;
+	}
+
+	read_array_node(node->buff, array_offset, array);
+	return true;
+}
+
+/* Reads element i of an array, as an integer if it's an integer array (returning true) or else as a double */
+static __inline__ bool read_array_element(const struct tml_array *array, size_t i, int64_t *integer, double *number)
+{
+	switch (array->type) {
+		case TML_ARRAY_INT8: *integer = ((const int8_t *)array->data)[i]; return true;
+		case TML_ARRAY_INT16: *integer = ((const int16_t *)array->data)[i]; return true;
+		case TML_ARRAY_INT32: *integer = ((const int32_t *)array->data)[i]; return true;
+		case TML_ARRAY_INT64: *integer = ((const int64_t *)array->data)[i]; return true;
+		case TML_ARRAY_FLOAT: *number = ((const float *)array->data)[i]; return false;
+		default: *number = ((const double *)array->data)[i]; return false;
+	}
+}
+
+/* The bulk conversions of a binary array, which give the same results as converting each element's text
+ * would (other than rounding doubles to floats directly). The array type given is the type to convert to. */
+static int read_binary_array(const struct tml_node *node, void *values, enum TML_ARRAY_TYPE type, int array_size,
+	int *first_error)
+{
+	struct tml_array array;
+	int count = 0;
+
+	tml_node_array(node, &array);
+	if (first_error) *first_error = -1;
+
+	for (; count < array_size && (size_t)count < array.count; ++count) {
+		int64_t integer = 0;
+		double number = 0;
+		bool is_integer = read_array_element(&array, count, &integer, &number), error = false;
+
+		if (type == TML_ARRAY_FLOAT) {
+			float value = is_integer ? (float)integer : (float)number;
+			/* doubles out of range become infinity or 0, as they do when parsed as floats */
+			error = !is_integer && ((value == 0 && number != 0) || value > FLT_MAX || value < -FLT_MAX);
+			((float *)values)[count] = value;
+		}
+		else if (type == TML_ARRAY_DOUBLE) {
+			/* a float is the shortest text that reads back as it, which isn't the same as the float widened */
+			if (array.type == TML_ARRAY_FLOAT) {
+				char text[MAX_PACKED_LENGTH + 1];
+				size_t length = format_decimal(text, sizeof(text), number, true);
+				tml_parse_double(text, length, &number, NULL);
+			}
+			((double *)values)[count] = is_integer ? (double)integer : number;
+		}
+		else {
+			/* a decimal reads as the integer it starts with (its integer part), and then isn't entirely a number */
+			if (!is_integer) {
+				if (number > INT32_MAX)
+					integer = (int64_t)INT32_MAX + 1;
+				else if (number < INT32_MIN)
+					integer = (int64_t)INT32_MIN - 1;
+				else
+					integer = (int64_t)number;
+				error = ((double)integer != number);
+			}
+			if (integer > INT32_MAX || integer < INT32_MIN) {
+				integer = (integer > INT32_MAX) ? INT32_MAX : INT32_MIN;
+				error = true;
+			}
+			((int32_t *)values)[count] = (int32_t)integer;
+		}
+
+		if (error && first_error && *first_error < 0)
+			*first_error = count;
+	}
+	return count;
+}
+
+/* The bulk conversions are all the same but for the type, so they're written once here */
+#define READ_NUMBER_ARRAY(type, parse_number, array_type) \
+	{ \
+		size_t offset = node->first_child, size, length; \
+		const char *value; \
+		type number; \
+		int count = 0; \
+		\
+		if (!offset && array_node_offset(node)) \
+			return read_binary_array(node, array, array_type, array_size, first_error); \
+		if (first_error) *first_error = -1; \
+		\
+		while (offset && count < array_size) { \
+			offset = read_child_value(node->buff, offset, &value, &size); \
+			if ((parse_number(value, size, &number, &length) != TML_NUMBER_OK || length != size) && \
+				first_error && *first_error < 0) \
+				*first_error = count; \
+			array[count++] = number; \
+		} \
+		return count; \
+	}
+
+int tml_node_read_float_array(const struct tml_node *node, float *array, int array_size, int *first_error)
+	READ_NUMBER_ARRAY(float, tml_parse_float, TML_ARRAY_FLOAT)
+
+int tml_node_read_double_array(const struct tml_node *node, double *array, int array_size, int *first_error)
+	READ_NUMBER_ARRAY(double, tml_parse_double, TML_ARRAY_DOUBLE)
+
+int tml_node_read_int_array(const struct tml_node *node, int *array, int array_size, int *first_error)
+	READ_NUMBER_ARRAY(int32_t, tml_parse_int32, TML_ARRAY_INT32)
+
+int tml_node_to_float_array(const struct tml_node *node, float *array, int array_size)
+{
+	return tml_node_read_float_array(node, array, array_size, NULL);
+}
+
+int tml_node_to_double_array(const struct tml_node *node, double *array, int array_size)
+{
+	return tml_node_read_double_array(node, array, array_size, NULL);
+}
+
+int tml_node_to_int_array(const struct tml_node *node, int *array, int array_size)
+{
+	return tml_node_read_int_array(node, array, array_size, NULL);
+}
+
+
+/* --------------- UTILITY FUNCTIONS (COMPARISON / PATTERN MATCHING AND SEARCH) -------------------- */
+
+static enum TML_WILDCARD check_wildcard(const char *value)
+{
+	/* special string with ASCII character #1 and #2 are \? and \* wildcards */
+	if (value[0] == '\0')
+		return TML_NO_WILDCARD;
+	if (value[1] == '\0' && (value[0] == 1 || value[0] == 2))
+		return (enum TML_WILDCARD)value[0];
+	else
+		return TML_NO_WILDCARD;
+}
+
+bool tml_compare_nodes(const struct tml_node *candidate, const struct tml_node *pattern)
+{
+	if (!tml_is_list(pattern)) {
+		/* expecting a "word" leaf node */
+		if (tml_is_list(candidate)) return false;
+		/* equal interned words share their value, and words of different lengths can't be equal */
+		else return candidate->value == pattern->value ||
+			(candidate->size == pattern->size && memcmp(candidate->value, pattern->value, pattern->size) == 0);
+	}
+	else {
+		struct tml_node p_child, c_child;
+		enum TML_WILDCARD wild;
+
+		/* at this point, we're expecting a list of zero or more items */
+		if (!tml_is_list(candidate)) {
+			return false;
+		}
+
+		/* if the pattern is an empty list [], then expect the same of the candidate */
+		if (!tml_has_children(pattern)) {
+			return !tml_has_children(candidate);
+		}
+
+		/* at this point, we're expecting a list of one or more items, so compare each element */
+
+		/* if the pattern list starts with a \* wildcard, match anything, even an empty candidate list */
+		p_child = tml_first_child(pattern);
+		wild = check_wildcard(p_child.value);
+		if (wild == TML_WILD_ANY)
+			return true;
+		c_child = tml_first_child(candidate);
+
+		while (!tml_is_null(&c_child) && !tml_is_null(&p_child)) {
+			/* the \? wildcard will match any single node, otherwise the node must be compared */
+			if (wild != TML_WILD_ONE) {
+				if (!tml_compare_nodes(&c_child, &p_child))
+					return false;
+			}
+
+			/* a following \* wildcard matches the remainder of the list, regardless of what it is */
+			p_child = tml_next_sibling(&p_child);
+			wild = check_wildcard(p_child.value);
+			if (wild == TML_WILD_ANY)
+				return true;
+
+			c_child = tml_next_sibling(&c_child);
+		}
+
+		/* if the candidate or pattern ran out of nodes before the other, they don't match */
+		if (!tml_is_null(&c_child) || !tml_is_null(&p_child)) {
+			return false;
+		}
+
+		/* everything seems to match */
+		return true;
+	}
+}
+
+struct tml_node tml_find_first_child(const struct tml_node *node, const struct tml_node *pattern)
+{
+	struct tml_node child = tml_first_child(node);
+
+	while (!tml_is_null(&child)) {
+		if (tml_compare_nodes(&child, pattern))
+			return child;
+		child = tml_next_sibling(&child);
+	}
+
+	return TML_NODE_NULL;
+}
+
+struct tml_node tml_find_next_sibling(const struct tml_node *node, const struct tml_node *pattern)
+{
+	struct tml_node sib = tml_next_sibling(node);
+
+	while (!tml_is_null(&sib)) {
+		if (tml_compare_nodes(&sib, pattern))
+			return sib;
+		sib = tml_next_sibling(&sib);
+	}
+
+	return TML_NODE_NULL;
+}
+
+/* A compiled pattern is the pattern's tree flattened into an array of items in document order, so the items
+ * within each list follow right after it. Wildcards are resolved when compiling, each list item knows how many
+ * children a match needs (so candidates with a child offset table can be ruled out by their count alone), and
+ * words are copied into the pattern so it doesn't depend on the tml_doc it came from. */
+
+enum PATTERN_ITEM_TYPE
+{
+	PATTERN_WORD, PATTERN_LIST, PATTERN_ANY_ONE
+};
+
+struct pattern_item
+{
+	enum PATTERN_ITEM_TYPE type;
+	const char *value; /* PATTERN_WORD only */
+	size_t size; /* PATTERN_WORD only: the length of value */
+	size_t child_count; /* PATTERN_LIST only: the number of items in the list, not counting a final \* */
+	bool any_rest; /* PATTERN_LIST only: the list ends with \*, so a match may have more children */
+	size_t next; /* index of the next item in the same list, or 0 if this is the last one */
+};
+
+struct tml_pattern
+{
+	struct pattern_item *items;
+	char *strings;
+	size_t item_count, strings_size;
+};
+
+/* Counts the items and string bytes needed to compile the given pattern node */
+static void measure_pattern(const struct tml_node *node, size_t *item_count, size_t *strings_size)
+{
+	struct tml_node child;
+
+	(*item_count)++;
+	if (!tml_is_list(node)) {
+		*strings_size += node->size + 1;
+		return;
+	}
+
+	for (child = tml_first_child(node); !tml_is_null(&child); child = tml_next_sibling(&child)) {
+		enum TML_WILDCARD wild = check_wildcard(child.value);
+		if (wild == TML_WILD_ANY)
+			break;
+		else if (wild == TML_WILD_ONE)
+			(*item_count)++;
+		else
+			measure_pattern(&child, item_count, strings_size);
+	}
+}
+
+/* Compiles the given pattern node into the next item (and those after it, for a list), returning its index */
+static size_t compile_pattern_item(struct tml_pattern *pattern, const struct tml_node *node, char **strings)
+{
+	size_t index = pattern->item_count++, prev = 0;
+	struct pattern_item *item = &pattern->items[index];
+	struct tml_node child;
+
+	memset(item, 0, sizeof(*item));
+
+	if (!tml_is_list(node)) {
+		item->type = PATTERN_WORD;
+		item->value = *strings;
+		item->size = node->size;
+		memcpy(*strings, node->value, node->size);
+		(*strings)[node->size] = '\0';
+		*strings += node->size + 1;
+		return index;
+	}
+
+	item->type = PATTERN_LIST;
+
+	for (child = tml_first_child(node); !tml_is_null(&child); child = tml_next_sibling(&child)) {
+		enum TML_WILDCARD wild = check_wildcard(child.value);
+		size_t child_index;
+
+		/* anything after \* is ignored, as in tml_compare_nodes() */
+		if (wild == TML_WILD_ANY) {
+			item->any_rest = true;
+			break;
+		}
+		else if (wild == TML_WILD_ONE) {
+			child_index = pattern->item_count++;
+			memset(&pattern->items[child_index], 0, sizeof(struct pattern_item));
+			pattern->items[child_index].type = PATTERN_ANY_ONE;
+		}
+		else {
+			child_index = compile_pattern_item(pattern, &child, strings);
+		}
+
+		if (item->child_count++ > 0)
+			pattern->items[prev].next = child_index;
+		prev = child_index;
+	}
+
+	return index;
+}
+
+struct tml_pattern *tml_compile_pattern(const struct tml_node *pattern_node)
+{
+	struct tml_pattern *pattern = malloc(sizeof(struct tml_pattern));
+	size_t item_count = 0, strings_size = 0;
+	char *strings;
+
+	if (!pattern)
+		return NULL;
+
+	measure_pattern(pattern_node, &item_count, &strings_size);
+	pattern->items = malloc(item_count * sizeof(struct pattern_item));
+	pattern->strings = malloc(strings_size + 1);
+
+	if (!pattern->items || !pattern->strings) {
+		tml_free_pattern(pattern);
+		return NULL;
+	}
+
+	pattern->item_count = 0;
+	pattern->strings_size = strings_size;
+	strings = pattern->strings;
+	compile_pattern_item(pattern, pattern_node, &strings);
+
+	return pattern;
+}
+
+struct tml_pattern *tml_compile_pattern_string(const char *pattern_str)
+{
+	struct tml_pattern *pattern = NULL;
+	struct tml_doc *doc = tml_parse_string(pattern_str);
+
+	if (doc && !doc->error_message)
+		pattern = tml_compile_pattern(&doc->root_node);
+
+	tml_free_doc(doc);
+	return pattern;
+}
+
+void tml_free_pattern(struct tml_pattern *pattern)
+{
+	if (pattern) {
+		free(pattern->items);
+		free(pattern->strings);
+		free(pattern);
+	}
+}
+
+static bool match_pattern_item(const struct tml_node *candidate, const struct tml_pattern *pattern, size_t index)
+{
+	const struct pattern_item *item = &pattern->items[index];
+	struct tml_node child;
+	size_t i;
+
+	if (item->type == PATTERN_ANY_ONE)
+		return true;
+
+	if (item->type == PATTERN_WORD) {
+		return !tml_is_list(candidate) && candidate->size == item->size &&
+			memcmp(candidate->value, item->value, item->size) == 0;
+	}
+
+	/* at this point, we're expecting a list with the right number of children */
+	if (!tml_is_list(candidate))
+		return false;
+	if (item->child_count == 0)
+		return item->any_rest || !tml_has_children(candidate);
+
+	if (candidate->size < item->child_count || (!item->any_rest && candidate->size != item->child_count))
+		return false;
+
+	child = tml_first_child(candidate);
+	index++;
+	for (i = 0; i < item->child_count; ++i) {
+		if (tml_is_null(&child) || !match_pattern_item(&child, pattern, index))
+			return false;
+		child = tml_next_sibling(&child);
+		index = pattern->items[index].next;
+	}
+
+	/* without a \* at the end, the candidate mustn't have any more children */
+	return item->any_rest || tml_is_null(&child);
+}
+
+bool tml_match_pattern(const struct tml_node *candidate, const struct tml_pattern *pattern)
+{
+	return match_pattern_item(candidate, pattern, 0);
+}
+
+struct tml_node tml_find_first_match(const struct tml_node *node, const struct tml_pattern *pattern)
+{
+	struct tml_node child = tml_first_child(node);
+
+	while (!tml_is_null(&child)) {
+		if (match_pattern_item(&child, pattern, 0))
+			return child;
+		child = tml_next_sibling(&child);
+	}
+
+	return TML_NODE_NULL;
+}
+
+struct tml_node tml_find_next_match(const struct tml_node *node, const struct tml_pattern *pattern)
+{
+	struct tml_node sib = tml_next_sibling(node);
+
+	while (!tml_is_null(&sib)) {
+		if (match_pattern_item(&sib, pattern, 0))
+			return sib;
+		sib = tml_next_sibling(&sib);
+	}
+
+	return TML_NODE_NULL;
+}
+
+/* A pattern set sorts its patterns by their leading word - the word reached by following first items down from
+ * the top of the pattern, such as "position" in [position | \? \? \?] - in a hash table of chains of pattern
+ * ids. Any candidate matching such a pattern must have that same leading word (see node_key()), so only the
+ * patterns in its word's chain, and those with no leading word (e.g. starting with \?), need to be tried. The
+ * number of children each pattern needs is checked before anything else. */
+
+struct pattern_set_key
+{
+	const char *key; /* NULL for an unused slot */
+	size_t length;
+	uint32_t hash;
+	int first, last; /* ids of the first and last patterns with this leading word */
+};
+
+struct tml_pattern_set
+{
+	const struct tml_pattern **patterns;
+	int *next_same_key; /* id of the next pattern with the same leading word (or also with none), or -1 */
+	size_t pattern_count, patterns_allocated;
+
+	struct pattern_set_key *keys;
+	size_t key_count, key_capacity;
+
+	int first_unkeyed, last_unkeyed; /* patterns with no leading word */
+	size_t max_child_count;
+};
+
+static const char *node_key(const struct tml_node *child, size_t *length);
+static uint32_t hash_key(const char *key, size_t length);
+static bool keys_equal(const char *a, size_t a_length, const char *b, size_t b_length);
+
+/* Returns the leading word of a compiled pattern and sets its length, or returns NULL if it has none */
+static const char *pattern_key(const struct tml_pattern *pattern, size_t *length)
+{
+	size_t index = 0;
+
+	while (pattern->items[index].type == PATTERN_LIST && pattern->items[index].child_count > 0)
+		index++;
+	if (pattern->items[index].type != PATTERN_WORD)
+		return NULL;
+	*length = pattern->items[index].size;
+	return pattern->items[index].value;
+}
+
+static struct pattern_set_key *find_pattern_set_key(const struct tml_pattern_set *set, const char *key, size_t length,
+	uint32_t hash)
+{
+	size_t mask = set->key_capacity - 1, i = hash & mask;
+
+	while (set->keys[i].key &&
+		(set->keys[i].hash != hash || !keys_equal(set->keys[i].key, set->keys[i].length, key, length)))
+		i = (i + 1) & mask;
+	return &set->keys[i];
+}
+
+static bool grow_pattern_set_keys(struct tml_pattern_set *set)
+{
+	struct pattern_set_key *old_keys = set->keys;
+	size_t old_capacity = set->key_capacity, i;
+
+	set->key_capacity = old_capacity ? old_capacity * 2 : 16;
+	set->keys = calloc(set->key_capacity, sizeof(struct pattern_set_key));
+	if (!set->keys) {
+		set->keys = old_keys;
+		set->key_capacity = old_capacity;
+		return false;
+	}
+
+	for (i = 0; i < old_capacity; ++i) {
+		if (old_keys[i].key)
+			*find_pattern_set_key(set, old_keys[i].key, old_keys[i].length, old_keys[i].hash) = old_keys[i];
+	}
+	free(old_keys);
+	return true;
+}
+
+struct tml_pattern_set *tml_create_pattern_set(void)
+{
+	struct tml_pattern_set *set = calloc(1, sizeof(struct tml_pattern_set));
+	if (!set) return NULL;
+
+	set->first_unkeyed = set->last_unkeyed = -1;
+	return set;
+}
+
+void tml_free_pattern_set(struct tml_pattern_set *set)
+{
+	if (set) {
+		free(set->patterns);
+		free(set->next_same_key);
+		free(set->keys);
+		free(set);
+	}
+}
+
+int tml_add_to_pattern_set(struct tml_pattern_set *set, const struct tml_pattern *pattern)
+{
+	const struct pattern_item *root = &pattern->items[0];
+	size_t key_length = 0;
+	const char *key = pattern_key(pattern, &key_length);
+	int id = (int)set->pattern_count, *last;
+
+	if (set->pattern_count == set->patterns_allocated) {
+		size_t allocated = set->patterns_allocated ? set->patterns_allocated * 2 : 16;
+		const struct tml_pattern **patterns = realloc(set->patterns, allocated * sizeof(*patterns));
+		int *next_same_key;
+
+		if (!patterns) return -1;
+		set->patterns = patterns;
+
+		next_same_key = realloc(set->next_same_key, allocated * sizeof(int));
+		if (!next_same_key) return -1;
+		set->next_same_key = next_same_key;
+
+		set->patterns_allocated = allocated;
+	}
+
+	if (key) {
+		uint32_t hash = hash_key(key, key_length);
+		struct pattern_set_key *entry;
+
+		if ((set->key_count + 1) * 2 > set->key_capacity && !grow_pattern_set_keys(set))
+			return -1;
+
+		entry = find_pattern_set_key(set, key, key_length, hash);
+		if (!entry->key) {
+			entry->key = key;
+			entry->length = key_length;
+			entry->hash = hash;
+			entry->first = entry->last = -1;
+			set->key_count++;
+		}
+
+		if (entry->first < 0) entry->first = id;
+		last = &entry->last;
+	}
+	else {
+		if (set->first_unkeyed < 0) set->first_unkeyed = id;
+		last = &set->last_unkeyed;
+	}
+
+	if (*last >= 0)
+		set->next_same_key[*last] = id;
+	*last = id;
+
+	set->patterns[id] = pattern;
+	set->next_same_key[id] = -1;
+	set->pattern_count++;
+
+	if (root->type == PATTERN_LIST && root->child_count > set->max_child_count)
+		set->max_child_count = root->child_count;
+
+	return id;
+}
+
+/* Checks the number of children a pattern needs before matching the whole thing. child_count is the number
+ * the candidate list has, counted up to one more than any pattern in the set needs. */
+static bool match_pattern_in_set(const struct tml_node *candidate, size_t child_count, const struct tml_pattern *pattern)
+{
+	const struct pattern_item *root = &pattern->items[0];
+
+	if (root->type == PATTERN_LIST) {
+		if (child_count < root->child_count || (!root->any_rest && child_count != root->child_count))
+			return false;
+	}
+	return match_pattern_item(candidate, pattern, 0);
+}
+
+int tml_match_pattern_set(const struct tml_node *candidate, const struct tml_pattern_set *set)
+{
+	int keyed = -1, unkeyed = set->first_unkeyed;
+	size_t child_count = 0;
+
+	if (set->key_count > 0) {
+		size_t key_length;
+		const char *key = node_key(candidate, &key_length);
+		const struct pattern_set_key *entry = find_pattern_set_key(set, key, key_length, hash_key(key, key_length));
+		if (entry->key)
+			keyed = entry->first;
+	}
+
+	if (keyed < 0 && unkeyed < 0)
+		return -1;
+
+	if (tml_is_list(candidate)) {
+		struct tml_node child = tml_first_child(candidate);
+
+		while (!tml_is_null(&child) && child_count <= set->max_child_count) {
+			child_count++;
+			child = tml_next_sibling(&child);
+		}
+	}
+
+	/* try both chains of candidates in order of id, so the first pattern added which matches is found */
+	while (keyed >= 0 || unkeyed >= 0) {
+		int id;
+
+		if (unkeyed < 0 || (keyed >= 0 && keyed < unkeyed)) {
+			id = keyed;
+			keyed = set->next_same_key[keyed];
+		}
+		else {
+			id = unkeyed;
+			unkeyed = set->next_same_key[unkeyed];
+		}
+
+		if (match_pattern_in_set(candidate, child_count, set->patterns[id]))
+			return id;
+	}
+
+	return -1;
+}
+
+/* Key lookup: tml_index_keys() gives a list a hash table of its children's keys, alongside its table of child
+ * offsets. Each slot holds the number (plus 1) of the first child with some key, and children sharing a key
+ * are chained in order through next_same. The hash of each child's key is kept to skip most string compares. */
+
+struct key_table
+{
+	uint32_t *slots, *next_same, *hashes;
+	size_t slot_count;
+};
+
+/* Returns the key of a child - itself if it's a word, otherwise the first word within it - and sets its length.
+ * Keys are compared by length, since words left in a file mapping (TML_PARSE_MMAP) aren't null terminated. */
+static const char *node_key(const struct tml_node *child, size_t *length)
+{
+	struct tml_node node = *child;
+
+	while (tml_has_children(&node))
+		node = tml_first_child(&node);
+	*length = tml_is_list(&node) ? 0 : node.size;
+	return node.value;
+}
+
+static bool keys_equal(const char *a, size_t a_length, const char *b, size_t b_length)
+{
+	return a_length == b_length && memcmp(a, b, a_length) == 0;
+}
+
+static uint32_t hash_key(const char *key, size_t length)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < length; ++i) {
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void free_key_table(struct tml_doc *data, struct key_table *keys, size_t child_count)
+{
+	struct tml_allocator *allocator = &data->allocator;
+
+	if (!keys)
+		return;
+
+	allocator->release(allocator->user_data, keys->slots, keys->slot_count * sizeof(uint32_t));
+	allocator->release(allocator->user_data, keys->next_same, child_count * sizeof(uint32_t));
+	allocator->release(allocator->user_data, keys->hashes, child_count * sizeof(uint32_t));
+	allocator->release(allocator->user_data, keys, sizeof(*keys));
+}
+
+/* Returns the slot for the given key, which is either empty or holds the first child with that key */
+static uint32_t *find_key_slot(const struct tml_node *list, const struct child_table *table,
+	const char *key, size_t length, uint32_t hash)
+{
+	const struct key_table *keys = table->keys;
+	size_t mask = keys->slot_count - 1, i = hash & mask;
+
+	for (;;) {
+		uint32_t child_number = keys->slots[i];
+
+		if (child_number == 0)
+			return &keys->slots[i];
+
+		if (keys->hashes[child_number - 1] == hash) {
+			struct tml_node child = table_child(list, table, child_number - 1);
+			size_t child_length;
+			const char *child_key = node_key(&child, &child_length);
+			if (keys_equal(child_key, child_length, key, length))
+				return &keys->slots[i];
+		}
+
+		i = (i + 1) & mask;
+	}
+}
+
+bool tml_index_keys(const struct tml_node *list)
+{
+	struct tml_doc *data;
+	struct tml_allocator *allocator;
+	struct child_table *table;
+	struct key_table *keys;
+	size_t i;
+
+	if (!tml_has_children(list))
+		return true;
+
+	table = lookup_child_table(list);
+	if (!table) table = add_child_table(list, list->size);
+	if (!table) return false;
+	if (table->keys)
+		return true;
+	if (table->count > UINT32_MAX / 2)
+		return false;
+
+	data = node_doc(list);
+	allocator = &data->allocator;
+
+	keys = allocator->alloc(allocator->user_data, sizeof(*keys));
+	if (!keys) return false;
+
+	for (keys->slot_count = 16; keys->slot_count < table->count * 2; keys->slot_count *= 2)
+		;
+	keys->slots = allocator->alloc(allocator->user_data, keys->slot_count * sizeof(uint32_t));
+	keys->next_same = allocator->alloc(allocator->user_data, table->count * sizeof(uint32_t));
+	keys->hashes = allocator->alloc(allocator->user_data, table->count * sizeof(uint32_t));
+
+	if (!keys->slots || !keys->next_same || !keys->hashes) {
+		if (keys->slots) allocator->release(allocator->user_data, keys->slots, keys->slot_count * sizeof(uint32_t));
+		if (keys->next_same) allocator->release(allocator->user_data, keys->next_same, table->count * sizeof(uint32_t));
+		if (keys->hashes) allocator->release(allocator->user_data, keys->hashes, table->count * sizeof(uint32_t));
+		allocator->release(allocator->user_data, keys, sizeof(*keys));
+		return false;
 	}
-	else {
-		/* read packed node links */
-		node.first_child = 0;
 
-		if (ptr[0] == 0)
-			node.next_sibling = 0;
-		else
-			node.next_sibling = (ptr - buff) + 2 + ((unsigned char*)ptr)[0];
+	memset(keys->slots, 0, keys->slot_count * sizeof(uint32_t));
+	table->keys = keys;
 
-		node.value = &ptr[1];
+	/* adding the children last to first chains those with the same key in order */
+	for (i = table->count; i-- > 0; ) {
+		struct tml_node child = table_child(list, table, i);
+		size_t length;
+		const char *key = node_key(&child, &length);
+		uint32_t *slot;
+
+		keys->hashes[i] = hash_key(key, length);
+		slot = find_key_slot(list, table, key, length, keys->hashes[i]);
+		keys->next_same[i] = *slot;
+		*slot = (uint32_t)(i + 1);
 	}
 
-	return node;
+	return true;
 }
 
-struct tml_node tml_next_sibling(const struct tml_node *node)
+/* Returns the list's table if it has a key table, making one if the list is long enough to be worth it. Binary
+ * arrays are left to be searched one child at a time, as they're seldom used as maps. These are the lists
+ * tml_index_children() makes key tables for, so nothing is added here once it has been called. */
+static struct child_table *key_lookup_table(const struct tml_node *list)
 {
-	if (node->next_sibling)
-		return read_node(node->buff, node->buff + node->next_sibling);
-	else
-		return TML_NODE_NULL;
-}
+	struct child_table *table = lookup_child_table(list);
 
-struct tml_node tml_first_child(const struct tml_node *node)
-{
-	if (node->first_child)
-		return read_node(node->buff, node->buff + node->first_child);
-	else
-		return TML_NODE_NULL;
+	if (table && table->keys)
+		return table;
+	if (list->first_child && tml_child_count(list) >= CHILD_TABLE_MIN_CHILDREN && tml_index_keys(list))
+		return lookup_child_table(list);
+	return NULL;
 }
 
-int tml_child_count(const struct tml_node *node)
+struct tml_node tml_find_key(const struct tml_node *list, const char *key)
 {
-	int count = 0;
-	struct tml_node cnode = tml_first_child(node);
-	while (!tml_is_null(&cnode)) {
-		count++;
-		cnode = tml_next_sibling(&cnode);
+	struct child_table *table = key_lookup_table(list);
+	size_t length = strlen(key), child_length;
+	struct tml_node child;
+
+	if (table) {
+		uint32_t child_number = *find_key_slot(list, table, key, length, hash_key(key, length));
+		return child_number ? table_child(list, table, child_number - 1) : TML_NODE_NULL;
 	}
-	return count;
+
+	for (child = tml_first_child(list); !tml_is_null(&child); child = tml_next_sibling(&child)) {
+		const char *child_key = node_key(&child, &child_length);
+		if (keys_equal(child_key, child_length, key, length))
+			return child;
+	}
+
+	return TML_NODE_NULL;
 }
 
-struct tml_node tml_child_at_index(const struct tml_node *node, int child_index)
+struct tml_node tml_find_next_key(const struct tml_node *list, const struct tml_node *child)
 {
-	int count = 0;
-	struct tml_node cnode = tml_first_child(node);
-	while (!tml_is_null(&cnode)) {
-		if (count == child_index)
-			return cnode;
-		count++;
-		cnode = tml_next_sibling(&cnode);
+	struct child_table *table = key_lookup_table(list);
+	size_t length, sib_length;
+	const char *key = node_key(child, &length);
+	struct tml_node sib;
+
+	if (table) {
+		/* find this child in the chain of those with its key (its value pointer is unique to it) */
+		uint32_t child_number = *find_key_slot(list, table, key, length, hash_key(key, length));
+
+		while (child_number) {
+			uint32_t next_number = table->keys->next_same[child_number - 1];
+
+			if (table_child(list, table, child_number - 1).value == child->value)
+				return next_number ? table_child(list, table, next_number - 1) : TML_NODE_NULL;
+			child_number = next_number;
+		}
+		return TML_NODE_NULL;
+	}
+
+	for (sib = tml_next_sibling(child); !tml_is_null(&sib); sib = tml_next_sibling(&sib)) {
+		const char *sib_key = node_key(&sib, &sib_length);
+		if (keys_equal(sib_key, sib_length, key, length))
+			return sib;
 	}
+
 	return TML_NODE_NULL;
 }
 
+/* A compiled path query is an array of steps, each referring to a run of the query's words. The words are
+ * copied into the query with their escape codes translated, and "?" words are stored as NULL. A query runs
+ * as a depth first search kept on a stack of frames, one for each step being searched (and one more for each
+ * level of nesting a "//" step has descended into), so nothing is allocated for the nodes it goes through. */
 
-/* --------------------------------- UTILITY FUNCTIONS (CONVERSION) -------------------------------- */
+struct query_step
+{
+	size_t first_word, word_count; /* the step's words in tml_query.words, not counting a final "*" */
+	bool any_rest; /* the step ends with "*" */
+	bool descendant; /* the step follows "//", so searches the whole subtree of the contents */
+};
 
-static char *write_node_to_string(const struct tml_node *node, char *dest_str, char *dest_end, bool write_brackets)
+struct tml_query
 {
-	if (dest_str >= dest_end-1)
-		return dest_str;
+	struct query_step *steps;
+	const char **words;
+	char *strings;
+	size_t step_count, word_count;
+};
 
-	if (!tml_has_children(node)) {
-		const char *value;
-		size_t nodelen;
+static __inline__ bool is_query_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
 
-		if (!tml_is_list(node)) {
-			value = node->value;
-			nodelen = strlen(value);
+/* Copies the word at *str into *strings (translating escape codes), leaving *str after it and *strings after
+ * its null terminator */
+static void read_query_word(const char **str, char **strings)
+{
+	const char *src = *str;
+	char *dest = *strings;
+
+	while (*src && *src != '/' && !is_query_space(*src)) {
+		if (*src == TML_ESCAPE_CHAR && src[1]) {
+			*dest++ = translate_escape_code(src[1]);
+			src += 2;
 		}
 		else {
-			if (write_brackets) {
-				value = "[]";
-				nodelen = 2;
-			}
-			else {
-				return dest_str;
-			}
+			*dest++ = *src++;
 		}
+	}
 
-		size_t dest_str_size = dest_end - dest_str - 1;
-		if (nodelen > dest_str_size)
-			nodelen = dest_str_size;
+	*dest++ = '\0';
+	*str = src;
+	*strings = dest;
+}
 
-		memcpy(dest_str, value, sizeof(char) * nodelen);
+struct tml_query *tml_compile_query(const char *path)
+{
+	struct tml_query *query = malloc(sizeof(struct tml_query));
+	size_t path_len = strlen(path), max_steps = 1;
+	bool descendant = false;
+	const char *src;
+	char *strings;
 
-		dest_str += nodelen;
-		return dest_str;
+	if (!query)
+		return NULL;
+
+	for (src = path; *src; ++src) {
+		if (*src == '/')
+			max_steps++;
+	}
+
+	/* every word but the last is followed by at least one space or slash, and none is longer than its text */
+	query->steps = malloc(max_steps * sizeof(struct query_step));
+	query->words = malloc((path_len / 2 + 1) * sizeof(const char *));
+	query->strings = malloc(path_len + 1);
+	query->step_count = query->word_count = 0;
+
+	if (!query->steps || !query->words || !query->strings) {
+		tml_free_query(query);
+		return NULL;
+	}
+
+	src = path;
+	strings = query->strings;
+	if (src[0] == '/') {
+		descendant = (src[1] == '/');
+		src += descendant ? 2 : 1;
 	}
-	else {
-		struct tml_node s_node = tml_first_child(node);
-			
-		if (write_brackets) {
-			if (dest_str >= dest_end-1)
-				return dest_str;
-			*dest_str++ = '[';
-		}
+
+	for (;;) {
+		struct query_step *step = &query->steps[query->step_count++];
+
+		step->first_word = query->word_count;
+		step->word_count = 0;
+		step->any_rest = false;
+		step->descendant = descendant;
 
 		for (;;) {
-			dest_str = write_node_to_string(&s_node, dest_str, dest_end, write_brackets);
+			char *word = strings;
 
-			s_node = tml_next_sibling(&s_node);
-			if (tml_is_null(&s_node))
+			while (is_query_space(*src))
+				src++;
+			if (*src == '\0' || *src == '/')
 				break;
 
-			if (dest_str >= dest_end-1)
-				return dest_str;
-			*dest_str++ = ' ';
+			/* nothing may follow "*" within a step */
+			if (step->any_rest) {
+				tml_free_query(query);
+				return NULL;
+			}
+
+			read_query_word(&src, &strings);
+			if ((word[0] == '*' || word[0] == TML_WILD_ANY) && word[1] == '\0') {
+				step->any_rest = true;
+				strings = word;
+			}
+			else {
+				bool any_one = (word[0] == '?' || word[0] == TML_WILD_ONE) && word[1] == '\0';
+				query->words[query->word_count++] = any_one ? NULL : word;
+				step->word_count++;
+			}
 		}
 
-		if (write_brackets) {
-			if (dest_str >= dest_end-1)
-				return dest_str;
-			*dest_str++ = ']';
+		if (step->word_count == 0 && !step->any_rest) {
+			tml_free_query(query);
+			return NULL;
 		}
 
-		return dest_str;
+		if (*src == '\0')
+			break;
+		descendant = (src[1] == '/');
+		src += descendant ? 2 : 1;
 	}
+
+	return query;
 }
 
-size_t tml_node_to_string(const struct tml_node *node, char *dest_str, size_t dest_str_size)
+void tml_free_query(struct tml_query *query)
 {
-	char *str = write_node_to_string(node, dest_str, dest_str + dest_str_size, false);
-	size_t result_size = str - dest_str;
-
-	if (result_size < dest_str_size) {
-		*str = '\0';
-		return result_size;
-	}
-	else {
-		return 0; /* error - this shouldn't happen */
+	if (query) {
+		free(query->steps);
+		free((void *)query->words);
+		free(query->strings);
+		free(query);
 	}
 }
 
-size_t tml_node_to_markup_string(const struct tml_node *node, char *dest_str, size_t dest_str_size)
+/* Returns true if the node is a word that's the same as the query word. The node's value is only read up to its
+ * size, since words left in a file mapping (TML_PARSE_MMAP) aren't null terminated. */
+static __inline__ bool query_word_matches(const struct tml_node *node, const char *word)
 {
-	char *str = write_node_to_string(node, dest_str, dest_str + dest_str_size, true);
-	size_t result_size = str - dest_str;
+	size_t i;
 
-	if (result_size < dest_str_size) {
-		*str = '\0';
-		return result_size;
-	}
-	else {
-		return 0; /* error - this shouldn't happen */
+	if (tml_is_list(node))
+		return false;
+	for (i = 0; i < node->size; ++i) {
+		if (word[i] == '\0' || word[i] != node->value[i])
+			return false;
 	}
+	return word[node->size] == '\0';
 }
 
-double tml_node_to_double(const struct tml_node *node)
+/* Matches the step's words against the nodes from *node on, leaving *node after the last one matched */
+static bool match_query_words(const struct tml_query *query, const struct query_step *step, struct tml_node *node)
 {
-	if (node->value && node->value[0] != 0) {
-		return atof(node->value);
-	}
-	else return 0;
-}
+	size_t i;
 
-float tml_node_to_float(const struct tml_node *node)
-{
-	return tml_node_to_double(node);
-}
+	for (i = 0; i < step->word_count; ++i) {
+		const char *word = query->words[step->first_word + i];
 
-int tml_node_to_int(const struct tml_node *node)
-{
-	if (node->value && node->value[0] != 0) {
-		return atoi(node->value);
+		if (tml_is_null(node))
+			return false;
+		if (word && !query_word_matches(node, word))
+			return false;
+		*node = tml_next_sibling(node);
 	}
-	else return 0;
+
+	return true;
 }
 
-int tml_node_to_float_array(const struct tml_node *node, float *array, int array_size)
+/* Moves the frame's cursor to the first content node in or after its current segment. Segments which are
+ * lists stand for their children, and any others for themselves. */
+static void enter_query_segment(struct tml_query_frame *frame)
 {
-	struct tml_node n = tml_first_child(node);
-	int count = 0;
+	while (!tml_is_null(&frame->segment)) {
+		if (!tml_is_list(&frame->segment)) {
+			frame->cursor = frame->segment;
+			frame->in_segment = false;
+			return;
+		}
 
-	while (!tml_is_null(&n)) {
-		if (count >= array_size) break;
-		array[count++] = tml_node_to_float(&n);
-		n = tml_next_sibling(&n);
+		frame->cursor = tml_first_child(&frame->segment);
+		if (!tml_is_null(&frame->cursor)) {
+			frame->in_segment = true;
+			return;
+		}
+		frame->segment = tml_next_sibling(&frame->segment);
 	}
 
-	return count;
+	frame->cursor = TML_NODE_NULL;
 }
 
-int tml_node_to_double_array(const struct tml_node *node, double *array, int array_size)
+static void next_query_node(struct tml_query_frame *frame)
 {
-	struct tml_node n = tml_first_child(node);
-	int count = 0;
-
-	while (!tml_is_null(&n)) {
-		if (count >= array_size) break;
-		array[count++] = tml_node_to_double(&n);
-		n = tml_next_sibling(&n);
+	if (tml_is_null(&frame->segment) || frame->in_segment) {
+		frame->cursor = tml_next_sibling(&frame->cursor);
+		if (!tml_is_null(&frame->cursor) || tml_is_null(&frame->segment))
+			return;
 	}
 
-	return count;
+	frame->segment = tml_next_sibling(&frame->segment);
+	enter_query_segment(frame);
 }
 
-int tml_node_to_int_array(const struct tml_node *node, int *array, int array_size)
+/* Returns true if the step finds the node, and if so sets up the frame to go through the node's contents */
+static bool match_query_step(const struct tml_query *query, const struct query_step *step,
+	const struct tml_node *node, struct tml_query_frame *contents)
 {
-	struct tml_node n = tml_first_child(node);
-	int count = 0;
+	struct tml_node child;
+
+	contents->cursor = contents->segment = TML_NODE_NULL;
+	contents->in_segment = false;
 
-	while (!tml_is_null(&n)) {
-		if (count >= array_size) break;
-		array[count++] = tml_node_to_int(&n);
-		n = tml_next_sibling(&n);
+	/* a lone "*" finds anything */
+	if (step->word_count == 0) {
+		contents->cursor = tml_first_child(node);
+		return true;
 	}
 
-	return count;
-}
+	if (!tml_is_list(node)) {
+		const char *word = query->words[step->first_word];
+		return step->word_count == 1 && (!word || query_word_matches(node, word));
+	}
 
+	child = tml_first_child(node);
 
-/* --------------- UTILITY FUNCTIONS (COMPARISON / PATTERN MATCHING AND SEARCH) -------------------- */
+	/* [name words | contents...] must match all of the name */
+	if (!tml_is_null(&child) && tml_is_list(&child)) {
+		struct tml_node name = tml_first_child(&child);
 
-static enum TML_WILDCARD check_wildcard(const char *value)
-{
-	/* special string with ASCII character #1 and #2 are \? and \* wildcards */
-	if (value[0] == '\0')
-		return TML_NO_WILDCARD;
-	if (value[1] == '\0' && (value[0] == 1 || value[0] == 2))
-		return (enum TML_WILDCARD)value[0];
-	else
-		return TML_NO_WILDCARD;
-}
+		if (!match_query_words(query, step, &name) || (!step->any_rest && !tml_is_null(&name)))
+			return false;
 
-bool tml_compare_nodes(const struct tml_node *candidate, const struct tml_node *pattern)
-{
-	if (!tml_is_list(pattern)) {
-		/* expecting a "word" leaf node */
-		if (tml_is_list(candidate)) return false;
-		else return (strcmp(candidate->value, pattern->value) == 0);
+		contents->segment = tml_next_sibling(&child);
+		enter_query_segment(contents);
+		return true;
 	}
-	else {
-		struct tml_node p_child, c_child;
-		enum TML_WILDCARD wild;
 
-		/* at this point, we're expecting a list of zero or more items */
-		if (!tml_is_list(candidate)) {
-			return false;
-		}
+	/* [name words contents...] */
+	if (!match_query_words(query, step, &child))
+		return false;
+	if (!step->any_rest)
+		contents->cursor = child;
+	return true;
+}
 
-		/* if the pattern is an empty list [], then expect the same of the candidate */
-		if (!tml_has_children(pattern)) {
-			return !tml_has_children(candidate);
-		}
+/* Sets up the frame to go through a node's contents for a "//" step to search, i.e. everything in it but its
+ * name: the parts after the divider of a divided list, or the children after any leading words of another
+ * list (all of its children for a lone "*", as in match_query_step()) */
+static void enter_query_subtree(const struct query_step *step, const struct tml_node *node,
+	struct tml_query_frame *frame)
+{
+	struct tml_node child = tml_first_child(node);
+	size_t i;
 
-		/* at this point, we're expecting a list of one or more items, so compare each element */
+	frame->segment = TML_NODE_NULL;
+	frame->in_segment = false;
 
-		/* if the pattern list starts with a \* wildcard, match anything, even an empty candidate list */
-		p_child = tml_first_child(pattern);
-		wild = check_wildcard(p_child.value);
-		if (wild == TML_WILD_ANY)
-			return true;
-		c_child = tml_first_child(candidate);
+	if (step->word_count > 0 && !tml_is_null(&child) && tml_is_list(&child)) {
+		frame->segment = tml_next_sibling(&child);
+		enter_query_segment(frame);
+		return;
+	}
 
-		while (!tml_is_null(&c_child) && !tml_is_null(&p_child)) {
-			/* the \? wildcard will match any single node, otherwise the node must be compared */
-			if (wild != TML_WILD_ONE) {
-				if (!tml_compare_nodes(&c_child, &p_child))
-					return false;
-			}
+	for (i = 0; i < step->word_count && !tml_is_null(&child) && !tml_is_list(&child); ++i)
+		child = tml_next_sibling(&child);
+	frame->cursor = child;
+}
 
-			/* a following \* wildcard matches the remainder of the list, regardless of what it is */
-			p_child = tml_next_sibling(&p_child);
-			wild = check_wildcard(p_child.value);
-			if (wild == TML_WILD_ANY)
-				return true;
+static bool push_query_frame(struct tml_query_iter *iter, const struct tml_query_frame *frame)
+{
+	struct tml_query_frame *stack = iter->stack ? iter->stack : iter->initial_stack;
 
-			c_child = tml_next_sibling(&c_child);
-		}
+	if (iter->depth == iter->stack_size) {
+		size_t new_size = iter->stack_size * 2;
 
-		/* if the candidate or pattern ran out of nodes before the other, they don't match */
-		if (!tml_is_null(&c_child) || !tml_is_null(&p_child)) {
-			return false;
+		if (iter->stack) {
+			stack = realloc(iter->stack, new_size * sizeof(struct tml_query_frame));
+		}
+		else {
+			stack = malloc(new_size * sizeof(struct tml_query_frame));
+			if (stack)
+				memcpy(stack, iter->initial_stack, sizeof(iter->initial_stack));
 		}
 
-		/* everything seems to match */
-		return true;
+		if (!stack)
+			return false;
+		iter->stack = stack;
+		iter->stack_size = new_size;
 	}
+
+	stack[iter->depth++] = *frame;
+	return true;
 }
 
-struct tml_node tml_find_first_child(const struct tml_node *node, const struct tml_node *pattern)
+void tml_query_begin(struct tml_query_iter *iter, const struct tml_query *query, const struct tml_node *node)
 {
-	struct tml_node child = tml_first_child(node);
-
-	while (!tml_is_null(&child)) {
-		if (tml_compare_nodes(&child, pattern))
-			return child;
-		child = tml_next_sibling(&child);
-	}
-
-	return TML_NODE_NULL;
+	struct tml_query_frame frame;
+
+	iter->query = query;
+	iter->stack = NULL;
+	iter->depth = 0;
+	iter->stack_size = TML_QUERY_STACK_SIZE;
+
+	frame.step = 0;
+	frame.cursor = tml_first_child(node);
+	frame.segment = TML_NODE_NULL;
+	frame.in_segment = false;
+	push_query_frame(iter, &frame);
 }
 
-struct tml_node tml_find_next_sibling(const struct tml_node *node, const struct tml_node *pattern)
+struct tml_node tml_query_next(struct tml_query_iter *iter)
 {
-	struct tml_node sib = tml_next_sibling(node);
+	const struct tml_query *query = iter->query;
 
-	while (!tml_is_null(&sib)) {
-		if (tml_compare_nodes(&sib, pattern))
-			return sib;
-		sib = tml_next_sibling(&sib);
+	while (iter->depth > 0) {
+		struct tml_query_frame *frame = &(iter->stack ? iter->stack : iter->initial_stack)[iter->depth - 1];
+		const struct query_step *step;
+		struct tml_query_frame next;
+		struct tml_node node;
+
+		if (tml_is_null(&frame->cursor)) {
+			iter->depth--;
+			continue;
+		}
+
+		node = frame->cursor;
+		step = &query->steps[frame->step];
+		next.step = frame->step;
+		next_query_node(frame);
+
+		/* search inside this node after searching whatever it's found to contain (pushed next, so first) */
+		if (step->descendant && tml_has_children(&node)) {
+			enter_query_subtree(step, &node, &next);
+			if (!tml_is_null(&next.cursor) && !push_query_frame(iter, &next))
+				break;
+		}
+
+		if (!match_query_step(query, step, &node, &next))
+			continue;
+		if (next.step + 1 == query->step_count)
+			return node;
+
+		next.step++;
+		if (!tml_is_null(&next.cursor) && !push_query_frame(iter, &next))
+			break;
 	}
 
+	/* no more nodes (or out of memory) */
+	iter->depth = 0;
 	return TML_NODE_NULL;
 }
 
+void tml_query_end(struct tml_query_iter *iter)
+{
+	free(iter->stack);
+	iter->stack = NULL;
+	iter->depth = 0;
+}
 
+struct tml_node tml_query_first(const struct tml_node *node, const struct tml_query *query)
+{
+	struct tml_query_iter iter;
+	struct tml_node result;
 
-
+	tml_query_begin(&iter, query, node);
+	result = tml_query_next(&iter);
+	tml_query_end(&iter);
+	return result;
+}
@@ -4,8 +4,15 @@
  *
  * This parser loads an entire TML file into memory very efficiently in both time and space.
  * 
- * Storage space overhead is very low, with only 1 extra byte per leaf node and exactly 10 bytes
- * for nonleaf (list) nodes. Malloc is called only once, and realloc is rarely used.
+ * Storage space overhead is very low. A leaf node of under 123 characters takes only 1 byte besides its
+ * null terminated text. Longer leaves, and nonleaf (list) nodes, which also record how many children they
+ * have, take 13 to 16 bytes besides theirs: a flag byte, padding to align their links, and 32 bit first child,
+ * next sibling and size fields (25 to 32 bytes with the 64 bit fields of TML_PARSE_WIDE_OFFSETS). Malloc is
+ * called only once, and realloc is rarely used.
+ *
+ * The tml_node values used to walk a document are 40 bytes on 64 bit systems, up from 24 before nodes had a
+ * size and their links became size_t (see tml_offset_t). This changes the ABI, so anything built against
+ * the older header has to be rebuilt.
  *
  * The parsing process consists of reading from the token stream and writing variable length
  * node data (along with leaf node contents strings) into one big array buffer. All node data is
@@ -17,6 +24,7 @@
 #define _TML_PARSER_H__
 
 #include <ctype.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -27,30 +35,65 @@
 #endif
 
 
-/* We use this typedef because 32 bit offset values are fine for any TML file under 4 GB.
- * If you need to load TML files over 4 GB into memory, then this can be changed larger. */
-typedef uint32_t tml_offset_t; 
-/* This should be kept consistent to be pow(2, sizeof(tml_offset_t))-1 */
+/* Offsets of nodes within a parsed document. Inside the document, links between nodes are stored as
+ * 32 bit offsets, which are fine for any document under 4 GB; larger documents are stored with 64 bit
+ * offsets instead (see TML_PARSE_WIDE_OFFSETS). These are always size_t so any document works with every
+ * build, which makes a tml_node 40 bytes on 64 bit systems rather than the 32 it would be with 32 bit fields;
+ * walking a document costs only a few percent more for it. */
+typedef size_t tml_offset_t;
+/* The largest a document stored with 32 bit offsets can be */
 #define TML_PARSER_MAX_DATA_SIZE 0xFFFFFFFF
 
+/* A node identified just by its offset within a known document (see tml_root_id()). These are 4 bytes (8 with
+ * TML_WIDE_NODE_IDS) against the 40 of a tml_node on 64 bit systems, for keeping large arrays of references to
+ * nodes. Being 32 bits, they only cover documents under 4 GB, and tml_root_id() returns TML_NODE_ID_NULL for
+ * anything larger; define TML_WIDE_NODE_IDS (for the parser and everything using it) for 64 bit ids. */
+#ifdef TML_WIDE_NODE_IDS
+typedef uint64_t tml_node_id;
+#else
+typedef uint32_t tml_node_id;
+#endif
+/* The id of no node, like TML_NODE_NULL */
+#define TML_NODE_ID_NULL 0
+
 
 struct tml_node
 {
 	/* If this is a leaf "word" node, this string contains the contents of that word.
 	 * If on the other hand this is a list node, this will be an empty string "".
-	 * (It is guaranteed to never be NULL, even for TML_NODE_NULL nodes) */
+	 * (It is guaranteed to never be NULL, even for TML_NODE_NULL nodes)
+	 * Words left in a TML_PARSE_MMAP file mapping aren't null terminated, so use size for the length. */
 	const char *value;
 
 	/* This will be 0 if there is no next sibling. If nonzero, do not try to use the value yourself.
 	 * Use the tml_next_sibling() function to return a new struct tml_node corresponding to the sibling.*/
 	tml_offset_t next_sibling;
 
-	/* This will be 0 if this has no child nodes. If nonzero, do not try to use the value yourself.
+	/* This will be 0 if this has no child nodes (or if it's a binary array, whose children aren't nodes of the
+	 * document: see tml_has_children()). If nonzero, do not try to use the value yourself.
 	 * Use the tml_first_child() function to return a new struct tml_node corresponding to the child.*/
 	tml_offset_t first_child;
 
 	/* This will be 0 if this is a "null" node. If nonzero, do NOT try to use or change the value yourself. */
 	char *buff;
+
+	/* For a leaf node, the length of value (which may contain null characters, if the text did).
+	 * For a list node, the number of children it contains. */
+	tml_offset_t size;
+};
+
+/* Memory allocation hooks. Everything a tml_doc is made of can be allocated through one of these instead
+ * of malloc (see the tml_parse_*_alloc() functions). The old size of a block is always given back when
+ * it's resized or released, so simple allocators don't need to keep track of it themselves. */
+struct tml_allocator
+{
+	/* This is passed to every function */
+	void *user_data;
+
+	/* Same as malloc(), realloc() and free() */
+	void *(*alloc)(void *user_data, size_t size);
+	void *(*resize)(void *user_data, void *ptr, size_t old_size, size_t new_size);
+	void (*release)(void *user_data, void *ptr, size_t size);
 };
 
 struct tml_doc
@@ -64,6 +107,31 @@ struct tml_doc
 	/* INTERNAL - Do not touch. This is the internal data buffer where all node data and strings are stored */
 	char *buff;
 	size_t buff_index, buff_allocated;
+
+	/* INTERNAL - Do not touch. True if node links are stored as 64 bit offsets (TML_PARSE_WIDE_OFFSETS) */
+	bool wide_offsets;
+
+	/* INTERNAL - Do not touch. Where the buffer and this tml_doc itself were allocated from */
+	struct tml_allocator allocator;
+
+	/* INTERNAL - Do not touch. The memory mapped file some leaf values point into (TML_PARSE_MMAP), or NULL */
+	void *mapping;
+	size_t mapping_size;
+
+	/* INTERNAL - Do not touch. Tables of child offsets for indexing into long lists, or NULL */
+	void *child_index;
+
+	/* INTERNAL - Do not touch. The words seen so far while parsing with TML_PARSE_INTERN, or NULL */
+	void *string_pool;
+
+	/* INTERNAL - Do not touch. True if parsed with TML_PARSE_NUMERIC_ARRAYS */
+	bool numeric_arrays;
+
+	/* INTERNAL - Do not touch. True if parsed with TML_PARSE_TYPED_LEAVES */
+	bool typed_leaves;
+
+	/* INTERNAL - Do not touch. The limits this is being parsed with (see struct tml_parse_options) */
+	size_t max_depth, max_nodes;
 };
 
 /* Iteration functions return this tml_node value when there's no such next node to return */
@@ -75,7 +143,8 @@ extern const struct tml_node TML_NODE_NULL;
 /* Create a new tml_doc object, parsing from TML text contained within the given C string. */
 struct tml_doc *tml_parse_string(const char *str);
 
-/* Create a new tml_doc object, parsing from TML text from the file specified (by filename). */
+/* Create a new tml_doc object, parsing from TML text from the file specified (by filename).
+ * The file is read and parsed a piece at a time, so its text is never all in memory at once. */
 struct tml_doc *tml_parse_file(const char *filename);
 
 /* Create a new tml_doc object, parsing from TML text contained within the given memory buffer.
@@ -90,6 +159,264 @@ struct tml_doc *tml_parse_memory(const char *buff, size_t buff_size);
  * delete the "buff" data right after calling this. */
 struct tml_doc *tml_parse_in_memory(char *buff, size_t buff_size);
 
+/* Options for the tml_parse_*_ex() functions below. Combine them with bitwise OR. */
+enum TML_PARSE_FLAGS
+{
+	TML_PARSE_DEFAULT = 0,
+
+	/* Tokenize using a structural index: the whole input is first scanned 64 bytes at a time for
+	 * brackets, dividers, words, escape codes and comments, and the tree is then built from that
+	 * index rather than character by character. The parsed result is identical to the default; this
+	 * is usually faster on large inputs but needs extra temporary memory for the index. */
+	TML_PARSE_STRUCTURAL_INDEX = 1,
+
+	/* For tml_parse_file_ex(): Memory map the file read only rather than reading it in, and parse it there.
+	 * Words of 14+ characters (30+ with TML_PARSE_WIDE_OFFSETS) without escape codes are left where they
+	 * are in the mapping instead of being copied. Nothing is ever written to the mapping, and the pages
+	 * parsed are given back as it goes (where the system allows), to be read back from the file only if
+	 * the words in them are used. So the memory used is little more than the document itself, which for a
+	 * file of long words is much smaller than the file. (With TML_PARSE_STRUCTURAL_INDEX, the whole file is
+	 * read in once to index it first.) The values of those words aren't null terminated, though: use
+	 * tml_node.size for their length rather than strlen() or strcmp(). The file stays mapped until
+	 * tml_free_doc(), and mustn't be changed until then. Ignored where memory mapping isn't supported
+	 * (non-POSIX). */
+	TML_PARSE_MMAP = 2,
+
+	/* Store the links between nodes as 64 bit offsets instead of 32 bit, so the parsed document isn't
+	 * limited to TML_PARSER_MAX_DATA_SIZE (4 GB). This costs 12 to 16 more bytes per list node (and per
+	 * leaf of 123+ characters); other leaves are unaffected. You don't normally need to give this: inputs
+	 * over TML_PARSER_MAX_DATA_SIZE / 2 bytes (around 2 GB) use it from the start, and smaller ones are
+	 * parsed with 32 bit offsets and parsed again with 64 bit ones only if the document outgrows them.
+	 * Push parsers can't parse their input again, so they use it only if given; tml_parse_in_memory() and
+	 * tml_parse_parallel() write over escape codes in the text, so they use it from the start for text
+	 * over TML_PARSER_MAX_DATA_SIZE / 17 bytes (around 250 MB) which contains any. */
+	TML_PARSE_WIDE_OFFSETS = 4,
+
+	/* Build the child offset and key tables that make tml_child_at_index() and tml_find_key() O(1) for
+	 * every long list right after parsing, rather than as each list is first used (see
+	 * tml_index_children()). The document has an "Out of memory" error if they can't all be built. */
+	TML_PARSE_CHILD_INDEX = 8,
+
+	/* Store each distinct word once. Repeated words (of 4+ characters, or 8+ with TML_PARSE_WIDE_OFFSETS)
+	 * after the first of each are stored as a 5 or 9 byte reference to it rather than another copy, which
+	 * saves a lot of memory for documents which repeat the same names over and over, such as ones converted
+	 * from XML. Equal words then share the same value pointer, which tml_compare_nodes() checks before
+	 * comparing strings. With TML_PARSE_MMAP, words left in the mapping aren't interned; with
+	 * tml_parse_parallel(), each piece is interned separately. */
+	TML_PARSE_INTERN = 16,
+
+	/* Call tml_doc_dedup() on the document once it's parsed */
+	TML_PARSE_DEDUP = 32,
+
+	/* Store lists of 4 or more numbers, such as "[data | 0 1 2 0 2 3 ...]", as binary arrays of the smallest
+	 * type that holds them all exactly (8 to 64 bit integers, floats or doubles) rather than as a leaf per
+	 * number, which tml_node_array() gives direct access to. Such a list still reads the same with
+	 * tml_first_child() and tml_next_sibling(): its children are formatted as text the first time they're
+	 * needed, and kept with the document like the tables of tml_index_children(). If there's no memory for
+	 * them then, tml_first_child() gives a null node, so the list reads as empty (though its size is still
+	 * the number of elements). tml_index_children() (or TML_PARSE_CHILD_INDEX) formats every array at once
+	 * instead, and reports running out of memory; call it before reading the document from several threads
+	 * at once, too. A list is only stored this way if every number in it is written as it would be formatted,
+	 * so that its words read back exactly as they were: integers without leading zeros or a "+", and decimals
+	 * without an exponent, trailing zeros or more digits than the value needs. Lists of numbers written any
+	 * other way are left as words. */
+	TML_PARSE_NUMERIC_ARRAYS = 64,
+
+	/* Find the type of every word (see tml_leaf_type()) while parsing, and store the binary value of each
+	 * number alongside its text, so that tml_node_to_int(), tml_node_to_int64(), tml_node_to_float() and
+	 * tml_node_to_double() just read it rather than converting the text each time. The results are exactly
+	 * the same either way. This suits documents whose numbers are read over and over, such as settings, at a
+	 * cost of 14 to 21 more bytes per number (or "true" or "false"). Words of 123+ characters aren't typed. */
+	TML_PARSE_TYPED_LEAVES = 128
+};
+
+/* These are the same as the functions above, with TML_PARSE_FLAGS options given by "flags". */
+struct tml_doc *tml_parse_string_ex(const char *str, unsigned int flags);
+struct tml_doc *tml_parse_file_ex(const char *filename, unsigned int flags);
+struct tml_doc *tml_parse_memory_ex(const char *buff, size_t buff_size, unsigned int flags);
+struct tml_doc *tml_parse_in_memory_ex(char *buff, size_t buff_size, unsigned int flags);
+
+/* These are the same as the functions above, allocating everything through the given allocator (or with
+ * malloc if it's NULL). The allocator struct is copied, so it doesn't need to outlive the call. */
+struct tml_doc *tml_parse_string_alloc(const char *str, unsigned int flags, const struct tml_allocator *allocator);
+struct tml_doc *tml_parse_file_alloc(const char *filename, unsigned int flags, const struct tml_allocator *allocator);
+struct tml_doc *tml_parse_memory_alloc(const char *buff, size_t buff_size, unsigned int flags,
+	const struct tml_allocator *allocator);
+struct tml_doc *tml_parse_in_memory_alloc(char *buff, size_t buff_size, unsigned int flags,
+	const struct tml_allocator *allocator);
+
+/* Everything a single parse can be given, for the tml_parse_*_opts() functions. Fill one in with
+ * tml_init_parse_options() and then change what you need, rather than setting every field yourself. */
+struct tml_parse_options
+{
+	/* TML_PARSE_FLAGS options (TML_PARSE_DEFAULT to begin with) */
+	unsigned int flags;
+
+	/* The allocator to allocate everything through, or NULL (to begin with) for malloc. It's copied, so it
+	 * doesn't need to outlive the call. */
+	const struct tml_allocator *allocator;
+
+	/* How deeply lists may be nested, and how many nodes there may be, as for tml_set_parse_limits() (whose
+	 * limits these are to begin with). 0 means no limit. */
+	size_t max_depth, max_nodes;
+};
+
+/* Sets the options to the defaults used by the functions above: no flags, malloc, and the limits last given
+ * to tml_set_parse_limits() */
+void tml_init_parse_options(struct tml_parse_options *options);
+
+/* These are the same as the functions above, with everything given by the options. Since the options only
+ * apply to this parse, these can be called from several threads at once with different limits. */
+struct tml_doc *tml_parse_string_opts(const char *str, const struct tml_parse_options *options);
+struct tml_doc *tml_parse_file_opts(const char *filename, const struct tml_parse_options *options);
+struct tml_doc *tml_parse_memory_opts(const char *buff, size_t buff_size, const struct tml_parse_options *options);
+struct tml_doc *tml_parse_in_memory_opts(char *buff, size_t buff_size, const struct tml_parse_options *options);
+
+/* A tml_arena is a simple allocator for parsing lots of documents without calling malloc each time. Memory
+ * is handed out one block after another from a big chunk, and is all given back at once by resetting the
+ * arena. The buffer of a tml_doc being parsed grows and shrinks in place, so it's never copied. After the
+ * first reset, the arena is one chunk big enough for everything since it was created, so parsing the same
+ * sort of documents again (resetting in between) doesn't touch the heap at all.
+ *
+ * Usage: parse with tml_parse_*_alloc() passing the allocator from tml_arena_allocator(), use the documents,
+ * then call tml_arena_reset(). Calling tml_free_doc() on these documents isn't necessary (but is harmless
+ * before the reset), and all of them are invalidated by the reset. An arena isn't thread safe. */
+struct tml_arena;
+
+/* Creates an arena, with a first chunk of initial_size bytes (or none yet if 0). Returns NULL if out of memory. */
+struct tml_arena *tml_arena_create(size_t initial_size);
+
+/* Returns an allocator which allocates from the arena */
+struct tml_allocator tml_arena_allocator(struct tml_arena *arena);
+
+/* Gives back everything allocated from the arena, invalidating all tml_doc's parsed with it */
+void tml_arena_reset(struct tml_arena *arena);
+
+/* Destroys the arena, invalidating all tml_doc's parsed with it */
+void tml_arena_destroy(struct tml_arena *arena);
+
+/* Parses the given memory buffer (which may be modified, like tml_parse_in_memory) using up to thread_count
+ * threads, or one per CPU if thread_count is 0. The contents of the root list are split into pieces between
+ * its children, which are parsed at the same time and then joined, so this helps most for large documents
+ * with many top-level children. The result is the same tree as tml_parse_in_memory_ex() would give. Inputs
+ * under 64 KB per thread, and documents whose root list contains a divider, are parsed on the calling
+ * thread as usual. Define TML_NO_THREADS when compiling tml_parser.c to never use threads. */
+struct tml_doc *tml_parse_parallel(char *buff, size_t buff_size, unsigned int flags, int thread_count);
+
+/* The same with everything given by the options. The allocator is only used for the resulting document, since
+ * the pieces are parsed with malloc on several threads at once. */
+struct tml_doc *tml_parse_parallel_opts(char *buff, size_t buff_size, const struct tml_parse_options *options,
+	int thread_count);
+
+/* The most threads tml_parse_parallel() will use */
+#define TML_PARALLEL_MAX_THREADS 64
+
+/* Limits how deeply lists may be nested (counting the root list as 1, and a list with dividers as
+ * containing one more level for its segments) and how many nodes a document may have, for parsing
+ * untrusted input. Documents that go over either limit fail to parse with an error message. 0 means no
+ * limit, which is the default for both. The parser never recurses, so deep nesting can't overflow the
+ * stack either way.
+ *
+ * These are the defaults for every parse function without options of its own, and for the options made by
+ * tml_init_parse_options(). They're shared by the whole program, so set them before any parsing and then
+ * leave them be; to use different limits for different documents, or from several threads, give each
+ * parse its own with struct tml_parse_options instead. */
+void tml_set_parse_limits(size_t max_depth, size_t max_nodes);
+
+/* Gets the limits set by tml_set_parse_limits() */
+void tml_get_parse_limits(size_t *max_depth, size_t *max_nodes);
+
+/* Incremental parsing: Create a tml_push_parser, then feed it the TML text in as many pieces as you like
+ * with tml_push_parse() as it arrives (e.g. from a socket or pipe), and finally call tml_push_parser_finish()
+ * to get the resulting tml_doc. Pieces can be of any size and split the text anywhere, even in the middle of
+ * a word or escape code; the result is exactly the same as parsing all the text at once. */
+struct tml_push_parser;
+
+/* Creates a new incremental parser. Returns NULL if out of memory. */
+struct tml_push_parser *tml_push_parser_create(void);
+
+/* The same with the given options, which apply to the tml_doc that tml_push_parser_finish() returns. Since the
+ * size of the text isn't known in advance, TML_PARSE_WIDE_OFFSETS is only used if it's given. */
+struct tml_push_parser *tml_push_parser_create_opts(const struct tml_parse_options *options);
+
+/* Parses the next piece of TML text. The chunk may be modified by the parsing process (like 
+ * tml_parse_in_memory), but isn't needed anymore once this returns, so you can reuse it for the next piece.
+ * Returns false if parsing has already failed, in which case there's no point feeding it any more. */
+bool tml_push_parse(struct tml_push_parser *parser, char *chunk, size_t chunk_size);
+
+/* Finishes parsing and destroys the parser, returning the parsed tml_doc (check its error_message). This must
+ * always be called, even if you decide to stop early; in that case just tml_free_doc() the result. */
+struct tml_doc *tml_push_parser_finish(struct tml_push_parser *parser);
+
+/* Event (SAX style) parsing: Instead of building a tml_doc, these report the structure of the TML text
+ * to your callbacks as it's parsed, so nothing is stored. Any callback may be NULL if you don't need it.
+ * Return false from a callback to stop parsing early.
+ *
+ * Lists produce on_list_begin(), then their contents, then on_list_end(). Divider bars are reported
+ * with on_divider_nesting(), where segment_index counts the dividers in the current list so far (1 for
+ * the first): everything in the list since its beginning (or the previous divider) is the contents of
+ * nested list number segment_index-1, and the next nested list starts after it. So "[a b | c]" is
+ * reported as: begin, a, b, divider(1), c, end - which describes the same tree as "[[a b] [c]]".
+ *
+ * Word values are NOT null terminated; use value_size for their length. The value pointer is only
+ * valid until the callback returns. */
+struct tml_event_handler
+{
+	/* This is passed to every callback */
+	void *user_data;
+
+	bool (*on_list_begin)(void *user_data);
+	bool (*on_word)(void *user_data, const char *value, size_t value_size);
+	bool (*on_divider_nesting)(void *user_data, int segment_index);
+	bool (*on_list_end)(void *user_data);
+};
+
+/* These parse TML text from a C string, file, or memory buffer (which may be modified, like with
+ * tml_parse_in_memory), reporting it to the given handler. They return NULL on success, or an error
+ * description string if a parse error occurred or a callback stopped the parsing. */
+const char *tml_parse_string_events(const char *str, const struct tml_event_handler *handler);
+const char *tml_parse_file_events(const char *filename, const struct tml_event_handler *handler);
+const char *tml_parse_in_memory_events(char *buff, size_t buff_size, const struct tml_event_handler *handler);
+
+/* The same with the limits given by the options (nothing else in them applies, since no tml_doc is made) */
+const char *tml_parse_string_events_opts(const char *str, const struct tml_event_handler *handler,
+	const struct tml_parse_options *options);
+const char *tml_parse_file_events_opts(const char *filename, const struct tml_event_handler *handler,
+	const struct tml_parse_options *options);
+const char *tml_parse_in_memory_events_opts(char *buff, size_t buff_size, const struct tml_event_handler *handler,
+	const struct tml_parse_options *options);
+
+/* Lists of 32 or more children get a table of child offsets the first time they're indexed into, after
+ * which tml_child_at_index() takes O(1) time for them. The tables are
+ * stored with the tml_doc, taking 4 bytes per child (8 for documents with TML_PARSE_WIDE_OFFSETS).
+ * This makes the tables for every such list in the document right away instead, along with their key tables
+ * (see tml_index_keys(), another 12-16 bytes per child) and the children of every binary array (see
+ * TML_PARSE_NUMERIC_ARRAYS). Since tables are otherwise added as they're needed, call this (or parse with
+ * TML_PARSE_CHILD_INDEX) before reading a document from several threads at once.
+ * Returns false if out of memory, in which case lists without a table still work as usual, just without the
+ * speedup, but binary arrays whose children couldn't be made read as empty until they can be. */
+bool tml_index_children(struct tml_doc *data);
+
+/* Compacts the document so that equal subtrees share storage: every list whose children are the same as
+ * another's (e.g. each of a thousand [type float3] lists) points to a single copy of them, and each distinct
+ * word is stored once, as with TML_PARSE_INTERN. The tree reads exactly as before with tml_first_child() and
+ * tml_next_sibling(), but all tml_node values from before are invalidated, and the nodes of shared subtrees
+ * are the same nodes wherever they appear (so e.g. their value pointers are too). This takes time in
+ * proportion to the size of the document, and temporary memory for the distinct lists found. Returns false
+ * if out of memory, leaving the document as it was. Documents with a parse error are left as they are. */
+bool tml_doc_dedup(struct tml_doc *data);
+
+/* Rewrites the document into a layout that's quicker to read: the children of every list are stored one after
+ * another, with the words right there among them, and lists come breadth first (so all of a list's children
+ * come before any of their own children), rather than with each nested list's contents in between its siblings
+ * as parsed. This is worth doing for a document that's kept and searched a lot, as iterating over a list or
+ * finding a key then touches fewer cache lines.
+ * Words shared by TML_PARSE_INTERN and subtrees shared by tml_doc_dedup() are copied wherever they appear, so
+ * this undoes that sharing (words left in a TML_PARSE_MMAP file mapping stay there, though). All tml_node values
+ * from before are invalidated. Returns false if out of memory, leaving the document as it was. Documents with a
+ * parse error are left as they are. */
+bool tml_doc_repack(struct tml_doc *data);
+
 /* Call this to destroy a tml_doc object (do NOT just use free() on a tml_doc* object) 
  * Warning: Once you call this, all tml_node values derived from this data object will be invalidated. */
 void tml_free_doc(struct tml_doc *data);
@@ -107,6 +434,23 @@ struct tml_node tml_next_sibling(const struct tml_node *node); /* O(1) time */
  * null output condition with tml_is_node_null() */
 struct tml_node tml_first_child(const struct tml_node *node); /* O(1) time */
 
+/* The same iteration with node ids, which only need the document and a single offset rather than a whole tml_node.
+ * The first_child and next_sibling of a tml_node are the ids of those nodes, and tml_node_at() goes the other way.
+ * Each returns TML_NODE_ID_NULL when there's no such node, and all of them are O(1) time. The elements of binary
+ * arrays (see TML_PARSE_NUMERIC_ARRAYS) aren't nodes of the document, so they have no ids: the first_child of
+ * such a list is 0 and tml_first_child_id() returns TML_NODE_ID_NULL for it, and its elements are read with
+ * tml_node_array() instead. The tml_node values tml_first_child() makes for those elements link to each other
+ * within a buffer of their own, so their next_sibling must never be used as an id. */
+tml_node_id tml_root_id(const struct tml_doc *data);
+tml_node_id tml_first_child_id(const struct tml_doc *data, tml_node_id id);
+tml_node_id tml_next_sibling_id(const struct tml_doc *data, tml_node_id id);
+
+/* Returns true if the node with this id is a list (see tml_is_list()) */
+bool tml_is_list_id(const struct tml_doc *data, tml_node_id id);
+
+/* Returns the tml_node with this id, or TML_NODE_NULL for TML_NODE_ID_NULL */
+struct tml_node tml_node_at(const struct tml_doc *data, tml_node_id id);
+
 /* Returns true if this is the null node (TML_NODE_NULL). A null node is a special
  * node that doesn't actually exist anywhere within your TML file. It's used to 
  * indicate the end of an iteration. Specifically, when tml_next_sibling() or 
@@ -117,6 +461,10 @@ static TML_INLINE bool tml_is_null(const struct tml_node *node)
 	return node->buff == 0;
 }
 
+/* Returns true if this list was stored as a binary array (see TML_PARSE_NUMERIC_ARRAYS). This is
+ * tml_node_array() without reading the array. */
+bool tml_is_array(const struct tml_node *node);
+
 /* Returns true if this node contains one or more children.
  * Equivalent to !tml_is_null(tml_first_child(node)), but slightly faster.
  * NOTE: An empty list "[]" is an exceptional case you should watch out for,
@@ -125,7 +473,9 @@ static TML_INLINE bool tml_is_null(const struct tml_node *node)
  * is a list, use tml_is_list() instead. */
 static TML_INLINE bool tml_has_children(const struct tml_node *node)
 {
-	return node->first_child != 0;
+	/* binary arrays have children but no first_child, and their value alone doesn't tell them apart from
+	 * leaves whose text starts with an escaped null character */
+	return node->first_child != 0 || (node->size != 0 && node->value[0] == '\0' && tml_is_array(node));
 }
 
 /* Returns true if this node is a list of zero or more subnodes.
@@ -137,12 +487,13 @@ static TML_INLINE bool tml_is_list(const struct tml_node *node)
 	return node->value[0] == '\0';
 }
 
-/* Returns the number of children this node contains
- * WARNING: This runs in O(n) time where n is the number of child nodes. */
+/* Returns the number of children this node contains (the same as node->size for a list, or 0 for a leaf).
+ * This runs in O(1) time, since every list node records its number of children. */
 int tml_child_count(const struct tml_node *node);
 
 /* Returns the nth child of this node indexed by child_index (base 0).
- * WARNING: This runs in O(child_index) linear time.*/
+ * This runs in O(child_index) linear time, except for lists with tables of child offsets
+ * (see tml_index_children()), which are made for long lists the first time they're needed. */
 struct tml_node tml_child_at_index(const struct tml_node *node, int child_index);
 
 
@@ -158,14 +509,56 @@ size_t tml_node_to_string(const struct tml_node *node, char *dest_str, size_t de
  * Returns the length of the resulting string. */
 size_t tml_node_to_markup_string(const struct tml_node *node, char *dest_str, size_t dest_str_size);
 
-/* Converts the value of this node into a float value. */
+/* Converts the value of this node into a float value (or 0 if it doesn't start with a number, see tml_parse_float()). */
 float tml_node_to_float(const struct tml_node *node);
 
-/* Converts the value of this node into an double value */
+/* Converts the value of this node into an double value (or 0 if it doesn't start with a number) */
 double tml_node_to_double(const struct tml_node *node);
 
-/* Converts the value of this node into an integer value */
+/* Converts the value of this node into an integer value (or 0 if it doesn't start with one, and the nearest
+ * int if it's out of range) */
 int tml_node_to_int(const struct tml_node *node);
+int64_t tml_node_to_int64(const struct tml_node *node);
+
+/* Returns true if the value of this node is "true" (and false for anything else, including "false") */
+bool tml_node_to_bool(const struct tml_node *node);
+
+/* The types of value a leaf can have (see tml_leaf_type()) */
+enum TML_LEAF_TYPE
+{
+	TML_LEAF_NONE = 0, /* a list, or TML_NODE_NULL */
+	TML_LEAF_STRING,
+	TML_LEAF_INT, /* a whole number in the range of int64_t, e.g. "-12" or "+7" */
+	TML_LEAF_DOUBLE, /* any other number in the range of a double, e.g. "0.5", "1e9", "inf" or "nan" */
+	TML_LEAF_BOOL /* "true" or "false" */
+};
+
+/* Returns the type of this node's value, with numbers as tml_parse_int64() and tml_parse_double() accept them
+ * (whole words only). For a document parsed with TML_PARSE_TYPED_LEAVES this was found while parsing and is
+ * just read; otherwise the value is examined now. */
+enum TML_LEAF_TYPE tml_leaf_type(const struct tml_node *node);
+
+/* Results of the number parsing functions below */
+enum TML_NUMBER_STATUS
+{
+	TML_NUMBER_OK = 0,
+	TML_NUMBER_INVALID, /* the string doesn't start with a number; the result is 0 */
+	TML_NUMBER_OUT_OF_RANGE /* the result is the nearest value that fits (or 0 or infinity for floating point) */
+};
+
+/* These read the number at the start of a string of str_len characters (which needn't be null terminated),
+ * and give the number of characters it took up in *consumed (if not NULL). To check a whole word is a number,
+ * e.g. a node's value, compare that with its length (node->size). They don't depend on the C locale.
+ * Floating point numbers are a decimal with an optional exponent (such as "-12", "0.5", ".5e-3" or "6.02E23"),
+ * or "inf", "infinity" or "nan" (in any case). Integers are just digits. Either can start with "-" or "+",
+ * except that unsigned integers can't be negative. Most floating point numbers (those with up to 15 significant
+ * digits and a small exponent, or 7 and 10 for floats) are converted with a single exact multiply or divide,
+ * and the rest by strtod(); either way the result is the nearest floating point value. */
+enum TML_NUMBER_STATUS tml_parse_float(const char *str, size_t str_len, float *result, size_t *consumed);
+enum TML_NUMBER_STATUS tml_parse_double(const char *str, size_t str_len, double *result, size_t *consumed);
+enum TML_NUMBER_STATUS tml_parse_int32(const char *str, size_t str_len, int32_t *result, size_t *consumed);
+enum TML_NUMBER_STATUS tml_parse_int64(const char *str, size_t str_len, int64_t *result, size_t *consumed);
+enum TML_NUMBER_STATUS tml_parse_uint64(const char *str, size_t str_len, uint64_t *result, size_t *consumed);
 
 /* Reads a list of float values (e.g. "[0.2 1.5 0.8]") into the given float array,
  * up to a maximum of array_size items. Returns the number of values read. */
@@ -179,6 +572,39 @@ int tml_node_to_double_array(const struct tml_node *node, double *array, int arr
  * up to a maximum of array_size items. Returns the number of values read. */
 int tml_node_to_int_array(const struct tml_node *node, int *array, int array_size);
 
+/* These are the same as the functions above, but also check every value read is entirely a number in range (see
+ * tml_parse_double()). If first_error isn't NULL, it's set to the index of the first child that isn't, or -1 if
+ * they all are. (Children that aren't numbers are still read, as 0 or whatever number they start with.) */
+int tml_node_read_float_array(const struct tml_node *node, float *array, int array_size, int *first_error);
+int tml_node_read_double_array(const struct tml_node *node, double *array, int array_size, int *first_error);
+int tml_node_read_int_array(const struct tml_node *node, int *array, int array_size, int *first_error);
+
+/* Element types of binary arrays */
+enum TML_ARRAY_TYPE
+{
+	TML_ARRAY_NONE = 0,
+	TML_ARRAY_INT8,
+	TML_ARRAY_INT16,
+	TML_ARRAY_INT32,
+	TML_ARRAY_INT64,
+	TML_ARRAY_FLOAT,
+	TML_ARRAY_DOUBLE
+};
+
+struct tml_array
+{
+	enum TML_ARRAY_TYPE type;
+	const void *data; /* count elements of the type (int8_t, int16_t, int32_t, int64_t, float or double), aligned */
+	size_t count;
+};
+
+/* If this list was stored as a binary array (see TML_PARSE_NUMERIC_ARRAYS), points the array at its elements
+ * where they are in the document and returns true. Otherwise sets the array to TML_ARRAY_NONE with no elements
+ * and returns false. The elements stay valid as long as the document's tml_node values do. The bulk conversions
+ * above read binary arrays directly too, converting each element as the functions here would its word (except
+ * that doubles read as floats are rounded from the double). */
+bool tml_node_array(const struct tml_node *node, struct tml_array *array);
+
 
 /* --------------- UTILITY FUNCTIONS (COMPARISON / PATTERN MATCHING AND SEARCH) -------------------- */
 
@@ -244,6 +670,148 @@ struct tml_node tml_find_first_child(const struct tml_node *node, const struct t
  * See tml_compare_nodes() for more info on how pattern matching works. */
 struct tml_node tml_find_next_sibling(const struct tml_node *node, const struct tml_node *pattern);
 
+/* Compiled patterns: Matching against a pattern node re-reads the pattern and checks every item of it for
+ * wildcards each time. For a pattern used over and over, compile it once into a tml_pattern instead, and use
+ * the functions below, which work exactly like tml_compare_nodes(), tml_find_first_child() and
+ * tml_find_next_sibling(). A compiled pattern doesn't refer to the node it was compiled from, so that can be
+ * freed right away. A tml_pattern is never changed by matching, so it can be shared between threads. */
+struct tml_pattern;
+
+/* Compiles the given pattern node. Returns NULL if out of memory. */
+struct tml_pattern *tml_compile_pattern(const struct tml_node *pattern);
+
+/* Compiles a pattern from TML text, e.g. "[position | \? \? \?]". Returns NULL if it fails to parse. */
+struct tml_pattern *tml_compile_pattern_string(const char *pattern_str);
+
+/* Frees a compiled pattern */
+void tml_free_pattern(struct tml_pattern *pattern);
+
+bool tml_match_pattern(const struct tml_node *candidate, const struct tml_pattern *pattern);
+struct tml_node tml_find_first_match(const struct tml_node *node, const struct tml_pattern *pattern);
+struct tml_node tml_find_next_match(const struct tml_node *node, const struct tml_pattern *pattern);
+
+/* Pattern sets: To find which of several patterns a node matches (e.g. when loading each child of a list
+ * according to what it is), add the compiled patterns to a tml_pattern_set, and match against them all at
+ * once with tml_match_pattern_set(). Rather than trying each pattern in turn, only the patterns which begin
+ * with the same word as the node (or which don't begin with a word, e.g. "[\? ...]") are tried, so the time
+ * taken hardly depends on how many patterns there are. */
+struct tml_pattern_set;
+
+/* Creates an empty pattern set. Returns NULL if out of memory. */
+struct tml_pattern_set *tml_create_pattern_set(void);
+
+/* Frees a pattern set (but not the patterns in it) */
+void tml_free_pattern_set(struct tml_pattern_set *set);
+
+/* Adds a pattern to the set, returning its id: 0 for the first pattern added, 1 for the next, and so on (or
+ * -1 if out of memory). The pattern must not be freed until the set is. Don't add patterns to a set while
+ * it's being matched against on another thread. */
+int tml_add_to_pattern_set(struct tml_pattern_set *set, const struct tml_pattern *pattern);
+
+/* Returns the id of the first pattern added to the set which the node matches, or -1 if it matches none */
+int tml_match_pattern_set(const struct tml_node *candidate, const struct tml_pattern_set *set);
+
+/* Key lookup: Many lists are used as maps, with children like [key | value] or [key value1 value2]. The key
+ * of a child is the first word in it (or the child itself if it's a word), so tml_find_key(list, "key") finds
+ * the first child in the list whose key is "key" - just like tml_find_first_child() with the pattern
+ * [key \*] or [[key] \*], but without any pattern. Then use tml_find_next_key() for any more with that key.
+ *
+ * These search the list one child at a time unless it has a hash table of its keys, made by tml_index_keys().
+ * That makes them O(1) instead. Lists of 32 or more children (other than binary arrays) get one automatically
+ * on the first search, or all at once from tml_index_children(), so call that or tml_index_keys() beforehand if
+ * the list is searched from several threads at once. The table takes 12-16 bytes per child, and is freed along
+ * with the tml_doc. */
+
+/* Makes a hash table of the keys of this list's children. Returns false if out of memory. */
+bool tml_index_keys(const struct tml_node *list);
+
+/* Returns the first child in the list with the given key, or a null node if there's none */
+struct tml_node tml_find_key(const struct tml_node *list, const char *key);
+
+/* Returns the next child in the list after the given one with the same key, or a null node if there's none */
+struct tml_node tml_find_next_key(const struct tml_node *list, const struct tml_node *child);
+
+/* Path queries: A path query finds nodes by name several levels down at once, instead of calling
+ * tml_find_first_child() at each level. For example, run on the root of
+ *
+ *   [[opengl model | [buffer vertex | [data position | 1 2 3] [data normal | 0 0 1]]]]
+ *
+ * (or on any other list containing the [opengl model | ...] list), the query
+ * "opengl model/buffer vertex/data position/\*" finds the nodes 1, 2 and 3.
+ *
+ * A query is a list of steps separated by "/". Each step is one or more words, and finds the nodes among the
+ * contents of those found by the step before it (or among the children of the node the query is run on, for
+ * the first step) which are named by those words:
+ *
+ * - A list written with a divider, like [data position | ...], is named by everything before the first
+ *   divider, and the step's words must match all of that. Its contents are the children of the parts after
+ *   the divider, e.g. 1 2 3 above. (Since [a b | c d] is the same as [[a b] [c d]], any list starting
+ *   with a nested list is treated this way.)
+ * - Any other list, like [position 1 2 3], is named by as many of its first children as the step has words,
+ *   and its contents are the rest of its children, e.g. 1 2 3.
+ * - A word is named by itself, so a one word step finds it. It has no contents.
+ *
+ * Within a step, "?" (or "\?") matches any one node, and a "*" (or "\*") at the end matches any number of
+ * nodes, as in patterns (see tml_compare_nodes()). A step of just "*" finds every node, and its contents
+ * are all its children. Other escape codes work as in TML, e.g. "\s" for a space within a word, or "\/".
+ *
+ * A step after "//" instead of "/" (or at the start of a query beginning with "//") searches the whole
+ * subtree of the contents rather than just the contents, so "//data position" finds every [data position
+ * | ...] node at any depth. Names aren't searched, so it doesn't also find the [data position] list naming
+ * each of those (except through a lone "*" step, whose contents include it). A node which is reached in
+ * more than one way (e.g. by "//a//b", through nested [a ...] lists) is found more than once.
+ *
+ * Queries are compiled once, and can then be used from several threads at once. Running one doesn't
+ * allocate any memory, unless a "//" step searches more than TML_QUERY_STACK_SIZE levels deep. */
+struct tml_query;
+
+/* Compiles a path query. Returns NULL if it's malformed (e.g. has an empty step), or if out of memory. */
+struct tml_query *tml_compile_query(const char *path);
+
+/* Frees a compiled query */
+void tml_free_query(struct tml_query *query);
+
+#define TML_QUERY_STACK_SIZE 16
+
+/* INTERNAL: one level of a running query */
+struct tml_query_frame
+{
+	size_t step;
+	struct tml_node cursor, segment;
+	bool in_segment;
+};
+
+/* The state of a running query. This is usually a local variable, e.g.:
+ *
+ *   struct tml_query_iter iter;
+ *   struct tml_node node;
+ *
+ *   tml_query_begin(&iter, query, &doc->root_node);
+ *   while (node = tml_query_next(&iter), !tml_is_null(&node))
+ *     ...
+ *   tml_query_end(&iter); */
+struct tml_query_iter
+{
+	/* INTERNAL (do not use these values yourself) */
+	const struct tml_query *query;
+	struct tml_query_frame *stack; /* NULL while initial_stack is used */
+	size_t depth, stack_size;
+	struct tml_query_frame initial_stack[TML_QUERY_STACK_SIZE];
+};
+
+/* Starts running a query over the children of the given node */
+void tml_query_begin(struct tml_query_iter *iter, const struct tml_query *query, const struct tml_node *node);
+
+/* Returns the next node found by the query, in document order, or a null node when there are no more (or
+ * if out of memory). */
+struct tml_node tml_query_next(struct tml_query_iter *iter);
+
+/* Frees anything allocated by a running query. The iterator may then be used for another. */
+void tml_query_end(struct tml_query_iter *iter);
+
+/* Returns the first node found by the query, or a null node if there's none */
+struct tml_node tml_query_first(const struct tml_node *node, const struct tml_query *query);
+
 
 
 #endif
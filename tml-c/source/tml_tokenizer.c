@@ -6,6 +6,7 @@
 #include "tml_tokenizer.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
@@ -14,7 +15,48 @@
 #else
 #define INLINE __inline__
 #endif
- 
+
+/* SIMD scanning kernels are compiled in whenever the compiler can target them. Which one actually
+ * runs is decided at runtime (see select_scan_kernel()). Define TML_NO_SIMD to build scalar only. */
+#ifndef TML_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TML_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(TML_SIMD_SSE2) && defined(__GNUC__) && !defined(__INTEL_COMPILER) && \
+	(__GNUC__ >= 5 || defined(__clang__))
+#define TML_SIMD_AVX2
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define TML_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static INLINE int count_trailing_zeros(unsigned long mask)
+{
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+}
+static INLINE int count_trailing_zeros64(uint64_t mask)
+{
+	unsigned long index;
+	if ((uint32_t)mask) {
+		_BitScanForward(&index, (unsigned long)mask);
+		return (int)index;
+	}
+	_BitScanForward(&index, (unsigned long)(mask >> 32));
+	return (int)index + 32;
+}
+#else
+#define count_trailing_zeros(mask) __builtin_ctz(mask)
+#define count_trailing_zeros64(mask) __builtin_ctzll(mask)
+#endif
+
 
 void stream_memzero(struct tml_stream *stream)
 {
@@ -37,10 +79,21 @@ struct tml_stream tml_stream_open(char *data, size_t data_size)
 	return stream;
 }
 
+struct tml_stream tml_stream_open_chunk(char *data, size_t data_size, int in_comment)
+{
+	struct tml_stream stream = tml_stream_open(data, data_size);
+	stream.more_data = 1;
+	stream.in_comment = in_comment;
+	return stream;
+}
+
 void tml_stream_close(struct tml_stream *stream)
 {
-	if (stream)
+	if (stream) {
+		if (stream->tape)
+			free(stream->tape);
 		stream_memzero(stream);
+	}
 }
 
 static INLINE int peek_char(struct tml_stream *stream)
@@ -69,6 +122,670 @@ char translate_escape_code(char code)
 	}
 }
 
+size_t tml_collapse_escapes(char *dest, const char *src, size_t size)
+{
+	const char *src_end = src + size;
+	char *start = dest;
+
+	while (src < src_end) {
+		if (*src != TML_ESCAPE_CHAR) {
+			*dest++ = *src++;
+		}
+		else if (src + 1 < src_end) {
+			*dest++ = translate_escape_code(src[1]);
+			src += 2;
+		}
+		else {
+			src++; /* a trailing backslash escapes nothing */
+		}
+	}
+
+	return dest - start;
+}
+
+/* --------------- STRUCTURAL CHARACTER SCANNING -------------------- */
+
+/* The tokenizer spends nearly all of its time in two loops: skipping the whitespace between tokens,
+ * and skimming to the end of a word. Both are done by a scanning kernel which returns a pointer to
+ * the first byte in [p, end) that stops the scan (or end if there is none):
+ *
+ * scan_word_end() stops on any of ' ', '\t', '\\', '|', '[' and ']'.
+ * skip_space() stops on anything other than ' ', '\t', '\r' and '\n'.
+ *
+ * classify_block() is used to build the structural index (see tml_stream_open_indexed()), and sorts
+ * each of 64 bytes into one of the character classes of struct block_masks, as one bit per byte.
+ *
+ * Every kernel must give exactly the same answer as the scalar versions, so the tokens produced
+ * never depend on which CPU the parser happens to run on. */
+
+typedef const char *(*scan_func)(const char *p, const char *end);
+
+struct block_masks
+{
+	uint64_t space, newline, open, close, divider, escape;
+};
+
+typedef void (*classify_func)(const char *p, struct block_masks *masks);
+
+struct scan_kernel
+{
+	enum TML_SCAN_KERNEL id;
+	scan_func scan_word_end;
+	scan_func skip_space;
+	classify_func classify_block;
+};
+
+#define IS_WORD_CHAR(ch) (ch != ' ' && ch != '\t' && ch != TML_ESCAPE_CHAR &&\
+		ch != TML_DIVIDER_CHAR && ch != TML_OPEN_CHAR && ch != TML_CLOSE_CHAR)
+#define IS_SPACE_CHAR(ch) (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n')
+
+static const char *scan_word_end_scalar(const char *p, const char *end)
+{
+	/* Note that some (ugly) manual loop unrolling is performed here.
+	 * This does improve performance by a noticeable amount. */
+	#define COND_NEXT_CHAR if (IS_WORD_CHAR(p[0])) { ++p; } else { return p; }
+	while (end - p >= 8) {
+		COND_NEXT_CHAR  COND_NEXT_CHAR  COND_NEXT_CHAR  COND_NEXT_CHAR
+		COND_NEXT_CHAR  COND_NEXT_CHAR  COND_NEXT_CHAR  COND_NEXT_CHAR
+	}
+	#undef COND_NEXT_CHAR
+	while (p < end && IS_WORD_CHAR(p[0]))
+		++p;
+	return p;
+}
+
+static const char *skip_space_scalar(const char *p, const char *end)
+{
+	while (p < end && IS_SPACE_CHAR(p[0]))
+		++p;
+	return p;
+}
+
+static void classify_block_scalar(const char *p, struct block_masks *masks)
+{
+	int i;
+	memset(masks, 0, sizeof(*masks));
+
+	for (i = 0; i < 64; ++i) {
+		uint64_t bit = (uint64_t)1 << i;
+		switch (p[i]) {
+			case ' ': case '\t': masks->space |= bit; break;
+			case '\r': case '\n': masks->newline |= bit; break;
+			case TML_OPEN_CHAR: masks->open |= bit; break;
+			case TML_CLOSE_CHAR: masks->close |= bit; break;
+			case TML_DIVIDER_CHAR: masks->divider |= bit; break;
+			case TML_ESCAPE_CHAR: masks->escape |= bit; break;
+		}
+	}
+}
+
+#ifdef TML_SIMD_SSE2
+static INLINE __m128i sse2_word_delimiters(__m128i v)
+{
+	__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(TML_ESCAPE_CHAR)));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(TML_DIVIDER_CHAR)));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(TML_OPEN_CHAR)));
+	return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(TML_CLOSE_CHAR)));
+}
+
+static INLINE __m128i sse2_space(__m128i v)
+{
+	__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+	return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+}
+
+static const char *scan_word_end_sse2(const char *p, const char *end)
+{
+	while (end - p >= 16) {
+		int mask = _mm_movemask_epi8(sse2_word_delimiters(_mm_loadu_si128((const __m128i*)p)));
+		if (mask)
+			return p + count_trailing_zeros(mask);
+		p += 16;
+	}
+	return scan_word_end_scalar(p, end);
+}
+
+static const char *skip_space_sse2(const char *p, const char *end)
+{
+	while (end - p >= 16) {
+		int mask = ~_mm_movemask_epi8(sse2_space(_mm_loadu_si128((const __m128i*)p))) & 0xFFFF;
+		if (mask)
+			return p + count_trailing_zeros(mask);
+		p += 16;
+	}
+	return skip_space_scalar(p, end);
+}
+
+#define SSE2_MATCH(v, a, b) (uint64_t)(unsigned int)_mm_movemask_epi8(\
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(a)), _mm_cmpeq_epi8(v, _mm_set1_epi8(b))))
+
+static void classify_block_sse2(const char *p, struct block_masks *masks)
+{
+	int i;
+	memset(masks, 0, sizeof(*masks));
+
+	for (i = 0; i < 64; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+		masks->space |= SSE2_MATCH(v, ' ', '\t') << i;
+		masks->newline |= SSE2_MATCH(v, '\r', '\n') << i;
+		masks->open |= SSE2_MATCH(v, TML_OPEN_CHAR, TML_OPEN_CHAR) << i;
+		masks->close |= SSE2_MATCH(v, TML_CLOSE_CHAR, TML_CLOSE_CHAR) << i;
+		masks->divider |= SSE2_MATCH(v, TML_DIVIDER_CHAR, TML_DIVIDER_CHAR) << i;
+		masks->escape |= SSE2_MATCH(v, TML_ESCAPE_CHAR, TML_ESCAPE_CHAR) << i;
+	}
+}
+#endif
+
+#ifdef TML_SIMD_AVX2
+/* These are compiled for AVX2 regardless of the flags the rest of the file is built with, and only
+ * ever called after the CPU has been checked for AVX2 support. */
+#define AVX2_FUNC __attribute__((target("avx2")))
+
+AVX2_FUNC static INLINE __m256i avx2_word_delimiters(__m256i v)
+{
+	__m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(TML_ESCAPE_CHAR)));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(TML_DIVIDER_CHAR)));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(TML_OPEN_CHAR)));
+	return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(TML_CLOSE_CHAR)));
+}
+
+AVX2_FUNC static INLINE __m256i avx2_space(__m256i v)
+{
+	__m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+	return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+}
+
+AVX2_FUNC static const char *scan_word_end_avx2(const char *p, const char *end)
+{
+	/* 64 bytes per iteration while the word is long, then 32 bytes */
+	while (end - p >= 64) {
+		__m256i lo = avx2_word_delimiters(_mm256_loadu_si256((const __m256i*)p));
+		__m256i hi = avx2_word_delimiters(_mm256_loadu_si256((const __m256i*)(p + 32)));
+		if (!_mm256_testz_si256(_mm256_or_si256(lo, hi), _mm256_or_si256(lo, hi))) {
+			unsigned int mask = (unsigned int)_mm256_movemask_epi8(lo);
+			if (mask)
+				return p + count_trailing_zeros(mask);
+			return p + 32 + count_trailing_zeros((unsigned int)_mm256_movemask_epi8(hi));
+		}
+		p += 64;
+	}
+	while (end - p >= 32) {
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(avx2_word_delimiters(_mm256_loadu_si256((const __m256i*)p)));
+		if (mask)
+			return p + count_trailing_zeros(mask);
+		p += 32;
+	}
+	return scan_word_end_sse2(p, end);
+}
+
+AVX2_FUNC static const char *skip_space_avx2(const char *p, const char *end)
+{
+	while (end - p >= 32) {
+		unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(avx2_space(_mm256_loadu_si256((const __m256i*)p)));
+		if (mask)
+			return p + count_trailing_zeros(mask);
+		p += 32;
+	}
+	return skip_space_sse2(p, end);
+}
+
+#define AVX2_MATCH(v, a, b) (uint64_t)(unsigned int)_mm256_movemask_epi8(\
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(a)), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(b))))
+
+AVX2_FUNC static void classify_block_avx2(const char *p, struct block_masks *masks)
+{
+	__m256i lo = _mm256_loadu_si256((const __m256i*)p);
+	__m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+
+	masks->space = AVX2_MATCH(lo, ' ', '\t') | (AVX2_MATCH(hi, ' ', '\t') << 32);
+	masks->newline = AVX2_MATCH(lo, '\r', '\n') | (AVX2_MATCH(hi, '\r', '\n') << 32);
+	masks->open = AVX2_MATCH(lo, TML_OPEN_CHAR, TML_OPEN_CHAR) | (AVX2_MATCH(hi, TML_OPEN_CHAR, TML_OPEN_CHAR) << 32);
+	masks->close = AVX2_MATCH(lo, TML_CLOSE_CHAR, TML_CLOSE_CHAR) | (AVX2_MATCH(hi, TML_CLOSE_CHAR, TML_CLOSE_CHAR) << 32);
+	masks->divider = AVX2_MATCH(lo, TML_DIVIDER_CHAR, TML_DIVIDER_CHAR) | (AVX2_MATCH(hi, TML_DIVIDER_CHAR, TML_DIVIDER_CHAR) << 32);
+	masks->escape = AVX2_MATCH(lo, TML_ESCAPE_CHAR, TML_ESCAPE_CHAR) | (AVX2_MATCH(hi, TML_ESCAPE_CHAR, TML_ESCAPE_CHAR) << 32);
+}
+#endif
+
+#ifdef TML_SIMD_NEON
+/* NEON has no movemask, so each 16 byte compare result is narrowed to a 64 bit mask holding
+ * 4 bits per input byte. */
+static INLINE uint64_t neon_mask(uint8x16_t m)
+{
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+static INLINE uint8x16_t neon_word_delimiters(uint8x16_t v)
+{
+	uint8x16_t m = vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\t')));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(TML_ESCAPE_CHAR)));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(TML_DIVIDER_CHAR)));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(TML_OPEN_CHAR)));
+	return vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(TML_CLOSE_CHAR)));
+}
+
+static INLINE uint8x16_t neon_space(uint8x16_t v)
+{
+	uint8x16_t m = vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\t')));
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\r')));
+	return vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\n')));
+}
+
+static const char *scan_word_end_neon(const char *p, const char *end)
+{
+	while (end - p >= 16) {
+		uint64_t mask = neon_mask(neon_word_delimiters(vld1q_u8((const uint8_t*)p)));
+		if (mask)
+			return p + (__builtin_ctzll(mask) >> 2);
+		p += 16;
+	}
+	return scan_word_end_scalar(p, end);
+}
+
+static const char *skip_space_neon(const char *p, const char *end)
+{
+	while (end - p >= 16) {
+		uint64_t mask = ~neon_mask(neon_space(vld1q_u8((const uint8_t*)p)));
+		if (mask)
+			return p + (__builtin_ctzll(mask) >> 2);
+		p += 16;
+	}
+	return skip_space_scalar(p, end);
+}
+
+/* A true 16 bit movemask (1 bit per byte), needed for classify_block() */
+static INLINE uint64_t neon_movemask(uint8x16_t m)
+{
+	static const uint8_t bit_weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t t = vandq_u8(m, vld1q_u8(bit_weights));
+	return (uint64_t)vaddv_u8(vget_low_u8(t)) | ((uint64_t)vaddv_u8(vget_high_u8(t)) << 8);
+}
+
+#define NEON_MATCH(v, a, b) neon_movemask(vorrq_u8(vceqq_u8(v, vdupq_n_u8(a)), vceqq_u8(v, vdupq_n_u8(b))))
+
+static void classify_block_neon(const char *p, struct block_masks *masks)
+{
+	int i;
+	memset(masks, 0, sizeof(*masks));
+
+	for (i = 0; i < 64; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t*)(p + i));
+		masks->space |= NEON_MATCH(v, ' ', '\t') << i;
+		masks->newline |= NEON_MATCH(v, '\r', '\n') << i;
+		masks->open |= NEON_MATCH(v, TML_OPEN_CHAR, TML_OPEN_CHAR) << i;
+		masks->close |= NEON_MATCH(v, TML_CLOSE_CHAR, TML_CLOSE_CHAR) << i;
+		masks->divider |= NEON_MATCH(v, TML_DIVIDER_CHAR, TML_DIVIDER_CHAR) << i;
+		masks->escape |= NEON_MATCH(v, TML_ESCAPE_CHAR, TML_ESCAPE_CHAR) << i;
+	}
+}
+#endif
+
+static const struct scan_kernel scan_kernels[] =
+{
+	{ TML_SCAN_SCALAR, scan_word_end_scalar, skip_space_scalar, classify_block_scalar },
+#ifdef TML_SIMD_SSE2
+	{ TML_SCAN_SSE2, scan_word_end_sse2, skip_space_sse2, classify_block_sse2 },
+#endif
+#ifdef TML_SIMD_AVX2
+	{ TML_SCAN_AVX2, scan_word_end_avx2, skip_space_avx2, classify_block_avx2 },
+#endif
+#ifdef TML_SIMD_NEON
+	{ TML_SCAN_NEON, scan_word_end_neon, skip_space_neon, classify_block_neon },
+#endif
+};
+
+#define SCAN_KERNEL_COUNT (sizeof(scan_kernels) / sizeof(scan_kernels[0]))
+
+/* NULL until a kernel is first needed. Selecting a kernel is idempotent, so it doesn't
+ * matter if several threads race to do it. */
+static const struct scan_kernel *active_kernel = NULL;
+
+static const struct scan_kernel *find_scan_kernel(enum TML_SCAN_KERNEL id)
+{
+	size_t i;
+	for (i = 0; i < SCAN_KERNEL_COUNT; ++i) {
+		if (scan_kernels[i].id == id)
+			return &scan_kernels[i];
+	}
+	return NULL;
+}
+
+static const struct scan_kernel *select_scan_kernel(void)
+{
+	const struct scan_kernel *kernel = NULL;
+
+#ifdef TML_SIMD_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		kernel = find_scan_kernel(TML_SCAN_AVX2);
+#endif
+#ifdef TML_SIMD_NEON
+	if (!kernel)
+		kernel = find_scan_kernel(TML_SCAN_NEON);
+#endif
+#ifdef TML_SIMD_SSE2
+	if (!kernel)
+		kernel = find_scan_kernel(TML_SCAN_SSE2);
+#endif
+	if (!kernel)
+		kernel = &scan_kernels[0];
+
+	return kernel;
+}
+
+static INLINE const struct scan_kernel *get_scan_kernel(void)
+{
+	if (!active_kernel)
+		active_kernel = select_scan_kernel();
+	return active_kernel;
+}
+
+enum TML_SCAN_KERNEL tml_set_scan_kernel(enum TML_SCAN_KERNEL kernel)
+{
+	const struct scan_kernel *k = NULL;
+
+	if (kernel != TML_SCAN_AUTO) {
+		k = find_scan_kernel(kernel);
+#ifdef TML_SIMD_AVX2
+		if (k && kernel == TML_SCAN_AVX2 && !__builtin_cpu_supports("avx2"))
+			k = NULL;
+#endif
+	}
+
+	if (k)
+		active_kernel = k;
+	else
+		active_kernel = select_scan_kernel();
+
+	return active_kernel->id;
+}
+
+enum TML_SCAN_KERNEL tml_get_scan_kernel(void)
+{
+	return get_scan_kernel()->id;
+}
+
+
+/* --------------- STRUCTURAL INDEX -------------------- */
+
+/* The structural index ("tape") is an array of byte offsets into the stream data, in order:
+ *
+ * - The offset of every '[', ']' and '|' token.
+ * - For each word: the offset of its first byte, then the offset of every escape code backslash
+ *   within it, then the offset just past its last byte (which may be the same offset as a
+ *   following '[', ']' or '|' entry, or data_size at the very end).
+ *
+ * The kind of each entry can be told from the character at its offset, so nothing but offsets
+ * needs to be stored. Comments never appear on the tape.
+ *
+ * The tape is built 64 bytes at a time: classify_block() produces a bitmask for each class of
+ * character, and everything else is worked out with bitwise arithmetic on those masks, carrying
+ * a few bits of state from one block to the next. */
+
+#define ODD_BITS (((uint64_t)0xAAAAAAAA << 32) | 0xAAAAAAAA)
+#define LOWEST_BIT(x) ((x) & (~(x) + 1))
+
+struct index_state
+{
+	uint64_t next_is_escaped; /* the previous block ended with an escape code backslash */
+	bool in_comment; /* the previous block ended inside a "||" comment */
+	uint64_t prev_in_word; /* the last byte of the previous block was part of a word */
+	uint64_t prev_leading_newline; /* ... or was a line break which may still precede a word */
+};
+
+/* Returns a mask of the escape code backslashes, and sets *escaped to the characters they escape
+ * (the odd backslashes of every run of backslashes escape the character after them). */
+static INLINE uint64_t find_escapes(struct index_state *state, uint64_t backslash, uint64_t *escaped)
+{
+	uint64_t potential_escape, maybe_escaped, codes, escape;
+
+	if (!backslash) {
+		*escaped = state->next_is_escaped;
+		state->next_is_escaped = 0;
+		return 0;
+	}
+
+	potential_escape = backslash & ~state->next_is_escaped;
+	maybe_escaped = potential_escape << 1;
+	codes = ((maybe_escaped | ODD_BITS) - potential_escape) ^ ODD_BITS;
+	escape = codes & backslash;
+	*escaped = codes ^ (backslash | state->next_is_escaped);
+
+	state->next_is_escaped = escape >> 63;
+	return escape;
+}
+
+/* Returns a mask of every byte within a "||" comment, from the first '|' up to and including the
+ * line break that ends it. Comments are rare, so this just walks from one to the next. */
+static uint64_t find_comments(struct index_state *state, uint64_t starts, uint64_t newline)
+{
+	uint64_t comments = 0, end;
+
+	if (state->in_comment) {
+		if (!newline)
+			return ~(uint64_t)0;
+		end = LOWEST_BIT(newline);
+		comments = end | (end - 1);
+		starts &= ~comments;
+		state->in_comment = false;
+	}
+
+	while (starts) {
+		uint64_t start = LOWEST_BIT(starts);
+		uint64_t rest = newline & ~(start - 1);
+
+		if (!rest) {
+			comments |= ~(start - 1);
+			state->in_comment = true;
+			break;
+		}
+
+		end = LOWEST_BIT(rest);
+		comments |= (end | (end - 1)) & ~(start - 1);
+		starts &= ~(end | (end - 1));
+	}
+
+	return comments;
+}
+
+/* Appends the tape entries for one block of up to 64 bytes at data[base], returning the new tape size.
+ * The tape must have room for 3 entries per byte. */
+static size_t index_block(struct index_state *state, const struct scan_kernel *kernel,
+	const char *data, size_t data_size, size_t base, uint32_t *tape, size_t tape_size)
+{
+	struct block_masks m;
+	uint64_t escape, escaped, valid, next_divider;
+	uint64_t space, open, close, divider, comments, structural;
+	uint64_t in_run, newline, seeds, leading_newline, in_word, prev_word, word_start, word_end, all;
+	size_t block_size = data_size - base;
+
+	if (block_size >= 64) {
+		block_size = 64;
+		valid = ~(uint64_t)0;
+		kernel->classify_block(data + base, &m);
+	}
+	else {
+		/* pad the last partial block with spaces, which end words and are otherwise ignored */
+		char block[64];
+		memset(block, ' ', sizeof(block));
+		memcpy(block, data + base, block_size);
+		valid = ((uint64_t)1 << block_size) - 1;
+		kernel->classify_block(block, &m);
+	}
+
+	/* anything escaped is a plain word character */
+	escape = find_escapes(state, m.escape, &escaped);
+	space = m.space & ~escaped;
+	open = m.open & ~escaped;
+	close = m.close & ~escaped;
+	divider = m.divider & ~escaped;
+
+	/* "||" starts a comment, even when the second '|' is the first byte of the next block */
+	next_divider = (base + 64 < data_size && data[base + 64] == TML_DIVIDER_CHAR && !state->next_is_escaped);
+	comments = divider & ((divider >> 1) | (next_divider << 63));
+	if (comments || state->in_comment)
+		comments = find_comments(state, comments, m.newline);
+
+	/* Runs of word characters. Line breaks (unescaped) don't end a word, but they can't begin one either,
+	 * so any that lead a run are whitespace. They're found by adding a carry at the start of each leading
+	 * run of line breaks, which ripples through the run and clears it. */
+	in_run = ~(space | open | close | divider | comments) & valid;
+	newline = in_run & m.newline & ~escaped;
+	seeds = (in_run & ~((in_run << 1) | state->prev_in_word | state->prev_leading_newline)) | state->prev_leading_newline;
+	seeds &= newline;
+	leading_newline = ((newline + seeds) ^ newline) & newline;
+	in_word = in_run & ~leading_newline;
+
+	prev_word = (in_word << 1) | state->prev_in_word;
+	word_start = in_word & ~prev_word;
+	word_end = ~in_word & prev_word;
+	escape &= in_word;
+	structural = (open | close | divider) & ~comments & valid;
+
+	state->prev_in_word = in_word >> 63;
+	state->prev_leading_newline = leading_newline >> 63;
+
+	/* write out the tape entries in order (a word end can share an offset with the token after it, and a
+	 * word start with an escape code) */
+	all = structural | word_start | word_end | escape;
+	while (all) {
+		int i = count_trailing_zeros64(all);
+		uint32_t offset = (uint32_t)(base + i);
+		all &= all - 1;
+
+		tape[tape_size] = offset;
+		tape_size += (size_t)((word_end >> i) & 1);
+		tape[tape_size] = offset;
+		tape_size += (size_t)(((structural | word_start) >> i) & 1);
+		tape[tape_size] = offset;
+		tape_size += (size_t)((escape >> i) & 1);
+	}
+
+	return tape_size;
+}
+
+struct tml_stream tml_stream_open_indexed(char *data, size_t data_size)
+{
+	struct tml_stream stream = tml_stream_open(data, data_size);
+	const struct scan_kernel *kernel = get_scan_kernel();
+	struct index_state state;
+	size_t base, allocated;
+
+	if (stream.data == NULL || data_size >= 0xFFFFFFFF)
+		return stream;
+
+	memset(&state, 0, sizeof(state));
+
+	allocated = data_size / 2 + 256;
+	stream.tape = malloc(allocated * sizeof(uint32_t));
+	if (!stream.tape)
+		return stream;
+
+	for (base = 0; base < data_size; base += 64) {
+		/* room for the worst case of 3 entries per byte, plus the final word end */
+		if (stream.tape_size + 3*64 + 1 > allocated) {
+			uint32_t *tape;
+			allocated *= 2;
+			tape = realloc(stream.tape, allocated * sizeof(uint32_t));
+			if (!tape) {
+				free(stream.tape);
+				stream.tape = NULL;
+				stream.tape_size = 0;
+				return stream;
+			}
+			stream.tape = tape;
+		}
+
+		stream.tape_size = index_block(&state, kernel, data, data_size, base, stream.tape, stream.tape_size);
+	}
+
+	/* a word running right up to the end of a 64 byte block ends at the end of the data */
+	if (state.prev_in_word)
+		stream.tape[stream.tape_size++] = (uint32_t)data_size;
+
+	return stream;
+}
+
+/* Reads a word off the tape given the offset of its first byte, collapsing escape codes in-place
+ * a span at a time (or just skipping over them, for a read only stream). */
+static void pop_tape_word(struct tml_stream *stream, size_t start, struct tml_token *token)
+{
+	char *data = stream->data;
+	char *dest = &data[start];
+	size_t from = start;
+
+	for (;;) {
+		size_t offset = stream->tape[stream->tape_index++];
+		bool is_escape = (offset < stream->data_size && data[offset] == TML_ESCAPE_CHAR);
+
+		if (stream->read_only) {
+			if (!is_escape) {
+				stream->index = offset;
+				dest = &data[offset];
+				break;
+			}
+			token->escaped = 1;
+			continue;
+		}
+
+		if (dest != &data[from])
+			memmove(dest, &data[from], offset - from);
+		dest += offset - from;
+
+		if (!is_escape) {
+			stream->index = offset;
+			break;
+		}
+
+		if (offset + 1 < stream->data_size) {
+			*dest++ = translate_escape_code(data[offset + 1]);
+			from = offset + 2;
+		}
+		else {
+			from = offset + 1; /* a trailing backslash escapes nothing */
+		}
+	}
+
+	token->type = TML_TOKEN_ITEM;
+	token->value = &data[start];
+	token->value_size = dest - &data[start];
+}
+
+static struct tml_token pop_tape_token(struct tml_stream *stream)
+{
+	struct tml_token token;
+	size_t offset;
+
+	token.value = NULL;
+	token.value_size = 0;
+	token.escaped = 0;
+
+	if (stream->tape_index >= stream->tape_size) {
+		stream->index = stream->data_size;
+		token.type = TML_TOKEN_EOF;
+		token.offset = stream->data_size;
+		return token;
+	}
+
+	offset = stream->tape[stream->tape_index++];
+	token.offset = offset;
+	stream->index = offset + 1;
+
+	switch (stream->data[offset]) {
+		case TML_OPEN_CHAR: token.type = TML_TOKEN_OPEN; break;
+		case TML_CLOSE_CHAR: token.type = TML_TOKEN_CLOSE; break;
+		case TML_DIVIDER_CHAR: token.type = TML_TOKEN_DIVIDER; break;
+		default:
+			pop_tape_word(stream, offset, &token);
+			break;
+	}
+
+	return token;
+}
+
+
 struct tml_token parse_token(struct tml_stream *stream);
 void skip_to_next_line(struct tml_stream *stream);
 void parse_word_item(struct tml_stream *stream, struct tml_token *token);
@@ -76,14 +793,23 @@ void parse_word_item(struct tml_stream *stream, struct tml_token *token);
 struct tml_token tml_stream_pop(struct tml_stream *stream)
 {
 	struct tml_token token;
+
+	if (stream->tape)
+		return pop_tape_token(stream);
+
 	token.value = NULL;
 	token.value_size = 0;
+	token.escaped = 0;
+
+	if (stream->in_comment)
+		skip_to_next_line(stream);
 
 	for (;;) {
 		int ch = peek_char(stream);
 
-		if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n') {
-			next_char(stream);
+		if (IS_SPACE_CHAR(ch)) {
+			const char *data_end = &stream->data[stream->data_size];
+			stream->index = get_scan_kernel()->skip_space(&stream->data[stream->index], data_end) - stream->data;
 			continue;
 		}
 
@@ -102,9 +828,16 @@ struct tml_token tml_stream_pop(struct tml_stream *stream)
 		else if (ch == TML_DIVIDER_CHAR) {
 			next_char(stream);
 			if (peek_char(stream) == TML_DIVIDER_CHAR) {
+				stream->in_comment = 1;
 				skip_to_next_line(stream);
 				continue;
 			}
+			else if (peek_char(stream) == -1 && stream->more_data) {
+				/* might be the start of a comment, so leave it for the next chunk */
+				stream->index = token.offset;
+				token.type = TML_TOKEN_EOF;
+				return token;
+			}
 			else {
 				token.type = TML_TOKEN_DIVIDER;
 				return token;
@@ -125,79 +858,108 @@ void skip_to_next_line(struct tml_stream *stream)
 {
 	for (;;) {
 		int ch = peek_char(stream);
+		if (ch == -1)
+			return;
+
 		next_char(stream);
 
-		if (ch == '\n' || ch == '\r' || ch == -1)
+		if (ch == '\n' || ch == '\r') {
+			stream->in_comment = 0;
 			return;
+		}
 	}
 }
 
-/* This function is a bit messy unfortunately since it does efficient in-place parsing of "words"
- * with escape codes. When escape codes are encountered, it collapses them to the actual character 
- * value in-place in memory. The token data generated from this operation points to the word within
- * the stream data memory. */
-void parse_escaped_word_item(struct tml_stream *stream, struct tml_token *token)
+/* Finishes reading a word with escape codes, given where the fast scan of it stopped at the first one.
+ * Everything before that is already in place, so from there escape codes are collapsed in-place to the
+ * character they represent, and each plain span between them is moved left in bulk as it's found with
+ * the scan kernel. The token data generated points to the word within the stream data memory. */
+static void parse_escaped_word_item(struct tml_stream *stream, struct tml_token *token, char *escape)
 {
-	char *word_start = &stream->data[stream->index];
-	char *p = word_start;
-	bool shift_necessary = false;
+	char *word_start = &stream->data[stream->index], *data_end = &stream->data[stream->data_size];
+	char *dest = escape, *p = escape;
 
-	/* scan the word, collapsing escape codes in-place if necessary */
-	int ch = peek_char(stream);
-	while (ch != ' ' && ch != '\t' && ch != -1 && 
-		ch != TML_DIVIDER_CHAR && ch != TML_OPEN_CHAR && ch != TML_CLOSE_CHAR)
-	{
-		if (ch == TML_ESCAPE_CHAR) {
-			/* substitute 2-character escape code with the character it represents */
-			next_char(stream);
-			ch = peek_char(stream);
-			if (ch == -1) break;
-			*p = translate_escape_code(ch);
-			shift_necessary = true;
-		}
-		else if (shift_necessary) {
-			/* shift character to the left collapsed position */
-			*p = (ch = peek_char(stream));
-		}
+	while (p < data_end && *p == TML_ESCAPE_CHAR) {
+		char *span_end;
 
-		/* go on to the next potential character */
-		p++;
-		next_char(stream);
-		ch = peek_char(stream);
+		/* substitute 2-character escape code with the character it represents */
+		if (p + 1 == data_end) {
+			p++; /* a trailing backslash escapes nothing */
+			break;
+		}
+		*dest++ = translate_escape_code(p[1]);
+
+		/* shift the following plain characters to the left collapsed position */
+		p += 2;
+		span_end = (char *)get_scan_kernel()->scan_word_end(p, data_end);
+		memmove(dest, p, span_end - p);
+		dest += span_end - p;
+		p = span_end;
 	}
 
 	/* return a reference to the data slice */
+	token->type = TML_TOKEN_ITEM;
+	token->value = word_start;
+	token->value_size = (dest - word_start);
+
+	stream->index = p - stream->data;
+}
+
+/* The same for a read only stream, which gives the word as written, escape codes and all */
+static void skip_escaped_word_item(struct tml_stream *stream, struct tml_token *token, const char *escape)
+{
+	const char *word_start = &stream->data[stream->index], *data_end = &stream->data[stream->data_size];
+	const char *p = escape;
+
+	while (p < data_end && *p == TML_ESCAPE_CHAR) {
+		if (p + 1 == data_end) {
+			p++; /* a trailing backslash escapes nothing */
+			break;
+		}
+		p = get_scan_kernel()->scan_word_end(p + 2, data_end);
+	}
+
 	token->type = TML_TOKEN_ITEM;
 	token->value = word_start;
 	token->value_size = (p - word_start);
+	token->escaped = 1;
+
+	stream->index = p - stream->data;
+}
+
+/* Returns true if the word being scanned, which has been skimmed up to p, definitely ends before data_end.
+ * This must be known before escape codes are collapsed, because an unfinished word is left untouched. */
+static bool word_ends_in_chunk(const char *p, const char *data_end)
+{
+	while (p < data_end) {
+		if (*p != TML_ESCAPE_CHAR)
+			return true;
+		if (p + 2 > data_end)
+			return false;
+		p = get_scan_kernel()->scan_word_end(p + 2, data_end);
+	}
+	return false;
 }
 
-/* This function reads in a word by quickly skimming to the end. This only works if it doesn't use escape
- * codes - if it bumps into one, it reverts to parse_escaped_word_item() to do the job. */
+/* This function reads in a word by quickly skimming to the end. If it bumps into an escape code, it
+ * hands over to parse_escaped_word_item() to carry on from there. */
 void parse_word_item(struct tml_stream *stream, struct tml_token *token)
 {
 	char *word_start = &stream->data[stream->index], *data_end = &stream->data[stream->data_size];
-	char *p = word_start;
+	const char *p = get_scan_kernel()->scan_word_end(word_start, data_end);
 
-	/* Scan up to the end of the word.
-	 * Note that some (ugly) manual loop unrolling is performed here.
-	 * This does improve performance by a noticeable amount. */
-	#define CONDITION (ch != ' ' && ch != '\t' && ch != TML_ESCAPE_CHAR &&\
-			ch != TML_DIVIDER_CHAR && ch != TML_OPEN_CHAR && ch != TML_CLOSE_CHAR)
-	#define NEXT_CHAR ++p; ch = *p;
-	#define COND_NEXT_CHAR if (CONDITION) { NEXT_CHAR } else { break; }
-	char ch = *p;
-	while ((p < data_end-8) && CONDITION) {
-		NEXT_CHAR  COND_NEXT_CHAR  COND_NEXT_CHAR  COND_NEXT_CHAR
-		COND_NEXT_CHAR  COND_NEXT_CHAR  COND_NEXT_CHAR  COND_NEXT_CHAR
-	}
-	while ((p < data_end) && CONDITION) {
-		NEXT_CHAR
+	/* in a chunk, a word reaching the end of the data may continue in the next one */
+	if (stream->more_data && !word_ends_in_chunk(p, data_end)) {
+		token->type = TML_TOKEN_EOF;
+		return;
 	}
 
-	/* if encountered an escape code, cancel this function's work, and use another more complex (slower) function */
-	if (ch == TML_ESCAPE_CHAR) {
-		parse_escaped_word_item(stream, token);
+	/* if encountered an escape code, collapse the rest of the word from there */
+	if (p < data_end && *p == TML_ESCAPE_CHAR) {
+		if (stream->read_only)
+			skip_escaped_word_item(stream, token, p);
+		else
+			parse_escaped_word_item(stream, token, (char *)p);
 		return;
 	}
 
@@ -209,5 +971,3 @@ void parse_word_item(struct tml_stream *stream, struct tml_token *token)
 	stream->index += token->value_size;
 }
 
-
-
@@ -28,6 +28,8 @@
 #define _TML_TOKENIZER_H__
 
 #include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
 
 
 /* If you don't like TML's choice of brackets, feel free to change these to whatever
@@ -47,12 +49,30 @@ enum TML_WILDCARD
 	TML_WILD_ANY = 2 /* ascii code for "\*" escape code */
 };
 
+/* Returns the character the escape code "\<code>" stands for, e.g. ' ' for "\s" */
+char translate_escape_code(char code);
+
+/* Copies a word of size characters as written in the text to dest, translating its escape codes, and returns
+ * the length of the result. dest needs room for size characters, and may be the same as src. */
+size_t tml_collapse_escapes(char *dest, const char *src, size_t size);
+
 
 struct tml_stream
 {
 	char *data;
 	size_t data_size;
 	size_t index;
+
+	/* Structural index built by tml_stream_open_indexed(), or NULL for an ordinary stream */
+	uint32_t *tape;
+	size_t tape_size, tape_index;
+
+	/* Set for streams opened with tml_stream_open_chunk() */
+	int more_data, in_comment;
+
+	/* Set this right after opening a stream to never write to its data. Words with escape codes are then
+	 * given as written rather than collapsed in place (see tml_token.escaped). */
+	int read_only;
 };
 
 enum TML_TOKEN_TYPE
@@ -67,6 +87,10 @@ struct tml_token
 	const char *value; /* IMPORTANT: value is NOT a null-terminated C string. */
 	size_t value_size;
 
+	/* Nonzero if value is the word as written, escape codes and all, which tml_collapse_escapes() translates
+	 * (only with stream->read_only) */
+	int escaped;
+
 	size_t offset;
 };
 
@@ -76,6 +100,24 @@ struct tml_token
  * buffer. You can think of struct tml_stream as an object containing a queue of tokens. */ 
 struct tml_stream tml_stream_open(char *data, size_t data_size);
 
+/* Same as tml_stream_open(), but the whole buffer is scanned up front (64 bytes at a time) into a
+ * "tape": the positions of every bracket, divider, word start, escape code and word end, with
+ * comments already stripped out. tml_stream_pop() then reads tokens straight off the tape without
+ * looking at individual characters again. The tokens returned are identical to tml_stream_open().
+ *
+ * Unlike tml_stream_open(), this allocates memory for the tape (4 bytes per entry, so on the order
+ * of the size of the data itself for word-heavy text), which tml_stream_close() releases. If the
+ * tape can't be built (out of memory, or data over 4 GB) this quietly returns an ordinary stream. */
+struct tml_stream tml_stream_open_indexed(char *data, size_t data_size);
+
+/* Same as tml_stream_open(), but for one piece of a larger input which arrives in chunks. Tokens are
+ * returned as usual until a token might continue into the next chunk (a word or "|" that runs up to
+ * the end of the data). TML_TOKEN_EOF is then returned early, with stream->index left at the first byte
+ * not consumed; those bytes should be carried over to the front of the next chunk. A "||" comment
+ * running off the end of the chunk is consumed and sets stream->in_comment, which should be passed
+ * on to the stream opened for the next chunk. Words are not modified unless they're returned. */
+struct tml_stream tml_stream_open_chunk(char *data, size_t data_size, int in_comment);
+
 /* Always call tml_stream_close() once you're finished with a tml_stream object. After you close
  * the stream you may then free the data buffer you originally gave the stream whwnever you
  * like, but do not free it before then. Note that deleting the data buffer will invalidate
@@ -90,4 +132,22 @@ void tml_stream_close(struct tml_stream *stream);
 struct tml_token tml_stream_pop(struct tml_stream *stream);
 
 
+/* The tokenizer finds word boundaries and skips whitespace with a scanning kernel that examines
+ * 16-64 bytes at a time when the CPU supports it. The fastest kernel available is picked
+ * automatically the first time it's needed, and every kernel produces exactly the same tokens.
+ * You should never need to touch this, except to test or benchmark a specific kernel. */
+enum TML_SCAN_KERNEL
+{
+	TML_SCAN_AUTO, TML_SCAN_SCALAR, TML_SCAN_SSE2, TML_SCAN_AVX2, TML_SCAN_NEON
+};
+
+/* Forces the tokenizer to use the given scanning kernel. If it isn't supported by this build
+ * or this CPU (or TML_SCAN_AUTO is given), the automatic choice is used instead. Returns the
+ * kernel which is now active. Not thread safe - call it before any parsing begins. */
+enum TML_SCAN_KERNEL tml_set_scan_kernel(enum TML_SCAN_KERNEL kernel);
+
+/* Returns the scanning kernel the tokenizer is currently using. */
+enum TML_SCAN_KERNEL tml_get_scan_kernel(void);
+
+
 #endif
@@ -1,7 +1,9 @@
 #include "../source/tml_parser.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 int g_test_num = 0, g_pass_count = 0;
 
@@ -114,23 +116,2541 @@ void test_pattern_match(const char *candidate, const char *pattern, bool match)
 	struct tml_doc *c_doc = tml_parse_string(candidate);
 	struct tml_doc *p_doc = tml_parse_string(pattern);
 
+	/* the compiled pattern must agree */
+	struct tml_pattern *compiled = tml_compile_pattern(&p_doc->root_node);
+
 	bool actual_match = tml_compare_nodes(&c_doc->root_node, &p_doc->root_node);
-	if (actual_match == match) {
+	if (actual_match == match && tml_match_pattern(&c_doc->root_node, compiled) == match) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s\n", FAIL_MSG);
+	}
+
+	tml_free_pattern(compiled);
+	tml_free_doc(c_doc);
+	tml_free_doc(p_doc);
+}
+
+/* Compiled patterns must match lists with child offset tables (which are ruled out by count) the same way,
+ * and searching with them must find the same children as with the pattern node */
+void test_compiled_pattern_search(int child_count)
+{
+	char *text = malloc(child_count * 16 + 64), *p = text;
+	struct tml_doc *doc;
+	struct tml_node list, found, expected;
+	struct tml_pattern *exact, *longer, *at_least, *item;
+	struct tml_doc *item_doc = tml_parse_string("[item \\? 7]");
+	bool pass;
+	int i;
+
+	p += sprintf(p, "[[");
+	for (i = 0; i < child_count; ++i)
+		p += sprintf(p, "x ");
+	p += sprintf(p, "]");
+	for (i = 0; i < child_count; ++i)
+		p += sprintf(p, " [item %d %d]", i, i % 10);
+	sprintf(p, "]");
+
+	doc = tml_parse_string(text);
+	list = tml_first_child(&doc->root_node);
+	tml_child_count(&list);
+
+	p = text;
+	p += sprintf(p, "[");
+	for (i = 0; i < child_count; ++i)
+		p += sprintf(p, "x ");
+	sprintf(p, "]");
+	exact = tml_compile_pattern_string(text);
+	sprintf(p, "x]");
+	longer = tml_compile_pattern_string(text);
+	at_least = tml_compile_pattern_string("[x x \\? \\*]");
+	item = tml_compile_pattern_string("[item \\? 7]");
+
+	pass = tml_match_pattern(&list, exact) && !tml_match_pattern(&list, longer) && tml_match_pattern(&list, at_least);
+	pass = pass && tml_compile_pattern_string("[unclosed") == NULL;
+
+	found = tml_find_first_match(&doc->root_node, item);
+	expected = tml_find_first_child(&doc->root_node, &item_doc->root_node);
+	while (pass && !tml_is_null(&expected)) {
+		pass = found.value == expected.value;
+		found = tml_find_next_match(&found, item);
+		expected = tml_find_next_sibling(&expected, &item_doc->root_node);
+	}
+	pass = pass && tml_is_null(&found);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Compiled pattern search of a list of %d children differs.\n", FAIL_MSG, child_count);
+	}
+
+	tml_free_pattern(exact);
+	tml_free_pattern(longer);
+	tml_free_pattern(at_least);
+	tml_free_pattern(item);
+	tml_free_doc(item_doc);
+	tml_free_doc(doc);
+	free(text);
+}
+
+/* Matching a pattern set must find the same pattern as trying each of its patterns in turn */
+void test_pattern_set(void)
+{
+	static const char *patterns[] = {
+		"[position | \\? \\? \\?]", "[color | \\?]", "[color | \\? \\? \\?]", "[\\? | \\*]", "[name \\?]",
+		"[[deep [key]] \\*]", "[]", "word", "[\\*]", "[position \\*]"
+	};
+	static const char *candidates[] = {
+		"[position | 1 2 3]", "[position | 1 2]", "[color | red]", "[color | 1 0 0]", "[color | 1 0]", "[name bob]",
+		"[name bob smith]", "[[deep [key]] x y]", "[[deep [other]] x]", "[]", "word", "other", "[position]",
+		"[a b c]", "[[]]", "[[] | x]"
+	};
+	const int pattern_count = sizeof(patterns) / sizeof(patterns[0]);
+	const int candidate_count = sizeof(candidates) / sizeof(candidates[0]);
+	struct tml_pattern *compiled[sizeof(patterns) / sizeof(patterns[0])];
+	struct tml_pattern_set *set = tml_create_pattern_set();
+	char text[64];
+	bool pass = true;
+	int i, j, first;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	for (i = 0; i < pattern_count; ++i) {
+		if (strchr(patterns[i], '[')) {
+			compiled[i] = tml_compile_pattern_string(patterns[i]);
+		}
+		else {
+			/* a bare word is compiled from within a list */
+			struct tml_doc *doc = tml_parse_string("[word]");
+			struct tml_node word = tml_first_child(&doc->root_node);
+			compiled[i] = tml_compile_pattern(&word);
+			tml_free_doc(doc);
+		}
+		pass = pass && tml_add_to_pattern_set(set, compiled[i]) == i;
+	}
+
+	/* from each pattern onwards, so that later patterns get their turn to be first */
+	for (first = 0; first < pattern_count && pass; ++first) {
+		struct tml_pattern_set *subset = tml_create_pattern_set();
+		for (i = first; i < pattern_count; ++i)
+			tml_add_to_pattern_set(subset, compiled[i]);
+
+		for (j = 0; j < candidate_count && pass; ++j) {
+			bool bare_word = !strchr(candidates[j], '[');
+			struct tml_doc *doc;
+			struct tml_node node;
+			int expected = -1;
+
+			/* a bare word is parsed within a list */
+			sprintf(text, bare_word ? "[%s]" : "%s", candidates[j]);
+			doc = tml_parse_string(text);
+			node = doc->root_node;
+			if (bare_word)
+				node = tml_first_child(&node);
+
+			for (i = first; i < pattern_count && expected < 0; ++i) {
+				if (tml_match_pattern(&node, compiled[i]))
+					expected = i - first;
+			}
+
+			if (tml_match_pattern_set(&node, subset) != expected) {
+				printf("%s: Pattern set gave %d instead of %d for \"%s\".\n", FAIL_MSG,
+					tml_match_pattern_set(&node, subset), expected, candidates[j]);
+				pass = false;
+			}
+			tml_free_doc(doc);
+		}
+		tml_free_pattern_set(subset);
+	}
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+
+	tml_free_pattern_set(set);
+	for (i = 0; i < pattern_count; ++i)
+		tml_free_pattern(compiled[i]);
+}
+
+/* Returns true if both documents parsed to exactly the same result, byte for byte (after the pointer
+ * back to the tml_doc which every buffer begins with). */
+bool docs_identical(const struct tml_doc *a, const struct tml_doc *b)
+{
+	const size_t header_size = sizeof(struct tml_doc *);
+
+	if (!a || !b)
+		return a == b;
+	if ((a->error_message == NULL) != (b->error_message == NULL))
+		return false;
+	if (a->error_message && strcmp(a->error_message, b->error_message) != 0)
+		return false;
+	if (a->buff_index != b->buff_index ||
+		memcmp(a->buff + header_size, b->buff + header_size, a->buff_index - header_size) != 0)
+		return false;
+	return a->root_node.first_child == b->root_node.first_child;
+}
+
+/* The structural index parser must produce a buffer identical to the default parser */
+void test_structural_index(const char *source_string)
+{
+	struct tml_doc *doc = tml_parse_string(source_string);
+	struct tml_doc *idoc = tml_parse_string_ex(source_string, TML_PARSE_STRUCTURAL_INDEX);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (docs_identical(doc, idoc)) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Structural index parse differs for \"%s\".\n", FAIL_MSG, source_string);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(idoc);
+}
+
+/* Compares both parsers on lots of random strings made from the characters that matter to the
+ * tokenizer, long enough to cross several 64 byte blocks. */
+void test_structural_index_random(int iterations)
+{
+	static const char alphabet[] = "[]|\\ \t\r\nab";
+	char source[400];
+	int i, j;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	srand(1234);
+	for (i = 0; i < iterations; ++i) {
+		int len = rand() % (sizeof(source) - 3);
+		source[0] = '[';
+		for (j = 1; j <= len; ++j)
+			source[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+		source[len + 1] = (i & 1) ? ']' : '\0';
+		source[len + 2] = '\0';
+
+		struct tml_doc *doc = tml_parse_string(source);
+		struct tml_doc *idoc = tml_parse_string_ex(source, TML_PARSE_STRUCTURAL_INDEX);
+		bool same = docs_identical(doc, idoc);
+		tml_free_doc(doc);
+		tml_free_doc(idoc);
+
+		if (!same) {
+			printf("%s: Structural index parse differs for \"%s\".\n", FAIL_MSG, source);
+			return;
+		}
+	}
+
+	printf("%s\n", PASS_MSG);
+	g_pass_count++;
+}
+
+/* Returns true if both documents parsed to the same tree, however it's laid out in memory. */
+bool docs_equivalent(const struct tml_doc *a, const struct tml_doc *b)
+{
+	char a_str[2048], b_str[2048];
+
+	if (!a || !b)
+		return a == b;
+	if ((a->error_message == NULL) != (b->error_message == NULL))
+		return false;
+	if (a->error_message)
+		return strcmp(a->error_message, b->error_message) == 0;
+
+	tml_node_to_markup_string(&a->root_node, a_str, sizeof(a_str));
+	tml_node_to_markup_string(&b->root_node, b_str, sizeof(b_str));
+	return strcmp(a_str, b_str) == 0;
+}
+
+#define MAPPED_TEST_FILE "test_mapped.tml"
+
+/* Writes the source string to a file and parses it memory mapped */
+struct tml_doc *parse_mapped(const char *source_string, unsigned int flags)
+{
+	FILE *fp = fopen(MAPPED_TEST_FILE, "wb");
+	struct tml_doc *doc;
+
+	fwrite(source_string, 1, strlen(source_string), fp);
+	fclose(fp);
+
+	doc = tml_parse_file_ex(MAPPED_TEST_FILE, TML_PARSE_MMAP | flags);
+	remove(MAPPED_TEST_FILE);
+	return doc;
+}
+
+/* Memory mapped parsing must give the same tree as parsing a string, with or without the structural index */
+bool mapped_matches(const char *source_string)
+{
+	struct tml_doc *doc = tml_parse_string(source_string);
+	struct tml_doc *mdoc = parse_mapped(source_string, TML_PARSE_DEFAULT);
+	struct tml_doc *midoc = parse_mapped(source_string, TML_PARSE_STRUCTURAL_INDEX);
+	struct tml_doc *mwdoc = parse_mapped(source_string, TML_PARSE_WIDE_OFFSETS);
+	bool same = docs_equivalent(doc, mdoc) && docs_equivalent(doc, midoc) && docs_equivalent(doc, mwdoc);
+
+	tml_free_doc(doc);
+	tml_free_doc(mdoc);
+	tml_free_doc(midoc);
+	tml_free_doc(mwdoc);
+	return same;
+}
+
+void test_mapped_file(const char *source_string)
+{
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (mapped_matches(source_string)) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Memory mapped parse differs for \"%s\".\n", FAIL_MSG, source_string);
+	}
+}
+
+void test_mapped_file_random(int iterations)
+{
+	static const char alphabet[] = "[]|\\ \t\r\nabcdefghijklmnop";
+	char source[200];
+	int i, j;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	srand(5678);
+	for (i = 0; i < iterations; ++i) {
+		int len = rand() % (sizeof(source) - 3);
+		source[0] = '[';
+		for (j = 1; j <= len; ++j)
+			source[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+		source[len + 1] = (i & 1) ? ']' : '\0';
+		source[len + 2] = '\0';
+
+		if (!mapped_matches(source)) {
+			printf("%s: Memory mapped parse differs for \"%s\".\n", FAIL_MSG, source);
+			return;
+		}
+	}
+
+	printf("%s\n", PASS_MSG);
+	g_pass_count++;
+}
+
+/* Long words without escape codes should be left in the mapping rather than copied, without writing to it */
+void test_mapped_references(void)
+{
+	struct tml_doc *doc = parse_mapped("[short a_longer_word_here an\\sescaped_long_word another_long_word]",
+		TML_PARSE_DEFAULT);
+	struct tml_node first = tml_first_child(&doc->root_node);
+	struct tml_node second = tml_next_sibling(&first);
+	struct tml_node third = tml_next_sibling(&second);
+	struct tml_node fourth = tml_next_sibling(&third);
+	const char *map = doc->mapping;
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	/* words in the mapping aren't null terminated */
+	pass = map && second.value == map + 7 && second.size == 18 && memcmp(second.value, "a_longer_word_here", 18) == 0;
+	pass = pass && fourth.value == map + 48 && fourth.size == 17 && memcmp(fourth.value, "another_long_word]", 18) == 0;
+	pass = pass && strcmp(first.value, "short") == 0 && (first.value < map || first.value >= map + doc->mapping_size);
+	pass = pass && strcmp(third.value, "an escaped_long_word") == 0 &&
+		(third.value < map || third.value >= map + doc->mapping_size);
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Expected long words without escape codes to be referenced in the mapping.\n", FAIL_MSG);
+	}
+
+	tml_free_doc(doc);
+}
+
+/* Keys, queries and pattern sets must compare words left in the mapping by their size, as they aren't null
+ * terminated: "long_key_name_here" mustn't be taken for "long_key_name_here_too" or the other way around */
+void test_mapped_lookups(void)
+{
+	char text[2048], *p = text;
+	struct tml_doc *doc;
+	struct tml_node here, here_too, value;
+	struct tml_query *query = tml_compile_query("long_key_name_here_too");
+	struct tml_pattern *here_pattern = tml_compile_pattern_string("[long_key_name_here | \\*]");
+	struct tml_pattern *here_too_pattern = tml_compile_pattern_string("[long_key_name_here_too | \\*]");
+	struct tml_pattern_set *set = tml_create_pattern_set();
+	bool pass;
+	int i;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	p += sprintf(p, "[");
+	for (i = 0; i < 40; ++i)
+		p += sprintf(p, "[long_key_name_%d_ab | v] ", i);
+	sprintf(p, "[long_key_name_here_too | b] [long_key_name_here | a]]");
+	doc = parse_mapped(text, TML_PARSE_DEFAULT);
+
+	tml_add_to_pattern_set(set, here_pattern);
+	tml_add_to_pattern_set(set, here_too_pattern);
+
+	here = tml_find_key(&doc->root_node, "long_key_name_here");
+	here_too = tml_find_key(&doc->root_node, "long_key_name_here_too");
+	value = tml_child_at_index(&here, 1);
+	value = tml_first_child(&value);
+	pass = !tml_is_null(&value) && strcmp(value.value, "a") == 0;
+	value = tml_child_at_index(&here_too, 1);
+	value = tml_first_child(&value);
+	pass = pass && !tml_is_null(&value) && strcmp(value.value, "b") == 0;
+
+	value = tml_query_first(&doc->root_node, query);
+	pass = pass && !tml_is_null(&value) && value.value == here_too.value;
+	pass = pass && tml_match_pattern_set(&here, set) == 0 && tml_match_pattern_set(&here_too, set) == 1;
+
+	tml_free_pattern_set(set);
+	tml_free_pattern(here_pattern);
+	tml_free_pattern(here_too_pattern);
+	tml_free_query(query);
+	tml_free_doc(doc);
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Words left in the mapping were compared wrongly.\n", FAIL_MSG);
+	}
+}
+
+/* Full nodes (lists, and leaves too long to pack) are padded to align their links, by up to 7 bytes */
+#define MAX_NODE_PADDING 7
+
+/* Returns the number of full nodes in the tree */
+static size_t count_full_nodes(const struct tml_node *node)
+{
+	struct tml_node child;
+	size_t count = (tml_is_list(node) || node->size >= 124) ? 1 : 0;
+
+	for (child = tml_first_child(node); !tml_is_null(&child); child = tml_next_sibling(&child))
+		count += count_full_nodes(&child);
+	return count;
+}
+
+/* Parsing with 64 bit offsets must give the same tree, with each of the given number of full nodes 9 to 19 bytes
+ * larger (12 bytes more for the links, and different padding) */
+void test_wide_offsets(const char *source_string, int list_count)
+{
+	struct tml_doc *doc = tml_parse_string(source_string);
+	struct tml_doc *wdoc = tml_parse_string_ex(source_string, TML_PARSE_WIDE_OFFSETS);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (docs_equivalent(doc, wdoc) && (doc->error_message || (wdoc->buff_index >= doc->buff_index + 9 * list_count &&
+		wdoc->buff_index <= doc->buff_index + 19 * list_count))) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Wide offset parse differs for \"%s\".\n", FAIL_MSG, source_string);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(wdoc);
+}
+
+/* Collects the leaves under the node into the array (up to max_count of them), returning how many there are */
+static int collect_leaves(const struct tml_node *node, const char **values, int count, int max_count)
+{
+	struct tml_node child;
+
+	if (!tml_is_list(node)) {
+		if (count < max_count)
+			values[count] = node->value;
+		return count + 1;
+	}
+
+	for (child = tml_first_child(node); !tml_is_null(&child); child = tml_next_sibling(&child))
+		count = collect_leaves(&child, values, count, max_count);
+	return count;
+}
+
+/* Interning repeated words must give the same tree, saving the given number of bytes (give or take the padding of
+ * full nodes, which moves with them), with repeated words of 4 to 123 characters sharing one value pointer */
+void test_interning(const char *source_string, int saved_size)
+{
+	struct tml_doc *doc = tml_parse_string(source_string);
+	struct tml_doc *idoc = tml_parse_string_ex(source_string, TML_PARSE_INTERN);
+	struct tml_doc *iwdoc = tml_parse_string_ex(source_string, TML_PARSE_INTERN | TML_PARSE_WIDE_OFFSETS);
+	struct tml_doc *imdoc = parse_mapped(source_string, TML_PARSE_INTERN);
+	const char *values[64];
+	int count, i, j;
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	pass = docs_equivalent(doc, idoc) && docs_equivalent(doc, iwdoc) && docs_equivalent(doc, imdoc);
+
+	if (pass && !doc->error_message) {
+		size_t padding = 3 * count_full_nodes(&doc->root_node);
+		pass = doc->buff_index + padding >= idoc->buff_index + saved_size &&
+			doc->buff_index <= idoc->buff_index + saved_size + padding;
+	}
+
+	if (pass && !doc->error_message) {
+		count = collect_leaves(&idoc->root_node, values, 0, 64);
+		for (i = 0; i < count && i < 64; ++i) {
+			for (j = 0; j < i; ++j) {
+				size_t len = strlen(values[i]);
+				if (len >= 4 && len < 124 && strcmp(values[i], values[j]) == 0 && values[i] != values[j])
+					pass = false;
+			}
+		}
+	}
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Interned parse differs for \"%s\".\n", FAIL_MSG, source_string);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(idoc);
+	tml_free_doc(iwdoc);
+	tml_free_doc(imdoc);
+}
+
+/* Returns true if both nodes have the same value and the same children */
+bool nodes_equal(const struct tml_node *a, const struct tml_node *b)
+{
+	struct tml_node a_child, b_child;
+
+	/* words left in a file mapping aren't null terminated, so values are compared by size */
+	if (a->size != b->size || tml_is_list(a) != tml_is_list(b) || (!tml_is_list(a) && memcmp(a->value, b->value, a->size) != 0))
+		return false;
+
+	a_child = tml_first_child(a);
+	b_child = tml_first_child(b);
+	while (!tml_is_null(&a_child) && !tml_is_null(&b_child)) {
+		if (!nodes_equal(&a_child, &b_child))
+			return false;
+		a_child = tml_next_sibling(&a_child);
+		b_child = tml_next_sibling(&b_child);
+	}
+
+	return tml_is_null(&a_child) && tml_is_null(&b_child);
+}
+
+/* Appends a random list to the text, with words, escape codes, comments and dividers */
+static size_t append_random_list(char *text, size_t len, size_t max_len, int depth)
+{
+	static const char *separators[] = { " ", "\t", " \n ", "  ", " || a comment [ | ] \\\n" };
+	int count = rand() % 12, i, j;
+
+	text[len++] = '[';
+	for (i = 0; i < count && len + 400 < max_len; ++i) {
+		int kind = rand() % 16;
+		const char *sep = separators[rand() % 5];
+
+		if (kind == 0 && depth < 6) {
+			len = append_random_list(text, len, max_len, depth + 1);
+		}
+		else if (kind == 1 && depth > 0) {
+			text[len++] = '|';
+		}
+		else if (kind == 2) {
+			/* word long enough to need full node link data */
+			for (j = 0; j < 300; ++j)
+				text[len++] = 'a' + j % 26;
+		}
+		else if (kind == 3) {
+			memcpy(text + len, "esc\\s\\[aped\\]", 14);
+			len += 14;
+		}
+		else {
+			int word_len = 1 + rand() % 10;
+			for (j = 0; j < word_len; ++j)
+				text[len++] = 'a' + rand() % 26;
+		}
+
+		memcpy(text + len, sep, strlen(sep));
+		len += strlen(sep);
+	}
+	text[len++] = ']';
+	return len;
+}
+
+/* Makes a large random document with many top-level children, followed by the given ending */
+char *make_wide_document(size_t size, const char *ending, size_t *doc_len)
+{
+	char *text = malloc(size + 1000);
+	size_t len = 0;
+
+	text[len++] = '[';
+	while (len < size) {
+		len = append_random_list(text, len, size + 500, 1);
+		text[len++] = (rand() % 3) ? ' ' : '\n';
+	}
+
+	memcpy(text + len, ending, strlen(ending));
+	len += strlen(ending);
+	text[len] = '\0';
+
+	*doc_len = len;
+	return text;
+}
+
+/* Returns true if every node's size is its value's length (which may include null characters), or for a list its
+ * number of children */
+/* The same for a document parsed with TML_PARSE_MMAP, whose words left in the mapping aren't null terminated but
+ * must lie within it */
+bool mapped_sizes_correct(const struct tml_doc *doc, const struct tml_node *node)
+{
+	const char *map = doc->mapping;
+	struct tml_node child;
+	size_t count = 0;
+
+	if (!tml_is_list(node)) {
+		if (map && node->value >= map && node->value < map + doc->mapping_size)
+			return node->value + node->size <= map + doc->mapping_size && tml_child_count(node) == 0;
+		return node->value[node->size] == '\0' && strlen(node->value) <= node->size && tml_child_count(node) == 0;
+	}
+
+	for (child = tml_first_child(node); !tml_is_null(&child); child = tml_next_sibling(&child)) {
+		if (!mapped_sizes_correct(doc, &child))
+			return false;
+		count++;
+	}
+	return node->size == count && tml_child_count(node) == (int)count;
+}
+
+bool sizes_correct(const struct tml_node *node)
+{
+	static const struct tml_doc unmapped_doc;
+	return mapped_sizes_correct(&unmapped_doc, node);
+}
+
+/* Every node must know its own size, however the document was parsed */
+void test_node_sizes(const char *source_string, unsigned int flags)
+{
+	struct tml_doc *doc = tml_parse_string_ex(source_string, flags);
+	struct tml_doc *mdoc = parse_mapped(source_string, flags);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (!doc->error_message && sizes_correct(&doc->root_node) && mapped_sizes_correct(mdoc, &mdoc->root_node)) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Node sizes are wrong for \"%s\".\n", FAIL_MSG, source_string);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(mdoc);
+}
+
+/* Deduplicating must leave the same tree, no larger (but for the padding of full nodes), with the children of the
+ * first two children of the root shared if they're the same */
+void test_dedup(const char *source_string, unsigned int flags)
+{
+	struct tml_doc *doc = tml_parse_string_ex(source_string, flags);
+	struct tml_doc *ddoc = tml_parse_string_ex(source_string, flags);
+	struct tml_node first, second;
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	tml_index_children(ddoc);
+	pass = tml_doc_dedup(ddoc) && docs_equivalent(doc, ddoc) &&
+		ddoc->buff_index <= doc->buff_index + MAX_NODE_PADDING * count_full_nodes(&doc->root_node);
+
+	if (pass && !ddoc->error_message) {
+		pass = nodes_equal(&doc->root_node, &ddoc->root_node) &&
+			tml_child_count(&doc->root_node) == tml_child_count(&ddoc->root_node);
+
+		first = tml_first_child(&ddoc->root_node);
+		second = tml_next_sibling(&first);
+		if (!tml_is_null(&second) && tml_is_list(&second) && tml_compare_nodes(&first, &second))
+			pass = pass && first.first_child == second.first_child;
+	}
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Deduplicated document differs for \"%s\".\n", FAIL_MSG, source_string);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(ddoc);
+}
+
+/* Returns true if the list's children are contiguous, and come before the children of any list among them */
+static bool children_packed(const struct tml_node *list, bool wide)
+{
+	struct tml_node child;
+	size_t offset = list->first_child, max_header = wide ? 32 : 16;
+
+	for (child = tml_first_child(list); !tml_is_null(&child); child = tml_next_sibling(&child)) {
+		size_t end = offset + max_header + (tml_is_list(&child) ? 0 : child.size) + 1;
+
+		if (child.next_sibling && (child.next_sibling <= offset || child.next_sibling > end))
+			return false;
+		if (child.first_child && (child.first_child <= offset || !children_packed(&child, wide)))
+			return false;
+		offset = child.next_sibling;
+	}
+	return true;
+}
+
+/* Repacking must leave the same tree, with every list's children stored together */
+void test_repack(const char *source_string, unsigned int flags)
+{
+	struct tml_doc *doc = tml_parse_string_ex(source_string, flags);
+	struct tml_doc *rdoc = tml_parse_string_ex(source_string, flags);
+	struct tml_doc *mdoc = parse_mapped(source_string, flags);
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	tml_index_children(rdoc);
+	pass = tml_doc_repack(rdoc) && tml_doc_repack(mdoc) && docs_equivalent(doc, rdoc) && docs_equivalent(doc, mdoc);
+
+	if (pass && !doc->error_message) {
+		pass = nodes_equal(&doc->root_node, &rdoc->root_node) && sizes_correct(&rdoc->root_node) &&
+			children_packed(&rdoc->root_node, rdoc->wide_offsets) && children_packed(&mdoc->root_node, mdoc->wide_offsets);
+	}
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Repacked document differs for \"%s\".\n", FAIL_MSG, source_string);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(rdoc);
+	tml_free_doc(mdoc);
+}
+
+/* Returns true if walking from this id visits the same nodes as walking from the node */
+static bool ids_match(const struct tml_doc *doc, tml_node_id id, const struct tml_node *node)
+{
+	struct tml_node child, id_node = tml_node_at(doc, id);
+	struct tml_array array;
+	tml_node_id child_id;
+
+	if (!nodes_equal(&id_node, node) || tml_is_list_id(doc, id) != (!tml_is_null(node) && tml_is_list(node)))
+		return false;
+
+	child = tml_first_child(node);
+	child_id = tml_first_child_id(doc, id);
+	if (child_id != node->first_child)
+		return false;
+
+	/* a binary array's elements aren't nodes of the document */
+	if (tml_node_array(node, &array))
+		return child_id == TML_NODE_ID_NULL && !tml_is_null(&child) && tml_has_children(node);
+
+	while (!tml_is_null(&child)) {
+		if (!ids_match(doc, child_id, &child) || tml_next_sibling_id(doc, child_id) != child.next_sibling)
+			return false;
+		child = tml_next_sibling(&child);
+		child_id = tml_next_sibling_id(doc, child_id);
+	}
+	return child_id == TML_NODE_ID_NULL;
+}
+
+/* Iterating with node ids must visit the same nodes as iterating with tml_node values */
+void test_node_ids(const char *source_string, unsigned int flags)
+{
+	struct tml_doc *doc = tml_parse_string_ex(source_string, flags);
+	struct tml_doc *mdoc = parse_mapped(source_string, flags);
+	struct tml_doc *rdoc = tml_parse_string_ex(source_string, flags);
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	pass = tml_doc_repack(rdoc) && tml_first_child_id(doc, TML_NODE_ID_NULL) == TML_NODE_ID_NULL &&
+		tml_next_sibling_id(doc, TML_NODE_ID_NULL) == TML_NODE_ID_NULL;
+
+	if (pass && doc->error_message) {
+		pass = tml_root_id(doc) == TML_NODE_ID_NULL;
+	}
+	else if (pass) {
+		pass = tml_root_id(doc) != TML_NODE_ID_NULL && tml_next_sibling_id(doc, tml_root_id(doc)) == TML_NODE_ID_NULL &&
+			ids_match(doc, tml_root_id(doc), &doc->root_node) && ids_match(mdoc, tml_root_id(mdoc), &mdoc->root_node) &&
+			ids_match(rdoc, tml_root_id(rdoc), &rdoc->root_node);
+	}
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Iterating by node id differs for \"%s\".\n", FAIL_MSG, source_string);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(mdoc);
+	tml_free_doc(rdoc);
+}
+
+/* Walking ids through a list with binary arrays must step over each array as one node, never into its elements */
+void test_node_ids_numeric_arrays(unsigned int flags)
+{
+	static const char *values[] = { "a", NULL, "b", NULL, "c" };
+	struct tml_doc *doc = tml_parse_string_ex("[a [1 2 3 4 5] b [1.5 2.5 3.5 4.5] c]",
+		TML_PARSE_NUMERIC_ARRAYS | flags);
+	tml_node_id id = tml_first_child_id(doc, tml_root_id(doc));
+	bool pass = true;
+	int i;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	for (i = 0; i < 5 && pass; ++i) {
+		struct tml_node node = tml_node_at(doc, id);
+		struct tml_array array;
+
+		if (values[i]) {
+			pass = !tml_is_list_id(doc, id) && strcmp(node.value, values[i]) == 0;
+		}
+		else {
+			/* the array's elements are still there by tml_node, just not by id */
+			struct tml_node element = tml_first_child(&node);
+			pass = id != TML_NODE_ID_NULL && tml_is_list_id(doc, id) && tml_node_array(&node, &array) &&
+				tml_first_child_id(doc, id) == TML_NODE_ID_NULL && !tml_is_null(&element) &&
+				strcmp(element.value, i == 1 ? "1" : "1.5") == 0 && tml_child_count(&node) == (i == 1 ? 5 : 4);
+		}
+		id = tml_next_sibling_id(doc, id);
+	}
+	pass = pass && id == TML_NODE_ID_NULL;
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Iterating by node id didn't step over binary arrays.\n", FAIL_MSG);
+	}
+
+	tml_free_doc(doc);
+}
+
+/* A document too large for its node ids must have none, rather than ids that wrap around to other nodes. Such a
+ * document can't be made here, so a copy of a small one claims to be that large */
+void test_node_ids_too_large(void)
+{
+	struct tml_doc *doc = tml_parse_string_ex("[a [b c] d]", TML_PARSE_WIDE_OFFSETS);
+	struct tml_doc large = *doc;
+	bool pass = tml_root_id(doc) != TML_NODE_ID_NULL;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (sizeof(size_t) > sizeof(tml_node_id)) {
+		/* the last node starts before buff_index, so the largest document with ids ends just past the largest id */
+		large.buff_index = (size_t)(tml_node_id)-1 + 2;
+		pass = pass && tml_root_id(&large) == TML_NODE_ID_NULL;
+		large.buff_index = (size_t)(tml_node_id)-1 + 1;
+		pass = pass && tml_root_id(&large) == tml_root_id(doc);
+	}
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: A document too large for its node ids still has a root id.\n", FAIL_MSG);
+	}
+
+	tml_free_doc(doc);
+}
+
+/* Random documents with lots of repetition must read the same after deduplicating */
+void test_dedup_random(int iterations)
+{
+	static const char *parts[] = { "[layout interleaved]", "[type float3]", "[stop | offset 0.5 [style a]]",
+		"[a [b [c]]]", "word", "another_word", "[]", "[x | y | z]", "\n" };
+	char text[4096];
+	int i, j;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	srand(2468);
+	for (i = 0; i < iterations; ++i) {
+		struct tml_doc *doc, *ddoc;
+		size_t len = 0;
+		int depth = 0, count = rand() % 60;
+		bool same;
+
+		text[len++] = '[';
+		for (j = 0; j < count; ++j) {
+			int kind = rand() % 12;
+			if (kind < 9) {
+				len += sprintf(text + len, "%s ", parts[kind]);
+			}
+			else if (kind == 9 && depth < 8) {
+				text[len++] = '[';
+				depth++;
+			}
+			else if (kind == 10 && depth > 0) {
+				text[len++] = ']';
+				depth--;
+			}
+		}
+		while (depth-- >= 0)
+			text[len++] = ']';
+		text[len] = '\0';
+
+		doc = tml_parse_string_ex(text, (i & 1) ? TML_PARSE_WIDE_OFFSETS : TML_PARSE_DEFAULT);
+		ddoc = tml_parse_string_ex(text, TML_PARSE_DEDUP | ((i & 1) ? TML_PARSE_WIDE_OFFSETS : TML_PARSE_DEFAULT));
+		same = nodes_equal(&doc->root_node, &ddoc->root_node) &&
+			ddoc->buff_index <= doc->buff_index + MAX_NODE_PADDING * count_full_nodes(&doc->root_node);
+		tml_free_doc(doc);
+		tml_free_doc(ddoc);
+
+		if (!same) {
+			printf("%s: Deduplicated document differs for \"%s\".\n", FAIL_MSG, text);
+			return;
+		}
+	}
+
+	printf("%s\n", PASS_MSG);
+	g_pass_count++;
+}
+
+/* Parallel parsing must give the same tree (or error) as sequential parsing */
+void test_parallel(const char *ending, unsigned int flags, int thread_count)
+{
+	size_t len;
+	char *text = make_wide_document(1 << 20, ending, &len);
+	char *copy = malloc(len);
+	struct tml_doc *doc, *pdoc;
+	bool same;
+
+	memcpy(copy, text, len);
+	doc = tml_parse_in_memory_ex(text, len, flags);
+	pdoc = tml_parse_parallel(copy, len, flags, thread_count);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (!doc->error_message)
+		same = !pdoc->error_message && nodes_equal(&doc->root_node, &pdoc->root_node) && sizes_correct(&pdoc->root_node);
+	else
+		same = pdoc->error_message && strcmp(doc->error_message, pdoc->error_message) == 0;
+
+	if (same) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Parallel parse with %d threads differs (ending \"%s\").\n", FAIL_MSG, thread_count, ending);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(pdoc);
+	free(text);
+	free(copy);
+}
+
+/* An allocator which keeps count of what's outstanding, to check everything is given back, and which fails while
+ * out_of_memory is set */
+struct counting_allocator
+{
+	long allocations, bytes;
+	bool out_of_memory;
+};
+
+static void *counting_alloc(void *user_data, size_t size)
+{
+	struct counting_allocator *counts = user_data;
+	if (counts->out_of_memory)
+		return NULL;
+	counts->allocations++;
+	counts->bytes += size;
+	return malloc(size);
+}
+
+static void *counting_resize(void *user_data, void *ptr, size_t old_size, size_t new_size)
+{
+	struct counting_allocator *counts = user_data;
+	if (counts->out_of_memory)
+		return NULL;
+	if (!ptr) counts->allocations++;
+	counts->bytes += (long)new_size - (long)old_size;
+	return realloc(ptr, new_size);
+}
+
+static void counting_release(void *user_data, void *ptr, size_t size)
+{
+	struct counting_allocator *counts = user_data;
+	counts->allocations--;
+	counts->bytes -= size;
+	free(ptr);
+}
+
+/* Parsing with a custom allocator must give the same result, and free everything it allocates */
+void test_custom_allocator(const char *source_string)
+{
+	struct counting_allocator counts = { 0, 0 };
+	struct tml_allocator allocator = { &counts, counting_alloc, counting_resize, counting_release };
+	struct tml_doc *doc = tml_parse_string(source_string);
+	struct tml_doc *adoc = tml_parse_string_alloc(source_string, TML_PARSE_DEFAULT, &allocator);
+	bool same = docs_identical(doc, adoc);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	tml_free_doc(doc);
+	tml_free_doc(adoc);
+
+	if (same && counts.allocations == 0 && counts.bytes == 0) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Allocator parse of \"%s\" differs or leaks (%ld allocations, %ld bytes).\n",
+			FAIL_MSG, source_string, counts.allocations, counts.bytes);
+	}
+}
+
+/* Indexing into "[data | 0 1 2 ...]" with child_count numbers, in random order, must find each number (and
+ * nothing past the end) whether the child offset tables are made up front or as they're needed. */
+void test_child_index(int child_count, unsigned int flags)
+{
+	struct counting_allocator counts = { 0, 0 };
+	struct tml_allocator allocator = { &counts, counting_alloc, counting_resize, counting_release };
+	char *text = malloc(child_count * 12 + 16), *p = text;
+	struct tml_doc *doc;
+	struct tml_node data, past_end;
+	bool pass = true;
+	int i;
+
+	p += sprintf(p, "[data |");
+	for (i = 0; i < child_count; ++i)
+		p += sprintf(p, " %d", i);
+	sprintf(p, "]");
+
+	doc = tml_parse_string_alloc(text, flags, &allocator);
+	data = tml_child_at_index(&doc->root_node, 1);
+
+	for (i = 0; i < child_count * 2 && pass; ++i) {
+		int index = (i < child_count) ? rand() % child_count : child_count - 1 - (i - child_count);
+		struct tml_node child = tml_child_at_index(&data, index);
+		pass = !tml_is_null(&child) && strlen(child.value) > 0 && atoi(child.value) == index;
+	}
+
+	pass = pass && tml_child_count(&data) == child_count && tml_child_count(&doc->root_node) == 2;
+
+	past_end = tml_child_at_index(&data, child_count);
+	pass = pass && tml_is_null(&past_end);
+	past_end = tml_child_at_index(&data, -1);
+	pass = pass && tml_is_null(&past_end);
+
+	tml_free_doc(doc);
+	free(text);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (pass && counts.allocations == 0 && counts.bytes == 0) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Indexing into a list of %d children failed or leaked (%ld allocations, %ld bytes).\n",
+			FAIL_MSG, child_count, counts.allocations, counts.bytes);
+	}
+}
+
+/* Looks up every key of a "[[k0 | v0] [k1 v1] ... word [dup | a] [dup | b] [dup c]]" map, with or without a key
+ * table, checking the values found (in order, for the duplicated key) and that missing keys aren't found. */
+void test_key_lookup(int entry_count, bool index_keys)
+{
+	struct counting_allocator counts = { 0, 0 };
+	struct tml_allocator allocator = { &counts, counting_alloc, counting_resize, counting_release };
+	char *text = malloc(entry_count * 32 + 64), *p = text, key[16], value[16];
+	struct tml_doc *doc;
+	struct tml_node child, value_node;
+	bool pass = true;
+	int i;
+
+	p += sprintf(p, "[");
+	for (i = 0; i < entry_count; ++i)
+		p += sprintf(p, (i % 2) ? "[k%d v%d] " : "[k%d | v%d] ", i, i);
+	sprintf(p, "word [dup | a] [dup | b] [[dup] c] []]");
+
+	doc = tml_parse_string_alloc(text, TML_PARSE_DEFAULT, &allocator);
+	if (index_keys)
+		pass = tml_index_keys(&doc->root_node);
+
+	for (i = 0; i < entry_count && pass; ++i) {
+		sprintf(key, "k%d", i);
+		sprintf(value, "v%d", i);
+		child = tml_find_key(&doc->root_node, key);
+		value_node = tml_child_at_index(&child, 1);
+		if (tml_has_children(&value_node))
+			value_node = tml_first_child(&value_node);
+		pass = !tml_is_null(&value_node) && strcmp(value_node.value, value) == 0;
+	}
+
+	child = tml_find_key(&doc->root_node, "word");
+	pass = pass && strcmp(child.value, "word") == 0;
+	child = tml_find_key(&doc->root_node, "missing");
+	pass = pass && tml_is_null(&child);
+
+	child = tml_find_key(&doc->root_node, "dup");
+	for (i = 0; i < 3 && pass; ++i) {
+		char values[] = "abc";
+		struct tml_node dup_value = tml_child_at_index(&child, 1);
+		if (tml_has_children(&dup_value))
+			dup_value = tml_first_child(&dup_value);
+		pass = !tml_is_null(&child) && dup_value.value[0] == values[i];
+		child = tml_find_next_key(&doc->root_node, &child);
+	}
+	pass = pass && tml_is_null(&child);
+
+	tml_free_doc(doc);
+	free(text);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (pass && counts.allocations == 0 && counts.bytes == 0) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Key lookup in a map of %d entries failed or leaked (%ld allocations, %ld bytes).\n",
+			FAIL_MSG, entry_count, counts.allocations, counts.bytes);
+	}
+}
+
+/* Checks that looking up keys in a document parsed with TML_PARSE_CHILD_INDEX doesn't allocate anything more, so
+ * that it can be read from several threads at once */
+void test_indexed_key_lookup(void)
+{
+	struct counting_allocator counts = { 0, 0 };
+	struct tml_allocator allocator = { &counts, counting_alloc, counting_resize, counting_release };
+	char *text = malloc(100 * 24 + 256), *p = text, key[16], value[16];
+	struct tml_doc *doc;
+	struct tml_node child, numbers;
+	long allocations;
+	bool pass;
+	int i;
+
+	p += sprintf(p, "[[numbers |");
+	for (i = 0; i < 40; ++i)
+		p += sprintf(p, " %d", i);
+	p += sprintf(p, "]");
+	for (i = 0; i < 100; ++i)
+		p += sprintf(p, " [k%d | v%d]", i, i);
+	sprintf(p, "]");
+
+	doc = tml_parse_string_alloc(text, TML_PARSE_CHILD_INDEX | TML_PARSE_NUMERIC_ARRAYS, &allocator);
+	pass = !doc->error_message;
+	allocations = counts.allocations;
+
+	for (i = 0; i < 100 && pass; ++i) {
+		sprintf(key, "k%d", i);
+		child = tml_find_key(&doc->root_node, key);
+		sprintf(value, "v%d", i);
+		child = tml_child_at_index(&child, 1);
+		child = tml_first_child(&child);
+		pass = !tml_is_null(&child) && strcmp(child.value, value) == 0;
+	}
+	/* the binary array after "numbers |" */
+	numbers = tml_find_key(&doc->root_node, "numbers");
+	numbers = tml_child_at_index(&numbers, 1);
+	child = tml_find_key(&numbers, "39");
+	pass = pass && !tml_is_null(&child) && strcmp(child.value, "39") == 0;
+	allocations = counts.allocations - allocations;
+
+	tml_free_doc(doc);
+	free(text);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (pass && allocations == 0 && counts.allocations == 0 && counts.bytes == 0) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Key lookup after TML_PARSE_CHILD_INDEX failed or allocated (%ld allocations, %ld bytes).\n",
+			FAIL_MSG, allocations, counts.bytes);
+	}
+}
+
+/* Parses lots of documents from an arena, resetting in between rounds */
+/* Runs the query over the root of the source, and checks that the nodes found, written out as markup and
+ * separated by commas, are the expected ones (or that the query doesn't compile, for NULL) */
+void test_query(const char *source_string, const char *path, const char *expected)
+{
+	struct tml_doc *doc = tml_parse_string(source_string);
+	struct tml_query *query = tml_compile_query(path);
+	struct tml_query_iter iter;
+	struct tml_node node;
+	char found[256], *p = found;
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (!query) {
+		pass = (expected == NULL);
+	}
+	else {
+		found[0] = '\0';
+		tml_query_begin(&iter, query, &doc->root_node);
+		while (node = tml_query_next(&iter), !tml_is_null(&node)) {
+			if (p != found)
+				*p++ = ',';
+			p += tml_node_to_markup_string(&node, p, found + sizeof(found) - p);
+		}
+		tml_query_end(&iter);
+
+		node = tml_query_first(&doc->root_node, query);
+		pass = expected && strcmp(found, expected) == 0 &&
+			(found[0] ? !tml_is_null(&node) : tml_is_null(&node));
+	}
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: \"%s\" found \"%s\"\n", FAIL_MSG, path, query ? found : "(no query)");
+	}
+
+	tml_free_query(query);
+	tml_free_doc(doc);
+}
+
+/* A "//" query over [[a [a [a ...]]]] has to grow its stack */
+void test_deep_query(int levels)
+{
+	char *text = malloc(levels * 4 + 8), *p = text;
+	struct tml_doc *doc;
+	struct tml_query *query = tml_compile_query("//a");
+	struct tml_query_iter iter;
+	struct tml_node node;
+	int i, found = 0;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	*p++ = '[';
+	for (i = 0; i < levels; ++i)
+		p += sprintf(p, "[a ");
+	memset(p, ']', levels + 1);
+	p[levels + 1] = '\0';
+
+	doc = tml_parse_string(text);
+	tml_query_begin(&iter, query, &doc->root_node);
+	while (node = tml_query_next(&iter), !tml_is_null(&node))
+		found++;
+	tml_query_end(&iter);
+
+	/* each [a ...] list, but not the word a naming it */
+	if (found == levels) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s\n", FAIL_MSG);
+	}
+
+	tml_free_query(query);
+	tml_free_doc(doc);
+	free(text);
+}
+
+void test_arena(int rounds)
+{
+	static const char *sources[] = {
+		"[a b c | d e f]",
+		"[bold | hello [italic | this] is a test]",
+		"[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[deep]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]",
+		"[a_word_longer_than_two_hundred_and_fifty_five_characters_aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+			"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+			"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa and_another]",
+		"[unclosed",
+		""
+	};
+	const int source_count = sizeof(sources) / sizeof(sources[0]);
+	struct tml_arena *arena = tml_arena_create(64);
+	struct tml_allocator allocator = tml_arena_allocator(arena);
+	int round, i;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	for (round = 0; round < rounds; ++round) {
+		struct tml_doc *adocs[sizeof(sources) / sizeof(sources[0])];
+
+		for (i = 0; i < source_count; ++i)
+			adocs[i] = tml_parse_string_alloc(sources[i], TML_PARSE_DEFAULT, &allocator);
+
+		for (i = 0; i < source_count; ++i) {
+			struct tml_doc *doc = tml_parse_string(sources[i]);
+			bool same = docs_identical(doc, adocs[i]);
+			tml_free_doc(doc);
+
+			if (!same) {
+				printf("%s: Arena parse of \"%s\" differs in round %d.\n", FAIL_MSG, sources[i], round);
+				tml_arena_destroy(arena);
+				return;
+			}
+		}
+
+		/* freeing some documents first mustn't matter */
+		if (round & 1)
+			tml_free_doc(adocs[source_count - 1]);
+
+		tml_arena_reset(arena);
+	}
+
+	tml_arena_destroy(arena);
+	printf("%s\n", PASS_MSG);
+	g_pass_count++;
+}
+
+/* Parses the source string in pieces of the given size with a push parser */
+struct tml_doc *push_parse_in_chunks(const char *source_string, size_t chunk_size)
+{
+	struct tml_push_parser *parser = tml_push_parser_create();
+	size_t len = strlen(source_string), pos;
+	char chunk[64];
+
+	for (pos = 0; pos < len; pos += chunk_size) {
+		size_t size = (len - pos < chunk_size) ? len - pos : chunk_size;
+		memcpy(chunk, source_string + pos, size);
+		tml_push_parse(parser, chunk, size);
+		memset(chunk, '#', sizeof(chunk)); /* the parser mustn't hold on to chunk data */
+	}
+
+	return tml_push_parser_finish(parser);
+}
+
+/* Incremental parsing must produce the same buffer as parsing all at once, however the text is split */
+void test_push_parser(const char *source_string)
+{
+	struct tml_doc *doc = tml_parse_string(source_string);
+	size_t chunk_size;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	for (chunk_size = 1; chunk_size <= 64; ++chunk_size) {
+		struct tml_doc *pdoc = push_parse_in_chunks(source_string, chunk_size);
+		bool same = docs_identical(doc, pdoc);
+		tml_free_doc(pdoc);
+
+		if (!same) {
+			printf("%s: Push parse in chunks of %d differs for \"%s\".\n", FAIL_MSG, (int)chunk_size, source_string);
+			tml_free_doc(doc);
+			return;
+		}
+	}
+
+	printf("%s\n", PASS_MSG);
+	g_pass_count++;
+	tml_free_doc(doc);
+}
+
+void test_push_parser_random(int iterations)
+{
+	static const char alphabet[] = "[]|\\ \t\r\nab";
+	char source[200];
+	int i, j;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	srand(4321);
+	for (i = 0; i < iterations; ++i) {
+		int len = rand() % (sizeof(source) - 3);
+		size_t chunk_size = 1 + rand() % 16;
+		source[0] = '[';
+		for (j = 1; j <= len; ++j)
+			source[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+		source[len + 1] = (i & 1) ? ']' : '\0';
+		source[len + 2] = '\0';
+
+		struct tml_doc *doc = tml_parse_string(source);
+		struct tml_doc *pdoc = push_parse_in_chunks(source, chunk_size);
+		bool same = docs_identical(doc, pdoc);
+		tml_free_doc(doc);
+		tml_free_doc(pdoc);
+
+		if (!same) {
+			printf("%s: Push parse in chunks of %d differs for \"%s\".\n", FAIL_MSG, (int)chunk_size, source);
+			return;
+		}
+	}
+
+	printf("%s\n", PASS_MSG);
+	g_pass_count++;
+}
+
+/* Event callbacks that write out each event they get, e.g. "[ a b |1 c ]" */
+struct event_log
+{
+	char text[1024];
+	int words_left;
+};
+
+static void log_event(struct event_log *log, const char *str, size_t str_len)
+{
+	size_t len = strlen(log->text);
+	if (len + str_len + 2 < sizeof(log->text)) {
+		if (len > 0) log->text[len++] = ' ';
+		memcpy(log->text + len, str, str_len);
+		log->text[len + str_len] = '\0';
+	}
+}
+
+static bool log_list_begin(void *user_data) { log_event(user_data, "[", 1); return true; }
+static bool log_list_end(void *user_data) { log_event(user_data, "]", 1); return true; }
+
+static bool log_word(void *user_data, const char *value, size_t value_size)
+{
+	struct event_log *log = user_data;
+	log_event(log, value, value_size);
+	return --log->words_left != 0;
+}
+
+static bool log_divider(void *user_data, int segment_index)
+{
+	char str[16];
+	sprintf(str, "|%d", segment_index);
+	log_event(user_data, str, strlen(str));
+	return true;
+}
+
+/* Parses with event callbacks, stopping after max_words words if nonzero. Expects an error if expected_events is NULL. */
+void test_events(const char *source_string, const char *expected_events, int max_words)
+{
+	struct event_log log;
+	struct tml_event_handler handler = { &log, log_list_begin, log_word, log_divider, log_list_end };
+	const char *err;
+
+	log.text[0] = '\0';
+	log.words_left = max_words;
+	err = tml_parse_string_events(source_string, &handler);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (expected_events == NULL) {
+		if (err) {
+			printf("%s\n", PASS_MSG);
+			g_pass_count++;
+		}
+		else
+			printf("%s: Expected error.\n", FAIL_MSG);
+		return;
+	}
+
+	if (err && max_words == 0) {
+		printf("%s: Unexpected parse error: \"%s\"\n", FAIL_MSG, err);
+		return;
+	}
+
+	if (strcmp(log.text, expected_events) == 0) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Produced \"%s\", expected \"%s\".\n", FAIL_MSG, log.text, expected_events);
+	}
+}
+
+/* Parses with limits set, through both the tree builder and events, expecting all to fail or all to pass -
+ * whether the limits are the defaults or given to just the one parse */
+void test_parse_limits(const char *source_string, size_t max_depth, size_t max_nodes, bool expect_pass)
+{
+	struct tml_event_handler handler = { NULL, NULL, NULL, NULL, NULL };
+	struct tml_parse_options options;
+	struct tml_push_parser *parser;
+	struct tml_doc *doc, *idoc, *odoc, *pdoc;
+	size_t len = strlen(source_string);
+	char *copy = malloc(len + 1);
+	const char *err, *oerr;
+	bool pass;
+
+	memcpy(copy, source_string, len + 1);
+
+	tml_set_parse_limits(max_depth, max_nodes);
+	doc = tml_parse_string(source_string);
+	idoc = tml_parse_string_ex(source_string, TML_PARSE_STRUCTURAL_INDEX);
+	err = tml_parse_string_events(source_string, &handler);
+	tml_set_parse_limits(0, 0);
+
+	tml_init_parse_options(&options);
+	options.max_depth = max_depth;
+	options.max_nodes = max_nodes;
+	odoc = tml_parse_string_opts(source_string, &options);
+	oerr = tml_parse_string_events_opts(source_string, &handler, &options);
+	parser = tml_push_parser_create_opts(&options);
+	tml_push_parse(parser, copy, len);
+	pdoc = tml_push_parser_finish(parser);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (expect_pass)
+		pass = !doc->error_message && !idoc->error_message && !err && !odoc->error_message && !oerr &&
+			!pdoc->error_message;
+	else
+		pass = doc->error_message && idoc->error_message && err && odoc->error_message && oerr &&
+			pdoc->error_message;
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Limits of %d depth and %d nodes %s \"%s\".\n", FAIL_MSG, (int)max_depth, (int)max_nodes,
+			expect_pass ? "rejected" : "accepted", source_string);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(idoc);
+	tml_free_doc(odoc);
+	tml_free_doc(pdoc);
+	free(copy);
+}
+
+/* Options made while default limits are set keep them, and limits given in options don't change the defaults */
+void test_default_parse_limits(void)
+{
+	struct tml_parse_options options;
+	struct tml_doc *doc, *odoc;
+	size_t max_depth, max_nodes;
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	tml_set_parse_limits(2, 0);
+	tml_init_parse_options(&options);
+	tml_set_parse_limits(0, 0);
+	pass = options.flags == TML_PARSE_DEFAULT && !options.allocator && options.max_depth == 2 && options.max_nodes == 0;
+
+	options.max_depth = 0;
+	options.max_nodes = 3;
+	odoc = tml_parse_string_opts("[a [b [c]]]", &options);
+	doc = tml_parse_string("[a [b [c]]]");
+	tml_get_parse_limits(&max_depth, &max_nodes);
+	pass = pass && odoc->error_message && !doc->error_message && max_depth == 0 && max_nodes == 0;
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Default parse limits weren't kept apart from options.\n", FAIL_MSG);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(odoc);
+}
+
+/* Nesting far deeper than any stack could recurse must still parse */
+void test_deep_nesting(int levels)
+{
+	char *text = malloc(levels * 2 + 8);
+	struct tml_doc *doc;
+	struct tml_node node;
+	int i, depth = 0;
+
+	for (i = 0; i < levels; ++i) text[i] = '[';
+	memcpy(&text[levels], "deep", 4);
+	for (i = 0; i < levels; ++i) text[levels + 4 + i] = ']';
+	text[levels * 2 + 4] = '\0';
+
+	doc = tml_parse_string(text);
+	node = doc->root_node;
+	while (!tml_is_null(&node) && tml_is_list(&node) && tml_has_children(&node)) {
+		node = tml_first_child(&node);
+		++depth;
+	}
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (!doc->error_message && depth == levels && strcmp(node.value, "deep") == 0) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Nesting %d levels deep gave depth %d.\n", FAIL_MSG, levels, depth);
+	}
+
+	tml_free_doc(doc);
+	free(text);
+}
+
+static size_t count_nodes(const struct tml_node *node)
+{
+	size_t count = 1;
+	struct tml_node child = tml_first_child(node);
+
+	for (; !tml_is_null(&child); child = tml_next_sibling(&child))
+		count += count_nodes(&child);
+	return count;
+}
+
+/* Parallel parsing must apply the node limit to the whole document, not each piece */
+void test_parallel_node_limit(void)
+{
+	size_t len, node_count;
+	char *text = make_wide_document(1 << 20, "]", &len);
+	char *copy = malloc(len);
+	struct tml_parse_options options;
+	struct tml_doc *doc;
+	bool pass;
+
+	doc = tml_parse_memory(text, len);
+	node_count = count_nodes(&doc->root_node);
+	tml_free_doc(doc);
+
+	memcpy(copy, text, len);
+	tml_set_parse_limits(0, node_count - 1);
+	doc = tml_parse_parallel(copy, len, TML_PARSE_DEFAULT, 4);
+	pass = doc->error_message != NULL;
+	tml_free_doc(doc);
+	tml_set_parse_limits(0, 0);
+
+	memcpy(copy, text, len);
+	tml_init_parse_options(&options);
+	options.max_nodes = node_count;
+	doc = tml_parse_parallel_opts(copy, len, &options, 4);
+	pass = pass && !doc->error_message;
+	tml_free_doc(doc);
+
+	memcpy(copy, text, len);
+	options.max_nodes = node_count - 1;
+	doc = tml_parse_parallel_opts(copy, len, &options, 4);
+	pass = pass && doc->error_message != NULL;
+	tml_free_doc(doc);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Parallel parse didn't limit the document to %d nodes.\n", FAIL_MSG, (int)node_count);
+	}
+
+	free(text);
+	free(copy);
+}
+
+void print_report()
+{
+	int pp = (int)(100 * (float)g_pass_count / (float)g_test_num);
+	printf("\n - Parser Test Suite: %d tests executed, %d passed (%d%%).\n\n", g_test_num, g_pass_count, pp);
+}
+
+/* Doubles must take up the given number of characters, and convert to the same value as strtod() does for them */
+void test_parse_double(const char *str, enum TML_NUMBER_STATUS expected_status, size_t expected_length)
+{
+	char prefix[128];
+	double value, expected;
+	size_t length;
+	enum TML_NUMBER_STATUS status = tml_parse_double(str, strlen(str), &value, &length);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	/* (strtod() accepts more than this does, such as hexadecimal) */
+	memcpy(prefix, str, expected_length);
+	prefix[expected_length] = '\0';
+	expected = expected_length ? strtod(prefix, NULL) : 0;
+
+	if (status == expected_status && length == expected_length &&
+		(memcmp(&value, &expected, sizeof(value)) == 0 || (value != value && expected != expected))) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: \"%s\" was read as %.17g (status %d, %d characters).\n", FAIL_MSG, str, value, (int)status, (int)length);
+	}
+}
+
+/* Random decimals (of up to 20 digits, with and without exponents), and doubles written out in full, must read
+ * the same as with strtod() */
+void test_parse_double_random(int iterations)
+{
+	char text[64];
+	int i, j;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	srand(9753);
+	for (i = 0; i < iterations; ++i) {
+		double value, expected;
+		size_t length, len = 0;
+		int digits = rand() % 20 + 1, point = rand() % (digits + 1);
+
+		if (i % 4 == 0) {
+			sprintf(text, "%.17g", (double)rand() / RAND_MAX * rand());
+		}
+		else {
+			if (rand() % 2) text[len++] = '-';
+			for (j = 0; j < digits; ++j) {
+				if (j == point) text[len++] = '.';
+				text[len++] = (char)('0' + rand() % 10);
+			}
+			if (i % 4 == 1) len += sprintf(text + len, "e%d", rand() % 80 - 40);
+			text[len] = '\0';
+		}
+
+		expected = strtod(text, NULL);
+		if (tml_parse_double(text, strlen(text), &value, &length) != TML_NUMBER_OK || value != expected ||
+			length != strlen(text)) {
+			printf("%s: \"%s\" was read as %.17g rather than %.17g.\n", FAIL_MSG, text, value, expected);
+			return;
+		}
+	}
+
+	printf("%s\n", PASS_MSG);
+	g_pass_count++;
+}
+
+/* Floats must convert to the given value */
+void test_parse_float(const char *str, float expected, enum TML_NUMBER_STATUS expected_status)
+{
+	float value;
+	size_t length;
+	enum TML_NUMBER_STATUS status = tml_parse_float(str, strlen(str), &value, &length);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (status == expected_status && value == expected && (status == TML_NUMBER_INVALID) == (length == 0)) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: \"%s\" was read as %.9g (status %d).\n", FAIL_MSG, str, value, (int)status);
+	}
+}
+
+/* Integers must convert to the given value (as each of int32, int64 and uint64, where it fits) */
+void test_parse_integer(const char *str, int64_t expected, enum TML_NUMBER_STATUS expected_status, size_t expected_length)
+{
+	int32_t value32;
+	int64_t value64;
+	uint64_t uvalue64;
+	size_t length32, length64, ulength64;
+	enum TML_NUMBER_STATUS status32 = tml_parse_int32(str, strlen(str), &value32, &length32);
+	enum TML_NUMBER_STATUS status64 = tml_parse_int64(str, strlen(str), &value64, &length64);
+	enum TML_NUMBER_STATUS ustatus64 = tml_parse_uint64(str, strlen(str), &uvalue64, &ulength64);
+	bool pass = status64 == expected_status && value64 == expected && length64 == expected_length;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	if (pass && expected_status == TML_NUMBER_OK && expected >= INT32_MIN && expected <= INT32_MAX)
+		pass = status32 == TML_NUMBER_OK && value32 == expected && length32 == expected_length;
+	else if (pass && expected_status == TML_NUMBER_OK)
+		pass = status32 == TML_NUMBER_OUT_OF_RANGE && value32 == (expected < 0 ? INT32_MIN : INT32_MAX);
+
+	if (pass && expected_status == TML_NUMBER_OK && expected >= 0)
+		pass = ustatus64 == TML_NUMBER_OK && uvalue64 == (uint64_t)expected && ulength64 == expected_length;
+	else if (pass && expected < 0)
+		pass = ustatus64 == TML_NUMBER_INVALID && uvalue64 == 0 && ulength64 == 0;
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: \"%s\" was read as %lld (status %d).\n", FAIL_MSG, str, (long long)value64, (int)status64);
+	}
+}
+
+/* Converting nodes must give the same as the number parsing functions, and 0 for lists */
+void test_node_numbers(void)
+{
+	struct tml_doc *doc = tml_parse_string("[12 -3.5e2 [7 8] word 18446744073709551615 99999999999]");
+	struct tml_node n = tml_first_child(&doc->root_node), list;
+	uint64_t big;
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	pass = tml_node_to_int(&n) == 12 && tml_node_to_double(&n) == 12 && tml_node_to_float(&n) == 12;
+	n = tml_next_sibling(&n);
+	pass = pass && tml_node_to_int(&n) == -3 && tml_node_to_double(&n) == -350 && tml_node_to_float(&n) == -350;
+	list = tml_next_sibling(&n);
+	pass = pass && tml_node_to_int(&list) == 0 && tml_node_to_double(&list) == 0 && tml_node_to_float(&list) == 0;
+	n = tml_next_sibling(&list);
+	pass = pass && tml_node_to_int(&n) == 0 && tml_node_to_double(&n) == 0;
+	n = tml_next_sibling(&n);
+	pass = pass && tml_parse_uint64(n.value, n.size, &big, NULL) == TML_NUMBER_OK && big == UINT64_MAX;
+	n = tml_next_sibling(&n);
+	pass = pass && tml_node_to_int(&n) == INT32_MAX;
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Numbers in nodes weren't converted correctly.\n", FAIL_MSG);
+	}
+
+	tml_free_doc(doc);
+}
+
+/* Reading a list of numbers at once must give the same as converting each child, and find the first that isn't
+ * one (for doubles, and for ints) */
+void test_number_array(const char *source_string, unsigned int flags, int max_count, int double_error, int int_error)
+{
+	struct tml_doc *doc = tml_parse_string_ex(source_string, flags);
+	struct tml_doc *mdoc = parse_mapped(source_string, flags);
+	struct tml_node child;
+	float floats[64];
+	double doubles[64];
+	int ints[64], float_error, double_error_found, int_error_found, mapped_error, count, i = 0;
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	count = tml_node_read_double_array(&doc->root_node, doubles, max_count, &double_error_found);
+	pass = tml_node_read_float_array(&doc->root_node, floats, max_count, &float_error) == count &&
+		tml_node_read_int_array(&doc->root_node, ints, max_count, &int_error_found) == count &&
+		tml_node_read_double_array(&mdoc->root_node, doubles, max_count, &mapped_error) == count &&
+		double_error_found == double_error && int_error_found == int_error && mapped_error == double_error &&
+		float_error == double_error && count == (tml_child_count(&doc->root_node) < max_count ?
+		tml_child_count(&doc->root_node) : max_count);
+
+	for (child = tml_first_child(&doc->root_node); pass && i < count; child = tml_next_sibling(&child), ++i)
+		pass = doubles[i] == tml_node_to_double(&child) && floats[i] == tml_node_to_float(&child) &&
+			ints[i] == tml_node_to_int(&child);
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Numbers read from \"%s\" were wrong (%d read, first errors %d and %d).\n", FAIL_MSG,
+			source_string, count, double_error_found, int_error_found);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(mdoc);
+}
+
+/* A long list of random numbers must read the same all at once as with strtod() */
+void test_number_array_random(int count)
+{
+	char *text = malloc(count * 32 + 3);
+	double *values = malloc(count * sizeof(double));
+	struct tml_doc *doc;
+	size_t len = 0;
+	int i, error;
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	srand(8642);
+	text[len++] = '[';
+	for (i = 0; i < count; ++i)
+		len += sprintf(text + len, (i % 3) ? " %.*g" : " %.*e", rand() % 18 + 1, ((double)rand() - RAND_MAX / 2) / (rand() % 1000 + 1));
+	text[len++] = ']';
+	text[len] = '\0';
+
+	doc = tml_parse_string_ex(text, TML_PARSE_INTERN);
+	pass = tml_node_read_double_array(&doc->root_node, values, count, &error) == count && error == -1;
+
+	for (i = 0, len = 1; pass && i < count; ++i) {
+		char *end;
+		pass = values[i] == strtod(text + len, &end);
+		len = end - text;
+	}
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Random numbers were read wrongly.\n", FAIL_MSG);
+	}
+
+	tml_free_doc(doc);
+	free(text);
+	free(values);
+}
+
+/* Returns the first binary array in the tree, or TML_NODE_NULL if there isn't one */
+static struct tml_node find_array(const struct tml_node *node)
+{
+	struct tml_array array;
+	struct tml_node child, found;
+
+	if (tml_node_array(node, &array))
+		return *node;
+	for (child = tml_first_child(node); !tml_is_null(&child); child = tml_next_sibling(&child)) {
+		found = find_array(&child);
+		if (!tml_is_null(&found))
+			return found;
+	}
+	return TML_NODE_NULL;
+}
+
+/* Returns true if the array's elements are aligned, and are the values of the list's children */
+static bool array_matches(const struct tml_array *array, const struct tml_node *list)
+{
+	static const size_t element_sizes[] = { 0, 1, 2, 4, 8, 4, 8 };
+	struct tml_node child = tml_first_child(list);
+	size_t i;
+
+	if (array->count != list->size || (uintptr_t)array->data % element_sizes[array->type] != 0)
+		return false;
+
+	for (i = 0; i < array->count; ++i, child = tml_next_sibling(&child)) {
+		int64_t integer;
+		bool same;
+
+		tml_parse_int64(child.value, child.size, &integer, NULL);
+		switch (array->type) {
+			case TML_ARRAY_INT8: same = ((const int8_t *)array->data)[i] == integer; break;
+			case TML_ARRAY_INT16: same = ((const int16_t *)array->data)[i] == integer; break;
+			case TML_ARRAY_INT32: same = ((const int32_t *)array->data)[i] == integer; break;
+			case TML_ARRAY_INT64: same = ((const int64_t *)array->data)[i] == integer; break;
+			case TML_ARRAY_FLOAT: same = ((const float *)array->data)[i] == tml_node_to_float(&child); break;
+			default: same = ((const double *)array->data)[i] == tml_node_to_double(&child); break;
+		}
+		if (!same)
+			return false;
+	}
+	return tml_is_null(&child);
+}
+
+/* Binary arrays among the root's children must be lists without child ids */
+static bool array_ids_empty(const struct tml_doc *doc)
+{
+	struct tml_array array;
+	tml_node_id id;
+
+	for (id = tml_first_child_id(doc, tml_root_id(doc)); id != TML_NODE_ID_NULL; id = tml_next_sibling_id(doc, id)) {
+		struct tml_node node = tml_node_at(doc, id);
+		if (tml_node_array(&node, &array) && (tml_first_child_id(doc, id) != TML_NODE_ID_NULL || !tml_is_list_id(doc, id)))
+			return false;
+	}
+	return true;
+}
+
+/* Reading a list all at once must give the same as reading each child, whether or not it's a binary array (except
+ * for doubles read as floats) */
+static bool bulk_reads_match(const struct tml_node *list, const struct tml_node *array_list)
+{
+	double doubles[64], array_doubles[64];
+	float floats[64], array_floats[64];
+	int ints[64], array_ints[64], errors[6], count;
+	struct tml_array array;
+
+	count = tml_node_read_double_array(list, doubles, 64, &errors[0]);
+	if (tml_node_read_double_array(array_list, array_doubles, 64, &errors[1]) != count ||
+		tml_node_read_int_array(list, ints, 64, &errors[2]) != count ||
+		tml_node_read_int_array(array_list, array_ints, 64, &errors[3]) != count ||
+		tml_node_read_float_array(list, floats, 64, &errors[4]) != count ||
+		tml_node_read_float_array(array_list, array_floats, 64, &errors[5]) != count)
+		return false;
+
+	if (errors[0] != errors[1] || errors[2] != errors[3] || memcmp(doubles, array_doubles, count * sizeof(double)) != 0 ||
+		memcmp(ints, array_ints, count * sizeof(int)) != 0)
+		return false;
+
+	tml_node_array(array_list, &array);
+	return array.type == TML_ARRAY_DOUBLE ||
+		(errors[4] == errors[5] && memcmp(floats, array_floats, count * sizeof(float)) == 0);
+}
+
+/* Lists of numbers must read the same stored as binary arrays (of the expected type, for the first one), and
+ * stay binary arrays when the document is compacted */
+void test_numeric_arrays(const char *source_string, unsigned int flags, enum TML_ARRAY_TYPE expected_type)
+{
+	struct tml_doc *doc = tml_parse_string_ex(source_string, flags);
+	struct tml_doc *adoc = tml_parse_string_ex(source_string, flags | TML_PARSE_NUMERIC_ARRAYS);
+	struct tml_node list, child;
+	struct tml_array array;
+	int round;
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	pass = docs_equivalent(doc, adoc);
+
+	for (round = 0; round < 3 && pass && !doc->error_message; ++round) {
+		/* as parsed, then deduplicated, then repacked */
+		if (round == 1) pass = tml_doc_dedup(adoc);
+		if (round == 2) pass = tml_doc_repack(adoc);
+
+		list = find_array(&adoc->root_node);
+		tml_node_array(&list, &array);
+		pass = pass && nodes_equal(&doc->root_node, &adoc->root_node) && sizes_correct(&adoc->root_node) &&
+			array.type == expected_type;
+
+		if (pass && expected_type != TML_ARRAY_NONE) {
+			struct tml_node last = tml_first_child(&list);
+			while (last.next_sibling)
+				last = tml_next_sibling(&last);
+
+			child = tml_first_child(&list);
+			pass = array_matches(&array, &list) && bulk_reads_match(&list, &list) &&
+				tml_find_key(&list, last.value).value == last.value &&
+				tml_child_at_index(&list, (int)array.count - 1).value == last.value &&
+				array_ids_empty(adoc) && child.value == tml_first_child(&list).value;
+		}
+	}
+
+	if (pass && expected_type != TML_ARRAY_NONE && !(flags & TML_PARSE_DEDUP))
+		pass = adoc->buff_index < doc->buff_index;
+
+	if (pass) {
 		printf("%s\n", PASS_MSG);
 		g_pass_count++;
 	}
 	else {
-		printf("%s\n", FAIL_MSG);
+		printf("%s: Numeric arrays parsed from \"%s\" were wrong.\n", FAIL_MSG, source_string);
 	}
 
-	tml_free_doc(c_doc);
-	tml_free_doc(p_doc);
+	tml_free_doc(doc);
+	tml_free_doc(adoc);
 }
 
-void print_report()
+/* Appends a list of random numbers, all written in one of a few ways (some of which can't be binary arrays) */
+static size_t append_random_numbers(char *text, size_t len)
 {
-	int pp = (int)(100 * (float)g_pass_count / (float)g_test_num);
-	printf("\n - Parser Test Suite: %d tests executed, %d passed (%d%%).\n\n", g_test_num, g_pass_count, pp);
+	int style = rand() % 6, count = rand() % 40, i, j;
+
+	text[len++] = '[';
+	for (i = 0; i < count; ++i) {
+		if (rand() % 200 == 0) {
+			len += sprintf(text + len, "word ");
+			continue;
+		}
+
+		switch (style) {
+			case 0: len += sprintf(text + len, "%d ", rand() % 200 - 100); break;
+			case 1: len += sprintf(text + len, "%d ", rand() % 70000 - 35000); break;
+			case 2: len += sprintf(text + len, "%ld%04d ", (long)(rand() % 2000000) - 1000000, rand() % 10000); break;
+			case 3: len += sprintf(text + len, "%.*g ", rand() % 17 + 1, ((double)rand() - RAND_MAX / 2) / (rand() % 1000 + 1)); break;
+			default: {
+				/* a decimal written without trailing zeros, of up to 6 (or 15) significant digits */
+				int digits = rand() % (style == 4 ? 4 : 12) + 1;
+				len += sprintf(text + len, "%s%d.", (rand() & 1) ? "-" : "", rand() % 100);
+				for (j = 0; j < digits; ++j)
+					text[len++] = (char)('0' + ((j == digits - 1) ? 1 + rand() % 9 : rand() % 10));
+				text[len++] = ' ';
+				break;
+			}
+		}
+	}
+	text[len++] = ']';
+	return len;
+}
+
+/* Random lists of numbers must read the same with and without TML_PARSE_NUMERIC_ARRAYS */
+/* With no memory to format a binary array's children, tml_index_children() must fail (and the array read as empty
+ * for now), and then make them once there is */
+void test_numeric_arrays_out_of_memory(void)
+{
+	struct counting_allocator counts = { 0, 0, false };
+	struct tml_allocator allocator = { &counts, counting_alloc, counting_resize, counting_release };
+	struct tml_doc *doc = tml_parse_string_alloc("[[data | 100000 200000 300000 400000]]", TML_PARSE_NUMERIC_ARRAYS,
+		&allocator);
+	struct tml_node list = tml_first_child(&doc->root_node), child;
+	struct tml_array array;
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	list = tml_first_child(&list);
+	list = tml_next_sibling(&list);
+
+	counts.out_of_memory = true;
+	pass = tml_node_array(&list, &array) && !tml_index_children(doc);
+	child = tml_first_child(&list);
+	pass = pass && tml_is_null(&child) && tml_child_count(&list) == 4;
+
+	/* once made, they don't need any more memory */
+	counts.out_of_memory = false;
+	pass = pass && tml_index_children(doc);
+	counts.out_of_memory = true;
+	child = tml_first_child(&list);
+	pass = pass && !tml_is_null(&child) && strcmp(child.value, "100000") == 0;
+	child = tml_child_at_index(&list, 3);
+	pass = pass && !tml_is_null(&child) && strcmp(child.value, "400000") == 0;
+	counts.out_of_memory = false;
+
+	tml_free_doc(doc);
+
+	if (pass && counts.allocations == 0 && counts.bytes == 0) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Binary array children weren't made correctly when out of memory.\n", FAIL_MSG);
+	}
+}
+
+/* Leaves whose text starts with an escaped null character look like lists by their value, but only binary arrays
+ * of all of those nodes have children */
+void test_escaped_null_leaves(unsigned int flags)
+{
+	static const char start[] = "[\\\0ab [1 2 3 4] \\\0";
+	char text[512];
+	size_t size = sizeof(start) - 1;
+	struct tml_doc *doc;
+	struct tml_node child;
+	bool pass = true;
+	int i, children = 0;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	memcpy(text, start, size);
+	for (i = 0; i < 200; ++i)
+		text[size++] = 'c';
+	memcpy(text + size, " []]", 4);
+	size += 4;
+
+	doc = tml_parse_memory_ex(text, size, flags);
+	for (child = tml_first_child(&doc->root_node); !tml_is_null(&child); child = tml_next_sibling(&child)) {
+		struct tml_node first = tml_first_child(&child);
+		bool array = children == 1 && (flags & TML_PARSE_NUMERIC_ARRAYS);
+		pass = pass && tml_is_array(&child) == array && tml_has_children(&child) == (children == 1) &&
+			tml_is_null(&first) == (children != 1);
+		children++;
+	}
+	pass = pass && !doc->error_message && children == 4;
+
+	tml_free_doc(doc);
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Leaves starting with an escaped null character were taken for lists with children.\n", FAIL_MSG);
+	}
+}
+
+/* A binary array which is the first child of a long list must keep a child table of its own, whichever of the two
+ * is read first (and with every table made at once, by TML_PARSE_CHILD_INDEX) */
+void test_numeric_array_first_child(bool parent_first, unsigned int flags)
+{
+	char text[256], markup[256], expected[256];
+	struct tml_doc *doc, *plain_doc;
+	struct tml_node array, parent_child = TML_NODE_NULL, array_child = TML_NODE_NULL;
+	bool pass;
+	int i;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	strcpy(text, "[[1 2 3 4]");
+	for (i = 0; i < 40; ++i)
+		strcat(text, " w");
+	strcat(text, "]");
+
+	doc = tml_parse_string_ex(text, TML_PARSE_NUMERIC_ARRAYS | flags);
+	plain_doc = tml_parse_string(text);
+	array = tml_first_child(&doc->root_node);
+
+	for (i = 0; i < 2; ++i) {
+		if (parent_first == (i == 0))
+			parent_child = tml_child_at_index(&doc->root_node, 39);
+		else
+			array_child = tml_child_at_index(&array, 3);
+	}
+
+	pass = tml_is_list(&array) && tml_child_count(&array) == 4 &&
+		!tml_is_null(&parent_child) && strcmp(parent_child.value, "w") == 0 &&
+		!tml_is_null(&array_child) && strcmp(array_child.value, "4") == 0;
+
+	parent_child = tml_child_at_index(&doc->root_node, 0);
+	array_child = tml_first_child(&array);
+	pass = pass && tml_is_list(&parent_child) && strcmp(array_child.value, "1") == 0;
+
+	tml_node_to_markup_string(&doc->root_node, markup, sizeof(markup));
+	tml_node_to_markup_string(&plain_doc->root_node, expected, sizeof(expected));
+	pass = pass && strcmp(markup, expected) == 0;
+
+	tml_free_doc(doc);
+	tml_free_doc(plain_doc);
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: A binary array first in a long list reads wrong (%s first).\n", FAIL_MSG,
+			parent_first ? "parent" : "array");
+	}
+}
+
+void test_numeric_arrays_random(int iterations)
+{
+	static const unsigned int flags[] = { TML_PARSE_DEFAULT, TML_PARSE_WIDE_OFFSETS, TML_PARSE_INTERN,
+		TML_PARSE_DEDUP, TML_PARSE_CHILD_INDEX };
+	char text[8192];
+	int i, j, array_count = 0;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	srand(97531);
+	for (i = 0; i < iterations; ++i) {
+		unsigned int doc_flags = flags[i % 5];
+		struct tml_doc *doc, *adoc;
+		struct tml_node list, array_list;
+		struct tml_array array;
+		size_t len = 0;
+		bool same;
+
+		text[len++] = '[';
+		for (j = rand() % 8; j >= 0; --j)
+			len = append_random_numbers(text, len);
+		text[len++] = ']';
+		text[len] = '\0';
+
+		doc = tml_parse_string_ex(text, doc_flags);
+		adoc = tml_parse_string_ex(text, doc_flags | TML_PARSE_NUMERIC_ARRAYS);
+		if (i % 7 == 0)
+			tml_doc_repack(adoc);
+		same = nodes_equal(&doc->root_node, &adoc->root_node) && sizes_correct(&adoc->root_node);
+
+		list = tml_first_child(&doc->root_node);
+		array_list = tml_first_child(&adoc->root_node);
+		for (; same && !tml_is_null(&list); list = tml_next_sibling(&list), array_list = tml_next_sibling(&array_list)) {
+			if (tml_node_array(&array_list, &array)) {
+				array_count++;
+				same = array_matches(&array, &list);
+			}
+			same = same && bulk_reads_match(&list, &array_list);
+		}
+
+		tml_free_doc(doc);
+		tml_free_doc(adoc);
+
+		if (!same) {
+			printf("%s: Numeric arrays read wrongly for \"%s\".\n", FAIL_MSG, text);
+			return;
+		}
+	}
+
+	if (array_count > iterations) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Only %d lists became numeric arrays.\n", FAIL_MSG, array_count);
+	}
+}
+
+/* Parallel parsing must store the same lists as binary arrays as sequential parsing */
+void test_numeric_arrays_parallel(unsigned int flags, int thread_count)
+{
+	size_t size = 1 << 20, len = 0;
+	char *text = malloc(size + 4096), *copy;
+	struct tml_doc *doc, *pdoc;
+	struct tml_node list, plist;
+	struct tml_array array, parray;
+	bool same;
+
+	srand(13579);
+	text[len++] = '[';
+	while (len < size) {
+		len = append_random_numbers(text, len);
+		text[len++] = '\n';
+	}
+	text[len++] = ']';
+	copy = malloc(len);
+	memcpy(copy, text, len);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	doc = tml_parse_in_memory_ex(text, len, flags | TML_PARSE_NUMERIC_ARRAYS);
+	pdoc = tml_parse_parallel(copy, len, flags | TML_PARSE_NUMERIC_ARRAYS, thread_count);
+	same = !doc->error_message && !pdoc->error_message && nodes_equal(&doc->root_node, &pdoc->root_node);
+
+	list = tml_first_child(&doc->root_node);
+	plist = tml_first_child(&pdoc->root_node);
+	for (; same && !tml_is_null(&list); list = tml_next_sibling(&list), plist = tml_next_sibling(&plist)) {
+		same = tml_node_array(&list, &array) == tml_node_array(&plist, &parray) && array.type == parray.type &&
+			array.count == parray.count && (array.type == TML_ARRAY_NONE || array_matches(&parray, &plist));
+	}
+
+	if (same) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Parallel parse of numeric arrays with %d threads differs.\n", FAIL_MSG, thread_count);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(pdoc);
+	free(text);
+	free(copy);
+}
+
+/* Every conversion of a leaf of a document parsed with TML_PARSE_TYPED_LEAVES must give exactly what converting
+ * the same leaf's text does, bit for bit */
+static bool leaves_convert_same(const struct tml_node *node, const struct tml_node *typed)
+{
+	struct tml_node child, typed_child;
+	double number = tml_node_to_double(node), typed_number = tml_node_to_double(typed);
+	float single = tml_node_to_float(node), typed_single = tml_node_to_float(typed);
+
+	if (tml_node_to_int(node) != tml_node_to_int(typed) || tml_node_to_int64(node) != tml_node_to_int64(typed) ||
+		memcmp(&number, &typed_number, sizeof(number)) != 0 || memcmp(&single, &typed_single, sizeof(single)) != 0 ||
+		tml_node_to_bool(node) != tml_node_to_bool(typed) || tml_leaf_type(node) != tml_leaf_type(typed))
+		return false;
+
+	child = tml_first_child(node);
+	typed_child = tml_first_child(typed);
+	for (; !tml_is_null(&child); child = tml_next_sibling(&child), typed_child = tml_next_sibling(&typed_child)) {
+		if (!leaves_convert_same(&child, &typed_child))
+			return false;
+	}
+	return tml_is_null(&typed_child);
+}
+
+/* Typed leaves must read the same as words, as parsed (from a string or a mapped file), deduplicated and repacked,
+ * and take more space if there are any */
+void test_typed_leaves(const char *source_string, unsigned int flags, bool has_typed)
+{
+	struct tml_doc *doc = tml_parse_string_ex(source_string, flags);
+	struct tml_doc *tdoc = tml_parse_string_ex(source_string, flags | TML_PARSE_TYPED_LEAVES);
+	struct tml_doc *mdoc = parse_mapped(source_string, flags | TML_PARSE_TYPED_LEAVES);
+	int round;
+	bool pass;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	pass = docs_equivalent(doc, tdoc) && docs_equivalent(doc, mdoc);
+	if (pass && !doc->error_message) {
+		pass = nodes_equal(&doc->root_node, &mdoc->root_node) && leaves_convert_same(&doc->root_node, &mdoc->root_node) &&
+			(tdoc->buff_index > doc->buff_index) == has_typed;
+	}
+
+	for (round = 0; round < 3 && pass && !doc->error_message; ++round) {
+		/* as parsed, then deduplicated, then repacked */
+		if (round == 1) pass = tml_doc_dedup(tdoc);
+		if (round == 2) pass = tml_doc_repack(tdoc);
+
+		pass = pass && nodes_equal(&doc->root_node, &tdoc->root_node) && sizes_correct(&tdoc->root_node) &&
+			leaves_convert_same(&doc->root_node, &tdoc->root_node) &&
+			((flags & TML_PARSE_NUMERIC_ARRAYS) || ids_match(tdoc, tml_root_id(tdoc), &tdoc->root_node));
+	}
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Typed leaves parsed from \"%s\" read differently.\n", FAIL_MSG, source_string);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(tdoc);
+	tml_free_doc(mdoc);
+}
+
+/* Every word must have the type its text does, whether it was found while parsing or not */
+void test_leaf_types(unsigned int flags)
+{
+	static const enum TML_LEAF_TYPE expected[] = { TML_LEAF_INT, TML_LEAF_INT, TML_LEAF_INT, TML_LEAF_DOUBLE,
+		TML_LEAF_DOUBLE, TML_LEAF_DOUBLE, TML_LEAF_DOUBLE, TML_LEAF_DOUBLE, TML_LEAF_BOOL, TML_LEAF_BOOL,
+		TML_LEAF_STRING, TML_LEAF_STRING, TML_LEAF_STRING, TML_LEAF_STRING, TML_LEAF_NONE };
+	struct tml_doc *doc = tml_parse_string_ex("[12 -0 +7 0.5 1e9 inf nan 99999999999999999999 true false True 12a "
+		"1e999 - [x]]", flags);
+	struct tml_node child = tml_first_child(&doc->root_node);
+	int i;
+	bool pass = tml_leaf_type(&doc->root_node) == TML_LEAF_NONE && tml_leaf_type(&TML_NODE_NULL) == TML_LEAF_NONE;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	for (i = 0; i < (int)(sizeof(expected) / sizeof(expected[0])); ++i) {
+		pass = pass && tml_leaf_type(&child) == expected[i];
+		child = tml_next_sibling(&child);
+	}
+	child = tml_child_at_index(&doc->root_node, 8);
+	pass = pass && tml_is_null(&child) == false && tml_node_to_bool(&child) &&
+		!tml_node_to_bool(&doc->root_node) && tml_node_to_int64(&doc->root_node) == 0;
+	child = tml_next_sibling(&child);
+	pass = pass && !tml_node_to_bool(&child);
+
+	if (pass) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Leaf types are wrong (with flags %u).\n", FAIL_MSG, flags);
+	}
+
+	tml_free_doc(doc);
+}
+
+/* Appends a random word that's a number (of any kind), "true", "false" or not a number at all */
+static size_t append_random_word(char *text, size_t len)
+{
+	static const char *words[] = { "true", "false", "-0", "+12", "007", "inf", "-nan", "1e999", "1e-999", "0x10",
+		"12a", "-", ".5", "5.", "3.4028236e38", "word", "9223372036854775807", "-9223372036854775808",
+		"9223372036854775808", "18446744073709551616" };
+	int i, length;
+
+	switch (rand() % 6) {
+		case 0: return len + sprintf(text + len, "%s ", words[rand() % (sizeof(words) / sizeof(words[0]))]);
+		case 1: return len + sprintf(text + len, "%d ", rand() - RAND_MAX / 2);
+		case 2: return len + sprintf(text + len, "%ld%09d ", (long)(rand() % 20000000) - 10000000, rand() % 1000000000);
+		case 3: return len + sprintf(text + len, "%.*g ", rand() % 17 + 1, ((double)rand() - RAND_MAX / 2) / (rand() % 1000 + 1));
+		case 4: return len + sprintf(text + len, "%d.%de%d ", rand() % 20 - 10, rand(), rand() % 90 - 45);
+		default:
+			/* a long string of digits, around the longest leaf that's typed */
+			length = 118 + rand() % 8;
+			for (i = 0; i < length; ++i)
+				text[len++] = (char)('0' + (i == 0 ? 1 + rand() % 9 : rand() % 10));
+			text[len++] = ' ';
+			return len;
+	}
+}
+
+/* Random words must convert the same with and without TML_PARSE_TYPED_LEAVES */
+void test_typed_leaves_random(int iterations)
+{
+	static const unsigned int flags[] = { TML_PARSE_DEFAULT, TML_PARSE_WIDE_OFFSETS, TML_PARSE_INTERN,
+		TML_PARSE_DEDUP, TML_PARSE_NUMERIC_ARRAYS, TML_PARSE_STRUCTURAL_INDEX };
+	char text[16384];
+	int i, j, k;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	srand(24680);
+	for (i = 0; i < iterations; ++i) {
+		unsigned int doc_flags = flags[i % 6];
+		struct tml_doc *doc, *tdoc;
+		size_t len = 0;
+		bool same;
+
+		text[len++] = '[';
+		for (j = rand() % 6; j >= 0; --j) {
+			text[len++] = '[';
+			for (k = rand() % 20; k >= 0; --k)
+				len = append_random_word(text, len);
+			text[len++] = ']';
+		}
+		text[len++] = ']';
+		text[len] = '\0';
+
+		doc = tml_parse_string_ex(text, doc_flags);
+		tdoc = tml_parse_string_ex(text, doc_flags | TML_PARSE_TYPED_LEAVES);
+		if (i % 5 == 0)
+			tml_doc_repack(tdoc);
+		same = nodes_equal(&doc->root_node, &tdoc->root_node) && sizes_correct(&tdoc->root_node) &&
+			leaves_convert_same(&doc->root_node, &tdoc->root_node);
+
+		tml_free_doc(doc);
+		tml_free_doc(tdoc);
+
+		if (!same) {
+			printf("%s: Typed leaves read differently for \"%s\".\n", FAIL_MSG, text);
+			return;
+		}
+	}
+
+	printf("%s\n", PASS_MSG);
+	g_pass_count++;
+}
+
+/* Parallel parsing must give the same typed leaves as sequential parsing */
+void test_typed_leaves_parallel(unsigned int flags, int thread_count)
+{
+	size_t size = 1 << 20, len = 0;
+	char *text = malloc(size + 4096), *copy;
+	struct tml_doc *doc, *pdoc;
+	bool same;
+
+	srand(86420);
+	text[len++] = '[';
+	while (len < size) {
+		len = append_random_word(text, len);
+		if (rand() % 10 == 0)
+			len += sprintf(text + len, "[a %d] ", rand());
+	}
+	text[len++] = ']';
+	copy = malloc(len);
+	memcpy(copy, text, len);
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	doc = tml_parse_in_memory_ex(text, len, flags);
+	pdoc = tml_parse_parallel(copy, len, flags | TML_PARSE_TYPED_LEAVES, thread_count);
+	same = !doc->error_message && !pdoc->error_message && nodes_equal(&doc->root_node, &pdoc->root_node) &&
+		leaves_convert_same(&doc->root_node, &pdoc->root_node) && tml_doc_repack(pdoc) &&
+		leaves_convert_same(&doc->root_node, &pdoc->root_node);
+
+	if (same) {
+		printf("%s\n", PASS_MSG);
+		g_pass_count++;
+	}
+	else {
+		printf("%s: Parallel parse of typed leaves with %d threads differs.\n", FAIL_MSG, thread_count);
+	}
+
+	tml_free_doc(doc);
+	tml_free_doc(pdoc);
+	free(text);
+	free(copy);
 }
 
 int main(void)
@@ -233,7 +2753,350 @@ int main(void)
 	test_pattern_match("[bold | hello, this is a test!]", "[bold|\\*]", true);
 	test_pattern_match("[bold | hello, this is a test!]", "[italic|\\*]", false);
 	test_pattern_match("[bold | hello, [italic | this] is a test!]", "[bold|\\*]", true);
+	test_compiled_pattern_search(10);
+	test_compiled_pattern_search(100);
+	test_pattern_set();
+
+	/* test path queries */
+	test_query("[[opengl model | [buffer vertex | [data position | 1 2 3] [data normal | 0 0 1]]]]",
+		"opengl model/buffer vertex/data position/*", "1,2,3");
+	test_query("[[opengl model | [buffer vertex | [data position | 1 2 3] [data normal | 0 0 1]]]]",
+		"opengl model/buffer vertex/data \\?", "[[data position] [1 2 3]],[[data normal] [0 0 1]]");
+	test_query("[[opengl model | [buffer vertex | [data position | 1 2 3] [data normal | 0 0 1]]]]",
+		"opengl model/buffer vertex/data *", "[[data position] [1 2 3]],[[data normal] [0 0 1]]");
+	test_query("[[opengl model | [buffer vertex | [data position | 1 2 3] [data normal | 0 0 1]]]]",
+		"opengl/buffer vertex", "");
+	test_query("[[opengl model | [buffer vertex | [data position | 1 2 3] [data normal | 0 0 1]]]]",
+		"//data normal/*", "0,0,1");
+	test_query("[[opengl model | [buffer vertex | [data position | 1 2 3] [data normal | 0 0 1]]]]",
+		"opengl model//data ?/1", "1,1");
+	test_query("[[position 1 2 3] [color | red] [color green] [size 2]]", "color", "[[color] [red]],[color green]");
+	test_query("[[position 1 2 3] [color | red] [color green] [size 2]]", "color/?", "red,green");
+	test_query("[[position 1 2 3] [color | red] [color green] [size 2]]", "position 1/*", "2,3");
+	test_query("[[position 1 2 3] [color | red] [color green] [size 2]]", "*/2", "2,2");
+	test_query("[[a | b | [c] d] [a | | e]]", "a/*", "b,[c],d,e");
+	test_query("[[a | b | [c] d] [a | | e]]", "a/c", "[c]");
+	test_query("[[a [b [a c]]] [a c]]", "//a c", "[a c],[a c]");
+	test_query("[[a [b [a c]]] [a c]]", "//a//c", "c,c,c");
+	test_query("[[mesh | [name | box]] [name | top]]", "//name", "[[name] [box]],[[name] [top]]");
+	test_query("[[opengl model | [buffer vertex | [data position | 1 2 3] [data normal | 0 0 1]]]]",
+		"//data position", "[[data position] [1 2 3]]");
+	test_query("[[a\\sb | 1] [a\\/b | 2] [x\\?y | 3]]", "a\\sb/*", "1");
+	test_query("[[a\\sb | 1] [a\\/b | 2] [x\\?y | 3]]", "/a\\/b/*", "2");
+	test_query("[a b c]", "b", "b");
+	test_query("[a b c]", "", NULL);
+	test_query("[a b c]", "a//", NULL);
+	test_query("[a b c]", "a///b", NULL);
+	test_query("[a b c]", "* a", NULL);
+	test_deep_query(1000);
+
+	/* test the structural index parser against the default parser */
+	test_structural_index("[a b c | d e f]");
+	test_structural_index("[bold | hello [italic | this] is a test]");
+	test_structural_index("[ [a|] || this is a comment\n b c |\n 1 2 3 ]");
+	test_structural_index("[a||comment]\n||another\r b]");
+	test_structural_index("[esc\\aped \\s \\[words\\] \\| and \\\\ backslashes\\]");
+	test_structural_index("[words\nwith\r\nline breaks]");
+	test_structural_index("[a_word_long_enough_to_cross_the_boundary_between_two_64_byte_blocks_of_input]");
+	test_structural_index("[a_word_long_enough_to_cross_the_boundary_between_two_64_byte_blo\\sks_of_input]");
+	test_structural_index("[..............................................................|| comment]\n]");
+	test_structural_index("[...............................................................\\|| x]");
+	test_structural_index("[a \\");
+	test_structural_index("[a |");
+	test_structural_index("");
+
+	/* test memory mapped file parsing */
+	test_mapped_file("[a b c | d e f]");
+	test_mapped_file("[bold | hello [italic | everyone] this is a test]");
+	test_mapped_file("[long_word_1 long_word_2\tlong_word_3 [long_word_4] long_word_5|long_word_6 ]");
+	test_mapped_file("[escaped\\sword \\[escaped\\] escaped\\|word]");
+	test_mapped_file("[a_long_word_with_a_comment_after|| comment\n another_long_word]");
+	test_mapped_file("[a_long_word_at_the_end_of_the_file");
+	test_mapped_file("[a_long_word_ending_with_a_backslash\\");
+	test_mapped_file("[a]");
+	test_mapped_file("");
+	test_mapped_file("[a] b");
+	test_mapped_file_random(2000);
+	test_mapped_references();
+	test_mapped_lookups();
+
+	/* test 64 bit offsets */
+	test_wide_offsets("[]", 1);
+	test_wide_offsets("[a b c]", 1);
+	test_wide_offsets("[a b c | d e f]", 3);
+	test_wide_offsets("[bold | hello [italic | this] is a test]", 6);
+	test_wide_offsets("[a [b [c] d] e]", 3);
+	test_wide_offsets("[a_word_longer_than_two_hundred_and_fifty_five_characters_aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa and_another]", 2);
+	test_wide_offsets("[unclosed", 0);
+
+	/* test string interning */
+	test_interning("[a b c]", 0);
+	test_interning("[style style style]", 2 * (7 - 5));
+	test_interning("[[stop | offset style] [stop | offset style] [id id id]]", (6 - 5) + (8 - 5) + (7 - 5));
+	test_interning("[offset [offset | offset] offset]", 3 * (8 - 5));
+	test_interning("[a_word_of_248_characters_is_never_interned_aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa a_word_of_248_characters_is_never_interned_aaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa]", 0);
+	test_interning("[esc\\saped esc\\saped [esc\\saped]]", 2 * (10 - 5));
+	test_interning("[unclosed unclosed", 0);
+
+	/* test subtree deduplication */
+	test_dedup("[a b c]", TML_PARSE_DEFAULT);
+	test_dedup("[[type float3] [type float3] [layout interleaved] [type float3]]", TML_PARSE_DEFAULT);
+	test_dedup("[[stop | offset [style a]] [stop | offset [style a]] [stop | offset [style b]]]", TML_PARSE_DEFAULT);
+	test_dedup("[[stop | offset [style a]] [stop | offset [style a]]]", TML_PARSE_WIDE_OFFSETS);
+	test_dedup("[[[a] [a]] [[a] [a]] [] [] a]", TML_PARSE_INTERN);
+	test_dedup("[[a_word_longer_than_two_hundred_and_fifty_five_characters_aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa x] [a_word_"
+		"longer_than_two_hundred_and_fifty_five_characters_aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa x]]", TML_PARSE_DEFAULT);
+	test_dedup("[unclosed [list", TML_PARSE_DEFAULT);
+	test_dedup_random(2000);
+
+	/* test repacking */
+	test_repack("[]", TML_PARSE_DEFAULT);
+	test_repack("[a b c]", TML_PARSE_DEFAULT);
+	test_repack("[bold | hello [italic | this] is a test]", TML_PARSE_DEFAULT);
+	test_repack("[[a [b [c] d] e] [f | g [h] | i] another_word_long_enough_to_map]", TML_PARSE_WIDE_OFFSETS);
+	test_repack("[[stop | offset style] [stop | offset style] esc\\saped esc\\saped]", TML_PARSE_INTERN);
+	test_repack("[[type float3] [type float3] [layout interleaved] [type float3]]", TML_PARSE_DEDUP);
+	test_repack("[a_word_too_long_to_pack_aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa [x]]", TML_PARSE_DEFAULT);
+	test_repack("[unclosed [list", TML_PARSE_DEFAULT);
+
+	/* test iterating by node id */
+	test_node_ids("[]", TML_PARSE_DEFAULT);
+	test_node_ids("[bold | hello [italic | this] is a test]", TML_PARSE_DEFAULT);
+	test_node_ids("[[a [b [c] d] e] [f | g [h] | i] another_word_long_enough_to_map]", TML_PARSE_WIDE_OFFSETS);
+	test_node_ids("[[stop | offset style] [stop | offset style] esc\\saped esc\\saped]", TML_PARSE_INTERN);
+	test_node_ids("[[type float3] [type float3] [layout interleaved] [type float3]]", TML_PARSE_DEDUP);
+	test_node_ids("[a_word_too_long_to_pack_aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa [x]]", TML_PARSE_DEFAULT);
+	test_node_ids("[unclosed [list", TML_PARSE_DEFAULT);
+	test_node_ids("[[data | 100000 200000 300000 400000] [more 1.25 2.5 3.75 5.125 6.25]]", TML_PARSE_NUMERIC_ARRAYS);
+	test_node_ids("[[data | 100000 200000 300000 400000] [more 1.25 2.5 3.75 5.125 6.25]]",
+		TML_PARSE_NUMERIC_ARRAYS | TML_PARSE_WIDE_OFFSETS);
+	test_node_ids_numeric_arrays(TML_PARSE_DEFAULT);
+	test_node_ids_numeric_arrays(TML_PARSE_WIDE_OFFSETS);
+	test_node_ids_too_large();
+
+	/* test node sizes */
+	test_node_sizes("[]", TML_PARSE_DEFAULT);
+	test_node_sizes("[a bb ccc [] [d] [e f | g h i | j]]", TML_PARSE_DEFAULT);
+	test_node_sizes("[a bb ccc [] [d] [e f | g h i | j]]", TML_PARSE_WIDE_OFFSETS);
+	test_node_sizes("[[| a] [a |] [| |] word_of_123_characters_is_the_longest_packed_aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa word_of_124_characters_has_full_links_aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa]", TML_PARSE_DEFAULT);
+	test_node_sizes("[[stop | offset style] [stop | offset style] esc\\saped esc\\saped esc\\saped]", TML_PARSE_INTERN);
+	test_node_sizes("[[type float3] [type float3] [layout interleaved] [type float3]]", TML_PARSE_DEDUP);
+
+	/* test parallel parsing */
+	srand(8765);
+	test_parallel("]", TML_PARSE_DEFAULT, 2);
+	test_parallel("]", TML_PARSE_DEFAULT, 3);
+	test_parallel("]", TML_PARSE_DEFAULT, 8);
+	test_parallel("]", TML_PARSE_DEFAULT, 0);
+	test_parallel("long_final_word_which_is_more_than_two_hundred_and_fifty_two_characters_long_aaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa]", TML_PARSE_DEFAULT, 5);
+	test_parallel("]", TML_PARSE_STRUCTURAL_INDEX, 4);
+	test_parallel("]", TML_PARSE_WIDE_OFFSETS, 4);
+	test_parallel("]", TML_PARSE_INTERN, 4);
+	test_parallel("]", TML_PARSE_INTERN | TML_PARSE_WIDE_OFFSETS, 4);
+	test_parallel(" | divided root ]", TML_PARSE_INTERN, 4);
+	test_parallel("  || comment at the end\n", TML_PARSE_DEFAULT, 4);
+	test_parallel(" | divided root ]", TML_PARSE_DEFAULT, 4);
+	test_parallel("] trailing", TML_PARSE_DEFAULT, 4);
+	test_parallel("", TML_PARSE_DEFAULT, 4);
+
+	/* test custom allocators */
+	test_custom_allocator("[a b c | d e f]");
+	test_custom_allocator("[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[deep]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]");
+	test_custom_allocator("[unclosed [list");
+	test_custom_allocator("");
+	test_arena(10);
+
+	/* test child indexing */
+	test_child_index(10, TML_PARSE_DEFAULT);
+	test_child_index(33, TML_PARSE_DEFAULT);
+	test_child_index(200000, TML_PARSE_DEFAULT);
+	test_child_index(200000, TML_PARSE_CHILD_INDEX);
+	test_child_index(1000, TML_PARSE_WIDE_OFFSETS);
+	test_child_index(1000, TML_PARSE_WIDE_OFFSETS | TML_PARSE_CHILD_INDEX);
+
+	/* test key lookup */
+	test_key_lookup(5, false);
+	test_key_lookup(5, true);
+	test_key_lookup(100000, false);
+	test_key_lookup(1000, true);
+	test_indexed_key_lookup();
+
+	/* test event parsing */
+	test_events("[]", "[ ]", 0);
+	test_events("[a b c]", "[ a b c ]", 0);
+	test_events("[a [b [c]] d]", "[ a [ b [ c ] ] d ]", 0);
+	test_events("[a b | c | d]", "[ a b |1 c |2 d ]", 0);
+	test_events("[bold | hello [italic | this] is]", "[ bold |1 hello [ italic |1 this ] is ]", 0);
+	test_events("[esc\\aped || comment\n word]", "[ escaped word ]", 0);
+	test_events("[a b c d]", "[ a b", 2);
+	test_events("[a b c d]", NULL, 2);
+	test_events("", NULL, 0);
+	test_events("[a b", NULL, 0);
+	test_events("[a] b", NULL, 0);
+	test_events("a b", NULL, 0);
+
+	/* test parse limits */
+	test_deep_nesting(100000);
+	test_parse_limits("[a [b [c]]]", 3, 0, true);
+	test_parse_limits("[a [b [c]]]", 2, 0, false);
+	test_parse_limits("[a | b [c]]", 3, 0, true);
+	test_parse_limits("[a | b [c]]", 2, 0, false);
+	test_parse_limits("[a | b | c]", 2, 0, true);
+	test_parse_limits("[a b [c d]]", 0, 6, true);
+	test_parse_limits("[a b [c d]]", 0, 5, false);
+	test_parse_limits("[a | b | c]", 0, 7, true);
+	test_parse_limits("[a | b | c]", 0, 6, false);
+	test_default_parse_limits();
+	test_parallel_node_limit();
+	test_structural_index_random(20000);
+
+	/* test incremental parsing */
+	test_push_parser("[a b c | d e f]");
+	test_push_parser("[bold | hello [italic | this] is a test]");
+	test_push_parser("[ [a|] || this is a comment\n b c |\n 1 2 3 ]");
+	test_push_parser("[a||comment]\n||another\r b]");
+	test_push_parser("[esc\\aped \\s \\[words\\] \\| and \\\\ backslashes\\]");
+	test_push_parser("[words\nwith\r\nline breaks]");
+	test_push_parser("[a \\");
+	test_push_parser("[a |");
+	test_push_parser("[a] b");
+	test_push_parser("");
+	test_push_parser_random(20000);
+
+	/* test number parsing */
+	test_parse_double("0", TML_NUMBER_OK, 1);
+	test_parse_double("-0", TML_NUMBER_OK, 2);
+	test_parse_double("0.1", TML_NUMBER_OK, 3);
+	test_parse_double("+2.5", TML_NUMBER_OK, 4);
+	test_parse_double(".5e-3", TML_NUMBER_OK, 5);
+	test_parse_double("5.", TML_NUMBER_OK, 2);
+	test_parse_double("6.02E23", TML_NUMBER_OK, 7);
+	test_parse_double("1e22", TML_NUMBER_OK, 4);
+	test_parse_double("1e23", TML_NUMBER_OK, 4);
+	test_parse_double("123456e30", TML_NUMBER_OK, 9);
+	test_parse_double("9007199254740993", TML_NUMBER_OK, 16);
+	test_parse_double("3.14159265358979323846264338327950288", TML_NUMBER_OK, 37);
+	test_parse_double("0.000000000000000000000000000000000000000000000000000000000000000000000000000001", TML_NUMBER_OK, 80);
+	test_parse_double("2.2250738585072011e-308", TML_NUMBER_OK, 23);
+	test_parse_double("4.9e-324", TML_NUMBER_OK, 8);
+	test_parse_double("1.7976931348623157e308", TML_NUMBER_OK, 22);
+	test_parse_double("1e400", TML_NUMBER_OUT_OF_RANGE, 5);
+	test_parse_double("-1e400", TML_NUMBER_OUT_OF_RANGE, 6);
+	test_parse_double("1e-400", TML_NUMBER_OUT_OF_RANGE, 6);
+	test_parse_double("0e999999999999", TML_NUMBER_OK, 14);
+	test_parse_double("12e", TML_NUMBER_OK, 2);
+	test_parse_double("12e+", TML_NUMBER_OK, 2);
+	test_parse_double("1.5.5", TML_NUMBER_OK, 3);
+	test_parse_double("7px", TML_NUMBER_OK, 1);
+	test_parse_double("inf", TML_NUMBER_OK, 3);
+	test_parse_double("-Infinity", TML_NUMBER_OK, 9);
+	test_parse_double("NaN", TML_NUMBER_OK, 3);
+	test_parse_double("in", TML_NUMBER_INVALID, 0);
+	test_parse_double("", TML_NUMBER_INVALID, 0);
+	test_parse_double("-", TML_NUMBER_INVALID, 0);
+	test_parse_double(".", TML_NUMBER_INVALID, 0);
+	test_parse_double("e5", TML_NUMBER_INVALID, 0);
+	test_parse_double("0x10", TML_NUMBER_OK, 1);
+	test_parse_double("word", TML_NUMBER_INVALID, 0);
+	test_parse_double_random(200000);
+	test_parse_float("0.1", 0.1f, TML_NUMBER_OK);
+	test_parse_float("-16777216", -16777216.0f, TML_NUMBER_OK);
+	test_parse_float("16777217", 16777216.0f, TML_NUMBER_OK);
+	test_parse_float("3.4028234e38", 3.4028234e38f, TML_NUMBER_OK);
+	test_parse_float("1.00000005960464477539", 1.0f, TML_NUMBER_OK);
+	test_parse_float("1e39", (float)HUGE_VAL, TML_NUMBER_OUT_OF_RANGE);
+	test_parse_float("1e-50", 0.0f, TML_NUMBER_OUT_OF_RANGE);
+	test_parse_float("x", 0.0f, TML_NUMBER_INVALID);
+	test_parse_integer("0", 0, TML_NUMBER_OK, 1);
+	test_parse_integer("42", 42, TML_NUMBER_OK, 2);
+	test_parse_integer("+42", 42, TML_NUMBER_OK, 3);
+	test_parse_integer("-42", -42, TML_NUMBER_OK, 3);
+	test_parse_integer("007", 7, TML_NUMBER_OK, 3);
+	test_parse_integer("12.5", 12, TML_NUMBER_OK, 2);
+	test_parse_integer("2147483647", INT32_MAX, TML_NUMBER_OK, 10);
+	test_parse_integer("-2147483648", INT32_MIN, TML_NUMBER_OK, 11);
+	test_parse_integer("2147483648", 2147483648LL, TML_NUMBER_OK, 10);
+	test_parse_integer("9223372036854775807", INT64_MAX, TML_NUMBER_OK, 19);
+	test_parse_integer("-9223372036854775808", INT64_MIN, TML_NUMBER_OK, 20);
+	test_parse_integer("9223372036854775808", INT64_MAX, TML_NUMBER_OUT_OF_RANGE, 19);
+	test_parse_integer("-99999999999999999999", INT64_MIN, TML_NUMBER_OUT_OF_RANGE, 21);
+	test_parse_integer("-", 0, TML_NUMBER_INVALID, 0);
+	test_parse_integer("abc", 0, TML_NUMBER_INVALID, 0);
+	test_node_numbers();
+	test_number_array("[]", TML_PARSE_DEFAULT, 64, -1, -1);
+	test_number_array("[1 2.5 -3e2 4 5]", TML_PARSE_DEFAULT, 64, -1, 1);
+	test_number_array("[1 2 3 4 5 6 7 8]", TML_PARSE_DEFAULT, 4, -1, -1);
+	test_number_array("[1 2 x 4 [5] 6]", TML_PARSE_DEFAULT, 64, 2, 2);
+	test_number_array("[1 2 [5] x 6]", TML_PARSE_WIDE_OFFSETS, 64, 2, 2);
+	test_number_array("[0.12345678901234567890 12345678901234567890 3.14159265358979 100000000 3000000000]",
+		TML_PARSE_DEFAULT, 64, -1, 0);
+	test_number_array("[0.12345678901234567890 0.12345678901234567890 1.5e10 1.5e10 16777216]", TML_PARSE_INTERN, 64, -1, 0);
+	test_number_array("[7 7px 7]", TML_PARSE_DEFAULT, 64, 1, 1);
+	test_number_array_random(100000);
+
+	/* test binary numeric arrays */
+	test_numeric_arrays("[[data | 0 1 2 0 2 3]]", TML_PARSE_DEFAULT, TML_ARRAY_INT8);
+	test_numeric_arrays("[[0 1 2 0 2 3 1000] a]", TML_PARSE_DEFAULT, TML_ARRAY_INT16);
+	test_numeric_arrays("[[-2147483648 0 5 2147483647]]", TML_PARSE_DEFAULT, TML_ARRAY_INT32);
+	test_numeric_arrays("[[4294967296 -9223372036854775808 1099511627776 123456789012]]", TML_PARSE_WIDE_OFFSETS, TML_ARRAY_INT64);
+	test_numeric_arrays("[[0.5 -1.25 3 0.1] [0.5 -1.25 3 0.1]]", TML_PARSE_DEDUP, TML_ARRAY_FLOAT);
+	test_numeric_arrays("[[0.000001 0.5 100000000000000000000 2]]", TML_PARSE_DEFAULT, TML_ARRAY_FLOAT);
+	test_numeric_arrays("[[0.30000000000000004 0.12345678901234 3.14159265358979 2.718281828459045]]", TML_PARSE_DEFAULT, TML_ARRAY_DOUBLE);
+	test_numeric_arrays("[[16777217.25 16777218.5 1234567.875 0.3 0.1 1234567.8125]]", TML_PARSE_WIDE_OFFSETS, TML_ARRAY_DOUBLE);
+	test_numeric_arrays("[[1000000 x] [1000000 1000001 1000002 1000003 1000004]]", TML_PARSE_INTERN, TML_ARRAY_INT32);
+	test_numeric_arrays("[[1 2 3 4 | 5 6 7 8]]", TML_PARSE_STRUCTURAL_INDEX, TML_ARRAY_INT8);
+	test_numeric_arrays("[[a | 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32 33]]",
+		TML_PARSE_CHILD_INDEX, TML_ARRAY_INT8);
+	test_numeric_arrays("[[1 2 3]]", TML_PARSE_DEFAULT, TML_ARRAY_NONE);
+	test_numeric_arrays("[1 2 3 4 5]", TML_PARSE_DEFAULT, TML_ARRAY_NONE);
+	test_numeric_arrays("[[1.0 2 3 4] [007 1 2 3] [1e5 1 2 3] [-0 1 2 3] [+1 2 3 4] [1 2 3 .5] [1 2 3 4.]]",
+		TML_PARSE_DEFAULT, TML_ARRAY_NONE);
+	test_numeric_arrays("[[1 2 3 4 [5]] [1 2 3 four]]", TML_PARSE_DEFAULT, TML_ARRAY_NONE);
+	test_numeric_arrays("[[123456789012345678901234567890 1 2 3] [0.30000000000000001 1 2 3]]", TML_PARSE_DEFAULT,
+		TML_ARRAY_NONE);
+	test_numeric_arrays("[[1 2 3 4 5", TML_PARSE_DEFAULT, TML_ARRAY_NONE);
+	test_numeric_arrays_out_of_memory();
+	test_numeric_array_first_child(true, TML_PARSE_DEFAULT);
+	test_numeric_array_first_child(false, TML_PARSE_DEFAULT);
+	test_numeric_array_first_child(true, TML_PARSE_CHILD_INDEX);
+	test_escaped_null_leaves(TML_PARSE_DEFAULT);
+	test_escaped_null_leaves(TML_PARSE_NUMERIC_ARRAYS);
+	test_numeric_arrays_random(5000);
+	test_numeric_arrays_parallel(TML_PARSE_DEFAULT, 4);
+	test_numeric_arrays_parallel(TML_PARSE_INTERN | TML_PARSE_WIDE_OFFSETS, 3);
 
+	/* test typed leaves */
+	test_typed_leaves("[[port 8080] [ratio 0.75] [verbose true] [name server]]", TML_PARSE_DEFAULT, true);
+	test_typed_leaves("[-0 +7 007 1e5 .5 5. inf -nan 1e999 0x10 12a true false True]", TML_PARSE_DEFAULT, true);
+	test_typed_leaves("[9223372036854775807 -9223372036854775808 9223372036854775808 18446744073709551616]",
+		TML_PARSE_WIDE_OFFSETS, true);
+	test_typed_leaves("[[1 2 3 4 5 6 7 8] [1 2 3 4 5 6 7 8] [0.5 1.5 2.5 3.5]]", TML_PARSE_NUMERIC_ARRAYS, false);
+	test_typed_leaves("[[12345 true 12345 a] [12345 true 12345 a] | x 12345]", TML_PARSE_INTERN, true);
+	test_typed_leaves("[[a b | 1 2] [c | 3.5]]", TML_PARSE_STRUCTURAL_INDEX | TML_PARSE_DEDUP, true);
+	test_typed_leaves("[a b [c d] 1x]", TML_PARSE_DEFAULT, false);
+	test_typed_leaves("[1 2 3", TML_PARSE_DEFAULT, false);
+	test_leaf_types(TML_PARSE_DEFAULT);
+	test_leaf_types(TML_PARSE_TYPED_LEAVES);
+	test_leaf_types(TML_PARSE_TYPED_LEAVES | TML_PARSE_WIDE_OFFSETS);
+	test_typed_leaves_random(3000);
+	test_typed_leaves_parallel(TML_PARSE_DEFAULT, 4);
+	test_typed_leaves_parallel(TML_PARSE_INTERN | TML_PARSE_NUMERIC_ARRAYS, 3);
 
 	print_report();
 
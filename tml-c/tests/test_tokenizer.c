@@ -3,10 +3,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
 #define PASS_MSG "pass"
 #define FAIL_MSG "[ F A I L ]"
 
+bool g_indexed = false;
+
 struct tml_stream *create_stream(const char *text)
 {
 	struct tml_stream *stream = malloc(sizeof(*stream));
@@ -15,7 +18,10 @@ struct tml_stream *create_stream(const char *text)
 	char *data = malloc(size);
 	memcpy(data, text, size);
 	
-	*stream = tml_stream_open(data, size);
+	if (g_indexed)
+		*stream = tml_stream_open_indexed(data, size);
+	else
+		*stream = tml_stream_open(data, size);
 
 	return stream;
 }
@@ -96,10 +102,114 @@ void print_report()
 }
 
 
-int main(void)
+/* Words long enough to span several SIMD blocks, with a delimiter placed at every possible
+ * offset, to make sure the vectorized scanners stop at exactly the same byte as the scalar one. */
+void test_long_words(void)
 {
-	printf("\n==== TML Tokenizer Test Suite ====\n\n");
+	static const char delimiters[] = { ' ', '\t', '|', '[', ']', '\\', '\r', '\n' };
+	char text[256], expected[256];
+	size_t expected_size;
+	struct tml_token token;
+	int d, len;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	for (d = 0; d < sizeof(delimiters); ++d) {
+		for (len = 1; len < 160; ++len) {
+			struct tml_stream *stream;
+
+			memset(text, 'x', len);
+			text[len] = delimiters[d];
+			memset(text + len + 1, 'y', 40);
+			text[len + 41] = '\0';
+
+			/* an escape code joins the two halves, \r and \n are just part of the word */
+			memcpy(expected, text, len + 41);
+			if (delimiters[d] == '\\') {
+				memmove(expected + len, text + len + 1, 40);
+				expected_size = len + 40;
+			}
+			else if (delimiters[d] == '\r' || delimiters[d] == '\n')
+				expected_size = len + 41;
+			else
+				expected_size = len;
+
+			stream = create_stream(text);
+			token = tml_stream_pop(stream);
+
+			if (token.type != TML_TOKEN_ITEM || token.value_size != expected_size ||
+				memcmp(token.value, expected, expected_size) != 0)
+			{
+				printf("%s: Word of length %d followed by character %d scanned incorrectly.\n", FAIL_MSG, len, delimiters[d]);
+				destroy_stream(stream);
+				return;
+			}
+
+			destroy_stream(stream);
+		}
+	}
+
+	printf("%s\n", PASS_MSG);
+	g_pass_count++;
+}
+
+/* Words made of escape codes separated by plain runs of every length up to a few SIMD blocks, as in text
+ * converted from XML, which must collapse to the same characters however the spans fall. */
+void test_escaped_words(void)
+{
+	static const char codes[] = { 's', 'n', 't', '\\', '[' };
+	static const char decoded[] = { ' ', '\n', '\t', '\\', '[' };
+	char text[1024], expected[1024];
+	size_t text_size, expected_size;
+	struct tml_token token;
+	int gap, i, j;
+
+	g_test_num++;
+	printf("#%d ", g_test_num);
+
+	for (gap = 0; gap < 150; ++gap) {
+		struct tml_stream *stream;
 
+		text_size = expected_size = 0;
+		for (i = 0; i < 5; ++i) {
+			for (j = 0; j < gap; ++j)
+				text[text_size++] = expected[expected_size++] = 'a' + (i + j) % 26;
+			text[text_size++] = '\\';
+			text[text_size++] = codes[i];
+			expected[expected_size++] = decoded[i];
+		}
+		text[text_size++] = 'z';
+		expected[expected_size++] = 'z';
+		memcpy(text + text_size, " next", 6);
+
+		stream = create_stream(text);
+		token = tml_stream_pop(stream);
+
+		if (token.type != TML_TOKEN_ITEM || token.value_size != expected_size ||
+			memcmp(token.value, expected, expected_size) != 0)
+		{
+			printf("%s: Word with escape codes %d characters apart decoded incorrectly.\n", FAIL_MSG, gap);
+			destroy_stream(stream);
+			return;
+		}
+
+		token = tml_stream_pop(stream);
+		if (token.type != TML_TOKEN_ITEM || token.value_size != 4 || memcmp(token.value, "next", 4) != 0) {
+			printf("%s: Word after escape codes %d characters apart scanned incorrectly.\n", FAIL_MSG, gap);
+			destroy_stream(stream);
+			return;
+		}
+
+		destroy_stream(stream);
+	}
+
+	printf("%s\n", PASS_MSG);
+	g_pass_count++;
+}
+
+void run_tests(void)
+{
 	test_parser("a b c", "a b c  ||EOF");
 	test_parser("\\[", "[  ||EOF");
 	test_parser("\\]", "]  ||EOF");
@@ -115,6 +225,40 @@ int main(void)
 	test_parser("\\", "  ||EOF");
 	test_parser("[  ]", "[] ||EOF");
 
+	test_parser("[ \t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\ta ]", "[a ] ||EOF");
+	test_parser("[a_very_long_word_that_spans_more_than_one_simd_register_width_of_bytes|b]",
+		"[a_very_long_word_that_spans_more_than_one_simd_register_width_of_bytes |b ] ||EOF");
+	test_parser("[a_very_long_word_that_spans_more_than_one_simd_register_width_\\sof_bytes]",
+		"[a_very_long_word_that_spans_more_than_one_simd_register_width_ of_bytes ] ||EOF");
+	test_parser("[tab\\tand\\snewline\\n\\s\\s\\s|x]", "[tab\tand newline\n    |x ] ||EOF");
+	test_parser("[trailing\\s\\", "[trailing   ||EOF");
+	test_long_words();
+	test_escaped_words();
+}
+
+int main(void)
+{
+	static const enum TML_SCAN_KERNEL kernels[] = { TML_SCAN_SCALAR, TML_SCAN_SSE2, TML_SCAN_AVX2, TML_SCAN_NEON };
+	static const char *kernel_names[] = { "auto", "scalar", "SSE2", "AVX2", "NEON" };
+	int i;
+
+	printf("\n==== TML Tokenizer Test Suite ====\n\n");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+		if (tml_set_scan_kernel(kernels[i]) != kernels[i])
+			continue;
+
+		printf("(%s scanning kernel)\n", kernel_names[kernels[i]]);
+		run_tests();
+
+		printf("(%s scanning kernel, structural index)\n", kernel_names[kernels[i]]);
+		g_indexed = true;
+		run_tests();
+		g_indexed = false;
+	}
+
+	tml_set_scan_kernel(TML_SCAN_AUTO);
+
 	print_report();
 
 	return 0;
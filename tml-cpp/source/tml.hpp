@@ -16,12 +16,25 @@ extern "C" {
 	#include "../../tml-c/source/tml_parser.h"
 }
 
+#include <array>
+#include <cstring>
 #include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #define MAX_TML_STRING_SIZE 4096
 
+// The most compiled patterns TmlPattern::get() keeps at once
+#define MAX_TML_PATTERN_CACHE_SIZE 1024
+
 class TmlDoc;
 class TmlNode;
+class TmlPattern;
+
+// A node identified just by its offset within a TmlDoc (see TmlDoc::getRootId())
+typedef tml_node_id TmlNodeId;
 
 // A TmlNode is a "handle" to a node within TML tml_doc tree (stored in a TmlData object). You can
 // use methods here to traverse the tree, like getFirstChild() and getNextSibling(). When you find
@@ -51,11 +64,18 @@ public:
 
 	std::string getValue() const
 	{
-		return std::string(node.value);
+		return std::string(node.value, node.size);
+	}
+
+	// The length of the value, without looking for its end.
+	size_t getValueSize() const
+	{
+		return tml_is_list(&node) ? 0 : node.size;
 	}
 
 	// Slightly faster than getValue() due to no extra copy operation.
 	// Useful for iteration/comparisons, since you can compare C strings to C++ strings.
+	// Words left in a TML_PARSE_MMAP file mapping aren't null terminated: use getValueSize() with those.
 	const char *getValueCstr() const
 	{
 		return node.value;
@@ -71,20 +91,20 @@ public:
 		return TmlNode( tml_next_sibling(&node) );
 	}
 
-	// WARNING: This runs in O(n) time where n is the number of child nodes.
+	// This runs in O(1) time.
 	int getChildCount() const
 	{
 		return tml_child_count(&node);
 	}
 
-	// WARNING: This runs in O(n) time where n is the number of child nodes.
+	// This runs in O(childIndex) time, except for lists of 32 or more children after the first time,
+	// which take O(1) time (see TmlDoc::indexChildren()).
 	TmlNode getChildAtIndex(int childIndex) const
 	{
 		return TmlNode( tml_child_at_index(&node, childIndex) );
 	}
 
 	// Same as getChildAtIndex().
-	// WARNING: This runs in O(n) time where n is the number of child nodes.
 	TmlNode operator[] (int childIndex) const
 	{
 		return TmlNode( tml_child_at_index(&node, childIndex) );
@@ -104,11 +124,25 @@ public:
 		return std::string(buff);
 	}
 
+	// These return 0 if the value doesn't start with a number (see tml_parse_double() in tml_parser.h), and the
+	// nearest value that fits if it's out of range. With TML_PARSE_TYPED_LEAVES, numbers are just read.
 	int toInt() const
 	{
 		return tml_node_to_int(&node);
 	}
 
+	int64_t toInt64() const
+	{
+		return tml_node_to_int64(&node);
+	}
+
+	uint64_t toUInt64() const
+	{
+		uint64_t value;
+		tml_parse_uint64(node.value, getValueSize(), &value, NULL);
+		return value;
+	}
+
 	float toFloat() const
 	{
 		return tml_node_to_float(&node);
@@ -119,6 +153,53 @@ public:
 		return tml_node_to_double(&node);
 	}
 
+	// Returns true only for "true"
+	bool toBool() const
+	{
+		return tml_node_to_bool(&node);
+	}
+
+	// Returns whether this is a number, "true" or "false", or some other word (see tml_leaf_type())
+	enum TML_LEAF_TYPE getLeafType() const
+	{
+		return tml_leaf_type(&node);
+	}
+
+	// Checked versions of the above, which return false (setting result as above) unless the whole value is
+	// a number in range.
+	bool toInt(int &result) const
+	{
+		int32_t value;
+		size_t length;
+		bool success = tml_parse_int32(node.value, getValueSize(), &value, &length) == TML_NUMBER_OK;
+		result = value;
+		return success && length == getValueSize();
+	}
+
+	bool toInt64(int64_t &result) const
+	{
+		size_t length;
+		return tml_parse_int64(node.value, getValueSize(), &result, &length) == TML_NUMBER_OK && length == getValueSize();
+	}
+
+	bool toUInt64(uint64_t &result) const
+	{
+		size_t length;
+		return tml_parse_uint64(node.value, getValueSize(), &result, &length) == TML_NUMBER_OK && length == getValueSize();
+	}
+
+	bool toFloat(float &result) const
+	{
+		size_t length;
+		return tml_parse_float(node.value, getValueSize(), &result, &length) == TML_NUMBER_OK && length == getValueSize();
+	}
+
+	bool toDouble(double &result) const
+	{
+		size_t length;
+		return tml_parse_double(node.value, getValueSize(), &result, &length) == TML_NUMBER_OK && length == getValueSize();
+	}
+
 	int toIntArray(int *array, int arraySize)
 	{
 		return tml_node_to_int_array(&node, array, arraySize);
@@ -134,6 +215,42 @@ public:
 		return tml_node_to_double_array(&node, array, arraySize);
 	}
 
+	// These read every child into the vector at once (see tml_node_read_double_array()), and return the index of
+	// the first that isn't entirely a number in range, or -1 if they all are.
+	int toIntVector(std::vector<int> &values) const
+	{
+		int firstError;
+		values.resize(getChildCount());
+		if (!values.empty())
+			tml_node_read_int_array(&node, &values[0], (int)values.size(), &firstError);
+		return values.empty() ? -1 : firstError;
+	}
+
+	int toFloatVector(std::vector<float> &values) const
+	{
+		int firstError;
+		values.resize(getChildCount());
+		if (!values.empty())
+			tml_node_read_float_array(&node, &values[0], (int)values.size(), &firstError);
+		return values.empty() ? -1 : firstError;
+	}
+
+	int toDoubleVector(std::vector<double> &values) const
+	{
+		int firstError;
+		values.resize(getChildCount());
+		if (!values.empty())
+			tml_node_read_double_array(&node, &values[0], (int)values.size(), &firstError);
+		return values.empty() ? -1 : firstError;
+	}
+
+	// Gives direct access to a list stored as a binary array (see TML_PARSE_NUMERIC_ARRAYS). Returns false
+	// if this list isn't one.
+	bool getArray(tml_array &array) const
+	{
+		return tml_node_array(&node, &array);
+	}
+
 	bool compareToPattern(const TmlNode &pattern) const
 	{
 		return tml_compare_nodes(&node, &pattern.node);
@@ -149,18 +266,55 @@ public:
 		return TmlNode( tml_find_next_sibling(&node, &pattern.node) );
 	}
 
+	// Returns the first child whose key (first word) is the given key, e.g. [key | value], in O(1) time for lists
+	// of 32 or more children after the first search. See tml_find_key() in tml_parser.h for details.
+	TmlNode find(const std::string &key) const
+	{
+		return TmlNode( tml_find_key(&node, key.c_str()) );
+	}
+
+	TmlNode find(const char *key) const
+	{
+		return TmlNode( tml_find_key(&node, key) );
+	}
+
+	// Returns the next child after the given one (found with find()) with the same key
+	TmlNode findNext(const TmlNode &child) const
+	{
+		return TmlNode( tml_find_next_key(&node, &child.node) );
+	}
+
+	// Makes a hash table of the keys of this list's children for find() (see tml_index_keys())
+	bool indexKeys() const
+	{
+		return tml_index_keys(&node);
+	}
+
 	bool compareToPattern(const TmlDoc *patternData) const;
 	TmlNode findFirstChild(const TmlDoc *patternData) const;
 	TmlNode findNextSibling(const TmlDoc *patternData) const;
 
-	// Be careful, the following overloads are potentially inefficient because they allocate, parse, and
-	// free the pattern string these functions are used.
+	bool compareToPattern(const TmlPattern &pattern) const;
+	TmlNode findFirstChild(const TmlPattern &pattern) const;
+	TmlNode findNextSibling(const TmlPattern &pattern) const;
+
+	// These overloads compile the pattern string the first time it's used, and after that find it in a cache
+	// shared by all threads (see TmlPattern::get()).
 
 	bool compareToPattern(const std::string &patternStr) const;
 	TmlNode findFirstChild(const std::string &patternStr) const;
 	TmlNode findNextSibling(const std::string &patternStr) const;
 
+	// Reads this node into a struct bound with TML_MAP() or TML_TUPLE(), or any other type TmlBinding supports.
+	// Returns false if it doesn't have the right shape.
+	template <typename T> bool read(T &value) const;
+
 private:
+	friend class TmlPattern;
+	friend class TmlPatternSet;
+	friend class TmlQuery;
+	friend class TmlQueryIterator;
+
 	struct tml_node node;
 };
 
@@ -210,6 +364,54 @@ public:
 		return TmlNode(data->root_node);
 	}
 
+	// Iteration with node ids, which are smaller than TmlNode objects to keep lots of. These return
+	// TML_NODE_ID_NULL when there's no such node (see tml_root_id()).
+	TmlNodeId getRootId() const
+	{
+		return tml_root_id(data);
+	}
+
+	TmlNodeId getFirstChildId(TmlNodeId id) const
+	{
+		return tml_first_child_id(data, id);
+	}
+
+	TmlNodeId getNextSiblingId(TmlNodeId id) const
+	{
+		return tml_next_sibling_id(data, id);
+	}
+
+	bool isListId(TmlNodeId id) const
+	{
+		return tml_is_list_id(data, id);
+	}
+
+	TmlNode getNode(TmlNodeId id) const
+	{
+		return TmlNode( tml_node_at(data, id) );
+	}
+
+	// Makes getChildAtIndex() and find() O(1) for every long list now, rather than as each is first
+	// used. Do this before using the same document from several threads. Returns false if out of memory.
+	bool indexChildren()
+	{
+		return tml_index_children(data);
+	}
+
+	// Makes equal subtrees share storage (see tml_doc_dedup()). This invalidates all TmlNode objects from this
+	// document. Returns false if out of memory.
+	bool dedup()
+	{
+		return tml_doc_dedup(data);
+	}
+
+	// Rewrites the document so that every list's children are stored together (see tml_doc_repack()). This
+	// invalidates all TmlNode objects from this document. Returns false if out of memory.
+	bool repack()
+	{
+		return tml_doc_repack(data);
+	}
+
 	std::string getParseError() const
 	{
 		const char *str = data->error_message;
@@ -225,6 +427,426 @@ private:
 };
 
 
+// TmlPattern is a compiled pattern (see tml_compile_pattern()), which is quicker to match against than a pattern
+// node. It doesn't depend on the TmlDoc it was compiled from, and can be used from several threads at once.
+class TmlPattern
+{
+public:
+	explicit TmlPattern(const TmlNode &patternNode)
+	{
+		pattern = tml_compile_pattern(&patternNode.node);
+		if (pattern == NULL)
+			throw "Error compiling tml_pattern";
+	}
+
+	explicit TmlPattern(const std::string &patternStr)
+	{
+		TmlDoc patternData(patternStr);
+		TmlNode patternNode = patternData.getRoot();
+		pattern = tml_compile_pattern(&patternNode.node);
+		if (pattern == NULL)
+			throw "Error compiling tml_pattern";
+	}
+
+	~TmlPattern()
+	{
+		tml_free_pattern(pattern);
+	}
+
+	// Returns the compiled pattern for the given string, compiling it only the first time it's asked for. This
+	// is thread safe. At most MAX_TML_PATTERN_CACHE_SIZE patterns are kept; when that's reached, the cache is
+	// emptied (patterns still in use stay valid until they're released).
+	static std::shared_ptr<const TmlPattern> get(const std::string &patternStr)
+	{
+		static std::mutex cacheMutex;
+		static std::unordered_map<std::string, std::shared_ptr<const TmlPattern> > cache;
+
+		std::lock_guard<std::mutex> lock(cacheMutex);
+
+		std::unordered_map<std::string, std::shared_ptr<const TmlPattern> >::iterator it = cache.find(patternStr);
+		if (it != cache.end())
+			return it->second;
+
+		if (cache.size() >= MAX_TML_PATTERN_CACHE_SIZE)
+			cache.clear();
+
+		std::shared_ptr<const TmlPattern> pattern(new TmlPattern(patternStr));
+		cache[patternStr] = pattern;
+		return pattern;
+	}
+
+	const struct tml_pattern *getPattern() const
+	{
+		return pattern;
+	}
+
+private:
+	TmlPattern(const TmlPattern &c);
+	TmlPattern &operator=(const TmlPattern &c);
+
+	struct tml_pattern *pattern;
+};
+
+
+// TmlPatternSet matches a node against many patterns at once (see tml_match_pattern_set()), e.g. to load each
+// child of a list according to which of several forms it takes. Patterns added by string are compiled through
+// TmlPattern::get(), and kept by the set as long as it's around.
+class TmlPatternSet
+{
+public:
+	TmlPatternSet()
+	{
+		set = tml_create_pattern_set();
+		if (set == NULL)
+			throw "Error creating tml_pattern_set";
+	}
+
+	~TmlPatternSet()
+	{
+		tml_free_pattern_set(set);
+	}
+
+	// Returns the id of the added pattern: 0 for the first, 1 for the next, and so on
+	int add(const std::string &patternStr)
+	{
+		std::shared_ptr<const TmlPattern> pattern = TmlPattern::get(patternStr);
+		int id = tml_add_to_pattern_set(set, pattern->getPattern());
+		if (id < 0)
+			throw "Error adding to tml_pattern_set";
+		patterns.push_back(pattern);
+		return id;
+	}
+
+	// Returns the id of the first pattern added which the node matches, or -1 if none
+	int match(const TmlNode &node) const;
+
+private:
+	TmlPatternSet(const TmlPatternSet &c);
+	TmlPatternSet &operator=(const TmlPatternSet &c);
+
+	struct tml_pattern_set *set;
+	std::vector< std::shared_ptr<const TmlPattern> > patterns;
+};
+
+
+// TmlQuery is a compiled path query, e.g. "opengl model/buffer vertex/data position/*" (see tml_compile_query()
+// for the syntax). Like TmlPattern, it can be used from several threads at once.
+class TmlQuery
+{
+public:
+	explicit TmlQuery(const std::string &path)
+	{
+		query = tml_compile_query(path.c_str());
+		if (query == NULL)
+			throw "Error compiling tml_query";
+	}
+
+	~TmlQuery()
+	{
+		tml_free_query(query);
+	}
+
+	// Returns the first node the query finds under the given node, or a null node if none
+	TmlNode findFirst(const TmlNode &node) const
+	{
+		return TmlNode( tml_query_first(&node.node, query) );
+	}
+
+	const struct tml_query *getQuery() const
+	{
+		return query;
+	}
+
+private:
+	TmlQuery(const TmlQuery &c);
+	TmlQuery &operator=(const TmlQuery &c);
+
+	struct tml_query *query;
+};
+
+
+// TmlQueryIterator goes through every node a query finds under the given node, without allocating anything:
+//   TmlQueryIterator it(query, doc.getRoot());
+//   for (TmlNode node = it.next(); !node.isNull(); node = it.next()) ...
+// The query must outlive the iterator.
+class TmlQueryIterator
+{
+public:
+	TmlQueryIterator(const TmlQuery &query, const TmlNode &node)
+	{
+		tml_query_begin(&iter, query.getQuery(), &node.node);
+	}
+
+	~TmlQueryIterator()
+	{
+		tml_query_end(&iter);
+	}
+
+	TmlNode next()
+	{
+		return TmlNode( tml_query_next(&iter) );
+	}
+
+private:
+	TmlQueryIterator(const TmlQueryIterator &c);
+	TmlQueryIterator &operator=(const TmlQueryIterator &c);
+
+	struct tml_query_iter iter;
+};
+
+
+// Struct binding: declare once how a struct's fields are laid out in TML, and read it straight from the nodes,
+// without any patterns or key strings at runtime. For example:
+//
+//   struct Position { float x, y, z; };
+//   TML_TUPLE(Position, x, y, z)                // read from [0.1 9.8 2.55]
+//
+//   struct Material { std::string color; Position position; std::vector<int> ids; };
+//   TML_MAP(Material, color, position, ids)     // read from [[color | red] [position | 0.1 9.8 2.55] [ids | 1 2]]
+//
+//   Material material;
+//   if (doc->getRoot().read(material)) ...
+//
+// A map's values can be written as [key | value...] or [key value...], in any order. Fields whose key isn't
+// there are left as they were. Fields can be numbers, bool, std::string, std::vector or std::array of any of
+// these, or other bound structs. The macros must be used outside any namespace, and bind up to 16 fields.
+
+// The nodes a value is read from: count siblings from first. These are either the children of a list, or the
+// values after the key in a child of a map. list is the list they're the children of, if they are.
+struct TmlItems
+{
+	TmlItems() : count(0) {}
+
+	// A list's children, or the word itself
+	static TmlItems of(const TmlNode &node)
+	{
+		TmlItems items;
+		if (node.isNull())
+			return items;
+		if (node.isList()) {
+			items.first = node.getFirstChild();
+			items.count = node.getChildCount();
+			items.list = node;
+		}
+		else {
+			items.first = node;
+			items.count = 1;
+		}
+		return items;
+	}
+
+	// The values of a child of a map, after its key
+	static TmlItems valueOf(const TmlNode &child)
+	{
+		TmlNode key = child.getFirstChild();
+		TmlItems items;
+
+		// "[key | value...]" is [[key] [value...]]
+		if (key.isNull() || key.isList())
+			return of(key.getNextSibling());
+
+		items.first = key.getNextSibling();
+		items.count = child.getChildCount() - 1;
+		return items;
+	}
+
+	// Returns the first item with the given key (see TmlNode::find())
+	TmlNode find(const char *key) const
+	{
+		if (!list.isNull())
+			return list.find(key);
+
+		TmlNode item = first;
+		for (int i = 0; i < count; ++i, item = item.getNextSibling()) {
+			TmlNode word = item;
+			while (!word.isNull() && word.isList())
+				word = word.getFirstChild();
+			if (std::strcmp(word.getValueCstr(), key) == 0)
+				return item;
+		}
+		return TmlNode();
+	}
+
+	TmlNode first;
+	int count;
+	TmlNode list;
+};
+
+// TmlBinding<T>::read(items, value) reads a T from the items, returning false if they don't have the right shape.
+// Structs get one from TML_MAP() or TML_TUPLE().
+template <typename T>
+struct TmlBinding;
+
+template <typename T>
+inline bool tmlReadNextItem(TmlNode &item, T &value)
+{
+	bool success = TmlBinding<T>::read(TmlItems::of(item), value);
+	item = item.getNextSibling();
+	return success;
+}
+
+template <typename T>
+inline bool tmlReadKey(const TmlItems &items, const char *key, T &value)
+{
+	TmlNode child = items.find(key);
+	return child.isNull() || TmlBinding<T>::read(TmlItems::valueOf(child), value);
+}
+
+template <>
+struct TmlBinding<int>
+{
+	static bool read(const TmlItems &items, int &value) { return items.count == 1 && items.first.toInt(value); }
+};
+
+template <>
+struct TmlBinding<int64_t>
+{
+	static bool read(const TmlItems &items, int64_t &value) { return items.count == 1 && items.first.toInt64(value); }
+};
+
+template <>
+struct TmlBinding<uint64_t>
+{
+	static bool read(const TmlItems &items, uint64_t &value) { return items.count == 1 && items.first.toUInt64(value); }
+};
+
+template <>
+struct TmlBinding<float>
+{
+	static bool read(const TmlItems &items, float &value) { return items.count == 1 && items.first.toFloat(value); }
+};
+
+template <>
+struct TmlBinding<double>
+{
+	static bool read(const TmlItems &items, double &value) { return items.count == 1 && items.first.toDouble(value); }
+};
+
+template <>
+struct TmlBinding<bool>
+{
+	static bool read(const TmlItems &items, bool &value)
+	{
+		if (items.count != 1 || items.first.getLeafType() != TML_LEAF_BOOL)
+			return false;
+		value = items.first.toBool();
+		return true;
+	}
+};
+
+template <>
+struct TmlBinding<std::string>
+{
+	static bool read(const TmlItems &items, std::string &value)
+	{
+		if (items.count != 1 || items.first.isList())
+			return false;
+		value.assign(items.first.getValueCstr(), items.first.getValueSize());
+		return true;
+	}
+};
+
+template <typename T>
+inline bool tmlReadEachItem(const TmlItems &items, std::vector<T> &values)
+{
+	TmlNode item = items.first;
+	values.resize(items.count);
+	for (int i = 0; i < items.count; ++i) {
+		if (!tmlReadNextItem(item, values[i]))
+			return false;
+	}
+	return true;
+}
+
+template <typename T>
+struct TmlBinding< std::vector<T> >
+{
+	static bool read(const TmlItems &items, std::vector<T> &values) { return tmlReadEachItem(items, values); }
+};
+
+// The children of a list of numbers are read all at once (see tml_node_read_double_array()), so binary arrays
+// are read directly
+#define TML_BIND_NUMBER_VECTOR(Type, readVector) \
+	template <> \
+	struct TmlBinding< std::vector<Type> > \
+	{ \
+		static bool read(const TmlItems &items, std::vector<Type> &values) \
+		{ \
+			return items.list.isNull() ? tmlReadEachItem(items, values) : items.list.readVector(values) < 0; \
+		} \
+	};
+
+TML_BIND_NUMBER_VECTOR(int, toIntVector)
+TML_BIND_NUMBER_VECTOR(float, toFloatVector)
+TML_BIND_NUMBER_VECTOR(double, toDoubleVector)
+
+template <typename T, size_t N>
+struct TmlBinding< std::array<T, N> >
+{
+	static bool read(const TmlItems &items, std::array<T, N> &values)
+	{
+		TmlNode item = items.first;
+		if (items.count != (int)N)
+			return false;
+		for (size_t i = 0; i < N; ++i) {
+			if (!tmlReadNextItem(item, values[i]))
+				return false;
+		}
+		return true;
+	}
+};
+
+// TML_FOR_EACH(macro, arg, a, b, ...) expands to macro(arg, a) macro(arg, b) ... for up to 16 arguments
+#define TML_EXPAND(x) x
+#define TML_CONCAT(a, b) TML_CONCAT_(a, b)
+#define TML_CONCAT_(a, b) a##b
+#define TML_ARG_COUNT(...) TML_EXPAND(TML_ARG_COUNT_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define TML_ARG_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define TML_FOR_EACH(m, arg, ...) TML_EXPAND(TML_CONCAT(TML_FOR_EACH_, TML_ARG_COUNT(__VA_ARGS__))(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_1(m, arg, x) m(arg, x)
+#define TML_FOR_EACH_2(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_1(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_3(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_2(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_4(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_3(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_5(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_4(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_6(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_5(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_7(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_6(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_8(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_7(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_9(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_8(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_10(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_9(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_11(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_10(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_12(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_11(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_13(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_12(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_14(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_13(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_15(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_14(m, arg, __VA_ARGS__))
+#define TML_FOR_EACH_16(m, arg, x, ...) m(arg, x) TML_EXPAND(TML_FOR_EACH_15(m, arg, __VA_ARGS__))
+
+#define TML_READ_TUPLE_FIELD(value, field) && tmlReadNextItem(item, value.field)
+#define TML_READ_MAP_FIELD(value, field) && tmlReadKey(items, #field, value.field)
+
+// Binds a struct to a list of its fields' values in order, e.g. [x y z]
+#define TML_TUPLE(Type, ...) \
+	template <> \
+	struct TmlBinding<Type> \
+	{ \
+		static bool read(const TmlItems &items, Type &value) \
+		{ \
+			TmlNode item = items.first; \
+			return items.count == TML_ARG_COUNT(__VA_ARGS__) TML_FOR_EACH(TML_READ_TUPLE_FIELD, value, __VA_ARGS__); \
+		} \
+	};
+
+// Binds a struct to a list of [key | value] children, keyed by the names of its fields
+#define TML_MAP(Type, ...) \
+	template <> \
+	struct TmlBinding<Type> \
+	{ \
+		static bool read(const TmlItems &items, Type &value) \
+		{ \
+			return (items.count == 0 || items.first.isList()) TML_FOR_EACH(TML_READ_MAP_FIELD, value, __VA_ARGS__); \
+		} \
+	};
+
+
 
 bool TmlNode::compareToPattern(const TmlDoc *patternData) const
 {
@@ -245,25 +867,46 @@ TmlNode TmlNode::findNextSibling(const TmlDoc *patternData) const
 }
 
 
-bool TmlNode::compareToPattern(const std::string &patternStr) const
+inline bool TmlNode::compareToPattern(const TmlPattern &pattern) const
 {
-	TmlDoc patternData(patternStr);
-	TmlNode pattern = patternData.getRoot();
-	return compareToPattern(pattern);
+	return tml_match_pattern(&node, pattern.getPattern());
 }
 
-TmlNode TmlNode::findFirstChild(const std::string &patternStr) const
+inline TmlNode TmlNode::findFirstChild(const TmlPattern &pattern) const
 {
-	TmlDoc patternData(patternStr);
-	TmlNode pattern = patternData.getRoot();
-	return findFirstChild(pattern);
+	return TmlNode( tml_find_first_match(&node, pattern.getPattern()) );
 }
 
-TmlNode TmlNode::findNextSibling(const std::string &patternStr) const
+inline TmlNode TmlNode::findNextSibling(const TmlPattern &pattern) const
 {
-	TmlDoc patternData(patternStr);
-	TmlNode pattern = patternData.getRoot();
-	return findNextSibling(pattern);
+	return TmlNode( tml_find_next_match(&node, pattern.getPattern()) );
+}
+
+
+inline int TmlPatternSet::match(const TmlNode &node) const
+{
+	return tml_match_pattern_set(&node.node, set);
+}
+
+inline bool TmlNode::compareToPattern(const std::string &patternStr) const
+{
+	return compareToPattern(*TmlPattern::get(patternStr));
+}
+
+inline TmlNode TmlNode::findFirstChild(const std::string &patternStr) const
+{
+	return findFirstChild(*TmlPattern::get(patternStr));
+}
+
+inline TmlNode TmlNode::findNextSibling(const std::string &patternStr) const
+{
+	return findNextSibling(*TmlPattern::get(patternStr));
+}
+
+template <typename T>
+inline bool TmlNode::read(T &value) const
+{
+	return TmlBinding<T>::read(TmlItems::of(*this), value);
 }
 
 
@@ -3,6 +3,15 @@
 #include <iostream>
 using namespace std;
 
+struct Position { float x, y, z; };
+TML_TUPLE(Position, x, y, z)
+
+struct Scene { string color; Position position; };
+TML_MAP(Scene, color, position)
+
+struct Mesh { string name; vector<int> indices; array<double, 2> range; bool visible; Scene scene; };
+TML_MAP(Mesh, name, indices, range, visible, scene)
+
 int main(void)
 {
 	cout << endl << "========== SIMPLE TML C++ TEST ==========" << endl;
@@ -26,6 +35,58 @@ int main(void)
 
 	cout << "The parsed \"" << nodeName << "\" is (x=" << vec[0] << ", y=" << vec[1] << ", z=" << vec[2] << ")." << endl;
 
+	double x;
+	if (posData[0].toDouble(x) && !positionNode[0].toDouble(x))
+		cout << "The first coordinate is a number, and \"" << nodeName << "\" isn't." << endl;
+
+	vector<double> values;
+	if (posData.toDoubleVector(values) < 0 && positionNode.toDoubleVector(values) == 0)
+		cout << "All " << posData.getChildCount() << " coordinates are numbers, and \"" << nodeName << "\" isn't." << endl;
+
+	TmlPattern colorPattern("[color | \\?]"); // compiled once, and can be reused
+	TmlNode colorNode = root.findFirstChild(colorPattern); // returns [color|red]
+	if (root.find("color").compareToPattern(colorPattern))
+		cout << "The parsed \"color\" is " << colorNode[1].toString() << "." << endl;
+
+	TmlPatternSet forms;
+	forms.add("[color | \\?]");
+	forms.add("[position | \\? \\? \\?]");
+	for (TmlNode child = root.getFirstChild(); !child.isNull(); child = child.getNextSibling())
+		cout << "\"" << child[0].toString() << "\" matches pattern #" << forms.match(child) << "." << endl;
+
+	TmlQuery coordinates("position/*");
+	TmlQueryIterator it(coordinates, root);
+	cout << "The query \"position/*\" finds:";
+	for (TmlNode node = it.next(); !node.isNull(); node = it.next())
+		cout << " " << node.toString();
+	cout << endl;
+
+	cout << "Iterating by node id finds:";
+	for (TmlNodeId id = doc->getFirstChildId(doc->getRootId()); id != TML_NODE_ID_NULL; id = doc->getNextSiblingId(id))
+		cout << " " << doc->getNode(id)[0].toString();
+	cout << endl;
+
+	TmlDoc settings(tml_parse_string_ex("[[port 8080] [ratio 0.75] [verbose true]]", TML_PARSE_TYPED_LEAVES));
+	TmlNode settingsRoot = settings.getRoot();
+	if (settingsRoot[0][1].getLeafType() == TML_LEAF_INT && settingsRoot[2][1].toBool())
+		cout << "The typed settings are port " << settingsRoot[0][1].toInt() << " and ratio " << settingsRoot[1][1].toDouble() << "." << endl;
+
+	Scene scene;
+	if (root.read(scene))
+		cout << "Binding reads color " << scene.color << " and position (x=" << scene.position.x << ", y=" <<
+			scene.position.y << ", z=" << scene.position.z << ")." << endl;
+
+	TmlDoc meshDoc("[[name cube] [indices | 0 1 2 0 2 3] [range 0.5 2] [visible | true] [scene | [color | blue]]]");
+	Mesh cube = Mesh();
+	if (meshDoc.getRoot().read(cube) && !meshDoc.getRoot().read(scene.position))
+		cout << "Binding reads mesh \"" << cube.name << "\" with " << cube.indices.size() << " indices, range " <<
+			cube.range[0] << " to " << cube.range[1] << ", and a " << cube.scene.color << " scene." << endl;
+
+	TmlDoc mesh(tml_parse_string_ex("[[indices | 0 1 2 0 2 3 100 200 300 400]]", TML_PARSE_NUMERIC_ARRAYS));
+	tml_array indices;
+	if (mesh.getRoot()[0][1].getArray(indices) && indices.type == TML_ARRAY_INT16)
+		cout << "The " << indices.count << " indices are stored as 16-bit integers." << endl;
+
 	cout << endl;
 
 	delete doc;
@@ -199,14 +199,14 @@ void write_xml_attrib(FILE *fout, struct tml_node attrib)
 	fputs("\"", fout);
 }
 
-static struct tml_node element_markup_pattern;
+static struct tml_pattern *element_markup_pattern;
 
 void write_xml_node(FILE *fout, int indent, struct tml_node node)
 {
 	if (tml_is_list(&node)) {
 		// first make sure the node is of the expected format, e.g.:
 		// [ element-name [attrib value] | element content ]
-		if (tml_compare_nodes(&node, &element_markup_pattern)) {
+		if (tml_match_pattern(&node, element_markup_pattern)) {
 			// iterate to the first meta and content items
 			struct tml_node attrib, content, name_node;
 			name_node = tml_first_child(&node);
@@ -268,10 +268,10 @@ void write_xml_node(FILE *fout, int indent, struct tml_node node)
 
 void tml_to_xml(const char *source_file, const char *dest_file)
 {
-	struct tml_doc *pattern = tml_parse_string("[ \\? \\* | \\* ]");
-	element_markup_pattern = pattern->root_node;
+	element_markup_pattern = tml_compile_pattern_string("[ \\? \\* | \\* ]");
 
-	struct tml_doc *doc = tml_parse_file(source_file);
+	/* element and attribute names repeat a lot, so store each only once */
+	struct tml_doc *doc = tml_parse_file_ex(source_file, TML_PARSE_INTERN);
 	if (doc == NULL) {
 		exit(error("Error parsing TML file."));
 	}
@@ -294,7 +294,7 @@ void tml_to_xml(const char *source_file, const char *dest_file)
 	fclose(fout);
 
 	tml_free_doc(doc);
-	tml_free_doc(pattern);
+	tml_free_pattern(element_markup_pattern);
 }
 
 void run_benchmark(const char *xml_file, const char *tml_file)